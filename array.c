@@ -0,0 +1,255 @@
+#pragma once
+
+#include <math.h>
+#include <stdlib.h>
+
+#include "common.h"
+#include "number.c"
+#include "object.c"
+
+// Packed arrays of numbers: doubles in a buffer aligned to ARRAY_ALIGN bytes
+// and padded to a whole number of ARRAY_ALIGN blocks, so the element-wise
+// kernels step through it one vector of ARRAY_LANES at a time with no scalar
+// remainder. They use the compiler's generic vectors, which it lowers to the
+// SIMD instructions of the target (SSE2, AVX, NEON). The padding is zeroed
+// when an array is made but holds whatever an operator left in it after
+// that; reductions stop at the last whole vector and finish with scalars.
+
+#define ARRAY_ALIGN 64
+#define ARRAY_LANES 4
+#define ARRAY_BLOCK (ARRAY_ALIGN / (int)sizeof(double)) // doubles per block
+#define ARRAY_MAX   (1 << 28)                          // elements
+
+typedef double  ArrayVec  __attribute__((vector_size(ARRAY_LANES * sizeof(double))));
+typedef int64_t ArrayMask __attribute__((vector_size(ARRAY_LANES * sizeof(double))));
+
+// Vectors in the padded buffer of length elements
+static int array_vectors(int length)
+{
+    return (length + ARRAY_BLOCK - 1) / ARRAY_BLOCK * ARRAY_BLOCK / ARRAY_LANES;
+}
+
+// Bytes in the buffer of length elements, at least one block so that even an
+// empty array has one to point at
+static size_t array_size(int length)
+{
+    return (size_t)array_vectors(BUF_MAX(length, 1)) * sizeof(ArrayVec);
+}
+
+// Bytes of the object of an array of length elements, which holds its buffer
+static size_t array_object_size(int length)
+{
+    return sizeof(ObjArray) + ARRAY_ALIGN + array_size(length);
+}
+
+// Array of length elements whose contents are left to the caller. The buffer
+// is in the same block as the object, so that freeing an array leaves a hole
+// the next one of its length fits in exactly.
+static ObjArray *array_alloc(Heap *h, int length)
+{
+    ObjArray *a = (ObjArray *)heap_alloc(h, array_object_size(length), OBJ_ARRAY);
+    a->length = length;
+    uintptr_t data = (uintptr_t)(a + 1);
+    a->data = (double *)((data + ARRAY_ALIGN - 1) & ~(uintptr_t)(ARRAY_ALIGN - 1));
+    return a;
+}
+
+// Array of length zeros
+static ObjArray *array_new(Heap *h, int length)
+{
+    ObjArray *a = array_alloc(h, length);
+    memset(a->data, 0, array_size(length));
+    return a;
+}
+
+// Array of the count numbers at values
+static ObjArray *array_from(Heap *h, const Value *values, int count)
+{
+    ObjArray *a = array_new(h, count);
+    for (int i = 0; i < count; ++i) {
+        a->data[i] = AS_NUMBER(values[i]);
+    }
+    return a;
+}
+
+// out = x op y over n vectors. A step of 0 reads the same vector each time,
+// a number spread over every lane.
+#define ARRAY_KERNEL(expr)                                   \
+    for (int i = 0; i < n; ++i) {                            \
+        ArrayVec x = xs[i * xstep], y = ys[i * ystep];       \
+        (void)y;                                             \
+        out[i] = (expr);                                     \
+    }
+
+static void array_kernel(byte op, ArrayVec *out, const ArrayVec *xs, int xstep,
+    const ArrayVec *ys, int ystep, int n)
+{
+    // Comparisons give all-ones lanes for true, masked down to 1.0
+    const ArrayMask one = (ArrayMask)(ArrayVec){ 1, 1, 1, 1 };
+    switch (op) {
+        case OP_ADD: ARRAY_KERNEL(x + y); break;
+        case OP_SUB: ARRAY_KERNEL(x - y); break;
+        case OP_MUL: ARRAY_KERNEL(x * y); break;
+        case OP_DIV: ARRAY_KERNEL(x / y); break;
+        case OP_GT:  ARRAY_KERNEL((ArrayVec)((ArrayMask)(x > y) & one)); break;
+        case OP_LT:  ARRAY_KERNEL((ArrayVec)((ArrayMask)(x < y) & one)); break;
+        case OP_NOT: ARRAY_KERNEL((ArrayVec)((ArrayMask)(x == 0) & one)); break;
+        default:     assert(0 && "unreachable");
+    }
+}
+
+#undef ARRAY_KERNEL
+
+// The vectors of operand v, an array or a number spread into *spread
+static const ArrayVec *array_operand(Value v, ArrayVec *spread, int *step)
+{
+    if (IS_ARRAY(v)) {
+        *step = 1;
+        return (const ArrayVec *)AS_ARRAY(v)->data;
+    }
+    double x = AS_NUMBER(v);
+    *spread = (ArrayVec){ x, x, x, x };
+    *step = 0;
+    return spread;
+}
+
+// a op b element-wise, for OP_ADD, OP_SUB, OP_MUL, OP_DIV, OP_GT and OP_LT
+// where one operand is an array and the other an array of the same length or
+// a number. Comparisons give 1 for true and 0 for false. Returns NULL, or the
+// message of a runtime error.
+static const char *array_binary(Heap *h, byte op, Value a, Value b, Value *result)
+{
+    if (!(IS_ARRAY(a) || IS_NUMBER(a)) || !(IS_ARRAY(b) || IS_NUMBER(b))) {
+        return "Operands must be numbers or arrays.";
+    }
+    int length = IS_ARRAY(a) ? AS_ARRAY(a)->length : AS_ARRAY(b)->length;
+    if (IS_ARRAY(a) && IS_ARRAY(b) && AS_ARRAY(b)->length != length) {
+        return "Arrays must have the same length.";
+    }
+    ArrayVec xv, yv;
+    int xstep, ystep;
+    const ArrayVec *xs = array_operand(a, &xv, &xstep);
+    const ArrayVec *ys = array_operand(b, &yv, &ystep);
+    ObjArray *r = array_alloc(h, length);
+    array_kernel(op, (ArrayVec *)r->data, xs, xstep, ys, ystep, array_vectors(length));
+    *result = OBJ_VAL(r);
+    return NULL;
+}
+
+// !a element-wise: 1 where an element is 0, 0 elsewhere, so that a >= b,
+// compiled as !(a < b), works on arrays too
+static Value array_not(Heap *h, const ObjArray *a)
+{
+    ObjArray *r = array_alloc(h, a->length);
+    const ArrayVec *xs = (const ArrayVec *)a->data;
+    array_kernel(OP_NOT, (ArrayVec *)r->data, xs, 1, xs, 1, array_vectors(a->length));
+    return OBJ_VAL(r);
+}
+
+static double array_sum(const ObjArray *a)
+{
+    const ArrayVec *v = (const ArrayVec *)a->data;
+    int full = a->length / ARRAY_LANES;
+    ArrayVec acc = { 0 };
+    for (int i = 0; i < full; ++i) {
+        acc += v[i];
+    }
+    double sum = 0;
+    for (int j = 0; j < ARRAY_LANES; ++j) {
+        sum += acc[j];
+    }
+    for (int i = full * ARRAY_LANES; i < a->length; ++i) {
+        sum += a->data[i];
+    }
+    return sum;
+}
+
+// Smallest element, or the largest with max, of a non-empty array. Like
+// number_min and number_max, an element replaces the one kept so far only
+// if it compares less (greater).
+static double array_extreme(const ObjArray *a, bool max)
+{
+    const ArrayVec *v = (const ArrayVec *)a->data;
+    int full = a->length / ARRAY_LANES;
+    double m = a->data[0];
+    ArrayVec acc = { m, m, m, m };
+    for (int i = 0; i < full; ++i) {
+        ArrayMask take = max ? v[i] > acc : v[i] < acc;
+        acc = (ArrayVec)(((ArrayMask)v[i] & take) | ((ArrayMask)acc & ~take));
+    }
+    for (int j = 0; j < ARRAY_LANES; ++j) {
+        if (max ? acc[j] > m : acc[j] < m) m = acc[j];
+    }
+    for (int i = full * ARRAY_LANES; i < a->length; ++i) {
+        if (max ? a->data[i] > m : a->data[i] < m) m = a->data[i];
+    }
+    return m;
+}
+
+// Element i of a, as an index value: a number that is a whole element index.
+// Returns NULL, or the message of a runtime error.
+static const char *array_index(Value a, Value i, int *index)
+{
+    if (!IS_ARRAY(a)) return "Only arrays can be indexed.";
+    if (!IS_NUMBER(i)) return "Array index must be a number.";
+    double x = AS_NUMBER(i);
+    if (x != floor(x) || x < 0 || x >= AS_ARRAY(a)->length) return "Array index out of range.";
+    *index = (int)x;
+    return NULL;
+}
+
+static void array_print(FILE *out, const ObjArray *a)
+{
+    char buf[NUMBER_FORMAT_MAX];
+    fputc('[', out);
+    for (int i = 0; i < a->length; ++i) {
+        if (i > 0) fputs(", ", out);
+        fwrite(buf, 1, number_format(a->data[i], buf), out);
+    }
+    fputc(']', out);
+}
+
+#ifndef NDEBUG
+static void array_test(void)
+{
+    // Counted by --mem like buffers
+    bool enabled = buf_stats_enabled;
+    BufStats saved = buf_stats;
+    buf_stats_enabled = true;
+    buf_stats = (BufStats){ 0 };
+
+    Heap h = { 0 };
+    Value values[11];
+    for (int i = 0; i < (int)countof(values); ++i) {
+        values[i] = INT_VAL(i - 5);
+    }
+    ObjArray *a = array_from(&h, values, countof(values));
+    assert(((uintptr_t)a->data & (ARRAY_ALIGN - 1)) == 0 && array_vectors(11) == 4);
+    assert(array_sum(a) == 0 && array_extreme(a, false) == -5 && array_extreme(a, true) == 5);
+
+    // Broadcast a number, compare element-wise, and check the tail past the
+    // last whole vector
+    Value r;
+    const char *error = array_binary(&h, OP_MUL, OBJ_VAL(a), INT_VAL(2), &r);
+    assert(!error && AS_ARRAY(r)->length == 11 && AS_ARRAY(r)->data[10] == 10);
+    error = array_binary(&h, OP_LT, r, OBJ_VAL(a), &r);
+    assert(!error && array_sum(AS_ARRAY(r)) == 5 && AS_ARRAY(r)->data[0] == 1);
+    Value n = array_not(&h, AS_ARRAY(r));
+    assert(array_sum(AS_ARRAY(n)) == 6 && AS_ARRAY(n)->data[10] == 1);
+
+    ObjArray *b = array_new(&h, 3);
+    error = array_binary(&h, OP_ADD, OBJ_VAL(a), OBJ_VAL(b), &r);
+    assert(error && strcmp(error, "Arrays must have the same length.") == 0);
+    int index = 0;
+    error = array_index(OBJ_VAL(b), NUMBER_VAL(2.5), &index);
+    assert(error);
+    error = array_index(OBJ_VAL(b), INT_VAL(2), &index);
+    assert(!error && index == 2);
+    heap_free(&h);
+
+    assert(buf_stats.objects == 5 && buf_stats.object_frees == 5 && buf_stats.live == 0);
+    assert(buf_stats.peak >= (int64_t)(array_object_size(11) + array_object_size(3)));
+    buf_stats_enabled = enabled;
+    buf_stats = saved;
+}
+#endif
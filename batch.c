@@ -0,0 +1,277 @@
+#pragma once
+
+#include <pthread.h>
+#include <unistd.h>
+
+#include "common.h"
+#include "buf.h"
+#include "clock.c"
+#include "file.c"
+#include "output.c"
+#include "sched.c"
+#include "vm.c"
+
+typedef struct {
+    const char *path;
+    int         status; // process exit status for this script (0 on success)
+    Value       value;
+    uint64_t    elapsed_ns;
+    Stats       stats;
+} BatchJob;
+
+// Each worker owns a range of job indexes. The owner takes jobs from the front
+// of its range and idle workers steal from the back.
+typedef struct {
+    pthread_mutex_t lock;
+    int             head;
+    int             tail;
+} BatchDeque;
+
+typedef struct Batch Batch;
+
+typedef struct {
+    Batch     *batch;
+    int        id;
+    pthread_t  thread;
+    VM         vm;
+} BatchWorker;
+
+struct Batch {
+    BatchJob    *jobs;
+    BatchDeque  *deques;
+    BatchWorker *workers;
+    int          worker_count;
+    ReportFlags  report;
+};
+
+static int batch_default_jobs(void)
+{
+    long n = sysconf(_SC_NPROCESSORS_ONLN);
+    return n > 0 ? (int)n : 1;
+}
+
+static int batch_pop(BatchDeque *d)
+{
+    pthread_mutex_lock(&d->lock);
+    int job = d->head < d->tail ? d->head++ : -1;
+    pthread_mutex_unlock(&d->lock);
+    return job;
+}
+
+static int batch_steal(BatchDeque *d)
+{
+    pthread_mutex_lock(&d->lock);
+    int job = d->head < d->tail ? --d->tail : -1;
+    pthread_mutex_unlock(&d->lock);
+    return job;
+}
+
+// Returns the next job index for worker id, or -1 once every deque is empty.
+// No jobs are added after startup so an empty sweep means the batch is done.
+static int batch_take(Batch *b, int id)
+{
+    int job = batch_pop(&b->deques[id]);
+    for (int i = 1; job < 0 && i < b->worker_count; ++i) {
+        job = batch_steal(&b->deques[(id + i) % b->worker_count]);
+    }
+    return job;
+}
+
+static void batch_run_job(BatchJob *job, VM *vm, ReportFlags report)
+{
+    vm->stats = report ? &job->stats : NULL;
+    vm_reset_globals(vm);
+    if (report & REPORT_MEM) stats_mem_begin();
+
+    uint64_t start = clock_ns();
+    char *source = read_file(job->path);
+    job->stats.ns[PHASE_READ] = clock_ns() - start;
+    if (!source) {
+        job->status = ERR_FILE;
+    } else {
+        VMResult r = vm_interpret(vm, source);
+        // Printed once every job is done, so later runs on vm must keep it
+        if (IS_OBJ(r.value)) AS_OBJ(r.value)->pinned = true;
+        job->value = r.value;
+        switch (r.result) {
+            case INTERPRET_OK:            job->status = 0; break;
+            case INTERPRET_COMPILE_ERROR: job->status = ERR_COMPILE; break;
+            case INTERPRET_RUNTIME_ERROR: job->status = ERR_RUNTIME; break;
+            case INTERPRET_YIELD:         assert(0 && "no budget is set"); break;
+        }
+        buf_free(source);
+    }
+
+    job->elapsed_ns = clock_ns() - start;
+    if (report & REPORT_MEM) stats_mem_end(&job->stats);
+}
+
+static void *batch_worker(void *arg)
+{
+    BatchWorker *w = arg;
+    int job;
+    while ((job = batch_take(w->batch, w->id)) >= 0) {
+        batch_run_job(&w->batch->jobs[job], &w->vm, w->batch->report);
+    }
+    return NULL;
+}
+
+// Runs every script on a VM of its own, in turns of slice instructions on
+// the scheduler's run queue, instead of one script per worker at a time. A
+// job's elapsed time is then how long after the start it finished.
+static void batch_schedule(Batch *b, Sched *s, int count, uint64_t slice)
+{
+    char **sources = NULL;
+    int *jobs = NULL; // job of each task
+    for (int i = 0; i < count; ++i) {
+        BatchJob *job = &b->jobs[i];
+        uint64_t start = clock_ns();
+        char *source = read_file(job->path);
+        job->stats.ns[PHASE_READ] = clock_ns() - start;
+        if (!source) {
+            job->status = ERR_FILE;
+            continue;
+        }
+        buf_push(sources, source);
+        buf_push(jobs, i);
+    }
+
+    sched_init(s, (const char **)sources, buf_len(sources), slice, 0);
+    for (int i = 0; i < s->count; ++i) {
+        s->tasks[i].vm.stats = b->report ? &b->jobs[jobs[i]].stats : NULL;
+    }
+    sched_run(s, b->worker_count);
+
+    for (int i = 0; i < s->count; ++i) {
+        const SchedTask *t = &s->tasks[i];
+        BatchJob *job = &b->jobs[jobs[i]];
+        job->value = t->result.value;
+        job->elapsed_ns = t->done_ns;
+        switch (t->result.result) {
+            case INTERPRET_OK:            job->status = 0; break;
+            case INTERPRET_COMPILE_ERROR: job->status = ERR_COMPILE; break;
+            case INTERPRET_RUNTIME_ERROR: job->status = ERR_RUNTIME; break;
+            case INTERPRET_YIELD:         assert(0 && "tasks run to completion"); break;
+        }
+        buf_free(sources[i]);
+    }
+    buf_free(sources);
+    buf_free(jobs);
+}
+
+static const char *batch_status_name(int status)
+{
+    switch (status) {
+        case 0:           return "ok";
+        case ERR_COMPILE: return "compile-error";
+        case ERR_RUNTIME: return "runtime-error";
+        case ERR_FILE:    return "file-error";
+        default:          return "error";
+    }
+}
+
+// Evaluates every script in paths on a pool of worker threads and prints one
+// line per script, in input order:
+//
+//     <path> TAB <status> TAB <exit code> TAB <milliseconds> TAB <value>
+//
+// Any requested instrumentation follows on stderr, also in input order. With
+// a slice, scripts take turns on the workers, see batch_schedule.
+// Returns the exit status of the first script that failed, or 0.
+static int batch_eval(Output *out, const char **paths, int count, int worker_count,
+    uint64_t slice, ReportFlags report)
+{
+    if (worker_count > count) worker_count = count;
+    if (worker_count < 1) worker_count = 1;
+
+    Batch b = {
+        .jobs         = calloc(count, sizeof(BatchJob)),
+        .deques       = calloc(worker_count, sizeof(BatchDeque)),
+        .workers      = calloc(worker_count, sizeof(BatchWorker)),
+        .worker_count = worker_count,
+        .report       = report,
+    };
+
+    for (int i = 0; i < count; ++i) {
+        b.jobs[i].path = paths[i];
+    }
+
+    uint64_t start = clock_ns();
+    for (int i = 0; i < worker_count; ++i) {
+        BatchDeque *d = &b.deques[i];
+        pthread_mutex_init(&d->lock, NULL);
+        d->head = (int)((int64_t)count * i / worker_count);
+        d->tail = (int)((int64_t)count * (i + 1) / worker_count);
+
+        BatchWorker *w = &b.workers[i];
+        w->batch = &b;
+        w->id = i;
+        vm_init(&w->vm);
+    }
+    Sched sched = { 0 };
+    if (slice) {
+        batch_schedule(&b, &sched, count, slice);
+        worker_count = 0;
+    }
+    for (int i = 0; i < worker_count; ++i) {
+        if (pthread_create(&b.workers[i].thread, NULL, batch_worker, &b.workers[i]) != 0) {
+            // Run the remaining jobs on the threads that did start (or this one).
+            worker_count = i;
+            break;
+        }
+    }
+    if (worker_count == 0 && !slice) {
+        batch_worker(&b.workers[0]);
+    }
+    for (int i = 0; i < worker_count; ++i) {
+        pthread_join(b.workers[i].thread, NULL);
+    }
+    uint64_t elapsed = clock_ns() - start;
+
+    int status = 0;
+    for (int i = 0; i < count; ++i) {
+        BatchJob *job = &b.jobs[i];
+        char fields[64];
+        snprintf(fields, sizeof(fields), "\t%s\t%d\t%.3f\t", batch_status_name(job->status),
+            job->status, clock_ms(job->elapsed_ns));
+        out_str(out, job->path);
+        out_str(out, fields);
+        if (job->status == 0) {
+            out_value(out, job->value);
+        }
+        out_char(out, '\n');
+        if (status == 0) {
+            status = job->status;
+        }
+    }
+    out_flush(out);
+    for (int i = 0; (report & (REPORT_TIME | REPORT_MEM)) && i < count; ++i) {
+        fprintf(stderr, "== %s\n", b.jobs[i].path);
+        stats_print(stderr, &b.jobs[i].stats, report);
+    }
+    fprintf(stderr, "%d scripts, %d jobs, %.3f ms", count, b.worker_count, clock_ms(elapsed));
+    if (slice) fprintf(stderr, ", %lld slices yielded", (long long)sched.switches);
+    fputc('\n', stderr);
+    if (report & REPORT_CACHE) {
+        CacheStats total = { 0 };
+        for (int i = 0; i < b.worker_count; ++i) {
+            const CacheStats *s = &b.workers[i].vm.cache.stats;
+            total.hits += s->hits;
+            total.misses += s->misses;
+            total.evictions += s->evictions;
+            total.bytes += s->bytes;
+        }
+        cache_print_stats(stderr, &total);
+    }
+
+    if (slice) sched_free(&sched);
+    for (int i = 0; i < b.worker_count; ++i) {
+        vm_free(&b.workers[i].vm);
+        pthread_mutex_destroy(&b.deques[i].lock);
+    }
+    free(b.workers);
+    free(b.deques);
+    free(b.jobs);
+
+    return status;
+}
@@ -0,0 +1,539 @@
+// End-to-end benchmarks for the scanner, compiler and VM.
+//
+//     make bench
+//     ./xol-bench [--reps N] [--warmup N]
+//
+// Each workload is generated in memory and timed one phase at a time. Results
+// are printed as JSON so they can be compared between commits.
+
+#include "common.h"
+#include "buf.h"
+#include "clock.c"
+#include "edit.c"
+#include "scanner.c"
+#include "sched.c"
+#include "vm.c"
+
+typedef struct {
+    const char *name;
+    char       *source;    // stretchy buffer
+    bool        iterative; // compile with the iterative parser
+} Workload;
+
+typedef struct {
+    uint64_t min;
+    uint64_t median;
+    uint64_t mean;
+} Timing;
+
+static void bench_appendf(char **buf, const char *format, ...)
+{
+    va_list args;
+    va_start(args, format);
+    int n = vsnprintf(NULL, 0, format, args);
+    va_end(args);
+
+    char *dest = buf_append(*buf, n + 1);
+    va_start(args, format);
+    vsnprintf(dest, n + 1, format, args);
+    va_end(args);
+    buf_take(*buf, buf_len(*buf) - 1); // drop the NUL, keep it in capacity
+}
+
+// (1 + (2 * (3 - ( ... 1))))
+static Workload gen_nested(const char *name, int depth, bool iterative)
+{
+    static const char ops[] = "+-*";
+    Workload w = { name, NULL, iterative };
+    for (int i = 0; i < depth; ++i) {
+        bench_appendf(&w.source, "(%d %c ", i % 10, ops[i % 3]);
+    }
+    bench_appendf(&w.source, "1");
+    for (int i = 0; i < depth; ++i) {
+        bench_appendf(&w.source, ")");
+    }
+    return w;
+}
+
+// 0 + 1 + 2 + ... with enough literals to need OP_CONSTANT_X
+static Workload gen_constants(int count)
+{
+    Workload w = { "constants", NULL, false };
+    bench_appendf(&w.source, "0");
+    for (int i = 1; i < count; ++i) {
+        bench_appendf(&w.source, " + %d", i);
+    }
+    return w;
+}
+
+// Mostly comment lines with an occasional term
+static Workload gen_comments(int lines)
+{
+    Workload w = { "comments", NULL, false };
+    bench_appendf(&w.source, "0\n");
+    for (int i = 0; i < lines; ++i) {
+        if (i % 16 == 15) {
+            bench_appendf(&w.source, "+ %d\n", i);
+        } else {
+            bench_appendf(&w.source,
+                "// comment line %d: the quick brown fox jumps over the lazy dog\n", i);
+        }
+    }
+    return w;
+}
+
+// Long fractional literals
+static Workload gen_numbers(int count)
+{
+    Workload w = { "numbers", NULL, false };
+    bench_appendf(&w.source, "0.5");
+    for (int i = 1; i < count; ++i) {
+        char op = i % 2 ? '+' : '-';
+        bench_appendf(&w.source, " %c %d.%09d", op, i % 100000, i * 10007 % 1000000000);
+    }
+    return w;
+}
+
+// "s0 " + "s1 " + ... == "" concatenates into a rope and flattens it once
+static Workload gen_strings(int count)
+{
+    Workload w = { "strings", NULL, false };
+    bench_appendf(&w.source, "\"string 0\"");
+    for (int i = 1; i < count; ++i) {
+        bench_appendf(&w.source, " + \"string %d\"", i);
+    }
+    bench_appendf(&w.source, " == \"\"");
+    return w;
+}
+
+// 0 + sqrt(1) + min(2, 1) + max(3, 1, 2) + ... alternates intrinsics that are
+// inlined with calls through OP_CALL_NATIVE
+static Workload gen_natives(int count)
+{
+    Workload w = { "natives", NULL, false };
+    bench_appendf(&w.source, "0");
+    for (int i = 1; i < count; ++i) {
+        switch (i % 4) {
+            case 0: bench_appendf(&w.source, " + floor(%d.5)", i); break;
+            case 1: bench_appendf(&w.source, " + sqrt(%d)", i); break;
+            case 2: bench_appendf(&w.source, " + min(%d, 1)", i); break;
+            case 3: bench_appendf(&w.source, " + max(%d, 1, 2)", i); break;
+        }
+    }
+    return w;
+}
+
+static int bench_scan(const char *source)
+{
+    Scanner s;
+    scanner_init(&s, source);
+    int tokens = 0;
+    for (;;) {
+        Token t = scanner_scan_token(&s);
+        ++tokens;
+        if (t.type == TOKEN_EOF) break;
+    }
+    return tokens;
+}
+
+static int compare_u64(const void *a, const void *b)
+{
+    uint64_t x = *(const uint64_t *)a;
+    uint64_t y = *(const uint64_t *)b;
+    return (x > y) - (x < y);
+}
+
+static Timing bench_summarize(uint64_t *samples, int n)
+{
+    qsort(samples, n, sizeof(*samples), compare_u64);
+    uint64_t sum = 0;
+    for (int i = 0; i < n; ++i) {
+        sum += samples[i];
+    }
+    return (Timing){ samples[0], samples[n / 2], sum / n };
+}
+
+static void bench_workload(Workload *w, VM *vm, int warmup, int reps, bool last)
+{
+    uint64_t *samples[phase__count];
+    for (int p = 0; p < phase__count; ++p) {
+        samples[p] = calloc(reps, sizeof(uint64_t));
+    }
+
+    Chunk chunk = { 0 };
+    chunk_init(&chunk);
+    int tokens = 0;
+    bool ok = true;
+
+    for (int i = -warmup; i < reps && ok; ++i) {
+        uint64_t t0 = clock_ns();
+        tokens = bench_scan(w->source);
+        uint64_t t1 = clock_ns();
+
+        chunk_free(&chunk);
+        compiler_options.iterative = w->iterative;
+        ok = compile(w->source, &chunk, &vm->heap, &vm->global_names) && chunk_verify(&chunk, stderr);
+        uint64_t t2 = clock_ns();
+
+        ok = ok && vm_execute(vm, &chunk).result == INTERPRET_OK;
+        uint64_t t3 = clock_ns();
+
+        if (i >= 0) {
+            samples[PHASE_SCAN][i] = t1 - t0;
+            samples[PHASE_COMPILE][i] = t2 - t1;
+            samples[PHASE_RUN][i] = t3 - t2;
+        }
+    }
+
+    printf("    {\n");
+    printf("      \"name\": \"%s\",\n", w->name);
+    printf("      \"ok\": %s,\n", ok ? "true" : "false");
+    printf("      \"iterative\": %s,\n", w->iterative ? "true" : "false");
+    printf("      \"source_bytes\": %d,\n", buf_len(w->source));
+    printf("      \"tokens\": %d,\n", tokens);
+    printf("      \"code_bytes\": %d,\n", buf_len(chunk.code));
+    printf("      \"constants\": %d,\n", buf_len(chunk.constants));
+    printf("      \"max_stack\": %d,\n", chunk.max_stack);
+    for (int p = PHASE_SCAN; p < phase__count; ++p) {
+        Timing t = ok ? bench_summarize(samples[p], reps) : (Timing){ 0 };
+        printf("      \"%s\": { \"min_ns\": %llu, \"median_ns\": %llu, \"mean_ns\": %llu }%s\n",
+            phase_names[p], (unsigned long long)t.min, (unsigned long long)t.median,
+            (unsigned long long)t.mean, p + 1 < phase__count ? "," : "");
+    }
+    printf("    }%s\n", last ? "" : ",");
+
+    chunk_free(&chunk);
+    for (int p = 0; p < phase__count; ++p) {
+        free(samples[p]);
+    }
+}
+
+// One-character edits to a long script, compiled incrementally (see edit.c)
+// and, for comparison, from scratch
+static void bench_edits(VM *vm, int lines, int edits)
+{
+    char *source = NULL;
+    int *digits = NULL; // offset of the last digit of each line's literal
+    bench_appendf(&source, "var v0 = 0;\n");
+    buf_push(digits, buf_len(source) - 3);
+    for (int i = 1; i < lines; ++i) {
+        bench_appendf(&source, "var v%d = v%d * 2 + %d;\n", i, i / 2, i);
+        buf_push(digits, buf_len(source) - 3);
+    }
+    bench_appendf(&source, "v%d", lines - 1);
+
+    EditBuffer e;
+    edit_init(&e, &vm->heap, &vm->global_names);
+    uint64_t start = clock_ns();
+    bool ok = edit_apply(&e, 0, 0, source, buf_len(source));
+    uint64_t open_ns = clock_ns() - start;
+
+    uint64_t *samples[4];
+    for (int p = 0; p < 4; ++p) {
+        samples[p] = calloc(edits, sizeof(uint64_t));
+    }
+    int scanned = 0, compiled = 0;
+    uint64_t x = 0x9E3779B97F4A7C15ull;
+    for (int i = 0; i < edits && ok; ++i) {
+        x ^= x << 13, x ^= x >> 7, x ^= x << 17;
+        int offset = digits[x % (uint64_t)lines];
+        char digit = (char)('0' + (e.source[offset] - '0' + 1) % 10);
+        ok = edit_apply(&e, offset, 1, &digit, 1);
+        samples[0][i] = e.stats.scan_ns;
+        samples[1][i] = e.stats.compile_ns;
+        samples[2][i] = e.stats.link_ns;
+        scanned += e.stats.tokens_scanned;
+        compiled += e.stats.decls_compiled;
+
+        Chunk chunk = { 0 };
+        chunk_init(&chunk);
+        start = clock_ns();
+        ok = ok && compile(e.source, &chunk, &vm->heap, &vm->global_names) && chunk_verify(&chunk, stderr);
+        samples[3][i] = clock_ns() - start;
+        chunk_free(&chunk);
+    }
+    ok = ok && vm_execute(vm, &e.chunk).result == INTERPRET_OK;
+
+    static const char *names[4] = { "scan", "compile", "link", "full_compile" };
+    printf("  \"edits\": {\n");
+    printf("    \"ok\": %s,\n", ok ? "true" : "false");
+    printf("    \"source_bytes\": %d,\n", edit_length(&e));
+    printf("    \"tokens\": %d,\n", buf_len(e.tokens));
+    printf("    \"declarations\": %d,\n", buf_len(e.decls));
+    printf("    \"edits\": %d,\n", edits);
+    printf("    \"open_ns\": %llu,\n", (unsigned long long)open_ns);
+    printf("    \"tokens_scanned_per_edit\": %.1f,\n", (double)scanned / edits);
+    printf("    \"declarations_compiled_per_edit\": %.1f,\n", (double)compiled / edits);
+    for (int p = 0; p < 4; ++p) {
+        Timing t = ok ? bench_summarize(samples[p], edits) : (Timing){ 0 };
+        printf("    \"%s\": { \"min_ns\": %llu, \"median_ns\": %llu, \"mean_ns\": %llu }%s\n",
+            names[p], (unsigned long long)t.min, (unsigned long long)t.median,
+            (unsigned long long)t.mean, p + 1 < 4 ? "," : "");
+        free(samples[p]);
+    }
+    printf("  },\n");
+
+    edit_free(&e);
+    buf_free(digits);
+    buf_free(source);
+}
+
+// A recursive function, to measure what a call and return cost. Its body is
+// compiled on the first call of the first run, which is reported apart.
+static void bench_calls(int n, int reps)
+{
+    char source[128];
+    snprintf(source, sizeof(source),
+        "fun fib(n) { return n < 2 ? n : fib(n - 1) + fib(n - 2); }\nfib(%d)", n);
+    int64_t calls = 1, prev = 1; // calls made by fib(i) and fib(i - 1)
+    for (int i = 1; i < n; ++i) {
+        int64_t next = calls + prev + 1;
+        prev = calls;
+        calls = next;
+    }
+
+    VM vm = { 0 };
+    vm_init(&vm);
+    Chunk chunk = { 0 };
+    chunk_init(&chunk);
+    bool ok = compile(source, &chunk, &vm.heap, &vm.global_names) && chunk_verify(&chunk, stderr);
+    uint64_t first_ns = 0;
+    uint64_t *samples = calloc(reps, sizeof(uint64_t));
+    for (int i = -1; i < reps && ok; ++i) {
+        uint64_t start = clock_ns();
+        ok = vm_execute(&vm, &chunk).result == INTERPRET_OK;
+        uint64_t elapsed = clock_ns() - start;
+        if (i < 0) first_ns = elapsed;
+        else samples[i] = elapsed;
+    }
+    Timing t = ok ? bench_summarize(samples, reps) : (Timing){ 0 };
+
+    printf("  \"calls\": {\n");
+    printf("    \"ok\": %s,\n", ok ? "true" : "false");
+    printf("    \"calls_per_run\": %lld,\n", (long long)calls);
+    printf("    \"first_run_ns\": %llu,\n", (unsigned long long)first_ns);
+    printf("    \"run\": { \"min_ns\": %llu, \"median_ns\": %llu, \"mean_ns\": %llu },\n",
+        (unsigned long long)t.min, (unsigned long long)t.median, (unsigned long long)t.mean);
+    printf("    \"ns_per_call\": %.2f\n", (double)t.median / (double)calls);
+    printf("  },\n");
+
+    free(samples);
+    chunk_free(&chunk);
+    vm_free(&vm);
+}
+
+// A counting loop around a constant subexpression, which is hoisted out of
+// it, to measure what an iteration costs with its single backward branch
+static void bench_loops(int n, int reps)
+{
+    char source[128];
+    snprintf(source, sizeof(source),
+        "var s = 0;\nfor (var i = 0; i < %d; i = i + 1) s = s + i * (60 * 60);\ns", n);
+
+    VM vm = { 0 };
+    vm_init(&vm);
+    Chunk chunk = { 0 };
+    chunk_init(&chunk);
+    bool ok = compile(source, &chunk, &vm.heap, &vm.global_names) && chunk_verify(&chunk, stderr);
+    uint64_t *samples = calloc(reps, sizeof(uint64_t));
+    for (int i = 0; i < reps && ok; ++i) {
+        uint64_t start = clock_ns();
+        VMResult r = vm_execute(&vm, &chunk);
+        samples[i] = clock_ns() - start;
+        ok = r.result == INTERPRET_OK && AS_NUMBER(r.value) == 1800.0 * n * (n - 1);
+    }
+    Timing t = ok ? bench_summarize(samples, reps) : (Timing){ 0 };
+
+    printf("  \"loops\": {\n");
+    printf("    \"ok\": %s,\n", ok ? "true" : "false");
+    printf("    \"iterations_per_run\": %d,\n", n);
+    printf("    \"run\": { \"min_ns\": %llu, \"median_ns\": %llu, \"mean_ns\": %llu },\n",
+        (unsigned long long)t.min, (unsigned long long)t.median, (unsigned long long)t.mean);
+    printf("    \"ns_per_iteration\": %.2f\n", (double)t.median / (double)n);
+    printf("  },\n");
+
+    free(samples);
+    chunk_free(&chunk);
+    vm_free(&vm);
+}
+
+// The same sum over an array of n numbers as one element-wise expression and
+// as a loop that indexes it, to compare the kernels with the interpreter
+static void bench_arrays(int n, int reps)
+{
+    char setup[128], sources[2][160];
+    snprintf(setup, sizeof(setup), "var a = array(%d);\nfor (var i = 0; i < %d; i = i + 1) a[i] = i;", n, n);
+    snprintf(sources[0], sizeof(sources[0]), "sum(a * 2 + 1)");
+    snprintf(sources[1], sizeof(sources[1]),
+        "var t = 0;\nfor (var i = 0; i < %d; i = i + 1) t = t + a[i] * 2 + 1;\nt", n);
+    static const char *names[] = { "elementwise", "indexed_loop" };
+
+    VM vm = { 0 };
+    vm_init(&vm);
+    bool ok = vm_interpret(&vm, setup).result == INTERPRET_OK;
+    Timing t[2] = { 0 };
+    for (int k = 0; k < 2; ++k) {
+        Chunk chunk = { 0 };
+        chunk_init(&chunk);
+        ok = ok && compile(sources[k], &chunk, &vm.heap, &vm.global_names) && chunk_verify(&chunk, stderr);
+        uint64_t *samples = calloc(reps, sizeof(uint64_t));
+        for (int i = 0; i < reps && ok; ++i) {
+            uint64_t start = clock_ns();
+            VMResult r = vm_execute(&vm, &chunk);
+            samples[i] = clock_ns() - start;
+            ok = r.result == INTERPRET_OK && AS_NUMBER(r.value) == (double)n * n;
+        }
+        if (ok) t[k] = bench_summarize(samples, reps);
+        free(samples);
+        chunk_free(&chunk);
+    }
+
+    printf("  \"arrays\": {\n");
+    printf("    \"ok\": %s,\n", ok ? "true" : "false");
+    printf("    \"elements\": %d,\n", n);
+    for (int k = 0; k < 2; ++k) {
+        printf("    \"%s\": { \"median_ns\": %llu, \"ns_per_element\": %.2f },\n", names[k],
+            (unsigned long long)t[k].median, (double)t[k].median / (double)n);
+    }
+    printf("    \"speedup\": %.1f\n", t[0].median ? (double)t[1].median / (double)t[0].median : 0.0);
+    printf("  },\n");
+
+    vm_free(&vm);
+}
+
+// Field reads and writes on instances of one shape in a loop, with what the
+// field caches made of them
+static void bench_fields(int n, int reps)
+{
+    char source[256];
+    snprintf(source, sizeof(source),
+        "class P {}\nvar p = P(); p.x = 0; p.y = 1;\n"
+        "for (var i = 0; i < %d; i = i + 1) p.x = p.x + p.y;\np.x", n);
+
+    VM vm = { 0 };
+    vm_init(&vm);
+    Chunk chunk = { 0 };
+    chunk_init(&chunk);
+    bool ok = compile(source, &chunk, &vm.heap, &vm.global_names) && chunk_verify(&chunk, stderr);
+    uint64_t *samples = calloc(reps, sizeof(uint64_t));
+    for (int i = 0; i < reps && ok; ++i) {
+        uint64_t start = clock_ns();
+        VMResult r = vm_execute(&vm, &chunk);
+        samples[i] = clock_ns() - start;
+        ok = r.result == INTERPRET_OK && AS_NUMBER(r.value) == n;
+    }
+    Timing t = ok ? bench_summarize(samples, reps) : (Timing){ 0 };
+
+    printf("  \"fields\": {\n");
+    printf("    \"ok\": %s,\n", ok ? "true" : "false");
+    printf("    \"accesses_per_run\": %d,\n", 3 * n);
+    printf("    \"run\": { \"min_ns\": %llu, \"median_ns\": %llu, \"mean_ns\": %llu },\n",
+        (unsigned long long)t.min, (unsigned long long)t.median, (unsigned long long)t.mean);
+    printf("    \"ns_per_iteration\": %.2f,\n", (double)t.median / (double)n);
+    printf("    \"cache_hits\": %lld,\n", (long long)vm.field_hits);
+    printf("    \"cache_misses\": %lld\n", (long long)vm.field_misses);
+    printf("  },\n");
+
+    free(samples);
+    chunk_free(&chunk);
+    vm_free(&vm);
+}
+
+// Many short scripts, each on a VM of its own, run on a few threads to
+// completion and, for comparison, in slices (see sched.c)
+static void bench_sched(int tasks, int threads, uint64_t slice)
+{
+    char *source = NULL;
+    for (int i = 0; i < 500; ++i) {
+        bench_appendf(&source, "%s%d", i ? " * 3 - " : "", i);
+    }
+    Stats stats = { 0 };
+    VM vm = { 0 };
+    vm_init(&vm);
+    vm.stats = &stats;
+    bool ok = vm_interpret(&vm, source).result == INTERPRET_OK;
+    vm_free(&vm);
+    const char **sources = calloc(tasks, sizeof(char *));
+    for (int i = 0; i < tasks; ++i) {
+        sources[i] = source;
+    }
+
+    printf("  \"sched\": {\n");
+    uint64_t slices[2] = { 0, slice };
+    for (int r = 0; r < 2; ++r) {
+        Sched s;
+        sched_init(&s, sources, tasks, slices[r], 0);
+        uint64_t start = clock_ns();
+        sched_run(&s, threads);
+        uint64_t elapsed = clock_ns() - start;
+        for (int i = 0; i < tasks; ++i) {
+            ok = ok && s.tasks[i].result.result == INTERPRET_OK;
+        }
+        if (r == 0) {
+            printf("    \"tasks\": %d,\n", tasks);
+            printf("    \"threads\": %d,\n", threads);
+            printf("    \"instructions_per_task\": %lld,\n", (long long)stats.instructions);
+        }
+        printf("    \"%s\": { \"slice\": %llu, \"yields\": %lld, \"elapsed_ns\": %llu, "
+               "\"task_ns\": %llu },\n",
+            r ? "sliced" : "unsliced", (unsigned long long)slices[r], (long long)s.switches,
+            (unsigned long long)elapsed, (unsigned long long)(elapsed / tasks));
+        sched_free(&s);
+    }
+    printf("    \"ok\": %s\n", ok ? "true" : "false");
+    printf("  }\n");
+
+    free(sources);
+    buf_free(source);
+}
+
+int main(int argc, const char *argv[])
+{
+    int warmup = 3;
+    int reps = 20;
+    for (int i = 1; i < argc; ++i) {
+        if (strcmp(argv[i], "--reps") == 0 && i + 1 < argc) {
+            reps = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--warmup") == 0 && i + 1 < argc) {
+            warmup = atoi(argv[++i]);
+        } else {
+            fputs("Usage: xol-bench [--reps N] [--warmup N]\n", stderr);
+            return ERR_USAGE;
+        }
+    }
+    if (reps < 1) reps = 1;
+    if (warmup < 0) warmup = 0;
+
+    Workload workloads[] = {
+        gen_nested("nested", 1000, false),
+        gen_nested("nested_iterative", 100000, true),
+        gen_constants(100000),
+        gen_comments(100000),
+        gen_numbers(50000),
+        gen_strings(50000),
+        gen_natives(50000),
+    };
+
+    VM vm = { 0 };
+    vm_init(&vm);
+
+    printf("{\n");
+    printf("  \"warmup\": %d,\n", warmup);
+    printf("  \"reps\": %d,\n", reps);
+    printf("  \"workloads\": [\n");
+    for (int i = 0; i < (int)countof(workloads); ++i) {
+        bench_workload(&workloads[i], &vm, warmup, reps, i + 1 == (int)countof(workloads));
+        buf_free(workloads[i].source);
+    }
+    printf("  ],\n");
+    bench_edits(&vm, 20000, reps * 10);
+    bench_calls(25, reps);
+    bench_loops(100000, reps);
+    bench_arrays(100000, reps);
+    bench_fields(100000, reps);
+    bench_sched(4096, 4, 64);
+    printf("}\n");
+
+    vm_free(&vm);
+    return 0;
+}
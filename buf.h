@@ -16,6 +16,23 @@ typedef struct {
     char buf[];
 } BufHdr;
 
+// Allocation accounting for buf__grow and buf_free, and for the heap objects
+// of xol (see heap_alloc). Counting only happens while buf_stats_enabled is
+// set; otherwise the hooks cost a single branch.
+typedef struct {
+    int64_t allocs;       // buffers created
+    int64_t reallocs;     // existing buffers grown
+    int64_t frees;
+    int64_t objects;      // heap objects created
+    int64_t object_frees;
+    int64_t bytes;        // total bytes requested from the allocator
+    int64_t live;         // bytes currently held by buffers and objects
+    int64_t peak;         // high water mark of live
+} BufStats;
+
+_Thread_local bool     buf_stats_enabled;
+_Thread_local BufStats buf_stats;
+
 // clang-format off
 #define buf__raw(b) ((int *)(b)-2)
 #define buf__len(b) buf__raw(b)[0]
@@ -23,6 +40,7 @@ typedef struct {
 
 int buf_len(const void *b);
 void *buf__grow(const void *b, int len, size_t elem_size);
+void buf__free(const void *b, size_t elem_size);
 #define buf__fit(b, n) ((n) <= buf_cap((b)) ? 0 : ((b) = buf__grow((b), (n), sizeof(*(b)))))
 
 // Adds n uninitialzed new elements at the end of the buffer and returns pointer to first new element.
@@ -46,7 +64,7 @@ bool buf_empty(const void *b) { return (b == NULL || buf__len(b) == 0); }
 #define buf_end(b) ((b) ? (b)+buf__len(b) : NULL)
 
 // Deallocates the buffer.
-#define buf_free(b) ((b) ? (free(buf__raw(b)), (b)=NULL) : NULL)
+#define buf_free(b) ((b) ? (buf__free((b), sizeof(*(b))), (b)=NULL) : NULL)
 
 // Returns a BufHdr pointer for the buffer.
 BufHdr *buf_hdr(const void *b) { return (b ? (BufHdr *)buf__raw(b) : NULL); }
@@ -61,7 +79,7 @@ int buf_len(const void *b) { return (b ? buf__len(b) : 0); }
 #define buf_peek(b, dist) ((b) && buf__len(b) > (dist) ? (b)+buf__len(b)-1-(dist) : NULL)
 
 // Adds a new element at the end of the buffer.
-#define buf_push(b, v) (buf__fit(b, buf_len((b))+1), (b)[buf__len(b)++]=(v), (b)+buf__len(b)-1)
+#define buf_push(b, v) (buf__fit(b, buf_len((b))+1), (b)[buf__len(b)++]=(v), (b)+buf_len(b)-1)
 
 // Removes the last element in the vector, returns pointer to the removed element.
 #define buf_pop(b) ((b) && buf__len(b) > 0 ? (b) + (--buf__len(b)) : NULL)
@@ -77,7 +95,7 @@ int buf_len(const void *b) { return (b ? buf__len(b) : 0); }
 // #define buf_new(T, b, n) ()
 
 //
-#define buf_take(b, n) ((b) && 0 <= (n) && (n) < buf__len(b) ? buf__len(b)=(n) : 0, (b))
+#define buf_take(b, n) ((void)((b) && 0 <= (n) && (n) < buf__len(b) ? buf__len(b)=(n) : 0))
 
 void *buf__grow(const void *b, int len, size_t elem_size)
 {
@@ -85,13 +103,30 @@ void *buf__grow(const void *b, int len, size_t elem_size)
     int cap = BUF_MAX(32, BUF_MAX(2 * buf_cap(b), len));
     assert(len <= cap && cap <= (INT_MAX - (int)offsetof(BufHdr, buf))/(int)elem_size);
     size_t size = offsetof(BufHdr, buf) + elem_size * cap;
+    if (buf_stats_enabled) {
+        size_t old_size = b ? offsetof(BufHdr, buf) + elem_size * buf_cap(b) : 0;
+        if (b) buf_stats.reallocs++; else buf_stats.allocs++;
+        buf_stats.bytes += size;
+        buf_stats.live += size - old_size;
+        buf_stats.peak = BUF_MAX(buf_stats.peak, buf_stats.live);
+    }
     BufHdr *hdr = (BufHdr *)realloc(b ? buf__raw(b) : NULL, size);
     hdr->cap = cap;
     if (!b) hdr->len = 0;
     return hdr->buf;
 }
+
+void buf__free(const void *b, size_t elem_size)
+{
+    if (buf_stats_enabled) {
+        buf_stats.frees++;
+        buf_stats.live -= offsetof(BufHdr, buf) + elem_size * buf_cap(b);
+    }
+    free(buf__raw(b));
+}
 // clang-format on
 
+#ifndef NDEBUG
 void buf_init_test(void)
 {
     int *b = NULL;
@@ -424,6 +459,26 @@ void buf_take_test(void)
     }
 }
 
+void buf_stats_test(void)
+{
+    bool enabled = buf_stats_enabled;
+    BufStats saved = buf_stats;
+    buf_stats_enabled = true;
+    buf_stats = (BufStats){ 0 };
+
+    int *b = NULL;
+    buf_reserve(b, 10);
+    buf_reserve(b, 100);
+    assert(buf_stats.allocs == 1 && buf_stats.reallocs == 1);
+    assert(buf_stats.live == (int64_t)(offsetof(BufHdr, buf) + sizeof(int) * buf_cap(b)));
+    assert(buf_stats.peak == buf_stats.live);
+    buf_free(b);
+    assert(buf_stats.frees == 1 && buf_stats.live == 0 && buf_stats.peak > 0);
+
+    buf_stats_enabled = enabled;
+    buf_stats = saved;
+}
+
 void buf_test(void)
 {
     buf_init_test();
@@ -439,4 +494,6 @@ void buf_test(void)
     buf_push_test();
     buf_reserve_test();
     buf_take_test();
+    buf_stats_test();
 }
+#endif
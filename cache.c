@@ -0,0 +1,162 @@
+#pragma once
+
+#include "common.h"
+#include "buf.h"
+#include "chunk.c"
+#include "image.c"
+
+// Bounded LRU cache of compiled images, keyed by a hash of the source text.
+// The source is kept too so a hash collision can't run the wrong image.
+// Cached images use the global slots and strings of the VM that compiled
+// them, so a cache belongs to a single VM.
+
+#define CACHE_CAPACITY_DEFAULT 256
+
+// Set once at startup (--cache N), read by every VM
+static int cache_capacity = CACHE_CAPACITY_DEFAULT;
+
+// Hashes 8 bytes per step
+static uint64_t source_hash(const char *source, size_t length)
+{
+    const uint64_t k = 0x9E3779B97F4A7C15ull;
+    uint64_t h = length * k;
+    size_t i = 0;
+    for (; i + 8 <= length; i += 8) {
+        uint64_t w;
+        memcpy(&w, source + i, 8);
+        h = (h ^ w) * k;
+        h ^= h >> 29;
+    }
+    uint64_t w = 0;
+    memcpy(&w, source + i, length - i);
+    h = (h ^ w) * k;
+    return h ^ (h >> 32);
+}
+
+static void cache_init(ChunkCache *c, int capacity)
+{
+    *c = (ChunkCache){ .capacity = capacity, .newest = -1, .oldest = -1 };
+}
+
+static int64_t cache_entry_bytes(const CacheEntry *e)
+{
+    const Chunk *ch = &e->image->chunk;
+    return buf_sizeof(e->source) + buf_sizeof(ch->code) + buf_sizeof(ch->lines) +
+           buf_sizeof(ch->offsets) + buf_sizeof(ch->constants);
+}
+
+static int *cache_bucket(ChunkCache *c, uint64_t hash)
+{
+    return &c->buckets[hash & (uint64_t)(buf_len(c->buckets) - 1)];
+}
+
+static void cache_unlink(ChunkCache *c, int i)
+{
+    CacheEntry *e = &c->entries[i];
+    if (e->newer >= 0) c->entries[e->newer].older = e->older; else c->newest = e->older;
+    if (e->older >= 0) c->entries[e->older].newer = e->newer; else c->oldest = e->newer;
+}
+
+static void cache_push_newest(ChunkCache *c, int i)
+{
+    CacheEntry *e = &c->entries[i];
+    e->newer = -1;
+    e->older = c->newest;
+    if (c->newest >= 0) c->entries[c->newest].newer = i; else c->oldest = i;
+    c->newest = i;
+}
+
+// Returns the cached image compiled from source, or NULL.
+static ChunkImage *cache_find(ChunkCache *c, const char *source, size_t length, uint64_t hash)
+{
+    if (c->count == 0) {
+        if (c->capacity > 0) ++c->stats.misses;
+        return NULL;
+    }
+    for (int i = *cache_bucket(c, hash); i >= 0; i = c->entries[i].next) {
+        CacheEntry *e = &c->entries[i];
+        if (e->hash == hash && (size_t)buf_len(e->source) == length + 1 &&
+                memcmp(e->source, source, length) == 0) {
+            cache_unlink(c, i);
+            cache_push_newest(c, i);
+            ++c->stats.hits;
+            return e->image;
+        }
+    }
+    ++c->stats.misses;
+    return NULL;
+}
+
+// Removes entry i and returns its image, with the entry's reference
+static ChunkImage *cache_evict(ChunkCache *c, int i)
+{
+    CacheEntry *e = &c->entries[i];
+    int *link = cache_bucket(c, e->hash);
+    while (*link != i) {
+        link = &c->entries[*link].next;
+    }
+    *link = e->next;
+    cache_unlink(c, i);
+
+    c->stats.bytes -= cache_entry_bytes(e);
+    ++c->stats.evictions;
+    buf_free(e->source);
+    --c->count;
+    return e->image;
+}
+
+// Adds image to the cache with a reference of its own, evicting the least
+// recently used entry if the cache is full. Does nothing if it is disabled.
+static void cache_insert(ChunkCache *c, const char *source, size_t length, uint64_t hash,
+    ChunkImage *image)
+{
+    if (c->capacity <= 0) return;
+
+    if (!c->entries) {
+        c->entries = calloc(c->capacity, sizeof(CacheEntry));
+        int buckets = 1;
+        while (buckets < c->capacity) buckets *= 2;
+        buf_append(c->buckets, buckets);
+        for (int i = 0; i < buckets; ++i) {
+            c->buckets[i] = -1;
+        }
+    }
+
+    int i = c->count;
+    if (c->count == c->capacity) {
+        i = c->oldest;
+        image_release(cache_evict(c, i));
+    }
+
+    CacheEntry *e = &c->entries[i];
+    e->hash = hash;
+    e->source = NULL;
+    memcpy(buf_append(e->source, (int)length + 1), source, length + 1);
+    e->image = image_retain(image);
+    int *bucket = cache_bucket(c, hash);
+    e->next = *bucket;
+    *bucket = i;
+    cache_push_newest(c, i);
+
+    ++c->count;
+    c->stats.bytes += cache_entry_bytes(e);
+}
+
+static void cache_free(ChunkCache *c)
+{
+    while (c->count > 0) {
+        image_release(cache_evict(c, c->oldest));
+    }
+    free(c->entries);
+    buf_free(c->buckets);
+    cache_init(c, c->capacity);
+}
+
+MAYBE_UNUSED static void cache_print_stats(FILE *out, const CacheStats *s)
+{
+    int64_t lookups = s->hits + s->misses;
+    fprintf(out, "cache hits %lld, misses %lld (%.1f%% hit), evictions %lld, bytes %lld\n",
+        (long long)s->hits, (long long)s->misses,
+        lookups ? 100.0 * (double)s->hits / (double)lookups : 0.0,
+        (long long)s->evictions, (long long)s->bytes);
+}
@@ -11,8 +11,19 @@ static void chunk_init(Chunk *c)
     buf_reserve(c->constants, 8);
 }
 
+// Gives c an id no other code had, for the VM's caches of its instructions:
+// the code of a chunk freed since may be at the same address.
+static void chunk_new_id(Chunk *c)
+{
+    static atomic_uint_fast64_t ids;
+    c->id = atomic_fetch_add_explicit(&ids, 1, memory_order_relaxed) + 1;
+}
+
+// Adds constant v. An object is pinned in its heap (see gc.c): the code may
+// run again for as long as the heap lives.
 static int chunk_add_constant(Chunk *c, const Value v)
 {
+    if (IS_OBJ(v)) AS_OBJ(v)->pinned = true;
     buf_push(c->constants, v);
     return buf_len(c->constants) - 1;
 }
@@ -23,14 +34,63 @@ static void chunk_free(Chunk *c)
     buf_free(c->lines);
     buf_free(c->offsets);
     buf_free(c->constants);
-    chunk_init(c);
+}
+
+// Drops the code from offset len on, and the line runs starting there
+static void chunk_truncate(Chunk *c, int len)
+{
+    buf_take(c->code, len);
+    while (!buf_empty(c->offsets) && *buf_last(c->offsets) >= len) {
+        buf_pop(c->offsets);
+        buf_pop(c->lines);
+    }
+}
+
+static bool op_is_jump(byte op)
+{
+    return op >= OP_JUMP && op <= OP_JUMP_IF_TRUE_OR_POP;
+}
+
+static bool op_is_loop(byte op)
+{
+    return op == OP_LOOP || op == OP_LOOP_IF_TRUE;
+}
+
+// Offset the jump at offset goes to
+static int chunk_jump_target(const Chunk *c, int offset)
+{
+    return offset + 3 + (c->code[offset + 1] | c->code[offset + 2] << 8);
+}
+
+// Points the jump at offset to target, which must follow it within u16 reach
+static void chunk_set_jump(Chunk *c, int offset, int target)
+{
+    int distance = target - offset - 3;
+    assert(distance >= 0 && distance <= UINT16_MAX);
+    c->code[offset + 1] = (byte)distance;
+    c->code[offset + 2] = (byte)(distance >> 8);
+}
+
+// Offset the backward jump at offset goes to
+static int chunk_loop_target(const Chunk *c, int offset)
+{
+    return offset + 3 - (c->code[offset + 1] | c->code[offset + 2] << 8);
+}
+
+// Points the backward jump at offset to target, which must not follow it
+static void chunk_set_loop(Chunk *c, int offset, int target)
+{
+    int distance = offset + 3 - target;
+    assert(distance >= 3 && distance <= UINT16_MAX);
+    c->code[offset + 1] = (byte)distance;
+    c->code[offset + 2] = (byte)(distance >> 8);
 }
 
 static int chunk_get_line(const Chunk *c, const int offset)
 {
     bool found = false;
     int low = 0;
-    int mid;
+    int mid = 0;
     int high = buf_len(c->lines) - 1;
     while (low <= high) {
         mid = (low + high) / 2;
@@ -61,8 +121,22 @@ static void chunk_write(Chunk *c, const byte *bytes, int count, int line)
     memcpy(dest, bytes, count);
 }
 
+// Small integers are carried in the instruction stream, anything else is
+// added to the constant pool.
 static void chunk_write_constant(Chunk *c, Value v, int line)
 {
+    if (IS_INT(v) && AS_INT(v) >= INT16_MIN && AS_INT(v) <= INT16_MAX) {
+        int n = (int)AS_INT(v);
+        if (n == 0 || n == 1) {
+            chunk_write(c, (byte[]){ n ? OP_ONE : OP_ZERO }, 1, line);
+        } else if (n >= INT8_MIN && n <= INT8_MAX) {
+            chunk_write(c, (byte[]){ OP_SMALLINT, (byte)n }, 2, line);
+        } else {
+            chunk_write(c, (byte[]){ OP_SMALLINT_X, (byte)n, (byte)(n >> 8) }, 3, line);
+        }
+        return;
+    }
+
     int constant = chunk_add_constant(c, v);
     if (buf_len(c->constants) <= 0xFF) {
         chunk_write(c, (byte[]){ OP_CONSTANT, constant }, 2, line);
@@ -0,0 +1,18 @@
+#pragma once
+
+#include <time.h>
+
+#include "common.h"
+
+// Returns a monotonic timestamp in nanoseconds.
+static uint64_t clock_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + (uint64_t)ts.tv_nsec;
+}
+
+MAYBE_UNUSED static double clock_ms(uint64_t ns)
+{
+    return (double)ns / 1e6;
+}
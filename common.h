@@ -1,14 +1,19 @@
 #pragma once
 
+#define _POSIX_C_SOURCE 200809L
+
 #include <stdarg.h>
+#include <stdatomic.h>
 #include <stdbool.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 
+#ifndef NDEBUG
 #define DEBUG_PRINT_CODE
 #define DEBUG_TRACE_EXECUTION
+#endif
 
 #define ANSI_RESET     "\x1b[0m"
 #define ANSI_BOLD      "\x1b[1m"
@@ -23,41 +28,189 @@
 #define ERR_RUNTIME 70
 #define ERR_FILE    74
 
+// Marks functions that xol calls but the other programs built from these
+// sources (xol-bench, xol-loadgen) or release builds may not
+#define MAYBE_UNUSED __attribute__((unused))
+
 #define countof(x) ((sizeof(x) / sizeof(0 [x])) / ((size_t)(!(sizeof(x) % sizeof(0 [x])))))
 
 typedef enum {
     VAL_BOOL,
     VAL_NIL,
-    VAL_NUMBER,
+    VAL_NUMBER,      // double
+    VAL_INT,         // int64_t, also a number; see value.c for the arithmetic
+    VAL_SMALL_STRING,
+    VAL_OBJ,
+    VAL_UNDEFINED, // global slot without a value, never on the stack
 } ValueType;
 
+typedef enum {
+    OBJ_STRING,
+    OBJ_ROPE,
+    OBJ_FUNCTION,
+    OBJ_ARRAY,
+    OBJ_SHAPE, // never a Value, kept in the Heap so heap_free frees it
+    OBJ_CLASS,
+    OBJ_INSTANCE,
+} ObjType;
+
+// Header of every heap object, see object.c
+typedef struct Obj {
+    ObjType     type;
+    bool        marked; // reached by the collection in progress, see gc.c
+    bool        pinned; // a root of every collection, like the constants of a chunk
+    bool        frozen; // owned by an image, never marked
+    struct Obj *next;   // all objects of a Heap, for heap_free
+} Obj;
+
+// Strings up to this many bytes are stored inline, NUL padded
+#define SMALL_STRING_MAX 8
+
 typedef struct {
     ValueType type;
     union {
         bool boolean;
         double number;
+        int64_t integer;
+        Obj *obj;
+        char small[SMALL_STRING_MAX];
     } as;
 } Value;
 
 #define NIL_VAL       ((Value){ VAL_NIL,    { 0 } })
 #define BOOL_VAL(v)   ((Value){ VAL_BOOL,   { .boolean = (v) } })
 #define NUMBER_VAL(v) ((Value){ VAL_NUMBER, { .number = (v) } })
+#define INT_VAL(v)    ((Value){ VAL_INT,    { .integer = (v) } })
+#define OBJ_VAL(o)    ((Value){ VAL_OBJ,    { .obj = (Obj *)(o) } })
+#define UNDEFINED_VAL ((Value){ VAL_UNDEFINED, { 0 } })
 
 #define AS_BOOL(v)    ((v).as.boolean)
-#define AS_NUMBER(v)  ((v).as.number)
+#define AS_NUMBER(v)  value_as_double(v) // of either kind of number
+#define AS_DOUBLE(v)  ((v).as.number)
+#define AS_INT(v)     ((v).as.integer)
+#define AS_OBJ(v)     ((v).as.obj)
+#define AS_STRING(v)  ((ObjString *)AS_OBJ(v))
+#define AS_ROPE(v)    ((ObjRope *)AS_OBJ(v))
+#define AS_FUNCTION(v) ((ObjFunction *)AS_OBJ(v))
+#define AS_ARRAY(v)   ((ObjArray *)AS_OBJ(v))
+#define AS_CLASS(v)   ((ObjClass *)AS_OBJ(v))
+#define AS_INSTANCE(v) ((ObjInstance *)AS_OBJ(v))
+
+#define IS_NIL(v)          ((v).type == VAL_NIL)
+#define IS_BOOL(v)         ((v).type == VAL_BOOL)
+#define IS_NUMBER(v)       ((v).type == VAL_NUMBER || (v).type == VAL_INT)
+#define IS_DOUBLE(v)       ((v).type == VAL_NUMBER)
+#define IS_INT(v)          ((v).type == VAL_INT)
+#define IS_SMALL_STRING(v) ((v).type == VAL_SMALL_STRING)
+#define IS_OBJ(v)          ((v).type == VAL_OBJ)
+#define IS_UNDEFINED(v)    ((v).type == VAL_UNDEFINED)
+#define IS_OBJ_TYPE(v, t)  (IS_OBJ(v) && AS_OBJ(v)->type == (t))
+#define IS_ROPE(v)         IS_OBJ_TYPE(v, OBJ_ROPE)
+#define IS_FUNCTION(v)     IS_OBJ_TYPE(v, OBJ_FUNCTION)
+#define IS_ARRAY(v)        IS_OBJ_TYPE(v, OBJ_ARRAY)
+#define IS_CLASS(v)        IS_OBJ_TYPE(v, OBJ_CLASS)
+#define IS_INSTANCE(v)     IS_OBJ_TYPE(v, OBJ_INSTANCE)
+#define IS_STRING(v) \
+    (IS_SMALL_STRING(v) || IS_OBJ_TYPE(v, OBJ_STRING) || IS_OBJ_TYPE(v, OBJ_ROPE))
+#define IS_FALSEY(v)  (IS_NIL(v) || (IS_BOOL(v) && !AS_BOOL(v)))
+
+static inline double value_as_double(Value v)
+{
+    return IS_INT(v) ? (double)v.as.integer : v.as.number;
+}
+
+// Interned heap string, longer than SMALL_STRING_MAX
+typedef struct {
+    Obj      obj;
+    int      length;
+    uint32_t hash;
+    char     chars[]; // NUL terminated
+} ObjString;
+
+// Concatenation of two strings, copied into flat on first use of its contents
+typedef struct {
+    Obj        obj;
+    int        length;
+    Value      left, right;
+    ObjString *flat;
+} ObjRope;
+
+// Packed array of numbers, see array.c
+typedef struct {
+    Obj     obj;
+    int     length;
+    double *data; // ARRAY_ALIGN aligned, padded to a whole number of ARRAY_ALIGN bytes
+} ObjArray;
+
+// Hidden class: the names of an instance's fields in slot order, shared by
+// the instances of a class that got the same fields in the same order. See
+// shape.c
+typedef struct Shape {
+    Obj            obj;
+    struct Shape  *parent;      // without the last field, NULL for a class's empty shape
+    Value          name;        // of the last field, which is in slot count - 1
+    int            count;       // fields
+    struct Shape **transitions; // shapes with one more field, stretchy buffer
+} Shape;
+
+typedef struct {
+    Obj    obj;
+    Value  name;
+    Shape *shape; // of new instances, without fields
+} ObjClass;
+
+typedef struct {
+    Obj       obj;
+    ObjClass *klass;
+    Shape    *shape;
+    Value    *fields; // by slot, stretchy buffer of shape->count values
+} ObjInstance;
+
+// Objects and interned strings owned by a VM
+typedef struct {
+    Obj        *objects;
+    ObjString **strings;      // intern table, stretchy buffer used as open addressing
+    int         string_count;
+    size_t      bytes;        // held by the objects, about
+    size_t      next_gc;      // bytes at which the VM collects next, see vm_collect
+    size_t      limit;        // bytes it may keep after a collection, 0 for no limit
+    Obj       **gray;         // marked objects not traced yet, stretchy buffer
+    int64_t     collections;
+} Heap;
 
-#define IS_NIL(v)     ((v).type == VAL_NIL)
-#define IS_BOOL(v)    ((v).type == VAL_BOOL)
-#define IS_NUMBER(v)  ((v).type == VAL_NUMBER)
+// Host function called by OP_CALL_NATIVE. args points at its argc arguments
+// on the VM stack, which the result written to *result replaces. Returns NULL,
+// or the message of a runtime error.
+typedef const char *(*NativeFn)(Heap *heap, const Value *args, int argc, Value *result);
+
+// Global variable names and their slots, see globals.c. The compiler resolves
+// names to slots; the VM keeps values in an array indexed by slot.
+typedef struct {
+    Value *names; // name of each slot, stretchy buffer
+    int   *slots; // open addressing hash table of slots by name, -1 when empty
+} GlobalTable;
 
 typedef uint8_t byte;
 
 typedef enum {
     OP_CONSTANT,
     OP_CONSTANT_X,
+    OP_ZERO,       // integers 0 and 1
+    OP_ONE,
+    OP_SMALLINT,   // integer in an i8 operand
+    OP_SMALLINT_X, // integer in an i16 operand
     OP_NIL,
     OP_FALSE,
     OP_TRUE,
+    OP_DUP,
+    OP_PICK,
+    OP_ROLL,
+    OP_POP,
+    OP_DEFINE_GLOBAL, // u16 slot operand, like the two below
+    OP_GET_GLOBAL,
+    OP_SET_GLOBAL,
+    OP_GET_LOCAL,     // byte slot operand, from the start of the call frame
+    OP_SET_LOCAL,
     OP_EQ,
     OP_GT,
     OP_LT,
@@ -67,26 +220,103 @@ typedef enum {
     OP_DIV,
     OP_NOT,
     OP_NEG,
+    OP_SQRT,   // intrinsics that native calls are inlined to, see natives.c
+    OP_FLOOR,
+    OP_MIN,
+    OP_MAX,
+    OP_GT_NN,  // unchecked variants, operands are known to be numbers
+    OP_LT_NN,
+    OP_ADD_NN,
+    OP_SUB_NN,
+    OP_MUL_NN,
+    OP_DIV_NN,
+    OP_NEG_N,
+    OP_JUMP,          // u16 forward offset from the next instruction, like the four below
+    OP_JUMP_IF_FALSE, // pops the condition
+    OP_JUMP_IF_TRUE,
+    OP_JUMP_IF_FALSE_OR_POP, // keeps the value if it jumps, pops it otherwise
+    OP_JUMP_IF_TRUE_OR_POP,
+    OP_LOOP,          // u16 backward offset from the next instruction
+    OP_LOOP_IF_TRUE,  // pops the condition
+    OP_SELECT,        // [cond a b] -> cond ? a : b
+    OP_ARRAY,         // element count operand, packs that many numbers into an array
+    OP_GET_INDEX,     // [array index] -> element
+    OP_SET_INDEX,     // [array index value] -> value
+    OP_CLASS,         // u24 name constant operand, like the two below
+    OP_GET_FIELD,     // [instance] -> value, see vm_get_field
+    OP_SET_FIELD,     // [instance value] -> value
+    OP_CALL_NATIVE,   // native index and argument count operands
+    OP_CALL,          // argument count operand, the function is below the arguments
     OP_RETURN,
     op__count,
 } OpCode;
 
+// Static types tracked by the compiler
+typedef enum {
+    TYPE_UNKNOWN,
+    TYPE_NIL,
+    TYPE_BOOL,
+    TYPE_NUMBER,
+    TYPE_STRING,
+} StaticType;
+
+// Entry of the native function registry, see natives.c
 typedef struct {
-    byte  *code;
-    int   *lines;     // array of line numbers
-    int   *offsets;   // array of byte offsets at the start of each line
-    Value *constants;
+    const char *name;
+    NativeFn    fn;
+    int         arity;  // -1 for one or more arguments
+    int         op;     // instruction calls with op_arity(op) arguments are inlined to, or -1
+    StaticType  result; // type of the value it returns
+} Native;
+
+// Expression DAG node, see ir.c
+typedef struct {
+    byte       op;      // OP_CONSTANT for every constant (nil, true, false too)
+    bool       pure;    // evaluating it can't raise a runtime error
+    bool       unique;  // never shared with an equal node, see ir_make_op
+    StaticType type;    // type of the value if evaluation succeeds
+    int        a, b;    // operand node ids, -1 when unused
+    int        line;
+    int        operand; // OP_GET_GLOBAL slot
+    Value      value;   // OP_CONSTANT only
+} IrNode;
+
+typedef struct {
+    byte    *code;
+    int     *lines;     // array of line numbers
+    int     *offsets;   // array of byte offsets at the start of each line
+    Value   *constants;
+    int      max_stack;    // deepest the stack gets, set by chunk_verify
+    int      global_count; // global slots the code may use, set by the compiler
+    int      arity;        // values on the stack when it starts: a function's arguments
+    uint64_t id;           // new each time the code is verified or linked, see chunk_new_id
 } Chunk;
 
+// Function declared by a script. Only its source is kept until the first
+// call compiles it, see compile_function, with the heap and global table it
+// was declared with.
+typedef struct {
+    Obj          obj;
+    Value        name;     // nil when anonymous
+    int          arity;
+    int          line;     // of the parameter list
+    char        *source;   // parameter list and body, NUL terminated
+    bool         compiled;
+    bool         failed;   // had a compile error, reported on its first call
+    Chunk        chunk;
+    Heap        *heap;
+    GlobalTable *globals;
+} ObjFunction;
+
 typedef enum {
     TOKEN_NONE,
 
     // Punctuation
-    TOKEN_BANG, TOKEN_BANG_EQUAL, TOKEN_COMMA, TOKEN_DOT, TOKEN_EQUAL,
-    TOKEN_EQUAL_EQUAL, TOKEN_GREATER, TOKEN_GREATER_EQUAL, TOKEN_LEFT_BRACE,
-    TOKEN_LEFT_PAREN, TOKEN_LESS, TOKEN_LESS_EQUAL, TOKEN_MINUS, TOKEN_PLUS,
-    TOKEN_RIGHT_BRACE, TOKEN_RIGHT_PAREN, TOKEN_SEMICOLON, TOKEN_SLASH,
-    TOKEN_STAR,
+    TOKEN_BANG, TOKEN_BANG_EQUAL, TOKEN_COLON, TOKEN_COMMA, TOKEN_DOT,
+    TOKEN_EQUAL, TOKEN_EQUAL_EQUAL, TOKEN_GREATER, TOKEN_GREATER_EQUAL,
+    TOKEN_LEFT_BRACE, TOKEN_LEFT_BRACKET, TOKEN_LEFT_PAREN, TOKEN_LESS,
+    TOKEN_LESS_EQUAL, TOKEN_MINUS, TOKEN_PLUS, TOKEN_QUESTION, TOKEN_RIGHT_BRACE,
+    TOKEN_RIGHT_BRACKET, TOKEN_RIGHT_PAREN, TOKEN_SEMICOLON, TOKEN_SLASH, TOKEN_STAR,
 
     // Literals
     TOKEN_IDENTIFIER, TOKEN_STRING, TOKEN_NUMBER,
@@ -109,6 +339,7 @@ typedef struct {
 typedef enum {
     PREC_NONE,
     PREC_ASSIGNMENT,  // =
+    PREC_CONDITIONAL, // ?:
     PREC_OR,          // or
     PREC_AND,         // and
     PREC_EQUALITY,    // == !=
@@ -127,6 +358,8 @@ typedef struct {
     Token current;
     bool  had_error;
     bool  panic_mode;
+    int   depth;      // nesting of the recursive parser
+    bool  can_assign; // the prefix rule being called may parse an assignment
 } Parser;
 
 typedef struct {
@@ -135,6 +368,51 @@ typedef struct {
     Precedence precedence;
 } ParseRule;
 
+typedef struct {
+    bool iterative; // parse expressions with an explicit stack, see parse_iterative
+    int  max_depth; // expression nesting limit, 0 for the parser's default
+    bool optimize;  // build an expression DAG before emitting, see ir.c
+} CompilerOptions;
+
+typedef enum {
+    FRAME_ROOT,
+    FRAME_GROUPING,
+    FRAME_UNARY,
+    FRAME_BINARY,
+    FRAME_SHORT_CIRCUIT, // rhs of and/or
+    FRAME_THEN,          // arms of cond ? a : b
+    FRAME_ELSE,
+    FRAME_SET_LOCAL,     // value of an assignment
+    FRAME_SET_GLOBAL,
+    FRAME_SET_FIELD,
+    FRAME_ARGUMENT,      // of a call
+    FRAME_ELEMENT,       // of an array literal
+    FRAME_INDEX,         // of a subscript
+    FRAME_SET_INDEX,
+} ParseFrameKind;
+
+// An operand being parsed for a rule, see parse_operand: a pending
+// parse_precedence call of the iterative parser
+typedef struct {
+    ParseFrameKind kind;       // what the rule does once this call returns
+    TokenType      op;         // operator to emit for FRAME_UNARY and FRAME_BINARY
+    Precedence     precedence;
+    union {
+        struct {
+            int        jump;     // to patch past the operand
+            int        end_jump; // FRAME_ELSE: the jump over it
+            StaticType type;     // of the operand before it
+        } branch;                // FRAME_SHORT_CIRCUIT, FRAME_THEN, FRAME_ELSE
+        struct {
+            int count;           // parsed before this one
+            int native;          // FRAME_ARGUMENT: called, -1 for OP_CALL
+        } list;                  // FRAME_ARGUMENT, FRAME_ELEMENT
+        int   slot;              // FRAME_SET_LOCAL, FRAME_SET_GLOBAL
+        Token name;              // FRAME_SET_FIELD
+        bool  can_assign;        // FRAME_INDEX: whether a[i] = v may follow
+    } as;
+} ParseFrame;
+
 typedef struct {
     const char *start;   // token
     const char *current; // cursor
@@ -145,6 +423,7 @@ typedef enum {
     INTERPRET_OK,
     INTERPRET_COMPILE_ERROR,
     INTERPRET_RUNTIME_ERROR,
+    INTERPRET_YIELD, // ran out of budget, vm_resume continues
 } VMInterpretResult;
 
 typedef struct {
@@ -152,10 +431,182 @@ typedef struct {
     Value             value;
 } VMResult;
 
+typedef struct Stats Stats;
+
+typedef struct {
+    int64_t hits;
+    int64_t misses;
+    int64_t evictions;
+    int64_t bytes;     // held by cached chunks and their sources
+} CacheStats;
+
+// A compiled script, read-only once made so that any number of VMs may run it
+// at once, see image.c
+typedef struct {
+    Chunk       chunk;
+    Heap        heap;  // strings it owns, see image_new
+    Value      *names; // name of each global slot the chunk uses
+    atomic_int  refs;
+} ChunkImage;
+
+typedef struct {
+    uint64_t    hash;
+    char       *source;       // stretchy buffer, NUL terminated
+    ChunkImage *image;        // holds a reference
+    int         newer, older; // LRU list, -1 at the ends
+    int         next;         // next entry of the same bucket, -1 at the end
+} CacheEntry;
+
+// Compiled images by source, see cache.c
+typedef struct {
+    CacheEntry *entries;  // capacity entries, allocated on first insert
+    int        *buckets;  // stretchy buffer of entry chains, power of two long
+    int         capacity; // 0 disables the cache
+    int         count;
+    int         newest, oldest;
+    CacheStats  stats;
+} ChunkCache;
+
+// A top-level declaration of an EditBuffer and the code compiled for it
+typedef struct {
+    int   first, end;     // token range, the parser also looked at token end
+    Chunk code;           // lines relative to the line of the first token
+    int   code_start;     // where its code is in the linked chunk
+    int   constant_start; // number of its first constant there
+    bool  result;         // trailing expression whose value the script returns
+    bool  failed;         // had a compile error, code is empty
+} EditDecl;
+
+// Declarations [decl, decl + count) replaced by an edit, and the code and
+// constants [start, end) that the old ones occupied in the linked chunk
+typedef struct {
+    int decl, count;
+    int code_start, code_end;
+    int constant_start, constant_end;
+} EditSplice;
+
+// Cost of the last edit applied to an EditBuffer
+typedef struct {
+    int      tokens, tokens_scanned;
+    int      decls, decls_compiled;
+    int      code_bytes, code_written;
+    uint64_t scan_ns, compile_ns, link_ns;
+} EditStats;
+
+// Source kept with its tokens and per-declaration code so an edit only
+// rescans and recompiles what it touched, see edit.c
+typedef struct {
+    char        *source;   // stretchy buffer, NUL terminated
+    Token       *tokens;   // stretchy buffer, ends with TOKEN_EOF
+    int         *ends;     // offset in source where the scan of each token stopped
+    EditDecl    *decls;    // stretchy buffer, in source order
+    int          failed;   // declarations with compile errors
+    Chunk        chunk;    // all declarations linked into a script
+    int          code_end; // end of the declarations' code in chunk
+    bool         linked;   // chunk is up to date with decls
+    bool         ok;       // no declaration failed, chunk can be run
+    Heap        *heap;     // of the VM that runs chunk, like the globals
+    GlobalTable *globals;
+    EditStats    stats;
+} EditBuffer;
+
+// A function call in progress. Its arguments and locals are slots of the VM
+// stack from slots on, with the function itself just below.
+typedef struct {
+    ObjFunction *function; // NULL for the script
+    Chunk       *chunk;
+    byte        *ip;       // of the caller while a callee runs
+    Value       *slots;
+} CallFrame;
+
+#define FRAMES_MAX 256
+
+#define PROFILE_DEPTH 32 // innermost frames kept per sample
+#define PROFILE_RING  64 // samples taken between two drains, see vm_run
+
+// A frame of a sample, resolved to a source line when the sample is drained
+typedef struct {
+    const ObjFunction *function; // NULL for the script
+    const Chunk       *chunk;
+    int                offset;   // of the instruction running, or after the call
+} ProfileFrame;
+
+typedef struct {
+    ProfileFrame frames[PROFILE_DEPTH]; // innermost first
+    int          depth;
+    bool         truncated;             // the call stack was deeper
+} ProfileSample;
+
+// Samples with the same folded call stack
+typedef struct {
+    char    *stack; // "script:12;fib:3", outermost first, stretchy buffer, NUL terminated
+    uint32_t hash;
+    int64_t  count;
+} ProfileStack;
+
+// Sampling profiler, see profile.c. The SIGPROF handler writes samples of
+// the VM running on its thread to the ring; the VM drains them.
+typedef struct {
+    ProfileSample  ring[PROFILE_RING];
+    atomic_uint    head;     // written by the handler only
+    atomic_uint    tail;     // written by the VM only
+    atomic_int     dropped;  // samples the ring had no room for
+    int64_t        samples;  // drained
+    int64_t       *lines;    // samples by line of the innermost frame, stretchy buffer
+    ProfileStack  *stacks;   // stretchy buffer
+    int           *table;    // open addressing hash table of stacks, -1 when empty
+} Profiler;
+
+#define VM_HOT_SLOTS 64   // backward branch counters, by a hash of the branch's address
+#define VM_HOT_LOOP  1024 // backward branches that make a loop hot
+#define VM_HOT_LOOPS 4096 // hot loops vm_start keeps, see vm_hot_loop
+
+#define VM_FIELD_SITES 4096 // field access caches vm_start keeps, see vm_field_cache
+#define VM_FIELD_WAYS  4    // shapes a cache holds, only one while the site is monomorphic
+
+// Inline cache of an OP_GET_FIELD or OP_SET_FIELD: the slot of its field in
+// each shape seen there. A store that adds the field also has the shape it
+// moves the instance to.
+typedef struct {
+    uint64_t site;   // id of the chunk << 24 | constant of the name, 0 when unused
+    int      count;  // shapes held
+    int      next;   // way to replace once all are in use
+    Shape   *shapes[VM_FIELD_WAYS];
+    Shape   *added[VM_FIELD_WAYS]; // or NULL
+    int      slots[VM_FIELD_WAYS];
+} FieldCache;
+
+// Loop whose backward branch made a counter reach VM_HOT_LOOP, for the tiers
+// that would optimize it, see vm_hot_loop
+typedef struct {
+    uint64_t chunk;    // id of the chunk with its code
+    int      offset;   // of the backward branch
+    int      line;
+    int64_t  branches; // counted VM_HOT_LOOP at a time, with any that collide
+} HotLoop;
+
 typedef struct {
-    Chunk *chunk;
-    byte  *ip;
-    Value *stack; // stretchy buffer
+    Chunk       *chunk;
+    ChunkImage  *image;        // chunk's image if it has one, holds a reference
+    CallFrame    frames[FRAMES_MAX];
+    int          frame_count;  // 0 when not running, 1 in the script
+    Value       *stack;        // stretchy buffer, only its capacity is used
+    Value       *stack_top;    // one past the last value in use
+    Stats       *stats;        // optional instrumentation, see stats.c
+    Profiler    *profile;      // optional sampling, see profile.c
+    Heap         heap;
+    GlobalTable  global_names;
+    Value       *globals;      // value of each global slot, stretchy buffer
+    ChunkCache   cache;
+    FILE        *errors;       // compile and runtime errors, stderr when NULL
+    uint64_t     budget;       // instructions vm_resume runs before yielding, 0 for no limit
+    uint64_t     deadline_ns;  // clock_ns() at which vm_resume yields, 0 for none
+    uint16_t     hot_counts[VM_HOT_SLOTS];
+    HotLoop     *hot_loops;    // stretchy buffer
+    FieldCache  *field_caches; // open addressing hash table by site, stretchy buffer
+    int          field_sites;  // caches in use
+    int64_t      field_hits;
+    int64_t      field_misses;
 } VM;
 
 
@@ -1,20 +1,95 @@
 #pragma once
 
+#include <errno.h>
+
 #include "common.h"
 #include "debug.c"
 #include "chunk.c"
+#include "globals.c"
+#include "ir.c"
+#include "natives.c"
 #include "scanner.c"
+#include "verify.c"
+
+// Nesting limits for expressions. The recursive parser uses a few C stack frames
+// per level so it stops well before the stack would overflow.
+#define PARSE_DEPTH_RECURSIVE 4096
+#define PARSE_DEPTH_ITERATIVE (1 << 20)
 
 // Forward declared so they are available for parse rules
+static void and_(void);
+static void array_literal(void);
 static void binary(void);
+static void call(void);
+static void conditional(void);
+static void dot(void);
+static void fn_expression(void);
 static void grouping(void);
 static void literal(void);
 static void number(void);
+static void or_(void);
+static void string(void);
+static void subscript(void);
 static void unary(void);
+static void variable(void);
+static bool declaration(void);
+static void parse_resume(const ParseFrame *frame);
+
+// Thread local so independent VMs can compile on separate threads
+static _Thread_local Chunk       *chunk;
+static _Thread_local Scanner     scanner;
+static _Thread_local Parser      parser;
+static _Thread_local Heap        *heap;    // owns string constants
+static _Thread_local GlobalTable *globals; // slots of global names
+
+// Static types of the values left on the stack by the code emitted so far.
+// The IR tracks types itself, so this is only used without -O.
+static _Thread_local StaticType *types;
+
+// Where compile errors are reported, stderr when NULL
+static _Thread_local FILE *compile_errors;
+
+// The operand a rule asked parse_iterative for, FRAME_ROOT if none, see
+// parse_operand
+static _Thread_local ParseFrame pending_operand;
+
+// Tokens to parse instead of scanning the source, ending with TOKEN_EOF; see
+// compile_declaration
+static _Thread_local const Token *token_stream;
 
-static Chunk   *chunk;
-static Scanner scanner;
-static Parser  parser;
+// Function whose body is being compiled, NULL at the top level of a script,
+// and the names of its locals by stack slot, parameters first. There are no
+// closures: any other name in a body is a global.
+static _Thread_local ObjFunction *function;
+static _Thread_local Token       *locals;
+
+#define LOCALS_MAX 256
+
+// Value on the stack computed from constants alone, by code that can't fail
+typedef struct {
+    int start;   // of its code in the chunk
+    int end;
+    int depth;   // in types
+    int hoisted; // index in hoisted, or -1 while its code is in place
+} ConstValue;
+
+typedef struct {
+    byte *code; // stretchy buffer
+    int   line;
+} HoistedValue;
+
+// Loops being compiled. Without -O, which folds them instead, constant
+// subexpressions in a loop are hoisted: computed once before the outermost
+// loop into stack slots from hoist_base on, below the locals declared in it,
+// and loaded from there. See hoist and loop_end.
+static _Thread_local int           loop_depth;
+static _Thread_local int           hoist_base;
+static _Thread_local HoistedValue *hoisted;
+static _Thread_local int          *hoist_refs; // offsets of the loads of hoisted values
+static _Thread_local ConstValue   *consts;     // constant values on the stack, by depth
+
+// Set once at startup, read by every compiling thread
+static CompilerOptions compiler_options;
 
 static ParseRule parse_rules[] = {
     //                        prefix    infix    precedence
@@ -22,37 +97,41 @@ static ParseRule parse_rules[] = {
 
     [TOKEN_BANG]          = { unary,    NULL,    PREC_NONE       },
     [TOKEN_BANG_EQUAL]    = { NULL,     binary,  PREC_EQUALITY   },
+    [TOKEN_COLON]         = { NULL,     NULL,    PREC_NONE       },
     [TOKEN_COMMA]         = { NULL,     NULL,    PREC_NONE       },
-    [TOKEN_DOT]           = { NULL,     NULL,    PREC_NONE       },
+    [TOKEN_DOT]           = { NULL,     dot,     PREC_CALL       },
     [TOKEN_EQUAL]         = { NULL,     NULL,    PREC_NONE       },
     [TOKEN_EQUAL_EQUAL]   = { NULL,     binary,  PREC_EQUALITY   },
     [TOKEN_GREATER]       = { NULL,     binary,  PREC_COMPARISON },
     [TOKEN_GREATER_EQUAL] = { NULL,     binary,  PREC_COMPARISON },
     [TOKEN_LEFT_BRACE]    = { NULL,     NULL,    PREC_NONE       },
-    [TOKEN_LEFT_PAREN]    = { grouping, NULL,    PREC_NONE       },
+    [TOKEN_LEFT_BRACKET]  = { array_literal, subscript, PREC_CALL },
+    [TOKEN_LEFT_PAREN]    = { grouping, call,    PREC_CALL       },
     [TOKEN_LESS]          = { NULL,     binary,  PREC_COMPARISON },
     [TOKEN_LESS_EQUAL]    = { NULL,     binary,  PREC_COMPARISON },
-    [TOKEN_MINUS]         = { unary,    binary,  PREC_EQUALITY   },
+    [TOKEN_MINUS]         = { unary,    binary,  PREC_TERM       },
     [TOKEN_PLUS]          = { NULL,     binary,  PREC_TERM       },
+    [TOKEN_QUESTION]      = { NULL, conditional, PREC_CONDITIONAL },
     [TOKEN_RIGHT_BRACE]   = { NULL,     NULL,    PREC_NONE       },
+    [TOKEN_RIGHT_BRACKET] = { NULL,     NULL,    PREC_NONE       },
     [TOKEN_RIGHT_PAREN]   = { NULL,     NULL,    PREC_NONE       },
     [TOKEN_SEMICOLON]     = { NULL,     NULL,    PREC_NONE       },
     [TOKEN_SLASH]         = { NULL,     binary,  PREC_FACTOR     },
     [TOKEN_STAR]          = { NULL,     binary,  PREC_FACTOR     },
 
-    [TOKEN_IDENTIFIER]    = { NULL,     NULL,    PREC_NONE       },
-    [TOKEN_STRING]        = { NULL,     NULL,    PREC_NONE       },
+    [TOKEN_IDENTIFIER]    = { variable, NULL,    PREC_NONE       },
+    [TOKEN_STRING]        = { string,   NULL,    PREC_NONE       },
     [TOKEN_NUMBER]        = { number,   NULL,    PREC_NONE       },
 
-    [TOKEN_AND]           = { NULL,     NULL,    PREC_NONE       },
+    [TOKEN_AND]           = { NULL,     and_,    PREC_AND        },
     [TOKEN_CLASS]         = { NULL,     NULL,    PREC_NONE       },
     [TOKEN_ELSE]          = { NULL,     NULL,    PREC_NONE       },
     [TOKEN_FALSE]         = { literal,  NULL,    PREC_NONE       },
     [TOKEN_FOR]           = { NULL,     NULL,    PREC_NONE       },
-    [TOKEN_FN]            = { NULL,     NULL,    PREC_NONE       },
+    [TOKEN_FN]            = { fn_expression, NULL, PREC_NONE     },
     [TOKEN_IF]            = { NULL,     NULL,    PREC_NONE       },
     [TOKEN_NIL]           = { literal,  NULL,    PREC_NONE       },
-    [TOKEN_OR]            = { NULL,     NULL,    PREC_NONE       },
+    [TOKEN_OR]            = { NULL,     or_,     PREC_OR         },
     [TOKEN_PRINT]         = { NULL,     NULL,    PREC_NONE       },
     [TOKEN_RETURN]        = { NULL,     NULL,    PREC_NONE       },
     [TOKEN_SUPER]         = { NULL,     NULL,    PREC_NONE       },
@@ -78,17 +157,18 @@ static void error_at(Token *token, const char *message)
     }
     parser.panic_mode = true;
 
-    fprintf(stderr, "[line %d] Error", token->line);
+    FILE *out = compile_errors ? compile_errors : stderr;
+    fprintf(out, "[line %d] Error", token->line);
 
     if (token->type == TOKEN_EOF) {
-        fprintf(stderr, " at end");
+        fprintf(out, " at end");
     } else if (token->type == TOKEN_ERROR) {
         // Nothing.
     } else {
-        fprintf(stderr, " at '%.*s'", token->length, token->start);
+        fprintf(out, " at '%.*s'", token->length, token->start);
     }
 
-    fprintf(stderr, ": %s\n", message);
+    fprintf(out, ": %s\n", message);
     parser.had_error = true;
 }
 
@@ -107,7 +187,12 @@ static void advance(void)
     parser.previous = parser.current;
 
     for (;;) {
-        parser.current = scanner_scan_token(&scanner);
+        if (token_stream) {
+            parser.current = *token_stream;
+            if (token_stream->type != TOKEN_EOF) ++token_stream;
+        } else {
+            parser.current = scanner_scan_token(&scanner);
+        }
         if (parser.current.type != TOKEN_ERROR) break;
 
         error_at_current(parser.current.start);
@@ -124,14 +209,22 @@ static void consume(TokenType type, const char *message)
     error_at_current(message);
 }
 
-static void emit_byte(byte b)
+static bool check(TokenType type)
 {
-    chunk_write(current_chunk(), (byte[]){ b }, 1, parser.previous.line);
+    return parser.current.type == type;
 }
 
-static void emit_bytes(const byte b1, byte b2)
+static bool match(TokenType type)
 {
-    chunk_write(current_chunk(), (byte[]){ b1, b2 }, 2, parser.previous.line);
+    if (!check(type)) return false;
+    advance();
+    return true;
+}
+
+static void emit_byte(byte b)
+{
+    ir_flush(current_chunk());
+    chunk_write(current_chunk(), (byte[]){ b }, 1, parser.previous.line);
 }
 
 static void emit_return(void)
@@ -139,13 +232,256 @@ static void emit_return(void)
     emit_byte(OP_RETURN);
 }
 
+// Emits op with a byte operand
+static void emit_u8(byte op, int operand)
+{
+    ir_flush(current_chunk());
+    byte bytes[] = { op, (byte)operand };
+    chunk_write(current_chunk(), bytes, 2, parser.previous.line);
+}
+
+// Emits op with a u16 operand
+static void emit_u16(byte op, int operand)
+{
+    ir_flush(current_chunk());
+    byte bytes[] = { op, (byte)operand, (byte)(operand >> 8) };
+    chunk_write(current_chunk(), bytes, 3, parser.previous.line);
+}
+
+// Emits op with the u24 index of a new constant for the identifier name
+static void emit_named(byte op, const Token *name)
+{
+    Chunk *c = current_chunk();
+    ir_flush(c);
+    int constant = chunk_add_constant(c, string_value(heap, name->start, name->length));
+    byte bytes[] = { op, (byte)constant, (byte)(constant >> 8), (byte)(constant >> 16) };
+    chunk_write(c, bytes, 4, parser.previous.line);
+}
+
+static StaticType pop_type(void)
+{
+    StaticType t = buf_empty(types) ? TYPE_UNKNOWN : *buf_pop(types);
+    while (!buf_empty(consts) && buf_last(consts)->depth >= buf_len(types)) {
+        buf_pop(consts);
+    }
+    return t;
+}
+
+// Records the value just pushed by the code from start on as a constant, in a
+// loop that may hoist it
+static void const_push(int start)
+{
+    if (loop_depth == 0) return;
+    buf_push(consts, ((ConstValue){ start, buf_len(current_chunk()->code), buf_len(types) - 1, -1 }));
+}
+
+// Copies the top count values of the stack to operands if they are all
+// constants and their code is all that was emitted since the first one
+static bool const_operands(ConstValue *operands, int count)
+{
+    int n = buf_len(consts), height = buf_len(types);
+    if (n < count) return false;
+    int end = buf_len(current_chunk()->code);
+    for (int i = count - 1; i >= 0; --i) {
+        const ConstValue *v = &consts[n - count + i];
+        if (v->depth != height - count + i || v->end != end) return false;
+        operands[i] = *v;
+        end = v->start;
+    }
+    return true;
+}
+
+// Moves the operator just emitted and the code of its constant operands to a
+// hoisted value, replacing them with a load of its slot. Operands that were
+// hoisted already are merged into it, and those are always the last ones.
+static void hoist(const ConstValue *operands, int arity)
+{
+    Chunk *c = current_chunk();
+    int start = operands[0].start, len = buf_len(c->code);
+    int index = -1;
+    for (int i = 0; i < arity && index < 0; ++i) {
+        index = operands[i].hoisted;
+    }
+    if (index < 0) {
+        if (buf_len(hoisted) + buf_len(locals) >= LOCALS_MAX) return;
+        index = buf_len(hoisted);
+        buf_push(hoisted, ((HoistedValue){ NULL, chunk_get_line(c, start) }));
+    }
+
+    byte *code = NULL;
+    for (int i = 0; i < arity; ++i) {
+        const ConstValue *v = &operands[i];
+        const byte *from = v->hoisted >= 0 ? hoisted[v->hoisted].code : &c->code[v->start];
+        int size = v->hoisted >= 0 ? buf_len(hoisted[v->hoisted].code) : v->end - v->start;
+        memcpy(buf_append(code, size), from, size);
+    }
+    buf_push(code, c->code[len - 1]);
+    for (int i = 0; i < arity; ++i) {
+        if (operands[i].hoisted >= 0) buf_free(hoisted[operands[i].hoisted].code);
+    }
+    buf_take(hoisted, index + 1);
+    hoisted[index].code = code;
+
+    chunk_truncate(c, start);
+    while (!buf_empty(hoist_refs) && *buf_last(hoist_refs) >= start) {
+        buf_pop(hoist_refs);
+    }
+    buf_push(hoist_refs, start);
+    chunk_write(c, (byte[]){ OP_GET_LOCAL, (byte)index }, 2, parser.previous.line);
+    buf_push(consts, ((ConstValue){ start, start + 2, buf_len(types) - 1, index }));
+}
+
+static void push_type(StaticType t)
+{
+    if (!compiler_options.optimize) {
+        buf_push(types, t);
+    }
+}
+
+// Emits jump op with its offset still to be set and returns where it is
+static int emit_jump(byte op)
+{
+    ir_flush(current_chunk());
+    int offset = buf_len(current_chunk()->code);
+    emit_u16(op, 0);
+    return offset;
+}
+
+// Points the jump at offset to the code emitted next
+static void patch_jump(int offset)
+{
+    Chunk *c = current_chunk();
+    ir_flush(c);
+    if (buf_len(c->code) - offset - 3 > UINT16_MAX) {
+        error("Too much code to jump over.");
+        return;
+    }
+    chunk_set_jump(c, offset, buf_len(c->code));
+}
+
+// Jump threading: a jump to another jump whose outcome it already knows goes
+// straight to where that one would. A jump that keeps a falsey value and lands
+// on OP_JUMP_IF_TRUE_OR_POP, say, pops it and carries on past it instead, so
+// chains of and/or and nested conditionals cost one branch per operand.
+// Jumps go forward, so going through them back to front finds the targets in
+// their final form.
+static void thread_jumps(Chunk *c)
+{
+    int len = buf_len(c->code);
+    int *jumps = NULL;
+    for (int offset = 0; offset < len; offset += InstrSize[c->code[offset]] ? InstrSize[c->code[offset]] : 1) {
+        if (op_is_jump(c->code[offset])) buf_push(jumps, offset);
+    }
+
+    for (int i = buf_len(jumps) - 1; i >= 0; --i) {
+        int offset = jumps[i];
+        byte op = c->code[offset];
+        int target = chunk_jump_target(c, offset);
+        while (target < len && op_is_jump(c->code[target])) {
+            byte next = c->code[target];
+            int next_target = chunk_jump_target(c, target);
+            bool keeps = op == OP_JUMP_IF_FALSE_OR_POP || op == OP_JUMP_IF_TRUE_OR_POP;
+            byte threaded = op;
+            if (next == OP_JUMP) {
+                // Goes on whatever the value
+            } else if (!keeps) {
+                break; // next tests a value this jump knows nothing about
+            } else {
+                bool falsey = op == OP_JUMP_IF_FALSE_OR_POP;
+                bool taken = falsey == (next == OP_JUMP_IF_FALSE || next == OP_JUMP_IF_FALSE_OR_POP);
+                bool next_keeps = next == OP_JUMP_IF_FALSE_OR_POP || next == OP_JUMP_IF_TRUE_OR_POP;
+                if (!taken || !next_keeps) {
+                    threaded = falsey ? OP_JUMP_IF_FALSE : OP_JUMP_IF_TRUE;
+                }
+                if (!taken) next_target = target + 3;
+            }
+            if (next_target - offset - 3 > UINT16_MAX) break;
+            op = threaded;
+            target = next_target;
+        }
+        c->code[offset] = op;
+        chunk_set_jump(c, offset, target);
+    }
+    buf_free(jumps);
+}
+
+// Pure expression operators and constants go through the IR when optimizing.
+// Otherwise operators whose operand types are known are emitted unchecked.
+static void emit_op(byte op)
+{
+    if (compiler_options.optimize) {
+        ir_op(current_chunk(), op, parser.previous.line);
+        return;
+    }
+    int arity = op_arity(op);
+    ConstValue operands[2];
+    bool constant = const_operands(operands, arity);
+    StaticType b = pop_type();
+    StaticType a = arity == 2 ? pop_type() : b;
+    emit_byte(op_unchecked(op, a, b));
+    buf_push(types, op_result_type(op, a, b));
+    if (constant && op_cannot_fail(op, a, b)) hoist(operands, arity);
+}
+
 static void emit_constant(Value v)
 {
-    chunk_write_constant(current_chunk(), v, parser.previous.line);
+    if (compiler_options.optimize) {
+        ir_constant(v, parser.previous.line);
+    } else {
+        ir_flush(current_chunk());
+        int start = buf_len(current_chunk()->code);
+        chunk_write_constant(current_chunk(), v, parser.previous.line);
+        buf_push(types, value_type(v));
+        const_push(start);
+    }
+}
+
+static void emit_literal(Value v, byte op)
+{
+    if (compiler_options.optimize) {
+        ir_constant(v, parser.previous.line);
+    } else {
+        int start = buf_len(current_chunk()->code);
+        emit_byte(op);
+        buf_push(types, value_type(v));
+        const_push(start);
+    }
+}
+
+static void emit_pop(void)
+{
+    if (compiler_options.optimize) {
+        ir_pop(current_chunk(), parser.previous.line);
+    } else {
+        emit_byte(OP_POP);
+        pop_type();
+    }
+}
+
+static void emit_get_global(int slot)
+{
+    if (compiler_options.optimize) {
+        ir_load(OP_GET_GLOBAL, slot, parser.previous.line);
+    } else {
+        emit_u16(OP_GET_GLOBAL, slot);
+        buf_push(types, TYPE_UNKNOWN);
+    }
+}
+
+static void emit_get_local(int slot)
+{
+    if (compiler_options.optimize) {
+        ir_load(OP_GET_LOCAL, slot, parser.previous.line);
+    } else {
+        emit_u8(OP_GET_LOCAL, slot);
+        buf_push(types, TYPE_UNKNOWN);
+    }
 }
 
 static void end_compiler(void)
 {
+    ir_flush(current_chunk());
+    thread_jumps(current_chunk());
 #ifdef DEBUG_PRINT_CODE
     if (!parser.had_error) {
         chunk_disassemble(current_chunk(), "code");
@@ -154,22 +490,139 @@ static void end_compiler(void)
     emit_return();
 }
 
-static void parse_precedence(Precedence precedence)
+static int max_depth(void)
+{
+    if (compiler_options.max_depth > 0) {
+        return compiler_options.max_depth;
+    }
+    return compiler_options.iterative ? PARSE_DEPTH_ITERATIVE : PARSE_DEPTH_RECURSIVE;
+}
+
+static void emit_unary(TokenType op)
 {
+    switch (op) {
+        case TOKEN_BANG:  emit_op(OP_NOT); break;
+        case TOKEN_MINUS: emit_op(OP_NEG); break;
+        default:          assert(0 && "unreachable");
+    }
+}
+
+static void emit_binary(TokenType op)
+{
+    switch (op) {
+        case TOKEN_BANG_EQUAL:    emit_op(OP_EQ); emit_op(OP_NOT); break;
+        case TOKEN_EQUAL_EQUAL:   emit_op(OP_EQ); break;
+        case TOKEN_GREATER:       emit_op(OP_GT); break;
+        case TOKEN_GREATER_EQUAL: emit_op(OP_LT); emit_op(OP_NOT); break;
+        case TOKEN_LESS:          emit_op(OP_LT); break;
+        case TOKEN_LESS_EQUAL:    emit_op(OP_GT); emit_op(OP_NOT); break;
+        case TOKEN_PLUS:          emit_op(OP_ADD); break;
+        case TOKEN_MINUS:         emit_op(OP_SUB); break;
+        case TOKEN_STAR:          emit_op(OP_MUL); break;
+        case TOKEN_SLASH:         emit_op(OP_DIV); break;
+        default:          assert(0 && "unreachable");
+    }
+}
+
+static void parse_recursive(Precedence precedence)
+{
+    if (parser.depth >= max_depth()) {
+        error_at_current("Expression nested too deeply.");
+        return;
+    }
+    ++parser.depth;
+
     advance();
     ParseFn prefix_rule_fn = parse_rules[parser.previous.type].prefix;
     if (prefix_rule_fn == NULL) {
         error("Expect expression.");
+        --parser.depth;
         return;
     }
 
+    bool can_assign = precedence <= PREC_ASSIGNMENT;
+    parser.can_assign = can_assign;
     prefix_rule_fn();
 
     while (precedence <= parse_rules[parser.current.type].precedence) {
         advance();
         ParseFn infix_rule_fn = parse_rules[parser.previous.type].infix;
+        parser.can_assign = can_assign;
         infix_rule_fn();
     }
+
+    if (can_assign && match(TOKEN_EQUAL)) {
+        error("Invalid assignment target.");
+    }
+
+    --parser.depth;
+}
+
+// Same grammar and bytecode as parse_recursive, but the rules that parse an
+// operand leave a frame for it (see parse_operand) instead of recursing, so
+// nesting costs heap rather than C stack. Every frame stands for a
+// parse_recursive call in progress and the rule that waits for it.
+static void parse_iterative(Precedence precedence)
+{
+    int limit = max_depth();
+    ParseFrame *stack = NULL;
+    buf_push(stack, ((ParseFrame){ .kind = FRAME_ROOT, .precedence = precedence }));
+    pending_operand.kind = FRAME_ROOT;
+
+    for (;;) {
+        // Prefix rule of the innermost call
+        advance();
+        ParseFn prefix_rule_fn = parse_rules[parser.previous.type].prefix;
+        bool returning = prefix_rule_fn == NULL;
+        if (returning) {
+            error("Expect expression.");
+        } else {
+            parser.can_assign = buf_last(stack)->precedence <= PREC_ASSIGNMENT;
+            prefix_rule_fn();
+        }
+
+        // Infix loop of the innermost call, then unwind finished calls, until
+        // a rule asks for an operand
+        while (pending_operand.kind == FRAME_ROOT) {
+            ParseFrame *top = buf_last(stack);
+            if (!returning && top->precedence <= parse_rules[parser.current.type].precedence) {
+                advance();
+                parser.can_assign = top->precedence <= PREC_ASSIGNMENT;
+                parse_rules[parser.previous.type].infix();
+                continue;
+            }
+
+            ParseFrame frame = *buf_pop(stack);
+            if (frame.precedence <= PREC_ASSIGNMENT && !returning && match(TOKEN_EQUAL)) {
+                error("Invalid assignment target.");
+            }
+            if (frame.kind == FRAME_ROOT) {
+                buf_free(stack);
+                return;
+            }
+            parse_resume(&frame);
+            returning = false;
+        }
+
+        if (buf_len(stack) >= limit) {
+            error_at_current("Expression nested too deeply.");
+            break;
+        }
+        buf_push(stack, pending_operand);
+        pending_operand.kind = FRAME_ROOT;
+    }
+
+    pending_operand.kind = FRAME_ROOT;
+    buf_free(stack);
+}
+
+static void parse_precedence(Precedence precedence)
+{
+    if (compiler_options.iterative) {
+        parse_iterative(precedence);
+    } else {
+        parse_recursive(precedence);
+    }
 }
 
 static void expression(void)
@@ -177,76 +630,1076 @@ static void expression(void)
     parse_precedence(PREC_ASSIGNMENT);
 }
 
+// Parses the operand that frame waits for, then lets it finish its rule (see
+// parse_resume). The iterative parser is left the frame instead, so a rule
+// returns before its operand is parsed and must not do anything after this.
+static void parse_operand(ParseFrame frame)
+{
+    if (compiler_options.iterative) {
+        assert(pending_operand.kind == FRAME_ROOT);
+        pending_operand = frame;
+        return;
+    }
+    parse_recursive(frame.precedence);
+    parse_resume(&frame);
+}
+
 static void grouping(void)
 {
-    expression();
-    consume(TOKEN_RIGHT_PAREN, "Expect ')' after expression.");
+    parse_operand((ParseFrame){ .kind = FRAME_GROUPING, .precedence = PREC_ASSIGNMENT });
 }
 
+// Literals without a fraction are integers unless they don't fit in one
 static void number(void)
 {
-    double value = strtod(parser.previous.start, NULL);
-    emit_constant(NUMBER_VAL(value));
+    const Token *t = &parser.previous;
+    if (!memchr(t->start, '.', t->length)) {
+        errno = 0;
+        long long value = strtoll(t->start, NULL, 10);
+        if (errno != ERANGE) {
+            emit_constant(INT_VAL(value));
+            return;
+        }
+    }
+    emit_constant(NUMBER_VAL(strtod(t->start, NULL)));
 }
 
-static void unary(void)
+static void string(void)
 {
-    TokenType op = parser.previous.type;
+    // Without the quotes
+    emit_constant(string_value(heap, parser.previous.start + 1, parser.previous.length - 2));
+}
 
-    // Compile the operand.
-    parse_precedence(PREC_UNARY);
+// Returns the global slot for an identifier token
+static int identifier_slot(const Token *name)
+{
+    int slot = global_slot(globals, string_value(heap, name->start, name->length));
+    if (slot < 0) {
+        error("Too many global variables.");
+        return 0;
+    }
+    return slot;
+}
 
-    // Emit the operator instruction.
-    switch (op) {
-        case TOKEN_BANG:  emit_byte(OP_NOT); break;
-        case TOKEN_MINUS: emit_byte(OP_NEG); break;
-        default:          assert(0 && "unreachable");
+// Arguments are left on the stack for OP_CALL_NATIVE, which replaces them with
+// the result. A call to an intrinsic with as many arguments as its instruction
+// takes is emitted as that instruction, so -O can fold it.
+static void call_native(int native, int argc)
+{
+    const Native *n = &natives[native];
+    if (n->arity >= 0 ? argc != n->arity : argc == 0) {
+        char message[64];
+        if (n->arity >= 0) {
+            snprintf(message, sizeof(message), "Expected %d arguments but got %d.", n->arity, argc);
+        } else {
+            snprintf(message, sizeof(message), "Expected at least 1 argument but got 0.");
+        }
+        error(message);
+        return;
+    }
+    if (n->op >= 0 && op_arity((byte)n->op) == argc) {
+        emit_op((byte)n->op);
+        return;
+    }
+    ir_flush(current_chunk());
+    byte bytes[] = { OP_CALL_NATIVE, (byte)native, (byte)argc };
+    chunk_write(current_chunk(), bytes, 3, parser.previous.line);
+    for (int i = 0; i < argc; ++i) {
+        pop_type();
+    }
+    push_type(n->result);
+}
+
+// Any value can be called; OP_CALL checks that it is a function. The callee
+// and its arguments stay on the stack, where they become the slots of its
+// frame. Natives are called by name instead, see variable.
+static void call_value(int argc)
+{
+    emit_u8(OP_CALL, argc);
+    for (int i = 0; i <= argc; ++i) {
+        pop_type();
+    }
+    push_type(TYPE_UNKNOWN);
+}
+
+// Parses the next call argument after argc of them, or the ')' after the last
+// and emits the call of native, or of the callee on the stack if it is -1
+static void argument_list(int native, int argc)
+{
+    if (argc == 0 ? !check(TOKEN_RIGHT_PAREN) : match(TOKEN_COMMA)) {
+        parse_operand((ParseFrame){ .kind = FRAME_ARGUMENT, .precedence = PREC_ASSIGNMENT,
+            .as.list = { .count = argc, .native = native } });
+        return;
+    }
+    consume(TOKEN_RIGHT_PAREN, "Expect ')' after arguments.");
+    if (native >= 0) {
+        call_native(native, argc);
+    } else {
+        call_value(argc);
+    }
+}
+
+static void call(void)
+{
+    argument_list(-1, 0);
+}
+
+// Parses the next element of [a, b, c] after count of them, or the ']' after
+// the last. The elements are left on the stack for OP_ARRAY, which packs them
+// into an array.
+static void element_list(int count)
+{
+    if (count == 0 ? !check(TOKEN_RIGHT_BRACKET) : match(TOKEN_COMMA)) {
+        parse_operand((ParseFrame){ .kind = FRAME_ELEMENT, .precedence = PREC_ASSIGNMENT,
+            .as.list.count = count });
+        return;
+    }
+    consume(TOKEN_RIGHT_BRACKET, "Expect ']' after array elements.");
+    emit_u8(OP_ARRAY, count);
+    for (int i = 0; i < count; ++i) {
+        pop_type();
+    }
+    push_type(TYPE_UNKNOWN);
+}
+
+static void array_literal(void)
+{
+    element_list(0);
+}
+
+// a[i] and a[i] = v. Elements are numbers, so both give a number.
+static void subscript(void)
+{
+    parse_operand((ParseFrame){ .kind = FRAME_INDEX, .precedence = PREC_ASSIGNMENT,
+        .as.can_assign = parser.can_assign });
+}
+
+// After a[i] or a[i] = v, which take operands off the stack
+static void subscript_end(int operands)
+{
+    for (int i = 0; i < operands; ++i) {
+        pop_type();
+    }
+    push_type(TYPE_NUMBER);
+}
+
+// After the index of a subscript
+static void subscript_index(bool can_assign)
+{
+    consume(TOKEN_RIGHT_BRACKET, "Expect ']' after index.");
+    if (can_assign && match(TOKEN_EQUAL)) {
+        parse_operand((ParseFrame){ .kind = FRAME_SET_INDEX, .precedence = PREC_ASSIGNMENT });
+        return;
+    }
+    emit_byte(OP_GET_INDEX);
+    subscript_end(2);
+}
+
+// a.name and a.name = v
+static void dot(void)
+{
+    bool can_assign = parser.can_assign;
+    consume(TOKEN_IDENTIFIER, "Expect field name after '.'.");
+    Token name = parser.previous;
+    if (can_assign && match(TOKEN_EQUAL)) {
+        parse_operand((ParseFrame){ .kind = FRAME_SET_FIELD, .precedence = PREC_ASSIGNMENT, .as.name = name });
+        return;
+    }
+    emit_named(OP_GET_FIELD, &name);
+    pop_type();
+    push_type(TYPE_UNKNOWN);
+}
+
+// After the value of a.name = v
+static void set_field(const Token *name)
+{
+    emit_named(OP_SET_FIELD, name);
+    StaticType t = pop_type();
+    pop_type();
+    push_type(t); // leaves the value and its type
+}
+
+// Returns the stack slot of local name in the function being compiled, or -1
+static int resolve_local(const Token *name)
+{
+    for (int i = buf_len(locals) - 1; i >= 0; --i) {
+        if (locals[i].length == name->length && memcmp(locals[i].start, name->start, name->length) == 0) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+// Makes name the local in the next stack slot, which the value on top of the
+// stack already occupies
+static void add_local(const Token *name)
+{
+    if (resolve_local(name) >= 0) {
+        error("Already a variable with this name in this function.");
+        return;
+    }
+    if (buf_len(locals) == LOCALS_MAX) {
+        error("Too many local variables in function.");
+        return;
+    }
+    buf_push(locals, *name);
+}
+
+static void variable(void)
+{
+    int local = resolve_local(&parser.previous);
+    if (local >= 0) {
+        if (!parser.can_assign || !match(TOKEN_EQUAL)) {
+            emit_get_local(local);
+            return;
+        }
+        parse_operand((ParseFrame){ .kind = FRAME_SET_LOCAL, .precedence = PREC_ASSIGNMENT, .as.slot = local });
+        return;
     }
+
+    if (check(TOKEN_LEFT_PAREN)) {
+        int native = native_find(parser.previous.start, parser.previous.length);
+        if (native >= 0) {
+            advance();
+            argument_list(native, 0);
+            return;
+        }
+    }
+
+    int slot = identifier_slot(&parser.previous);
+    if (!parser.can_assign || !match(TOKEN_EQUAL)) {
+        emit_get_global(slot);
+        return;
+    }
+
+    parse_operand((ParseFrame){ .kind = FRAME_SET_GLOBAL, .precedence = PREC_ASSIGNMENT, .as.slot = slot });
+}
+
+static void unary(void)
+{
+    TokenType op = parser.previous.type;
+    parse_operand((ParseFrame){ .kind = FRAME_UNARY, .op = op, .precedence = PREC_UNARY });
 }
 
 static void binary(void)
 {
     TokenType op = parser.previous.type;
+    Precedence rhs = (Precedence)(parse_rules[op].precedence + 1);
+    parse_operand((ParseFrame){ .kind = FRAME_BINARY, .op = op, .precedence = rhs });
+}
 
-    // Compile the rhs operand.
-    parse_precedence((Precedence)(parse_rules[op].precedence + 1));
+// a and b: b is only evaluated when a is truthy
+static void and_(void)
+{
+    StaticType a = pop_type();
+    int jump = emit_jump(OP_JUMP_IF_FALSE_OR_POP);
+    parse_operand((ParseFrame){ .kind = FRAME_SHORT_CIRCUIT, .precedence = PREC_AND + 1,
+        .as.branch = { .jump = jump, .type = a } });
+}
 
-    // Emit the operator instruction.
-    switch (op) {
-        case TOKEN_BANG_EQUAL:    emit_bytes(OP_EQ, OP_NOT); break;
-        case TOKEN_EQUAL_EQUAL:   emit_byte(OP_EQ); break;
-        case TOKEN_GREATER:       emit_byte(OP_GT); break;
-        case TOKEN_GREATER_EQUAL: emit_bytes(OP_LT, OP_NOT); break;
-        case TOKEN_LESS:          emit_byte(OP_LT); break;
-        case TOKEN_LESS_EQUAL:    emit_bytes(OP_GT, OP_NOT); break;
-        case TOKEN_PLUS:          emit_byte(OP_ADD); break;
-        case TOKEN_MINUS:         emit_byte(OP_SUB); break;
-        case TOKEN_STAR:          emit_byte(OP_MUL); break;
-        case TOKEN_SLASH:         emit_byte(OP_DIV); break;
-        default:          assert(0 && "unreachable");
+// a or b: b is only evaluated when a is falsey
+static void or_(void)
+{
+    StaticType a = pop_type();
+    int jump = emit_jump(OP_JUMP_IF_TRUE_OR_POP);
+    parse_operand((ParseFrame){ .kind = FRAME_SHORT_CIRCUIT, .precedence = PREC_OR + 1,
+        .as.branch = { .jump = jump, .type = a } });
+}
+
+// Whether code [from, to) is a single instruction that loads a constant
+static bool cheap_constant(const Chunk *c, int from, int to)
+{
+    byte op = c->code[from];
+    int size = InstrSize[op] ? InstrSize[op] : 1;
+    return from + size == to && op <= OP_TRUE; // OP_CONSTANT up to here
+}
+
+// cond ? a : b, right associative. When both arms are constants the jumps are
+// replaced by OP_SELECT, which loads both and picks one without branching.
+static void conditional(void)
+{
+    pop_type();
+    int else_jump = emit_jump(OP_JUMP_IF_FALSE);
+    parse_operand((ParseFrame){ .kind = FRAME_THEN, .precedence = PREC_ASSIGNMENT,
+        .as.branch.jump = else_jump });
+}
+
+// After the then arm of a conditional
+static void conditional_else(int else_jump)
+{
+    ir_flush(current_chunk());
+    StaticType a = pop_type();
+    int end_jump = emit_jump(OP_JUMP);
+    patch_jump(else_jump);
+    consume(TOKEN_COLON, "Expect ':' after then branch of conditional.");
+    parse_operand((ParseFrame){ .kind = FRAME_ELSE, .precedence = PREC_CONDITIONAL,
+        .as.branch = { .jump = else_jump, .end_jump = end_jump, .type = a } });
+}
+
+// After the else arm of a conditional
+static void conditional_end(int else_jump, int end_jump, StaticType a)
+{
+    Chunk *c = current_chunk();
+    patch_jump(end_jump);
+    push_type(type_merge(a, pop_type()));
+
+    int then_start = else_jump + 3, else_start = end_jump + 3, end = buf_len(c->code);
+    if (!parser.had_error && cheap_constant(c, then_start, end_jump) &&
+            cheap_constant(c, else_start, end)) {
+        byte arms[8];
+        int then_size = end_jump - then_start, else_size = end - else_start;
+        memcpy(arms, &c->code[then_start], then_size);
+        memcpy(arms + then_size, &c->code[else_start], else_size);
+        int then_line = chunk_get_line(c, then_start), else_line = chunk_get_line(c, else_start);
+        chunk_truncate(c, else_jump);
+        chunk_write(c, arms, then_size, then_line);
+        chunk_write(c, arms + then_size, else_size, else_line);
+        chunk_write(c, (byte[]){ OP_SELECT }, 1, parser.previous.line);
+    }
+}
+
+// Finishes the rule that waited for the operand of frame, see parse_operand
+static void parse_resume(const ParseFrame *frame)
+{
+    switch (frame->kind) {
+        case FRAME_ROOT:
+            break;
+        case FRAME_GROUPING:
+            consume(TOKEN_RIGHT_PAREN, "Expect ')' after expression.");
+            break;
+        case FRAME_UNARY:
+            emit_unary(frame->op);
+            break;
+        case FRAME_BINARY:
+            emit_binary(frame->op);
+            break;
+        case FRAME_SHORT_CIRCUIT:
+            patch_jump(frame->as.branch.jump);
+            push_type(type_merge(frame->as.branch.type, pop_type()));
+            break;
+        case FRAME_THEN:
+            conditional_else(frame->as.branch.jump);
+            break;
+        case FRAME_ELSE:
+            conditional_end(frame->as.branch.jump, frame->as.branch.end_jump, frame->as.branch.type);
+            break;
+        case FRAME_SET_LOCAL:
+            emit_u8(OP_SET_LOCAL, frame->as.slot); // leaves the value and its type
+            break;
+        case FRAME_SET_GLOBAL:
+            emit_u16(OP_SET_GLOBAL, frame->as.slot);
+            break;
+        case FRAME_SET_FIELD:
+            set_field(&frame->as.name);
+            break;
+        case FRAME_ARGUMENT:
+            if (frame->as.list.count + 1 == 256) error("Can't have more than 255 arguments.");
+            argument_list(frame->as.list.native, frame->as.list.count + 1);
+            break;
+        case FRAME_ELEMENT:
+            if (frame->as.list.count + 1 == 256) error("Can't have more than 255 elements.");
+            element_list(frame->as.list.count + 1);
+            break;
+        case FRAME_INDEX:
+            subscript_index(frame->as.can_assign);
+            break;
+        case FRAME_SET_INDEX:
+            emit_byte(OP_SET_INDEX);
+            subscript_end(3);
+            break;
     }
 }
 
 static void literal()
 {
     switch (parser.previous.type) {
-        case TOKEN_NIL:   emit_byte(OP_NIL);   break;
-        case TOKEN_FALSE: emit_byte(OP_FALSE); break;
-        case TOKEN_TRUE:  emit_byte(OP_TRUE);  break;
+        case TOKEN_NIL:   emit_literal(NIL_VAL, OP_NIL);           break;
+        case TOKEN_FALSE: emit_literal(BOOL_VAL(false), OP_FALSE); break;
+        case TOKEN_TRUE:  emit_literal(BOOL_VAL(true), OP_TRUE);   break;
         default:          assert(0 && "unreachable");
     }
 }
 
-static bool compile(const char *source, Chunk *ch)
+// Parses a parameter list and body and emits the function as a constant.
+// Only the parameters are counted: the body is skipped to its closing brace
+// and kept as source, which compile_function compiles on the first call.
+static void function_literal(Value name)
+{
+    consume(TOKEN_LEFT_PAREN, "Expect '(' after function name.");
+    const char *start = parser.previous.start;
+    int line = parser.previous.line;
+    int arity = 0;
+    if (!check(TOKEN_RIGHT_PAREN)) {
+        do {
+            consume(TOKEN_IDENTIFIER, "Expect parameter name.");
+            if (++arity == 256) error("Can't have more than 255 parameters.");
+        } while (match(TOKEN_COMMA));
+    }
+    consume(TOKEN_RIGHT_PAREN, "Expect ')' after parameters.");
+    consume(TOKEN_LEFT_BRACE, "Expect '{' before function body.");
+    for (int depth = 1; depth > 0 && !parser.panic_mode;) {
+        if (check(TOKEN_EOF)) {
+            error_at_current("Expect '}' after function body.");
+        } else {
+            depth += check(TOKEN_LEFT_BRACE) - check(TOKEN_RIGHT_BRACE);
+            advance();
+        }
+    }
+    if (parser.panic_mode) return;
+
+    const Token *end = &parser.previous;
+    int length = (int)(end->start + end->length - start);
+    emit_constant(OBJ_VAL(function_new(heap, name, arity, start, length, line, globals)));
+}
+
+// fn (params) { body }, a function without a name
+static void fn_expression(void)
+{
+    function_literal(NIL_VAL);
+}
+
+// Declares a global, or a local inside a function
+static void fn_declaration(void)
+{
+    consume(TOKEN_IDENTIFIER, "Expect function name.");
+    Token name = parser.previous;
+    if (!function && native_find(name.start, name.length) >= 0) {
+        error("Can't redefine a native function.");
+    }
+    int slot = function ? 0 : identifier_slot(&name);
+    function_literal(string_value(heap, name.start, name.length));
+
+    if (function) {
+        ir_flush(current_chunk());
+        add_local(&name);
+        return;
+    }
+    emit_u16(OP_DEFINE_GLOBAL, slot);
+    pop_type();
+}
+
+static void var_declaration(void)
+{
+    consume(TOKEN_IDENTIFIER, "Expect variable name.");
+    Token name = parser.previous;
+    int slot = function ? 0 : identifier_slot(&name);
+
+    if (match(TOKEN_EQUAL)) {
+        expression();
+    } else {
+        emit_literal(NIL_VAL, OP_NIL);
+    }
+    consume(TOKEN_SEMICOLON, "Expect ';' after variable declaration.");
+
+    // A local is the slot the value was left in
+    if (function) {
+        ir_flush(current_chunk());
+        add_local(&name);
+        return;
+    }
+    emit_u16(OP_DEFINE_GLOBAL, slot);
+    pop_type();
+}
+
+// class Name {} makes a new class each time it runs, declared like a
+// variable. Calling it makes an instance, which gets fields by assignment.
+static void class_declaration(void)
+{
+    consume(TOKEN_IDENTIFIER, "Expect class name.");
+    Token name = parser.previous;
+    int slot = function ? 0 : identifier_slot(&name);
+    emit_named(OP_CLASS, &name);
+    push_type(TYPE_UNKNOWN);
+    consume(TOKEN_LEFT_BRACE, "Expect '{' before class body.");
+    consume(TOKEN_RIGHT_BRACE, "Expect '}' after class body.");
+
+    if (function) {
+        add_local(&name);
+        return;
+    }
+    emit_u16(OP_DEFINE_GLOBAL, slot);
+    pop_type();
+}
+
+static void return_statement(void)
+{
+    if (!function) {
+        error("Can't return from top-level code.");
+    }
+    if (match(TOKEN_SEMICOLON)) {
+        emit_literal(NIL_VAL, OP_NIL);
+    } else {
+        expression();
+        consume(TOKEN_SEMICOLON, "Expect ';' after return value.");
+    }
+    emit_return();
+    pop_type();
+}
+
+// Code cut from the end of the chunk to be written again further on, with the
+// line of each byte and the loads of hoisted values in it
+typedef struct {
+    byte *code;
+    int  *lines;
+    int  *refs;
+} CodeBlock;
+
+static CodeBlock code_cut(int start)
+{
+    Chunk *c = current_chunk();
+    ir_flush(c);
+    CodeBlock b = { 0 };
+    int len = buf_len(c->code);
+    if (len > start) memcpy(buf_append(b.code, len - start), &c->code[start], len - start);
+    for (int i = start; i < len; ++i) {
+        buf_push(b.lines, chunk_get_line(c, i));
+    }
+    while (!buf_empty(hoist_refs) && *buf_last(hoist_refs) >= start) {
+        buf_push(b.refs, *buf_pop(hoist_refs) - start);
+    }
+    chunk_truncate(c, start);
+    return b;
+}
+
+// Writes b at the end of the chunk and frees it. Jumps in it are relative to
+// themselves, so they still land in it.
+static void code_paste(CodeBlock *b)
+{
+    Chunk *c = current_chunk();
+    int start = buf_len(c->code), len = buf_len(b->code);
+    for (int i = 0, j; i < len; i = j) {
+        for (j = i; j < len && b->lines[j] == b->lines[i]; ++j) {}
+        chunk_write(c, &b->code[i], j - i, b->lines[i]);
+    }
+    for (int i = buf_len(b->refs) - 1; i >= 0; --i) {
+        buf_push(hoist_refs, start + b->refs[i]);
+    }
+    buf_free(b->code);
+    buf_free(b->lines);
+    buf_free(b->refs);
+}
+
+// Emits backward jump op to target
+static void emit_loop(byte op, int target)
+{
+    Chunk *c = current_chunk();
+    ir_flush(c);
+    int offset = buf_len(c->code);
+    emit_u16(op, 0);
+    if (offset + 3 - target > UINT16_MAX) {
+        error("Loop body too large.");
+        return;
+    }
+    chunk_set_loop(c, offset, target);
+}
+
+// Points the jump at offset to target, further on
+static void set_jump(int offset, int target)
+{
+    if (target - offset - 3 > UINT16_MAX) {
+        error("Too much code to jump over.");
+        return;
+    }
+    chunk_set_jump(current_chunk(), offset, target);
+}
+
+// Pops the locals declared since there were scope of them
+static void end_scope(int scope)
+{
+    while (buf_len(locals) > scope) {
+        emit_pop();
+        buf_pop(locals);
+    }
+}
+
+static void loop_reset(void)
+{
+    for (int i = 0; i < buf_len(hoisted); ++i) {
+        buf_free(hoisted[i].code);
+    }
+    buf_free(hoisted);
+    buf_free(hoist_refs);
+    buf_free(consts);
+    loop_depth = 0;
+}
+
+// Loops are rotated so an iteration takes a single branch, at the bottom:
+//
+//         JUMP cond
+//   body: body, and the increment of a for
+//   cond: condition
+//         LOOP_IF_TRUE body
+//
+// Returns the offset of the JUMP, which loop_end points at the condition.
+static int loop_begin(void)
+{
+    if (loop_depth++ == 0) {
+        loop_reset();
+        loop_depth = 1;
+        hoist_base = buf_len(locals);
+    }
+    return emit_jump(OP_JUMP);
+}
+
+// Emits the condition, if any, and the branch back to body. The outermost
+// loop then gets the values hoisted out of it, which the JUMP into the loop
+// computes first:
+//
+//         JUMP pre
+//         ...
+//         LOOP_IF_TRUE body
+//         JUMP exit
+//   pre:  hoisted values, one per slot
+//         LOOP cond
+//   exit: POP for each hoisted value
+static void loop_end(int entry, int body, CodeBlock *cond)
+{
+    Chunk *c = current_chunk();
+    ir_flush(c);
+    int test = buf_len(c->code);
+    if (cond) {
+        code_paste(cond);
+        emit_loop(OP_LOOP_IF_TRUE, body);
+    } else {
+        emit_loop(OP_LOOP, body);
+    }
+    if (--loop_depth > 0 || buf_empty(hoisted)) {
+        set_jump(entry, test);
+        return;
+    }
+
+    // The hoisted values go below the locals declared in the loop
+    int count = buf_len(hoisted), ref = 0;
+    for (int offset = entry; offset < buf_len(c->code); offset += InstrSize[c->code[offset]] ? InstrSize[c->code[offset]] : 1) {
+        byte op = c->code[offset];
+        if (op != OP_GET_LOCAL && op != OP_SET_LOCAL) continue;
+        while (ref < buf_len(hoist_refs) && hoist_refs[ref] < offset) {
+            ++ref;
+        }
+        int slot = c->code[offset + 1];
+        if (ref < buf_len(hoist_refs) && hoist_refs[ref] == offset) {
+            slot += hoist_base;
+        } else if (slot >= hoist_base) {
+            slot += count;
+        }
+        if (slot > UINT8_MAX) {
+            error("Too many local variables in function.");
+            break;
+        }
+        c->code[offset + 1] = (byte)slot;
+    }
+
+    int exit = cond ? emit_jump(OP_JUMP) : -1;
+    set_jump(entry, buf_len(c->code));
+    for (int i = 0; i < count; ++i) {
+        chunk_write(c, hoisted[i].code, buf_len(hoisted[i].code), hoisted[i].line);
+    }
+    emit_loop(OP_LOOP, cond ? test : body);
+    if (exit >= 0) {
+        patch_jump(exit);
+        for (int i = 0; i < count; ++i) {
+            emit_byte(OP_POP);
+        }
+    }
+    loop_reset();
+}
+
+static void expression_statement(void)
+{
+    expression();
+    consume(TOKEN_SEMICOLON, "Expect ';' after expression.");
+    emit_pop();
+}
+
+// The body of a loop: a block or a single declaration. Inside a function the
+// locals declared in it end with it.
+static void statement(void)
+{
+    int scope = buf_len(locals);
+    if (match(TOKEN_LEFT_BRACE)) {
+        while (!check(TOKEN_RIGHT_BRACE) && !check(TOKEN_EOF)) {
+            declaration();
+        }
+        consume(TOKEN_RIGHT_BRACE, "Expect '}' after block.");
+    } else {
+        declaration();
+    }
+    end_scope(scope);
+}
+
+static void while_statement(void)
+{
+    int entry = loop_begin();
+    consume(TOKEN_LEFT_PAREN, "Expect '(' after 'while'.");
+    int start = buf_len(current_chunk()->code);
+    expression();
+    consume(TOKEN_RIGHT_PAREN, "Expect ')' after condition.");
+    pop_type();
+    CodeBlock cond = code_cut(start);
+    statement();
+    loop_end(entry, start, &cond);
+}
+
+// for (init; cond; incr) body. A var in init is scoped to the loop, or a
+// global outside functions.
+static void for_statement(void)
+{
+    int scope = buf_len(locals);
+    consume(TOKEN_LEFT_PAREN, "Expect '(' after 'for'.");
+    if (match(TOKEN_VAR)) {
+        var_declaration();
+    } else if (!match(TOKEN_SEMICOLON)) {
+        expression_statement();
+    }
+
+    int entry = loop_begin();
+    int start = buf_len(current_chunk()->code);
+    CodeBlock cond = { 0 };
+    bool has_cond = !match(TOKEN_SEMICOLON);
+    if (has_cond) {
+        expression();
+        consume(TOKEN_SEMICOLON, "Expect ';' after loop condition.");
+        pop_type();
+        cond = code_cut(start);
+    }
+    CodeBlock incr = { 0 };
+    if (!match(TOKEN_RIGHT_PAREN)) {
+        expression();
+        consume(TOKEN_RIGHT_PAREN, "Expect ')' after for clauses.");
+        emit_pop();
+        incr = code_cut(start);
+    }
+    statement();
+    code_paste(&incr);
+    loop_end(entry, start, has_cond ? &cond : NULL);
+    end_scope(scope);
+}
+
+// Skips to the next statement after an error so more errors can be reported
+static void synchronize(void)
+{
+    parser.panic_mode = false;
+    while (!check(TOKEN_EOF)) {
+        if (parser.previous.type == TOKEN_SEMICOLON) return;
+        if (check(TOKEN_VAR) || check(TOKEN_FN) || check(TOKEN_CLASS) || check(TOKEN_RETURN) ||
+            check(TOKEN_WHILE) || check(TOKEN_FOR)) return;
+        if ((function || loop_depth > 0) && check(TOKEN_RIGHT_BRACE)) return;
+        advance();
+    }
+}
+
+// Returns true for an expression without a ';' at the end of the script,
+// which is left on the stack as its result.
+static bool declaration(void)
+{
+    bool result = false;
+    if (match(TOKEN_FN)) {
+        fn_declaration();
+    } else if (match(TOKEN_VAR)) {
+        var_declaration();
+    } else if (match(TOKEN_CLASS)) {
+        class_declaration();
+    } else if (match(TOKEN_RETURN)) {
+        return_statement();
+    } else if (match(TOKEN_WHILE)) {
+        while_statement();
+    } else if (match(TOKEN_FOR)) {
+        for_statement();
+    } else {
+        expression();
+        if (check(TOKEN_EOF) && !function && loop_depth == 0) {
+            result = true;
+        } else {
+            consume(TOKEN_SEMICOLON, "Expect ';' after expression.");
+            emit_pop();
+        }
+    }
+
+    if (parser.panic_mode) {
+        synchronize();
+    }
+    return result;
+}
+
+// script := declaration* expression?
+// The value of the trailing expression, or nil, is returned by the chunk.
+static bool compile(const char *source, Chunk *ch, Heap *h, GlobalTable *g)
 {
     chunk = ch;
+    heap = h;
+    globals = g;
+    function = NULL;
     scanner_init(&scanner, source);
     parser.had_error = false;
     parser.panic_mode = false;
+    parser.depth = 0;
 
     advance();
-    expression();
-    consume(TOKEN_EOF, "Expect end of expression.");
+    bool result = false;
+    while (!match(TOKEN_EOF)) {
+        result = declaration();
+    }
+    if (!result) {
+        emit_literal(NIL_VAL, OP_NIL);
+    }
     end_compiler();
+    ch->global_count = buf_len(g->names);
+    ir_free();
+    loop_reset();
+    buf_free(types);
+    return !parser.had_error;
+}
+
+// Compiles the first declaration of tokens into ch, without the OP_RETURN that
+// ends a script; see edit.c. Sets *consumed to the number of tokens it took,
+// including any skipped after an error, and *result when it is the trailing
+// expression whose value the script returns.
+static bool compile_declaration(const Token *tokens, Chunk *ch, Heap *h, GlobalTable *g,
+                                int *consumed, bool *result)
+{
+    chunk = ch;
+    heap = h;
+    globals = g;
+    function = NULL;
+    token_stream = tokens;
+    parser.had_error = false;
+    parser.panic_mode = false;
+    parser.depth = 0;
+
+    advance();
+    *result = declaration();
+    ir_flush(ch);
+    thread_jumps(ch);
+    ir_free();
+    loop_reset();
+    buf_free(types);
+
+    // The parser has read one token past the declaration, unless that is EOF
+    *consumed = (int)(token_stream - tokens) - (parser.current.type != TOKEN_EOF);
+    token_stream = NULL;
     return !parser.had_error;
 }
+
+// Compiles the body of f, kept as source by function_literal, into f->chunk
+// and verifies it. Called on its first call, so the body is only compiled if
+// it runs. Errors are reported like any compile error and mark it failed.
+static bool compile_function(ObjFunction *f)
+{
+    if (f->compiled || f->failed) return f->compiled;
+    chunk = &f->chunk;
+    heap = f->heap;
+    globals = f->globals;
+    function = f;
+    scanner_init(&scanner, f->source);
+    scanner.line = f->line;
+    parser.had_error = false;
+    parser.panic_mode = false;
+    parser.depth = 0;
+
+    // The arguments are the first locals
+    advance();
+    consume(TOKEN_LEFT_PAREN, "Expect '(' after function name.");
+    if (!check(TOKEN_RIGHT_PAREN)) {
+        do {
+            consume(TOKEN_IDENTIFIER, "Expect parameter name.");
+            add_local(&parser.previous);
+            push_type(TYPE_UNKNOWN);
+        } while (match(TOKEN_COMMA));
+    }
+    consume(TOKEN_RIGHT_PAREN, "Expect ')' after parameters.");
+    consume(TOKEN_LEFT_BRACE, "Expect '{' before function body.");
+    while (!check(TOKEN_RIGHT_BRACE) && !check(TOKEN_EOF)) {
+        declaration();
+    }
+    consume(TOKEN_RIGHT_BRACE, "Expect '}' after function body.");
+    emit_literal(NIL_VAL, OP_NIL);
+    end_compiler();
+    f->chunk.global_count = buf_len(globals->names);
+    f->chunk.arity = f->arity;
+    ir_free();
+    loop_reset();
+    buf_free(types);
+    buf_free(locals);
+    function = NULL;
+
+    f->compiled = !parser.had_error &&
+                  chunk_verify(&f->chunk, compile_errors ? compile_errors : stderr);
+    f->failed = !f->compiled;
+    return f->compiled;
+}
+
+#ifndef NDEBUG
+static void compiler_test(void)
+{
+    // Both parsers must produce identical chunks
+    const char *source = "var a = 1; var b; b = a = -(a + 2);\n"
+                         "var f; f(a, sqrt(b), [a, -b][0] = 1)[b] = min(a, 2);\n"
+                         "!(1 + -2 * 3 >= 4 - 5 / 6) == (nil != false) < -(-(7)) - a + b\n"
+                         "and (a or b ? b = 2 : a ? 1 : -a and !b) or nil ? a : b";
+    CompilerOptions saved = compiler_options;
+    Heap h = { 0 };
+    GlobalTable g = { 0 };
+    Chunk chunks[2] = { 0 };
+    for (int i = 0; i < 2; ++i) {
+        compiler_options.iterative = i;
+        assert(compile(source, &chunks[i], &h, &g));
+    }
+    compiler_options = saved;
+
+    Chunk *a = &chunks[0];
+    Chunk *b = &chunks[1];
+    assert(buf_len(a->code) == buf_len(b->code));
+    assert(memcmp(a->code, b->code, buf_sizeof(a->code)) == 0);
+    assert(buf_len(a->lines) == buf_len(b->lines));
+    assert(memcmp(a->lines, b->lines, buf_sizeof(a->lines)) == 0);
+    assert(memcmp(a->offsets, b->offsets, buf_sizeof(a->offsets)) == 0);
+    assert(buf_len(a->constants) == buf_len(b->constants));
+    for (int i = 0; i < buf_len(a->constants); ++i) {
+        assert(AS_NUMBER(a->constants[i]) == AS_NUMBER(b->constants[i]));
+    }
+    chunk_free(a);
+    chunk_free(b);
+
+    // Operands of every rule nest deeper than the recursive parser may in the
+    // iterative one
+    static const struct { const char *open, *close; } nested[] = {
+        { "1 ? ", " : 1" },
+        { "a = ", "" },
+        { "(a and (", "))" },
+        { "nil.x = ", "" },
+        { "sqrt(", ")" },
+        { "f(nil, ", ")" },
+        { "[", "]" },
+        { "[1, 2][", "]" },
+        { "a[0] = ", "" },
+    };
+    compiler_options.iterative = true;
+    for (int i = 0; i < (int)BUF_COUNT(nested); ++i) {
+        char *deep = NULL;
+        int open = (int)strlen(nested[i].open), close = (int)strlen(nested[i].close);
+        for (int n = 0; n < PARSE_DEPTH_RECURSIVE + 1000; ++n) {
+            memcpy(buf_append(deep, open), nested[i].open, open);
+        }
+        buf_push(deep, '1');
+        for (int n = 0; n < PARSE_DEPTH_RECURSIVE + 1000; ++n) {
+            memcpy(buf_append(deep, close), nested[i].close, close);
+        }
+        buf_push(deep, '\0');
+        Chunk c = { 0 };
+        assert(compile(deep, &c, &h, &g));
+        chunk_free(&c);
+        buf_free(deep);
+    }
+    compiler_options = saved;
+
+    // Unchecked operators where operand types are known, without and with -O.
+    // -nil can't be folded since it fails at runtime.
+    static const struct { bool optimize; const char *source; byte code[40]; int len; } cases[] = {
+        { false, "-1 < nil", { OP_ONE, OP_NEG_N, OP_NIL, OP_LT }, 4 },
+        { false, "-nil + 1", { OP_NIL, OP_NEG, OP_ONE, OP_ADD_NN }, 4 },
+        { true,  "(-1 + 2) * 3 - -4 == 7", { OP_TRUE, OP_RETURN }, 2 },
+        { true,  "-nil * 2", { OP_NIL, OP_NEG, OP_DUP, OP_ADD_NN, OP_RETURN }, 5 },
+        { true,  "-nil - 0 == 1 * -nil", { OP_NIL, OP_NEG, OP_DUP, OP_EQ, OP_RETURN }, 5 },
+        { true,  "-nil / 1", { OP_NIL, OP_NEG, OP_CONSTANT, 0, OP_MUL_NN, OP_RETURN }, 6 },
+        { true,  "-nil + 0", { OP_NIL, OP_NEG, OP_ZERO, OP_ADD_NN, OP_RETURN }, 5 },
+        { true,  "(-nil + 1) + (-nil - 1) * (-nil + 1)", {
+            OP_NIL, OP_NEG, OP_DUP, OP_ONE, OP_ADD_NN, OP_DUP, OP_ROLL, 2,
+            OP_ONE, OP_SUB_NN, OP_ROLL, 2, OP_MUL_NN, OP_ADD_NN }, 14 },
+        { false, "\"ab\" + \"cd\" < 1", {
+            OP_CONSTANT, 0, OP_CONSTANT, 1, OP_ADD, OP_ONE, OP_LT }, 7 },
+        { true,  "\"interned string\" == \"interned string\"", { OP_TRUE, OP_RETURN }, 2 },
+        { true,  "\"ab\" + \"cd\" == \"abcd\"", {
+            OP_CONSTANT, 0, OP_CONSTANT, 1, OP_ADD, OP_CONSTANT, 2, OP_EQ, OP_RETURN }, 9 },
+        // x may be an array, and each x * x a new one: only the load is shared
+        { true,  "var x = 3; x * x + x * x", {
+            OP_SMALLINT, 3, OP_DEFINE_GLOBAL, 0, 0, OP_GET_GLOBAL, 0, 0,
+            OP_DUP, OP_DUP, OP_MUL, OP_ROLL, 1, OP_DUP, OP_MUL, OP_ADD, OP_RETURN }, 17 },
+        { true,  "1 + 2; -nil; nil", { OP_NIL, OP_NEG, OP_POP, OP_NIL, OP_RETURN }, 5 },
+        // Integers up to 16 bits are immediate operands
+        { false, "300 - -100 * 100000", {
+            OP_SMALLINT_X, 44, 1, OP_SMALLINT, 100, OP_NEG_N, OP_CONSTANT, 0, OP_MUL_NN,
+            OP_SUB_NN }, 10 },
+        // Jumps to jumps are threaded, constant arms are selected
+        { false, "nil and nil and 1", {
+            OP_NIL, OP_JUMP_IF_FALSE_OR_POP, 5, 0, OP_NIL, OP_JUMP_IF_FALSE_OR_POP, 1, 0,
+            OP_ONE, OP_RETURN }, 10 },
+        { true,  "nil and 1 or 2", {
+            OP_NIL, OP_JUMP_IF_FALSE, 4, 0, OP_ONE, OP_JUMP_IF_TRUE_OR_POP, 2, 0,
+            OP_SMALLINT, 2, OP_RETURN }, 11 },
+        { false, "nil ? nil ? 1 : nil + 2 : 3", {
+            OP_NIL, OP_JUMP_IF_FALSE, 15, 0, OP_NIL, OP_JUMP_IF_FALSE, 4, 0, OP_ONE,
+            OP_JUMP, 9, 0, OP_NIL, OP_SMALLINT, 2, OP_ADD, OP_JUMP, 2, 0, OP_SMALLINT, 3,
+            OP_RETURN }, 22 },
+        { false, "nil ? 1 : \"s\"", { OP_NIL, OP_ONE, OP_CONSTANT, 0, OP_SELECT }, 5 },
+        // Intrinsics are inlined when they can be, and folded with -O
+        { false, "sqrt(4) + min(1, 2, 3) - max(1, clock())", {
+            OP_SMALLINT, 4, OP_SQRT, OP_ONE, OP_SMALLINT, 2, OP_SMALLINT, 3,
+            OP_CALL_NATIVE, 2, 3, OP_ADD_NN, OP_ONE, OP_CALL_NATIVE, 4, 0, OP_MAX, OP_SUB_NN }, 18 },
+        { true,  "floor(7 / 2) + max(1, 2) * sqrt(4)", { OP_CONSTANT, 0, OP_RETURN }, 3 },
+        // Functions are constants, called with the arguments above them
+        { false, "fun f(a) { return a; } f(1)", {
+            OP_CONSTANT, 0, OP_DEFINE_GLOBAL, 0, 0, OP_GET_GLOBAL, 0, 0, OP_ONE, OP_CALL, 1 }, 11 },
+        // Array elements are numbers, arrays are not known to be
+        { false, "[1, 2][0] + 1", {
+            OP_ONE, OP_SMALLINT, 2, OP_ARRAY, 2, OP_ZERO, OP_GET_INDEX, OP_ONE, OP_ADD_NN }, 9 },
+        { true,  "[1] * 2 - 1", { OP_ONE, OP_ARRAY, 1, OP_SMALLINT, 2, OP_MUL, OP_ONE, OP_SUB, OP_RETURN }, 9 },
+        // Field names are constants, with a u24 operand
+        { false, "class C {} C().x", {
+            OP_CLASS, 0, 0, 0, OP_DEFINE_GLOBAL, 0, 0, OP_GET_GLOBAL, 0, 0, OP_CALL, 0,
+            OP_GET_FIELD, 1, 0, 0 }, 16 },
+        { true,  "var o = nil; o.x = 1 + 2", {
+            OP_NIL, OP_DEFINE_GLOBAL, 0, 0, OP_GET_GLOBAL, 0, 0, OP_SMALLINT, 3,
+            OP_SET_FIELD, 0, 0, 0, OP_RETURN }, 14 },
+        { false, "while (nil) 1;", {
+            OP_JUMP, 2, 0, OP_ONE, OP_POP, OP_NIL, OP_LOOP_IF_TRUE, 6, 0, OP_NIL }, 10 },
+        { false, "var i = 0; while (i < 2 * 3) i = i + 1;", {
+            OP_ZERO, OP_DEFINE_GLOBAL, 0, 0, OP_JUMP, 21, 0,
+            OP_GET_GLOBAL, 0, 0, OP_ONE, OP_ADD, OP_SET_GLOBAL, 0, 0, OP_POP,
+            OP_GET_GLOBAL, 0, 0, OP_GET_LOCAL, 0, OP_LT, OP_LOOP_IF_TRUE, 18, 0, OP_JUMP, 8, 0,
+            OP_SMALLINT, 2, OP_SMALLINT, 3, OP_MUL_NN, OP_LOOP, 20, 0, OP_POP, OP_NIL }, 38 },
+    };
+    for (int i = 0; i < (int)BUF_COUNT(cases); ++i) {
+        compiler_options.optimize = cases[i].optimize;
+        global_table_free(&g);
+        Chunk c = { 0 };
+        assert(compile(cases[i].source, &c, &h, &g));
+        int len = cases[i].len;
+        assert(buf_len(c.code) == len + (cases[i].code[len - 1] != OP_RETURN));
+        assert(memcmp(c.code, cases[i].code, len) == 0);
+        chunk_free(&c);
+    }
+    compiler_options = saved;
+
+    // Function bodies are compiled on demand, with locals in stack slots
+    static const struct { bool optimize; const char *source; byte code[40]; int len; } bodies[] = {
+        { false, "fun f(a, b) { var c = a; b = c; }", {
+            OP_GET_LOCAL, 0, OP_GET_LOCAL, 2, OP_SET_LOCAL, 1, OP_POP, OP_NIL, OP_RETURN }, 9 },
+        { true,  "fun f(a) { return a * a + a * a; }", {
+            OP_GET_LOCAL, 0, OP_DUP, OP_DUP, OP_MUL, OP_ROLL, 1, OP_DUP, OP_MUL, OP_ADD,
+            OP_RETURN, OP_NIL, OP_RETURN }, 13 },
+        // Locals declared in a loop end with it, above the values hoisted out of it
+        { false, "fun f(n) { while (n) { var a = n; n = nil; } }", {
+            OP_JUMP, 7, 0, OP_GET_LOCAL, 0, OP_NIL, OP_SET_LOCAL, 0, OP_POP, OP_POP,
+            OP_GET_LOCAL, 0, OP_LOOP_IF_TRUE, 12, 0, OP_NIL, OP_RETURN }, 17 },
+        { false, "fun f(n) { for (var i = 0; i < n; i = i + 1) { var k = -1; } }", {
+            OP_ZERO, OP_JUMP, 21, 0, OP_GET_LOCAL, 2, OP_POP,
+            OP_GET_LOCAL, 1, OP_ONE, OP_ADD, OP_SET_LOCAL, 1, OP_POP,
+            OP_GET_LOCAL, 1, OP_GET_LOCAL, 0, OP_LT, OP_LOOP_IF_TRUE, 18, 0, OP_JUMP, 5, 0,
+            OP_ONE, OP_NEG_N, OP_LOOP, 16, 0, OP_POP, OP_POP, OP_NIL, OP_RETURN }, 34 },
+    };
+    for (int i = 0; i < (int)BUF_COUNT(bodies); ++i) {
+        compiler_options.optimize = bodies[i].optimize;
+        Chunk c = { 0 };
+        bool ok = compile(bodies[i].source, &c, &h, &g);
+        assert(ok && IS_FUNCTION(c.constants[0]));
+        ObjFunction *f = AS_FUNCTION(c.constants[0]);
+        assert(!f->compiled && compile_function(f) && f->chunk.arity == f->arity);
+        assert(buf_len(f->chunk.code) == bodies[i].len);
+        assert(memcmp(f->chunk.code, bodies[i].code, bodies[i].len) == 0);
+        chunk_free(&c);
+    }
+    compiler_options = saved;
+    global_table_free(&g);
+    heap_free(&h);
+}
+#endif
@@ -2,21 +2,73 @@
 
 #include "common.h"
 #include "chunk.c"
+#include "number.c"
+#include "natives.c"
+#include "object.c"
+#include "shape.c"
 
 static int InstrSize[op__count] = {
     [OP_CONSTANT]   = 2,
     [OP_CONSTANT_X] = 4,
+    [OP_SMALLINT]   = 2,
+    [OP_SMALLINT_X] = 3,
+    [OP_PICK]       = 2,
+    [OP_ROLL]       = 2,
+    [OP_DEFINE_GLOBAL] = 3,
+    [OP_GET_GLOBAL]    = 3,
+    [OP_SET_GLOBAL]    = 3,
+    [OP_GET_LOCAL]     = 2,
+    [OP_SET_LOCAL]     = 2,
+    [OP_JUMP]                = 3,
+    [OP_JUMP_IF_FALSE]       = 3,
+    [OP_JUMP_IF_TRUE]        = 3,
+    [OP_JUMP_IF_FALSE_OR_POP] = 3,
+    [OP_JUMP_IF_TRUE_OR_POP]  = 3,
+    [OP_LOOP]                 = 3,
+    [OP_LOOP_IF_TRUE]         = 3,
+    [OP_ARRAY]         = 2,
+    [OP_CLASS]         = 4,
+    [OP_GET_FIELD]     = 4,
+    [OP_SET_FIELD]     = 4,
+    [OP_CALL_NATIVE]   = 3,
+    [OP_CALL]          = 2,
 };
 
-static void print_value(Value v)
+MAYBE_UNUSED static void fprint_value(FILE *out, Value v)
 {
     switch (v.type) {
-        case VAL_NIL:    printf("nil"); break;
-        case VAL_BOOL:   printf(AS_BOOL(v) ? "true" : "false"); break;
-        case VAL_NUMBER: printf("%g", AS_NUMBER(v)); break;
+        case VAL_NIL:    fputs("nil", out); break;
+        case VAL_BOOL:   fputs(AS_BOOL(v) ? "true" : "false", out); break;
+        case VAL_NUMBER: {
+            char buf[NUMBER_FORMAT_MAX];
+            fwrite(buf, 1, number_format(AS_DOUBLE(v), buf), out);
+            break;
+        }
+        case VAL_INT: {
+            char buf[NUMBER_FORMAT_MAX];
+            fwrite(buf, 1, number_format_int(AS_INT(v), buf), out);
+            break;
+        }
+        case VAL_SMALL_STRING: string_print(out, v); break;
+        case VAL_OBJ:
+            if (IS_FUNCTION(v)) function_print(out, AS_FUNCTION(v));
+            else if (IS_ARRAY(v)) array_print(out, AS_ARRAY(v));
+            else if (IS_CLASS(v)) class_print(out, AS_CLASS(v));
+            else if (IS_INSTANCE(v)) instance_print(out, AS_INSTANCE(v));
+            else string_print(out, v);
+            break;
+        case VAL_UNDEFINED: fputs("undefined", out); break;
     }
 }
 
+// The disassembler prints code as it is compiled and traces it as it runs,
+// which only debug builds do (see DEBUG_PRINT_CODE)
+#ifndef NDEBUG
+static void print_value(Value v)
+{
+    fprint_value(stdout, v);
+}
+
 static int const_instr(const char *name, const Chunk *c, const int offset)
 {
     byte byte0 = c->code[offset + 1];
@@ -39,6 +91,49 @@ static int const_long_instr(const char *name, const Chunk *c, const int offset)
     return offset + 4;
 }
 
+static int smallint_instr(const char *name, const Chunk *c, const int offset)
+{
+    const byte *operand = &c->code[offset + 1];
+    bool wide = c->code[offset] == OP_SMALLINT_X;
+    int n = wide ? (int16_t)(operand[0] | operand[1] << 8) : (int8_t)operand[0];
+    printf("%-16s %4d", name, n);
+    return offset + (wide ? 3 : 2);
+}
+
+static int byte_instr(const char *name, const Chunk *c, const int offset)
+{
+    printf("%-16s %4d", name, c->code[offset + 1]);
+    return offset + 2;
+}
+
+static int u16_instr(const char *name, const Chunk *c, const int offset)
+{
+    printf("%-16s %4d", name, c->code[offset + 1] | c->code[offset + 2] << 8);
+    return offset + 3;
+}
+
+static int jump_instr(const char *name, const Chunk *c, const int offset)
+{
+    int target = offset + 3 + (c->code[offset + 1] | c->code[offset + 2] << 8);
+    printf("%-16s %4d -> %06X", name, target - offset - 3, target);
+    return offset + 3;
+}
+
+static int loop_instr(const char *name, const Chunk *c, const int offset)
+{
+    int target = chunk_loop_target(c, offset);
+    printf("%-16s %4d -> %06X", name, offset + 3 - target, target);
+    return offset + 3;
+}
+
+static int native_instr(const char *name, const Chunk *c, const int offset)
+{
+    int native = c->code[offset + 1];
+    printf("%-16s %4d '%s' (%d)", name, native, native < native_count ? natives[native].name : "?",
+        c->code[offset + 2]);
+    return offset + 3;
+}
+
 static int simple_instr(const char *name, const int offset)
 {
     printf("%-16s           ", name);
@@ -78,9 +173,22 @@ static int instr_disassemble(const Chunk *chunk, const int offset)
     switch (instr) { // clang-format off
         case OP_CONSTANT:   const_instr("OP_CONSTANT", chunk, offset); break;
         case OP_CONSTANT_X: const_long_instr("OP_CONSTANT_X", chunk, offset); break;
+        case OP_ZERO:       simple_instr("OP_ZERO", offset); break;
+        case OP_ONE:        simple_instr("OP_ONE", offset); break;
+        case OP_SMALLINT:   smallint_instr("OP_SMALLINT", chunk, offset); break;
+        case OP_SMALLINT_X: smallint_instr("OP_SMALLINT_X", chunk, offset); break;
         case OP_NIL:        simple_instr("OP_NIL", offset); break;
         case OP_FALSE:      simple_instr("OP_FALSE", offset); break;
         case OP_TRUE:       simple_instr("OP_TRUE", offset); break;
+        case OP_DUP:        simple_instr("OP_DUP", offset); break;
+        case OP_PICK:       byte_instr("OP_PICK", chunk, offset); break;
+        case OP_ROLL:       byte_instr("OP_ROLL", chunk, offset); break;
+        case OP_POP:        simple_instr("OP_POP", offset); break;
+        case OP_DEFINE_GLOBAL: u16_instr("OP_DEFINE_GLOBAL", chunk, offset); break;
+        case OP_GET_GLOBAL: u16_instr("OP_GET_GLOBAL", chunk, offset); break;
+        case OP_SET_GLOBAL: u16_instr("OP_SET_GLOBAL", chunk, offset); break;
+        case OP_GET_LOCAL:  byte_instr("OP_GET_LOCAL", chunk, offset); break;
+        case OP_SET_LOCAL:  byte_instr("OP_SET_LOCAL", chunk, offset); break;
         case OP_EQ:         simple_instr("OP_EQ", offset); break;
         case OP_GT:         simple_instr("OP_GT", offset); break;
         case OP_LT:         simple_instr("OP_LT", offset); break;
@@ -90,6 +198,33 @@ static int instr_disassemble(const Chunk *chunk, const int offset)
         case OP_DIV:        simple_instr("OP_DIV", offset); break;
         case OP_NOT:        simple_instr("OP_NOT", offset); break;
         case OP_NEG:        simple_instr("OP_NEG", offset); break;
+        case OP_SQRT:       simple_instr("OP_SQRT", offset); break;
+        case OP_FLOOR:      simple_instr("OP_FLOOR", offset); break;
+        case OP_MIN:        simple_instr("OP_MIN", offset); break;
+        case OP_MAX:        simple_instr("OP_MAX", offset); break;
+        case OP_GT_NN:      simple_instr("OP_GT_NN", offset); break;
+        case OP_LT_NN:      simple_instr("OP_LT_NN", offset); break;
+        case OP_ADD_NN:     simple_instr("OP_ADD_NN", offset); break;
+        case OP_SUB_NN:     simple_instr("OP_SUB_NN", offset); break;
+        case OP_MUL_NN:     simple_instr("OP_MUL_NN", offset); break;
+        case OP_DIV_NN:     simple_instr("OP_DIV_NN", offset); break;
+        case OP_NEG_N:      simple_instr("OP_NEG_N", offset); break;
+        case OP_JUMP:       jump_instr("OP_JUMP", chunk, offset); break;
+        case OP_JUMP_IF_FALSE: jump_instr("OP_JUMP_IF_FALSE", chunk, offset); break;
+        case OP_JUMP_IF_TRUE:  jump_instr("OP_JUMP_IF_TRUE", chunk, offset); break;
+        case OP_JUMP_IF_FALSE_OR_POP: jump_instr("OP_JUMP_IF_FALSE_OR_POP", chunk, offset); break;
+        case OP_JUMP_IF_TRUE_OR_POP:  jump_instr("OP_JUMP_IF_TRUE_OR_POP", chunk, offset); break;
+        case OP_LOOP:         loop_instr("OP_LOOP", chunk, offset); break;
+        case OP_LOOP_IF_TRUE: loop_instr("OP_LOOP_IF_TRUE", chunk, offset); break;
+        case OP_SELECT:     simple_instr("OP_SELECT", offset); break;
+        case OP_ARRAY:      byte_instr("OP_ARRAY", chunk, offset); break;
+        case OP_GET_INDEX:  simple_instr("OP_GET_INDEX", offset); break;
+        case OP_SET_INDEX:  simple_instr("OP_SET_INDEX", offset); break;
+        case OP_CLASS:      const_long_instr("OP_CLASS", chunk, offset); break;
+        case OP_GET_FIELD:  const_long_instr("OP_GET_FIELD", chunk, offset); break;
+        case OP_SET_FIELD:  const_long_instr("OP_SET_FIELD", chunk, offset); break;
+        case OP_CALL_NATIVE: native_instr("OP_CALL_NATIVE", chunk, offset); break;
+        case OP_CALL:       byte_instr("OP_CALL", chunk, offset); break;
         case OP_RETURN:     simple_instr("OP_RETURN", offset); break;
         default:            unknown_instr(instr, offset); break;
     } // clang-format on
@@ -118,3 +253,4 @@ static void chunk_disassemble(Chunk *c, const char *name)
     }
     printf("\n");
 }
+#endif
@@ -0,0 +1,717 @@
+#pragma once
+
+#include "common.h"
+#include "buf.h"
+#include "chunk.c"
+#include "clock.c"
+#include "compiler.c"
+#include "debug.c"
+#include "scanner.c"
+#include "verify.c"
+
+// Incremental compilation of a source that is edited in place, for editors.
+//
+// An edit replaces a range of the source. Tokens whose scan could have read
+// the range are scanned again, until the scanner stops at a place in the
+// unchanged text where it also stopped before: the old tokens from there on
+// are kept. Declarations that contain a rescanned token, or looked ahead at
+// one, are compiled again until one ends where an old declaration began.
+// Each declaration keeps its own code, and the pieces are linked into a chunk
+// that is identical to what compile would produce for the whole source.
+
+static void edit_init(EditBuffer *e, Heap *h, GlobalTable *g)
+{
+    *e = (EditBuffer){ .heap = h, .globals = g };
+    buf_push(e->source, '\0');
+    buf_push(e->tokens, ((Token){ .type = TOKEN_EOF, .start = e->source, .line = 1 }));
+    buf_push(e->ends, 0);
+}
+
+static void edit_free(EditBuffer *e)
+{
+    for (int i = 0; i < buf_len(e->decls); ++i) {
+        chunk_free(&e->decls[i].code);
+    }
+    buf_free(e->decls);
+    buf_free(e->source);
+    buf_free(e->tokens);
+    buf_free(e->ends);
+    chunk_free(&e->chunk);
+}
+
+static int edit_length(const EditBuffer *e)
+{
+    return buf_len(e->source) - 1;
+}
+
+// Last offset in the source that the scan of token i read
+static int edit_scan_limit(const EditBuffer *e, int i)
+{
+    int end = e->ends[i];
+    return end + (e->tokens[i].type == TOKEN_NUMBER && e->source[end] == '.');
+}
+
+// Points token i back into the source after the text before it moved
+static void edit_rebase_token(EditBuffer *e, int i)
+{
+    Token *t = &e->tokens[i];
+    if (t->type != TOKEN_ERROR) { // error tokens point at their message
+        t->start = e->source + e->ends[i] - t->length;
+    }
+}
+
+// Replaces source[offset, offset + removed) with text in place
+static void edit_splice_source(EditBuffer *e, int offset, int removed, const char *text, int length)
+{
+    int old_length = edit_length(e);
+    int new_length = old_length - removed + length;
+    const char *old = e->source;
+    buf_reserve(e->source, new_length + 1);
+    if (e->source != old) {
+        for (int i = 0; i < buf_len(e->tokens); ++i) {
+            edit_rebase_token(e, i);
+        }
+    }
+    char *p = e->source + offset;
+    memmove(p + length, p + removed, old_length - offset - removed + 1);
+    if (length > 0) memcpy(p, text, length);
+    buf__len(e->source) = new_length + 1;
+}
+
+// Rescans the tokens an edit may have changed, after the source was spliced.
+// Returns the index of the first token that was rescanned and sets *kept to
+// the index of the first old token kept after them, *shift to how far the
+// kept tokens moved in the token array and *line_delta to how many lines.
+static int edit_rescan(EditBuffer *e, int offset, int removed, int length, int *kept, int *shift,
+                       int *line_delta)
+{
+    int n = buf_len(e->tokens);
+    int delta = length - removed;
+
+    // The first token affected is the first one whose scan read the offset
+    int low = 0, high = n - 1;
+    while (low < high) {
+        int mid = (low + high) / 2;
+        if (edit_scan_limit(e, mid) < offset) low = mid + 1;
+        else high = mid;
+    }
+    int first = low;
+
+    // Scan until the scanner stops where it stopped before, in the text after
+    // the edit: from there on it would produce the same tokens.
+    Token *scanned = NULL;
+    int *scanned_ends = NULL;
+    Scanner s;
+    scanner_init(&s, e->source);
+    if (first > 0) {
+        s.current = e->source + e->ends[first - 1];
+        s.line = e->tokens[first - 1].line;
+    }
+    int old = first;
+    *line_delta = 0;
+    for (;;) {
+        Token t = scanner_scan_token(&s);
+        int end = (int)(s.current - e->source);
+        buf_push(scanned, t);
+        buf_push(scanned_ends, end);
+        if (t.type == TOKEN_EOF) {
+            old = n;
+            break;
+        }
+        if (end < offset + length) continue;
+
+        while (old < n - 1 && e->ends[old] < end - delta) ++old;
+        if (old < n - 1 && e->ends[old] == end - delta) {
+            *line_delta = t.line - e->tokens[old].line;
+            ++old;
+            break;
+        }
+    }
+
+    // Replace tokens [first, old) with the scanned ones and move the rest
+    int count = buf_len(scanned);
+    int moved = n - old;
+    int at = first + count;
+    buf_reserve(e->tokens, at + moved);
+    buf_reserve(e->ends, at + moved);
+    memmove(e->tokens + at, e->tokens + old, moved * sizeof(Token));
+    memmove(e->ends + at, e->ends + old, moved * sizeof(int));
+    memcpy(e->tokens + first, scanned, count * sizeof(Token));
+    memcpy(e->ends + first, scanned_ends, count * sizeof(int));
+    buf__len(e->tokens) = buf__len(e->ends) = at + moved;
+    if (delta != 0 || *line_delta != 0) {
+        for (int i = at; i < at + moved; ++i) {
+            e->ends[i] += delta;
+            e->tokens[i].line += *line_delta;
+            edit_rebase_token(e, i);
+        }
+    }
+
+    buf_free(scanned);
+    buf_free(scanned_ends);
+
+    e->stats.tokens = at + moved;
+    e->stats.tokens_scanned = count;
+    *kept = at;
+    *shift = at - old;
+    return first;
+}
+
+// Compiles the declaration starting at token i and verifies its code on its
+// own: the stack is empty between declarations, so the deepest the linked
+// chunk gets is the deepest any declaration gets.
+static EditDecl edit_compile(EditBuffer *e, int i)
+{
+    EditDecl d = { .first = i };
+    int consumed;
+    Chunk *c = &d.code;
+    bool ok = compile_declaration(&e->tokens[i], c, e->heap, e->globals, &consumed, &d.result);
+    d.end = i + consumed;
+    if (ok) {
+        // End it like a script to verify it, then take the ending off again
+        int len = buf_len(c->code);
+        int line = e->tokens[d.end].line;
+        if (!d.result) chunk_write(c, (byte[]){ OP_NIL }, 1, line);
+        chunk_write(c, (byte[]){ OP_RETURN }, 1, line);
+        c->global_count = buf_len(e->globals->names);
+        ok = chunk_verify(c, compile_errors ? compile_errors : stderr);
+        buf_take(c->code, len);
+        while (!buf_empty(c->offsets) && *buf_last(c->offsets) >= len) {
+            buf_pop(c->offsets);
+            buf_pop(c->lines);
+        }
+    }
+    d.failed = !ok;
+    if (d.failed) {
+        chunk_free(c);
+    }
+    int base = e->tokens[i].line;
+    for (int j = 0; j < buf_len(c->lines); ++j) {
+        c->lines[j] -= base;
+    }
+    return d;
+}
+
+// Recompiles the declarations affected by rescanning tokens [first, kept).
+// The tokens from kept on moved by shift. Fills in which declarations were
+// replaced, and what they occupied in the linked chunk.
+static void edit_recompile(EditBuffer *e, int first, int kept, int shift, EditSplice *s)
+{
+    EditDecl *old = e->decls;
+    int n = buf_len(old);
+
+    // First declaration that contains token first or depends on it. One that
+    // ends with a ';' didn't look at the token after it.
+    int low = 0, high = n;
+    while (low < high) {
+        int mid = (low + high) / 2;
+        if (old[mid].end < first) low = mid + 1;
+        else high = mid;
+    }
+    int k = low;
+    if (k < n && old[k].end == first && !old[k].failed && !old[k].result) ++k;
+
+    // Compile until a declaration ends where an old one began after the
+    // rescanned tokens
+    EditDecl *compiled = NULL;
+    int i = k < n ? old[k].first : (k > 0 ? old[k - 1].end : 0);
+    int m = n; // first old declaration that is kept
+    for (int next = k; e->tokens[i].type != TOKEN_EOF;) {
+        EditDecl d = edit_compile(e, i);
+        buf_push(compiled, d);
+        e->failed += d.failed;
+        i = d.end;
+        if (i < kept) continue;
+
+        while (next < n && old[next].first + shift < i) ++next;
+        if (next < n && old[next].first + shift == i) {
+            m = next;
+            break;
+        }
+    }
+
+    *s = (EditSplice){
+        .decl           = k,
+        .count          = buf_len(compiled),
+        .code_start     = k < n ? old[k].code_start : e->code_end,
+        .code_end       = m < n ? old[m].code_start : e->code_end,
+        .constant_start = k < n ? old[k].constant_start : buf_len(e->chunk.constants),
+        .constant_end   = m < n ? old[m].constant_start : buf_len(e->chunk.constants),
+    };
+
+    // Replace declarations [k, m) with the compiled ones and move the rest
+    for (int j = k; j < m; ++j) {
+        e->failed -= old[j].failed;
+        chunk_free(&old[j].code);
+    }
+    int count = buf_len(compiled);
+    int moved = n - m;
+    int at = k + count;
+    buf_reserve(e->decls, at + moved);
+    if (moved > 0) memmove(e->decls + at, e->decls + m, moved * sizeof(EditDecl));
+    if (count > 0) memcpy(e->decls + k, compiled, count * sizeof(EditDecl));
+    if (e->decls) buf__len(e->decls) = at + moved; // none yet if the script is still blank
+    if (shift != 0) {
+        for (int j = at; j < at + moved; ++j) {
+            e->decls[j].first += shift;
+            e->decls[j].end += shift;
+        }
+    }
+    buf_free(compiled);
+
+    e->stats.decls = at + moved;
+    e->stats.decls_compiled = count;
+}
+
+// Retargets the jumps and loops of code, which was written to out from offset start on
+// with some constant operands widened, so they land where they did before.
+// Returns false if one no longer reaches, which compile reports as an error.
+static bool edit_relocate_jumps(const Chunk *code, Chunk *out, int start)
+{
+    int len = buf_len(code->code);
+    int *moved = NULL; // offset in out of each instruction of code
+    buf_append(moved, len + 1);
+    int from = 0, to = start;
+    while (from < len) {
+        moved[from] = to;
+        from += InstrSize[code->code[from]] ? InstrSize[code->code[from]] : 1;
+        to += InstrSize[out->code[to]] ? InstrSize[out->code[to]] : 1;
+    }
+    moved[len] = to;
+    bool fits = true;
+    for (from = 0; fits && from < len; from += InstrSize[code->code[from]] ? InstrSize[code->code[from]] : 1) {
+        int at = moved[from];
+        if (op_is_jump(code->code[from])) {
+            int target = moved[chunk_jump_target(code, from)];
+            fits = target - at - 3 <= UINT16_MAX;
+            if (fits) chunk_set_jump(out, at, target);
+        } else if (op_is_loop(code->code[from])) {
+            int target = moved[chunk_loop_target(code, from)];
+            fits = at + 3 - target <= UINT16_MAX;
+            if (fits) chunk_set_loop(out, at, target);
+        }
+    }
+    buf_free(moved);
+    return fits;
+}
+
+// Appends the code of declaration d to out, which starts at offset at in the
+// linked chunk. Its constants go to the linked chunk's pool from
+// d->constant_start on, numbered and encoded the way chunk_write_constant
+// would have for the whole script. Returns false if its jumps don't fit then.
+static bool edit_write_decl(EditBuffer *e, EditDecl *d, Chunk *out, int at)
+{
+    Value *pool = e->chunk.constants;
+    const Chunk *code = &d->code;
+    int base = e->tokens[d->first].line;
+    int start = buf_len(out->code);
+    bool widened = false;
+    d->code_start = at + start;
+    for (int l = 0; l < buf_len(code->lines); ++l) {
+        int offset = code->offsets[l];
+        int end = l + 1 < buf_len(code->lines) ? code->offsets[l + 1] : buf_len(code->code);
+        int line = base + code->lines[l];
+        if (buf_empty(code->constants)) {
+            chunk_write(out, &code->code[offset], end - offset, line);
+            continue;
+        }
+        while (offset < end) {
+            const byte *instr = &code->code[offset];
+            int size = InstrSize[*instr] ? InstrSize[*instr] : 1;
+            offset += size;
+            bool named = *instr == OP_CLASS || *instr == OP_GET_FIELD || *instr == OP_SET_FIELD;
+            if (*instr != OP_CONSTANT && *instr != OP_CONSTANT_X && !named) {
+                chunk_write(out, instr, size, line);
+                continue;
+            }
+            int local = *instr == OP_CONSTANT ? instr[1] : instr[1] | instr[2] << 8 | instr[3] << 16;
+            int constant = d->constant_start + local;
+            if (constant == buf_len(pool)) {
+                buf_push(pool, code->constants[local]);
+            } else {
+                pool[constant] = code->constants[local];
+            }
+            if (named) {
+                // Names always take a u24 operand
+                byte bytes[] = { *instr, constant, constant >> 8, constant >> 16 };
+                chunk_write(out, bytes, 4, line);
+            } else if (constant < 0xFF) {
+                chunk_write(out, (byte[]){ OP_CONSTANT, constant }, 2, line);
+            } else {
+                byte bytes[] = { OP_CONSTANT_X, constant, constant >> 8, constant >> 16 };
+                chunk_write(out, bytes, 4, line);
+                widened |= *instr == OP_CONSTANT;
+            }
+        }
+    }
+    e->chunk.constants = pool;
+    return !widened || edit_relocate_jumps(code, out, start);
+}
+
+// Writes declarations [from, to) to out, see edit_write_decl
+static bool edit_write_decls(EditBuffer *e, int from, int to, int constant_start, Chunk *out, int at)
+{
+    for (int i = from; i < to; ++i) {
+        EditDecl *d = &e->decls[i];
+        d->constant_start = constant_start;
+        if (!edit_write_decl(e, d, out, at)) return false;
+        constant_start += buf_len(d->code.constants);
+    }
+    return true;
+}
+
+// Brings the linked chunk up to date after declarations were replaced. If the
+// new ones have as many constants as the old ones, the other declarations keep
+// their constant numbers and only the new code is written: the code after it
+// is moved, and its line runs renumbered. Otherwise everything is rewritten.
+// Returns false if the code doesn't link, see edit_write_decl.
+static bool edit_link(EditBuffer *e, const EditSplice *s, int line_delta)
+{
+    Chunk *c = &e->chunk;
+    int new_constants = 0;
+    for (int i = s->decl; i < s->decl + s->count; ++i) {
+        new_constants += buf_len(e->decls[i].code.constants);
+    }
+    int n = buf_len(e->decls);
+    int written;
+
+    if (!e->linked || new_constants != s->constant_end - s->constant_start) {
+        chunk_truncate(c, 0);
+        buf_take(c->constants, 0);
+        if (!edit_write_decls(e, 0, n, 0, c, 0)) return false;
+        written = buf_len(c->code);
+    } else {
+        // Line runs before the new code, and those of the code after it
+        chunk_truncate(c, e->code_end);
+        int runs = buf_len(c->offsets);
+        int prefix = 0;
+        for (int low = 0, high = runs; low < high;) {
+            int mid = (low + high) / 2;
+            if (c->offsets[mid] < s->code_start) low = prefix = mid + 1;
+            else high = mid;
+        }
+        int *lines = NULL, *offsets = NULL;
+        if (s->code_end < e->code_end) {
+            int low = 0, high = runs - 1;
+            while (low < high) {
+                int mid = (low + high + 1) / 2;
+                if (c->offsets[mid] <= s->code_end) low = mid;
+                else high = mid - 1;
+            }
+            memcpy(buf_append(lines, runs - low), c->lines + low, (runs - low) * sizeof(int));
+            memcpy(buf_append(offsets, runs - low), c->offsets + low, (runs - low) * sizeof(int));
+            offsets[0] = s->code_end; // may have started in replaced code
+        }
+
+        // The new code, with its first line run merged into the one before it
+        Chunk piece = { 0 };
+        if (prefix > 0) {
+            buf_push(piece.lines, c->lines[prefix - 1]);
+            buf_push(piece.offsets, 0);
+        }
+        if (!edit_write_decls(e, s->decl, s->decl + s->count, s->constant_start, &piece,
+                s->code_start)) {
+            buf_free(lines);
+            buf_free(offsets);
+            chunk_free(&piece);
+            return false;
+        }
+
+        // Move the code after it, put the new code in between and renumber
+        // the line runs that follow
+        int size = buf_len(piece.code);
+        int moved = e->code_end - s->code_end;
+        int code_delta = s->code_start + size - s->code_end;
+        buf_reserve(c->code, s->code_start + size + moved + 2);
+        memmove(c->code + s->code_start + size, c->code + s->code_end, moved);
+        if (size > 0) memcpy(c->code + s->code_start, piece.code, size);
+        buf__len(c->code) = s->code_start + size + moved;
+
+        buf_take(c->lines, prefix);
+        buf_take(c->offsets, prefix);
+        for (int r = prefix > 0; r < buf_len(piece.lines); ++r) {
+            buf_push(c->lines, piece.lines[r]);
+            buf_push(c->offsets, s->code_start + piece.offsets[r]);
+        }
+        for (int r = 0; r < buf_len(lines); ++r) {
+            if (buf_empty(c->lines) || *buf_last(c->lines) != lines[r] + line_delta) {
+                buf_push(c->lines, lines[r] + line_delta);
+                buf_push(c->offsets, offsets[r] + code_delta);
+            }
+        }
+        for (int i = s->decl + s->count; i < n && code_delta != 0; ++i) {
+            e->decls[i].code_start += code_delta;
+        }
+        written = size;
+        buf_free(lines);
+        buf_free(offsets);
+        chunk_free(&piece);
+    }
+
+    // End it like compile ends a script
+    e->code_end = buf_len(c->code);
+    int line = buf_last(e->tokens)->line;
+    if (n == 0 || !e->decls[n - 1].result) {
+        chunk_write(c, (byte[]){ OP_NIL }, 1, line);
+    }
+    chunk_write(c, (byte[]){ OP_RETURN }, 1, line);
+    c->global_count = buf_len(e->globals->names);
+    c->max_stack = 1;
+    for (int i = 0; i < n; ++i) {
+        c->max_stack = BUF_MAX(c->max_stack, e->decls[i].code.max_stack);
+    }
+    chunk_new_id(c);
+    e->linked = true;
+    e->stats.code_written = written;
+    return true;
+}
+
+// Compiles the whole source into the linked chunk, for when the declarations
+// don't link. The next edit rewrites everything.
+static bool edit_compile_all(EditBuffer *e)
+{
+    Chunk *c = &e->chunk;
+    chunk_free(c);
+    *c = (Chunk){ 0 };
+    bool ok = compile(e->source, c, e->heap, e->globals) &&
+              chunk_verify(c, compile_errors ? compile_errors : stderr);
+    e->linked = false;
+    e->stats.code_written = ok ? buf_len(c->code) : 0;
+    return ok;
+}
+
+// Replaces removed bytes at offset with text[0, length) and brings the chunk
+// up to date. Returns e->ok; errors go to compile_errors like compile's.
+static bool edit_apply(EditBuffer *e, int offset, int removed, const char *text, int length)
+{
+    assert(0 <= offset && 0 <= removed && offset + removed <= edit_length(e) && 0 <= length);
+
+    uint64_t start = clock_ns();
+    edit_splice_source(e, offset, removed, text, length);
+    int kept, shift, line_delta;
+    int first = edit_rescan(e, offset, removed, length, &kept, &shift, &line_delta);
+    uint64_t scanned = clock_ns();
+
+    EditSplice splice;
+    edit_recompile(e, first, kept, shift, &splice);
+    uint64_t compiled = clock_ns();
+
+    e->ok = e->failed == 0;
+    if (e->ok) {
+        e->ok = edit_link(e, &splice, line_delta) || edit_compile_all(e);
+    } else {
+        e->linked = false;
+        e->stats.code_written = 0;
+    }
+    uint64_t linked = clock_ns();
+
+    e->stats.code_bytes = e->ok ? buf_len(e->chunk.code) : 0;
+    e->stats.scan_ns = scanned - start;
+    e->stats.compile_ns = compiled - scanned;
+    e->stats.link_ns = linked - compiled;
+    return e->ok;
+}
+
+MAYBE_UNUSED static void edit_print_stats(FILE *out, const EditStats *s)
+{
+    fprintf(out, "edit: scanned %d/%d tokens in %.3f ms, compiled %d/%d declarations in %.3f ms, "
+                 "wrote %d/%d code bytes in %.3f ms\n",
+        s->tokens_scanned, s->tokens, clock_ms(s->scan_ns), s->decls_compiled, s->decls,
+        clock_ms(s->compile_ns), s->code_written, s->code_bytes, clock_ms(s->link_ns));
+}
+
+#ifndef NDEBUG
+static void edit_assert_same_chunk(const Chunk *a, const Chunk *b)
+{
+    assert(buf_len(a->code) == buf_len(b->code));
+    assert(memcmp(a->code, b->code, buf_sizeof(a->code)) == 0);
+    assert(buf_len(a->lines) == buf_len(b->lines));
+    assert(memcmp(a->lines, b->lines, buf_sizeof(a->lines)) == 0);
+    assert(memcmp(a->offsets, b->offsets, buf_sizeof(a->offsets)) == 0);
+    assert(buf_len(a->constants) == buf_len(b->constants));
+    for (int i = 0; i < buf_len(a->constants); ++i) {
+        Value x = a->constants[i], y = b->constants[i];
+        assert(x.type == y.type);
+        if (IS_FUNCTION(x)) {
+            // A new object for every compile, with the same source
+            assert(AS_FUNCTION(x)->arity == AS_FUNCTION(y)->arity);
+            assert(strcmp(AS_FUNCTION(x)->source, AS_FUNCTION(y)->source) == 0);
+        } else {
+            assert(values_equal(x, y));
+        }
+    }
+    assert(a->max_stack == b->max_stack && a->global_count == b->global_count);
+}
+
+// Compares e with a buffer that scans and compiles its source from scratch
+static void edit_assert_fresh(EditBuffer *e)
+{
+    EditBuffer fresh;
+    edit_init(&fresh, e->heap, e->globals);
+    assert(edit_apply(&fresh, 0, 0, e->source, edit_length(e)) == e->ok);
+    assert(buf_len(fresh.tokens) == buf_len(e->tokens));
+    for (int i = 0; i < buf_len(e->tokens); ++i) {
+        const Token *a = &fresh.tokens[i];
+        const Token *b = &e->tokens[i];
+        assert(a->type == b->type && a->length == b->length && a->line == b->line);
+        assert(a->type == TOKEN_ERROR || a->start - fresh.source == b->start - e->source);
+        assert(fresh.ends[i] == e->ends[i]);
+    }
+    assert(buf_len(fresh.decls) == buf_len(e->decls));
+    for (int i = 0; i < buf_len(e->decls); ++i) {
+        assert(fresh.decls[i].first == e->decls[i].first && fresh.decls[i].end == e->decls[i].end);
+    }
+    if (e->ok) {
+        edit_assert_same_chunk(&fresh.chunk, &e->chunk);
+    }
+    edit_free(&fresh);
+}
+
+// Compares e with compiling its whole source
+static void edit_assert_compiled(EditBuffer *e)
+{
+    Chunk c = { 0 };
+    assert(compile(e->source, &c, e->heap, e->globals) && chunk_verify(&c, NULL));
+    assert(e->ok);
+    edit_assert_same_chunk(&c, &e->chunk);
+    chunk_free(&c);
+}
+
+static void edit_test(void)
+{
+    Heap h = { 0 };
+    GlobalTable g = { 0 };
+    CompilerOptions saved_options = compiler_options;
+    FILE *saved_errors = compile_errors;
+    compile_errors = fopen("/dev/null", "w");
+
+    static const char *source = "var a = 1;\nvar b = a + 2.5;\n// comment\nb = \"str\" + \"ing\";\n"
+                                "a * (b - 3) == \"x\"";
+    static const char *pieces[] = {
+        "1", "23", ".5", " ", "\n", "+", "-", "*", "=", "==", ";", "(", ")", "var ", "a", "b",
+        "c1", "//", "\"", "\"s\"", "nil", "!", " and ", " or ", "?", ":",
+        "fun f(", "{", "}", "return ", "a(", ",", "while (", "for (",
+        "class C {}", ".x", "C()",
+    };
+    uint64_t x = 0x9E3779B97F4A7C15ull;
+    for (int optimize = 0; optimize < 2; ++optimize) {
+        compiler_options.optimize = optimize;
+        EditBuffer e;
+        edit_init(&e, &h, &g);
+        assert(edit_apply(&e, 0, 0, source, (int)strlen(source)));
+        edit_assert_compiled(&e);
+
+        // Changing a literal rescans one token and recompiles its declaration
+        assert(edit_apply(&e, 8, 1, "42", 2));
+        assert(e.stats.tokens_scanned == 1 && e.stats.decls_compiled == 1);
+        assert(strncmp(e.source, "var a = 42;", 11) == 0);
+        edit_assert_compiled(&e);
+
+        // Random edits, mostly errors, agree with starting from scratch and
+        // undoing them gets back a script that compiles
+        for (int i = 0; i < 500; ++i) {
+            x ^= x << 13, x ^= x >> 7, x ^= x << 17;
+            int length = edit_length(&e);
+            int offset = (int)(x % (uint64_t)(length + 1));
+            int removed = (int)((x >> 32) % 4);
+            if (removed > length - offset) removed = length - offset;
+            const char *text = pieces[(x >> 40) % countof(pieces)];
+            char undo[4];
+            memcpy(undo, e.source + offset, removed);
+            edit_apply(&e, offset, removed, text, (int)strlen(text));
+            edit_assert_fresh(&e);
+            assert(edit_apply(&e, offset, (int)strlen(text), undo, removed));
+            edit_assert_fresh(&e);
+
+            // Add a declaration at the start of a line, drop the first line
+            // when the script gets long
+            const char *line = strchr(e.source + offset, '\n');
+            offset = line ? (int)(line - e.source) + 1 : 0;
+            char decl[32];
+            snprintf(decl, sizeof(decl), "var c%d = %d;\n", i % 7, i);
+            assert(edit_apply(&e, offset, 0, decl, (int)strlen(decl)));
+            if (edit_length(&e) > 400) {
+                assert(edit_apply(&e, 0, (int)strcspn(e.source, "\n") + 1, "", 0));
+            }
+        }
+        edit_assert_compiled(&e);
+
+        // Jumps over and loops back over constants whose operands get wider
+        // once linked after those of the other declarations
+        char *many = NULL;
+        for (int i = 0; i < 300; ++i) {
+            char decl[16];
+            int n = snprintf(decl, sizeof(decl), "\"k%d\";\n", i);
+            memcpy(buf_append(many, n), decl, n);
+        }
+        const char *last = "while (a) a = \"w\";\na ? \"p\" + b : \"q\" or a";
+        int n = (int)strlen(last);
+        memcpy(buf_append(many, n), last, n);
+        assert(edit_apply(&e, 0, edit_length(&e), many, buf_len(many)));
+        edit_assert_compiled(&e);
+        assert(edit_apply(&e, buf_len(many) - n + 24, 1, "r", 1)); // "p"
+        assert(e.stats.decls_compiled == 1);
+        edit_assert_compiled(&e);
+        buf_free(many);
+
+        // A conditional that jumps over its constants only while their
+        // operands are narrow doesn't link after enough constants are added
+        // before it, and compiling the whole script reports the error
+        if (!optimize) {
+            char *cond = NULL, *before = NULL, piece[16];
+            memcpy(buf_append(cond, 7), "a ? nil", 7);
+            for (int i = 0; i < 255; ++i) {
+                int len = snprintf(piece, sizeof(piece), " == \"q%d\"", i);
+                memcpy(buf_append(cond, len), piece, len);
+                len = snprintf(piece, sizeof(piece), "\"k%d\";\n", i);
+                memcpy(buf_append(before, len), piece, len);
+            }
+            for (int i = 0; i < 32280; ++i) {
+                memcpy(buf_append(cond, 7), " == nil", 7);
+            }
+            memcpy(buf_append(cond, 7), " : nil;", 7);
+            assert(edit_apply(&e, 0, edit_length(&e), cond, buf_len(cond)));
+            assert(!edit_apply(&e, 0, 0, before, buf_len(before)));
+            edit_assert_fresh(&e);
+            assert(edit_apply(&e, 0, buf_len(before), "", 0));
+            edit_assert_compiled(&e);
+            buf_free(cond);
+            buf_free(before);
+        }
+
+        // Likewise a loop that reaches back over its constants
+        if (!optimize) {
+            char *loop = NULL, *before = NULL, piece[16];
+            memcpy(buf_append(loop, 11), "while (a) {", 11);
+            for (int i = 0; i < 255; ++i) {
+                int len = snprintf(piece, sizeof(piece), "\"q%d\";", i);
+                memcpy(buf_append(loop, len), piece, len);
+                len = snprintf(piece, sizeof(piece), "\"k%d\";\n", i);
+                memcpy(buf_append(before, len), piece, len);
+            }
+            for (int i = 0; i < 32267; ++i) {
+                memcpy(buf_append(loop, 4), "nil;", 4);
+            }
+            buf_push(loop, '}');
+            assert(edit_apply(&e, 0, edit_length(&e), loop, buf_len(loop)));
+            assert(!edit_apply(&e, 0, 0, before, buf_len(before)));
+            edit_assert_fresh(&e);
+            assert(edit_apply(&e, 0, buf_len(before), "", 0));
+            edit_assert_compiled(&e);
+            buf_free(loop);
+            buf_free(before);
+        }
+
+        // Deleting everything leaves an empty script
+        assert(edit_apply(&e, 0, edit_length(&e), "", 0));
+        assert(buf_len(e.chunk.code) == 2 && e.chunk.code[0] == OP_NIL);
+        edit_free(&e);
+    }
+
+    fclose(compile_errors);
+    compile_errors = saved_errors;
+    compiler_options = saved_options;
+    global_table_free(&g);
+    heap_free(&h);
+}
+#endif
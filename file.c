@@ -0,0 +1,38 @@
+#pragma once
+
+#include "common.h"
+#include "buf.h"
+
+static size_t fsize(FILE *stream)
+{
+    fseek(stream, 0L, SEEK_END);
+    long size = ftell(stream);
+    rewind(stream);
+    return size;
+}
+
+// Reads the whole file into a NUL terminated stretchy buffer. Returns NULL and
+// prints an error if the file could not be read.
+static char *read_file(const char *path)
+{
+    FILE *file = fopen(path, "rb");
+    if (!file) {
+        fprintf(stderr, "Could not open file \"%s\".\n", path);
+        return NULL;
+    }
+
+    size_t sz = fsize(file);
+    char *buf = NULL;
+    buf_append(buf, (int)(sz + 1)); // extra byte for NUL
+    size_t bytes_read = fread(buf, sizeof(char), sz, file);
+    fclose(file);
+    if (bytes_read < sz) {
+        fprintf(stderr, "Could not read file \"%s\".\n", path);
+        buf_free(buf);
+        return NULL;
+    }
+    buf[bytes_read] = '\0';
+    buf_take(buf, (int)bytes_read);
+
+    return buf;
+}
@@ -0,0 +1,199 @@
+#pragma once
+
+#include <ctype.h>
+#include <errno.h>
+#include <unistd.h>
+
+#include "common.h"
+#include "buf.h"
+#include "clock.c"
+#include "output.c"
+#include "vm.c"
+
+// Evaluates one expression per input record (-e). Records are read in large
+// blocks and split in place: the delimiter after each record is overwritten
+// with a NUL and the record is used where it is. Only a record cut off at the
+// end of a block is moved, to the front of the block before the next read.
+
+#define FILTER_BLOCK_SIZE (1 << 20)
+
+static int filter_block_size = FILTER_BLOCK_SIZE; // grows for longer records
+
+// Numeric records become numbers the way literals do: integers unless they
+// have a fraction or an exponent or don't fit. Only decimal ones are numeric,
+// although strtod would also read hex, "inf" and "nan". Anything else is a
+// string. chars is NUL terminated.
+static Value filter_value(Heap *h, const char *chars, int length)
+{
+    char last = length > 0 ? chars[length - 1] : '\0';
+    if (strspn(chars, "0123456789+-.eE") == (size_t)length && (isdigit((byte)last) || last == '.')) {
+        char *end;
+        errno = 0;
+        long long i = strtoll(chars, &end, 10);
+        if (end == chars + length && errno != ERANGE) return INT_VAL(i);
+        double d = strtod(chars, &end);
+        if (end == chars + length) return NUMBER_VAL(d);
+    }
+    return string_value(h, chars, length);
+}
+
+// Runs chunk with record [chars, chars + length) bound to global slot and
+// writes the result followed by delim. chars[length] is overwritten. Returns
+// an exit status: a function body that doesn't compile is ERR_COMPILE.
+// The strings of records done are collected as the heap grows, here since
+// an expression that allocates nothing never collects.
+static int filter_record(VM *vm, Output *out, Chunk *chunk, int slot, char *chars,
+    int length, char delim)
+{
+    if (delim == '\n' && length > 0 && chars[length - 1] == '\r') --length;
+    chars[length] = '\0';
+    vm_start(vm, chunk);
+    if (vm->heap.bytes >= vm->heap.next_gc) vm_collect(vm);
+    vm->globals[slot] = filter_value(&vm->heap, chars, length);
+    VMResult r = vm_resume(vm);
+    if (r.result == INTERPRET_COMPILE_ERROR) return ERR_COMPILE;
+    if (r.result != INTERPRET_OK) return ERR_RUNTIME;
+    out_value(out, r.value);
+    out_char(out, delim);
+    return 0;
+}
+
+// Compiles expr once, then evaluates it for every delim terminated record read
+// from fd with the record in global _, writing one result per record. With
+// --time the throughput is reported. Returns an exit status.
+static int filter_eval(VM *vm, Output *out, int fd, const char *expr, char delim,
+    ReportFlags report)
+{
+    int slot = global_slot(&vm->global_names, string_value(&vm->heap, "_", 1));
+    Chunk chunk = { 0 };
+    chunk_init(&chunk);
+    compile_errors = vm->errors;
+    if (!compile(expr, &chunk, &vm->heap, &vm->global_names) ||
+            !chunk_verify(&chunk, vm_errors(vm))) {
+        chunk_free(&chunk);
+        return ERR_COMPILE;
+    }
+
+    uint64_t start = clock_ns();
+    int64_t records = 0, bytes = 0;
+    int status = 0;
+    int size = filter_block_size;
+    char *block = malloc(size + 1); // and a NUL after a last record without delim
+    int len = 0;
+    for (bool eof = false; !eof && status == 0;) {
+        ssize_t n = read(fd, block + len, size - len);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            fputs("Could not read input.\n", stderr);
+            status = ERR_FILE;
+            break;
+        }
+        eof = n == 0;
+        len += (int)n;
+        bytes += n;
+
+        char *p = block, *end = block + len;
+        for (char *d; status == 0 && (d = memchr(p, delim, end - p)); p = d + 1) {
+            ++records;
+            status = filter_record(vm, out, &chunk, slot, p, (int)(d - p), delim);
+        }
+        if (eof && status == 0 && p < end) {
+            ++records;
+            status = filter_record(vm, out, &chunk, slot, p, (int)(end - p), delim);
+        }
+
+        // Keep the partial record, in a larger block if it fills this one
+        len = (int)(end - p);
+        memmove(block, p, len);
+        if (len == size) {
+            size *= 2;
+            block = realloc(block, size + 1);
+        }
+    }
+    if (status == ERR_RUNTIME || status == ERR_COMPILE) {
+        fprintf(vm_errors(vm), "[record %lld]\n", (long long)records);
+    }
+    out_flush(out);
+    uint64_t elapsed = clock_ns() - start;
+
+    if (report & REPORT_TIME) {
+        fprintf(stderr, "filter: %lld records, %.1f MB in %.3f ms, %.0f records/s, %.1f MB/s\n",
+            (long long)records, (double)bytes / 1e6, clock_ms(elapsed),
+            stats_rate((double)records, elapsed), stats_rate((double)bytes, elapsed) / 1e6);
+    }
+    free(block);
+    chunk_free(&chunk);
+    return status;
+}
+
+#ifndef NDEBUG
+// Runs filter_eval on input through a pipe and compares what it wrote
+static void filter_assert_output(const char *expr, const char *input, int input_len, char delim,
+    const char *expected, int expected_len, int expected_status)
+{
+    int in[2], out[2];
+    bool ok = pipe(in) == 0 && pipe(out) == 0;
+    assert(ok);
+    ok = write(in[1], input, input_len) == input_len;
+    assert(ok);
+    close(in[1]);
+
+    VM vm = { 0 };
+    vm_init(&vm);
+    vm.errors = fopen("/dev/null", "w");
+    Output o = { .fd = out[1] };
+    int status = filter_eval(&vm, &o, in[0], expr, delim, 0);
+    out_close(&o);
+    close(out[1]);
+    close(in[0]);
+    assert(status == expected_status);
+
+    char result[256];
+    int len = (int)read(out[0], result, sizeof(result));
+    close(out[0]);
+    assert(len == expected_len && memcmp(result, expected, len) == 0);
+    fclose(vm.errors);
+    vm_free(&vm);
+}
+
+static void filter_test(void)
+{
+    // Records cut off at the end of a block, and longer than a block
+    filter_block_size = 4;
+    const char numbers[] = "1\n2.5\n-3\r\n1234567890\n0.125";
+    const char doubled[] = "2\n5\n-6\n2469135780\n0.25\n";
+    filter_assert_output("_ * 2", numbers, sizeof(numbers) - 1, '\n', doubled, sizeof(doubled) - 1, 0);
+    const char strings[] = "ab\0-\0longer than a block\0";
+    const char shouted[] = "ab!\0-!\0longer than a block!\0";
+    filter_assert_output("_ + \"!\"", strings, sizeof(strings) - 1, '\0', shouted, sizeof(shouted) - 1, 0);
+    filter_block_size = FILTER_BLOCK_SIZE;
+
+    // A runtime error stops after the records before it
+    filter_assert_output("-_", "1\nx\n2\n", 6, '\n', "-1\n", 3, ERR_RUNTIME);
+    filter_assert_output("_ +", "1\n", 2, '\n', "", 0, ERR_COMPILE);
+    filter_assert_output("(fun (x) { return x +; })(_)", "1\n", 2, '\n', "", 0, ERR_COMPILE);
+
+    // Only decimal records are numbers
+    const char words[] = "0x10\n1e2\n-.5\ninf\nnan\n1-\n";
+    const char twice[] = "0x100x10\n200\n-1\ninfinf\nnannan\n1-1-\n";
+    filter_assert_output("_ + _", words, sizeof(words) - 1, '\n', twice, sizeof(twice) - 1, 0);
+
+    // Records done don't stay in the heap
+    FILE *records = tmpfile();
+    FILE *sink = fopen("/dev/null", "w");
+    assert(records && sink);
+    for (int i = 0; i < 50000; ++i) {
+        fprintf(records, "record %d, long enough to be a heap string\n", i);
+    }
+    rewind(records);
+    VM vm = { 0 };
+    vm_init(&vm);
+    Output o = { .fd = fileno(sink) };
+    assert(filter_eval(&vm, &o, fileno(records), "_", '\n', 0) == 0);
+    assert(vm.heap.collections > 0 && vm.heap.bytes < 4 * GC_MIN_BYTES);
+    out_close(&o);
+    vm_free(&vm);
+    fclose(sink);
+    fclose(records);
+}
+#endif
@@ -0,0 +1,115 @@
+#pragma once
+
+#include "common.h"
+#include "buf.h"
+#include "array.c"
+#include "object.c"
+
+// Mark and sweep collection of a VM's heap, see vm_collect. The VM marks its
+// roots, then every pinned object is marked too and the marked objects are
+// traced from a stack rather than by recursion, so deep ropes don't overflow
+// the C stack. What wasn't reached is freed. Interning is weak: the table
+// only keeps the strings that survive. Objects of an image are frozen: VMs
+// on other threads may be reading them, and nothing in them points into the
+// heap of a VM, so they are neither marked nor traced.
+
+#define GC_MIN_BYTES (1 << 20) // the heap grows to this before it is collected
+
+static void gc_mark(Heap *h, Obj *o)
+{
+    if (!o || o->marked || o->frozen) return;
+    o->marked = true;
+    buf_push(h->gray, o);
+}
+
+static void gc_mark_value(Heap *h, Value v)
+{
+    if (IS_OBJ(v)) gc_mark(h, AS_OBJ(v));
+}
+
+static void gc_mark_values(Heap *h, const Value *values, int count)
+{
+    for (int i = 0; i < count; ++i) {
+        gc_mark_value(h, values[i]);
+    }
+}
+
+// Marks the objects o points to
+static void gc_trace(Heap *h, Obj *o)
+{
+    switch (o->type) {
+        case OBJ_STRING:
+        case OBJ_ARRAY:
+            break;
+        case OBJ_ROPE: {
+            ObjRope *r = (ObjRope *)o;
+            gc_mark_value(h, r->left);
+            gc_mark_value(h, r->right);
+            gc_mark(h, (Obj *)r->flat);
+        } break;
+        case OBJ_FUNCTION: {
+            ObjFunction *f = (ObjFunction *)o;
+            gc_mark_value(h, f->name);
+            gc_mark_values(h, f->chunk.constants, buf_len(f->chunk.constants));
+        } break;
+        case OBJ_SHAPE: {
+            Shape *s = (Shape *)o;
+            gc_mark(h, (Obj *)s->parent);
+            gc_mark_value(h, s->name);
+            for (int i = 0; i < buf_len(s->transitions); ++i) {
+                gc_mark(h, (Obj *)s->transitions[i]);
+            }
+        } break;
+        case OBJ_CLASS: {
+            ObjClass *c = (ObjClass *)o;
+            gc_mark_value(h, c->name);
+            gc_mark(h, (Obj *)c->shape);
+        } break;
+        case OBJ_INSTANCE: {
+            ObjInstance *i = (ObjInstance *)o;
+            gc_mark(h, (Obj *)i->klass);
+            gc_mark(h, (Obj *)i->shape);
+            gc_mark_values(h, i->fields, buf_len(i->fields));
+        } break;
+    }
+}
+
+// Marks the pinned objects of h, traces from everything marked and frees the
+// objects left unmarked. The caller marks its roots first. Returns false if
+// what is left is over h->limit.
+static bool gc_collect(Heap *h)
+{
+    for (Obj *o = h->objects; o; o = o->next) {
+        if (o->pinned) gc_mark(h, o);
+    }
+    while (!buf_empty(h->gray)) {
+        gc_trace(h, *buf_pop(h->gray));
+    }
+
+    memset(h->strings, 0, buf_sizeof(h->strings));
+    h->string_count = 0;
+    h->bytes = 0;
+    for (Obj **link = &h->objects; *link;) {
+        Obj *o = *link;
+        if (!o->marked) {
+            *link = o->next;
+            obj_free(o);
+            continue;
+        }
+        o->marked = false;
+        h->bytes += obj_size(o);
+        if (o->type == OBJ_STRING) {
+            ObjString *s = (ObjString *)o;
+            *heap_find_string(h->strings, s->chars, s->length, s->hash) = s;
+            ++h->string_count;
+        }
+        link = &o->next;
+    }
+    h->next_gc = BUF_MAX(2 * h->bytes, (size_t)GC_MIN_BYTES);
+    if (h->limit && h->next_gc > h->limit) {
+        // Checked at every allocation while over it
+        h->next_gc = BUF_MAX(h->limit, h->bytes);
+    }
+    ++h->collections;
+    return !h->limit || h->bytes <= h->limit;
+}
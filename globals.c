@@ -0,0 +1,65 @@
+#pragma once
+
+#include "common.h"
+#include "buf.h"
+#include "object.c"
+#include "value.c"
+
+// Slots are dense and never reused, so a slot stays valid for every chunk
+// compiled against the same table.
+#define GLOBAL_SLOTS_MAX (1 << 16) // operands are u16
+
+static uint32_t global_name_hash(Value name)
+{
+    if (IS_SMALL_STRING(name)) {
+        return string_hash(name.as.small, string_length(name));
+    }
+    return AS_STRING(name)->hash;
+}
+
+static int *global_find(GlobalTable *g, int *slots, Value name)
+{
+    int mask = buf_len(slots) - 1;
+    for (int i = (int)(global_name_hash(name) & (uint32_t)mask);; i = (i + 1) & mask) {
+        if (slots[i] < 0 || values_equal(g->names[slots[i]], name)) {
+            return &slots[i];
+        }
+    }
+}
+
+static void global_grow(GlobalTable *g)
+{
+    int cap = BUF_MAX(64, 2 * buf_len(g->slots));
+    int *slots = NULL;
+    buf_append(slots, cap);
+    for (int i = 0; i < cap; ++i) {
+        slots[i] = -1;
+    }
+    for (int slot = 0; slot < buf_len(g->names); ++slot) {
+        *global_find(g, slots, g->names[slot]) = slot;
+    }
+    buf_free(g->slots);
+    g->slots = slots;
+}
+
+// Returns the slot of global name (an interned or small string), adding one
+// if it is new, or -1 if every slot is taken.
+static int global_slot(GlobalTable *g, Value name)
+{
+    if (2 * (buf_len(g->names) + 1) > buf_len(g->slots)) {
+        global_grow(g);
+    }
+    int *slot = global_find(g, g->slots, name);
+    if (*slot < 0) {
+        if (buf_len(g->names) == GLOBAL_SLOTS_MAX) return -1;
+        *slot = buf_len(g->names);
+        buf_push(g->names, name);
+    }
+    return *slot;
+}
+
+static void global_table_free(GlobalTable *g)
+{
+    buf_free(g->names);
+    buf_free(g->slots);
+}
@@ -0,0 +1,90 @@
+#pragma once
+
+#include "common.h"
+#include "buf.h"
+#include "chunk.c"
+#include "compiler.c"
+#include "object.c"
+
+// An image is a compiled chunk made read-only, so that VMs on any number of
+// threads can run it at once without copying or locking: each keeps its own
+// stack, ip and global values (see vm_start_image). References are counted
+// and the last image_release frees it.
+
+// Returns string v, or its copy in the image's heap if it lives in a heap
+static Value image_own_string(ChunkImage *image, Value v)
+{
+    if (!IS_OBJ(v)) return v;
+    const ObjString *s = AS_STRING(v); // constants and names are never ropes
+    return OBJ_VAL(heap_intern(&image->heap, s->chars, s->length));
+}
+
+// Compiles f and the functions declared in its body, which the compiler puts
+// in the same heap. Compile errors are reported now, and again as a runtime
+// error by the first call.
+static void image_compile_function(ObjFunction *f)
+{
+    if (!compile_function(f)) return;
+    for (int i = 0; i < buf_len(f->chunk.constants); ++i) {
+        Value v = f->chunk.constants[i];
+        if (IS_FUNCTION(v)) image_compile_function(AS_FUNCTION(v));
+    }
+}
+
+// Returns constant v, or its copy in the image's heap if it lives in a heap.
+// A function is copied with its body compiled, against global table g, so
+// no VM running the image ever compiles one.
+static Value image_own_constant(ChunkImage *image, Value v, GlobalTable *g)
+{
+    if (!IS_FUNCTION(v)) return image_own_string(image, v);
+    const ObjFunction *f = AS_FUNCTION(v);
+    ObjFunction *copy = function_new(&image->heap, image_own_string(image, f->name), f->arity,
+        f->source, (int)strlen(f->source), f->line, g);
+    image_compile_function(copy);
+    return OBJ_VAL(copy);
+}
+
+// Moves *chunk, compiled against global table g, into a new image with one
+// reference. With own_strings the strings and functions it uses are copied
+// into the image, which then doesn't depend on the heap it was compiled with,
+// and values produced by running it stay valid as long as it is held. The
+// functions are compiled right away, which may add globals to g. Without,
+// that heap must outlive the image, and its functions are compiled by the VM
+// that first calls them.
+static ChunkImage *image_new(Chunk *chunk, GlobalTable *g, bool own_strings)
+{
+    ChunkImage *image = calloc(1, sizeof(ChunkImage));
+    image->chunk = *chunk;
+    *chunk = (Chunk){ 0 };
+    Value *constants = image->chunk.constants;
+    for (int i = 0; own_strings && i < buf_len(constants); ++i) {
+        constants[i] = image_own_constant(image, constants[i], g);
+    }
+    if (own_strings) image->chunk.global_count = buf_len(g->names);
+    for (int slot = 0; slot < image->chunk.global_count; ++slot) {
+        Value name = g->names[slot];
+        buf_push(image->names, own_strings ? image_own_string(image, name) : name);
+    }
+    // VMs collecting their heaps leave the image's objects alone
+    for (Obj *o = image->heap.objects; o; o = o->next) {
+        o->frozen = true;
+    }
+    atomic_init(&image->refs, 1);
+    return image;
+}
+
+static ChunkImage *image_retain(ChunkImage *image)
+{
+    atomic_fetch_add_explicit(&image->refs, 1, memory_order_relaxed);
+    return image;
+}
+
+static void image_release(ChunkImage *image)
+{
+    if (atomic_fetch_sub_explicit(&image->refs, 1, memory_order_acq_rel) == 1) {
+        chunk_free(&image->chunk);
+        heap_free(&image->heap);
+        buf_free(image->names);
+        free(image);
+    }
+}
@@ -0,0 +1,505 @@
+#pragma once
+
+#include <math.h>
+
+#include "common.h"
+#include "buf.h"
+#include "chunk.c"
+#include "debug.c"
+#include "types.c"
+#include "value.c"
+
+// Expression DAG between the parser and the chunk, enabled with -O.
+//
+// While optimizing, the compiler hands constants and pure expression operators
+// to the IR instead of writing them to the chunk. The IR keeps a symbolic stack
+// of node ids that mirrors what the VM stack would hold. Nodes are hash-consed,
+// so a repeated subexpression maps to the node that already exists, and each
+// new node is folded, simplified or strength reduced on the way in. Operators
+// that may give a new array are the exception, see ir_make_op.
+//
+// Any other instruction flushes the IR first: the symbolic stack is lowered to
+// bytecode, evaluating each shared node once and reusing its value with
+// OP_DUP, OP_PICK and OP_ROLL.
+
+typedef struct {
+    IrNode *nodes; // operands always have smaller ids than their users
+    int    *table; // open addressing hash table of node ids, -1 when empty
+    int    *stack; // symbolic VM stack of node ids
+} Ir;
+
+typedef struct {
+    int  id;
+    bool expanded; // operands have been pushed, emit the operator next
+} IrWork;
+
+typedef struct {
+    Chunk  *chunk;     // NULL for a dry run
+    bool    share;     // keep shared nodes on the stack instead of recomputing them
+    int    *uses;      // references to each node from the roots and live users
+    bool   *held;      // shared node has been evaluated and is on the stack
+    int    *sim;       // simulated stack: node id of held values, -1 for the rest
+    IrWork *work;
+    bool    overflow;  // a held node was deeper than OP_PICK/OP_ROLL can reach
+} IrLower;
+
+static _Thread_local Ir ir;
+
+static void ir_reset(void)
+{
+    buf_clear(ir.nodes);
+    buf_clear(ir.stack);
+    for (int i = 0; i < buf_len(ir.table); ++i) {
+        ir.table[i] = -1;
+    }
+}
+
+static void ir_free(void)
+{
+    buf_free(ir.nodes);
+    buf_free(ir.table);
+    buf_free(ir.stack);
+}
+
+static bool ir_empty(void)
+{
+    return buf_empty(ir.stack);
+}
+
+static uint64_t ir_mix(uint64_t h, uint64_t v)
+{
+    return h ^ (v + 0x9E3779B97F4A7C15ull + (h << 6) + (h >> 2));
+}
+
+// Constants are keyed by their bits so 0 and -0 stay distinct.
+static uint64_t ir_constant_bits(Value v)
+{
+    uint64_t bits = 0;
+    switch (v.type) {
+        case VAL_NIL:    break;
+        case VAL_BOOL:   bits = AS_BOOL(v); break;
+        case VAL_NUMBER: memcpy(&bits, &AS_DOUBLE(v), sizeof(bits)); break;
+        case VAL_INT:    bits = (uint64_t)AS_INT(v); break;
+        case VAL_SMALL_STRING: memcpy(&bits, v.as.small, sizeof(bits)); break;
+        case VAL_OBJ:    bits = (uintptr_t)AS_OBJ(v); break; // interned
+        case VAL_UNDEFINED: break;
+    }
+    return bits;
+}
+
+static uint64_t ir_hash(const IrNode *n)
+{
+    uint64_t h = ir_mix(n->op, (uint32_t)n->a);
+    h = ir_mix(h, (uint32_t)n->b);
+    h = ir_mix(h, (uint32_t)n->operand);
+    if (n->op == OP_CONSTANT) {
+        h = ir_mix(h, n->value.type);
+        h = ir_mix(h, ir_constant_bits(n->value));
+    }
+    return h;
+}
+
+static bool ir_same(const IrNode *x, const IrNode *y)
+{
+    if (x->op != y->op || x->a != y->a || x->b != y->b) return false;
+    if (x->operand != y->operand) return false;
+    if (x->op != OP_CONSTANT) return true;
+    return x->value.type == y->value.type &&
+           ir_constant_bits(x->value) == ir_constant_bits(y->value);
+}
+
+static void ir_rehash(void)
+{
+    int cap = BUF_MAX(64, 2 * buf_len(ir.table));
+    buf_free(ir.table);
+    buf_append(ir.table, cap);
+    for (int i = 0; i < cap; ++i) {
+        ir.table[i] = -1;
+    }
+    for (int id = 0; id < buf_len(ir.nodes); ++id) {
+        if (ir.nodes[id].unique) continue;
+        int i = (int)(ir_hash(&ir.nodes[id]) & (uint64_t)(cap - 1));
+        while (ir.table[i] >= 0) {
+            i = (i + 1) & (cap - 1);
+        }
+        ir.table[i] = id;
+    }
+}
+
+// Returns the id of the node equal to n, adding it if it is new.
+static int ir_intern(IrNode n)
+{
+    if (2 * (buf_len(ir.nodes) + 1) > buf_len(ir.table)) {
+        ir_rehash();
+    }
+    int mask = buf_len(ir.table) - 1;
+    for (int i = (int)(ir_hash(&n) & (uint64_t)mask);; i = (i + 1) & mask) {
+        int id = ir.table[i];
+        if (id < 0) {
+            id = buf_len(ir.nodes);
+            buf_push(ir.nodes, n);
+            ir.table[i] = id;
+            return id;
+        }
+        if (ir_same(&ir.nodes[id], &n)) {
+            return id;
+        }
+    }
+}
+
+// Adds operator node n. One that may give an array is never shared: every
+// evaluation of an element-wise operator makes a new array, which can be
+// changed without changing the others.
+static int ir_make_op(IrNode n)
+{
+    if (n.type != TYPE_UNKNOWN) return ir_intern(n);
+    n.unique = true;
+    buf_push(ir.nodes, n);
+    return buf_len(ir.nodes) - 1;
+}
+
+static int ir_make_constant(Value v, int line)
+{
+    return ir_intern((IrNode){
+        .op    = OP_CONSTANT,
+        .pure  = true,
+        .type  = value_type(v),
+        .a     = -1,
+        .b     = -1,
+        .line  = line,
+        .value = v,
+    });
+}
+
+static bool ir_is_number(int id)
+{
+    return ir.nodes[id].type == TYPE_NUMBER;
+}
+
+// Whether node id is the integer constant x. Identities are only applied
+// with integer constants: x * 1.0 would turn an integer x into a double.
+static bool ir_is_int_constant(int id, int64_t x)
+{
+    const IrNode *n = &ir.nodes[id];
+    return n->op == OP_CONSTANT && IS_INT(n->value) && AS_INT(n->value) == x;
+}
+
+// Whether dividing by c gives exactly the same result as multiplying by 1/c.
+// True when c is a power of two whose reciprocal is representable.
+static bool ir_exact_reciprocal(const IrNode *n)
+{
+    if (n->op != OP_CONSTANT || !IS_NUMBER(n->value)) return false;
+    double c = AS_NUMBER(n->value);
+    if (c == 0 || !isfinite(c)) return false;
+    int exp;
+    double r = 1 / c;
+    return fabs(frexp(c, &exp)) == 0.5 && isfinite(r) && r != 0 && r * c == 1;
+}
+
+// Evaluates op at compile time. Returns false if it would be a runtime error.
+static bool ir_fold(byte op, Value a, Value b, Value *out)
+{
+    switch (op) {
+        case OP_NOT: *out = BOOL_VAL(IS_FALSEY(a)); return true;
+        case OP_EQ:  *out = BOOL_VAL(values_equal(a, b)); return true;
+        case OP_NEG:
+        case OP_SQRT:
+        case OP_FLOOR:
+            if (!IS_NUMBER(a)) return false;
+            *out = op == OP_NEG ? number_neg(a) : op == OP_SQRT ? number_sqrt(a) : number_floor(a);
+            return true;
+        default:
+            break;
+    }
+
+    if (!IS_NUMBER(a) || !IS_NUMBER(b)) return false;
+    switch (op) {
+        case OP_GT:  *out = number_gt(a, b); return true;
+        case OP_LT:  *out = number_lt(a, b); return true;
+        case OP_ADD: *out = number_add(a, b); return true;
+        case OP_SUB: *out = number_sub(a, b); return true;
+        case OP_MUL: *out = number_mul(a, b); return true;
+        case OP_DIV: *out = number_div(a, b); return true;
+        case OP_MIN: *out = number_min(a, b); return true;
+        case OP_MAX: *out = number_max(a, b); return true;
+        default:     return false;
+    }
+}
+
+static int ir_make_unary(byte op, int a, int line)
+{
+    const IrNode *na = &ir.nodes[a];
+    Value v;
+    if (na->op == OP_CONSTANT && ir_fold(op, na->value, NIL_VAL, &v)) {
+        return ir_make_constant(v, line);
+    }
+
+    // !!x, but only where the inner operator can't convert. --x is kept since
+    // negating the smallest integer overflows into a double.
+    if (na->op == op && op == OP_NOT && ir.nodes[na->a].type == TYPE_BOOL) return na->a;
+
+    bool checked = op != OP_NOT;
+    return ir_make_op((IrNode){
+        .op   = op,
+        .pure = na->pure && (!checked || na->type == TYPE_NUMBER),
+        .type = op_result_type(op, na->type, na->type),
+        .a    = a,
+        .b    = -1,
+        .line = line,
+    });
+}
+
+static int ir_make_binary(byte op, int a, int b, int line)
+{
+    const IrNode *na = &ir.nodes[a];
+    const IrNode *nb = &ir.nodes[b];
+    Value v;
+    if (na->op == OP_CONSTANT && nb->op == OP_CONSTANT &&
+            ir_fold(op, na->value, nb->value, &v)) {
+        return ir_make_constant(v, line);
+    }
+
+    // Identities that hold for every integer and every double, including -0,
+    // inf and NaN. The kept operand must be a number or the dropped operator's
+    // error would be lost. x + 0 is not one of them since -0 + 0 is 0, and
+    // x / 1 is not since it turns an integer into a double.
+    bool a_num = ir_is_number(a);
+    bool b_num = ir_is_number(b);
+    switch (op) {
+        case OP_SUB:
+            if (a_num && ir_is_int_constant(b, 0)) return a;
+            break;
+        case OP_MUL:
+            if (a_num && ir_is_int_constant(b, 1)) return a;
+            if (b_num && ir_is_int_constant(a, 1)) return b;
+            if (a_num && ir_is_int_constant(b, 2)) return ir_make_binary(OP_ADD, a, a, line);
+            if (b_num && ir_is_int_constant(a, 2)) return ir_make_binary(OP_ADD, b, b, line);
+            break;
+        case OP_DIV:
+            if (a_num && ir_exact_reciprocal(nb)) {
+                int r = ir_make_constant(NUMBER_VAL(1 / AS_NUMBER(nb->value)), line);
+                return ir_make_binary(OP_MUL, a, r, line);
+            }
+            break;
+        default:
+            break;
+    }
+
+    return ir_make_op((IrNode){
+        .op   = op,
+        .pure = na->pure && nb->pure && (op == OP_EQ || (a_num && b_num)),
+        .type = op_result_type(op, na->type, nb->type),
+        .a    = a,
+        .b    = b,
+        .line = line,
+    });
+}
+
+static void ir_lower_write(IrLower *l, const byte *bytes, int count, int line)
+{
+    if (l->chunk) {
+        chunk_write(l->chunk, bytes, count, line);
+    }
+}
+
+// Emits a reference to a held node: a copy while other users remain, the value
+// itself (moved to the top) for the last one.
+static void ir_lower_ref(IrLower *l, int id, int line)
+{
+    int top = buf_len(l->sim) - 1;
+    int pos = top;
+    while (pos >= 0 && top - pos <= 0xFF && l->sim[pos] != id) {
+        --pos;
+    }
+    if (pos < 0 || top - pos > 0xFF) {
+        // Out of reach for a byte operand
+        l->overflow = true;
+        return;
+    }
+    int depth = top - pos;
+
+    if (--l->uses[id] > 0) {
+        if (depth == 0) {
+            ir_lower_write(l, (byte[]){ OP_DUP }, 1, line);
+        } else {
+            ir_lower_write(l, (byte[]){ OP_PICK, (byte)depth }, 2, line);
+        }
+    } else if (depth > 0) {
+        ir_lower_write(l, (byte[]){ OP_ROLL, (byte)depth }, 2, line);
+        memmove(&l->sim[pos], &l->sim[pos + 1], depth * sizeof(*l->sim));
+        buf_pop(l->sim);
+    } else {
+        buf_pop(l->sim);
+    }
+    buf_push(l->sim, -1);
+}
+
+// Pushes the value of node root. Iterative so deep expressions don't recurse.
+static void ir_lower_node(IrLower *l, int root)
+{
+    buf_clear(l->work);
+    buf_push(l->work, ((IrWork){ root, false }));
+    while (!buf_empty(l->work) && !l->overflow) {
+        IrWork w = *buf_pop(l->work);
+        const IrNode *n = &ir.nodes[w.id];
+
+        if (w.expanded) {
+            if (n->a == n->b) {
+                ir_lower_write(l, (byte[]){ OP_DUP }, 1, n->line);
+                buf_push(l->sim, -1);
+            }
+            StaticType b = n->b >= 0 ? ir.nodes[n->b].type : TYPE_UNKNOWN;
+            byte op = op_unchecked(n->op, ir.nodes[n->a].type, b);
+            ir_lower_write(l, &op, 1, n->line);
+            buf_take(l->sim, buf_len(l->sim) - (n->b >= 0 ? 2 : 1));
+            buf_push(l->sim, -1);
+            continue;
+        }
+
+        if (l->held[w.id]) {
+            ir_lower_ref(l, w.id, n->line);
+            continue;
+        }
+
+        if (n->a < 0 && n->op != OP_CONSTANT) {
+            byte bytes[] = { n->op, (byte)n->operand, (byte)(n->operand >> 8) };
+            ir_lower_write(l, bytes, InstrSize[n->op], n->line);
+            buf_push(l->sim, -1);
+            continue;
+        }
+
+        if (n->op == OP_CONSTANT) {
+            Value v = n->value;
+            if (IS_NIL(v) || IS_BOOL(v)) {
+                byte op = IS_NIL(v) ? OP_NIL : AS_BOOL(v) ? OP_TRUE : OP_FALSE;
+                ir_lower_write(l, &op, 1, n->line);
+            } else if (l->chunk) {
+                chunk_write_constant(l->chunk, v, n->line);
+            }
+            buf_push(l->sim, -1);
+            continue;
+        }
+
+        buf_push(l->work, ((IrWork){ w.id, true }));
+        if (n->b >= 0 && n->b != n->a) {
+            buf_push(l->work, ((IrWork){ n->b, false }));
+        }
+        buf_push(l->work, ((IrWork){ n->a, false }));
+    }
+}
+
+static void ir_lower(IrLower *l)
+{
+    int count = buf_len(ir.nodes);
+    buf_clear(l->uses);
+    buf_clear(l->held);
+    buf_clear(l->sim);
+    memset(buf_append(l->uses, count), 0, count * sizeof(*l->uses));
+    memset(buf_append(l->held, count), 0, count * sizeof(*l->held));
+    l->overflow = false;
+
+    // Count references. Users come after their operands, so one backwards
+    // sweep visits every reachable node after all of its users.
+    for (int i = 0; i < buf_len(ir.stack); ++i) {
+        l->uses[ir.stack[i]]++;
+    }
+    for (int id = count - 1; id >= 0; --id) {
+        const IrNode *n = &ir.nodes[id];
+        if (l->uses[id] == 0) continue;
+        if (n->a >= 0) l->uses[n->a]++;
+        if (n->b >= 0 && n->b != n->a) l->uses[n->b]++;
+    }
+
+    // Evaluate shared nodes first, in dependency order, and leave them on the
+    // stack below the roots until their last use. Ids follow source order, so
+    // nodes that may fail and come before a shared one that may fail are
+    // evaluated first too, keeping the first runtime error the same.
+    int last_impure = -1;
+    for (int id = 0; id < count; ++id) {
+        if (l->uses[id] > 1 && !ir.nodes[id].pure) last_impure = id;
+    }
+    for (int id = 0; l->share && id < count; ++id) {
+        const IrNode *n = &ir.nodes[id];
+        bool shared = l->uses[id] > 1 && n->op != OP_CONSTANT;
+        bool ordered = l->uses[id] > 0 && !n->pure && id < last_impure;
+        if (shared || ordered) {
+            ir_lower_node(l, id);
+            *buf_last(l->sim) = id;
+            l->held[id] = true;
+        }
+    }
+
+    for (int i = 0; i < buf_len(ir.stack) && !l->overflow; ++i) {
+        ir_lower_node(l, ir.stack[i]);
+    }
+}
+
+// Writes the symbolic stack to chunk c and empties the IR.
+static void ir_flush(Chunk *c)
+{
+    if (ir_empty()) return;
+
+    // Operands of OP_PICK and OP_ROLL are a byte. Recompute shared nodes
+    // instead if holding them would need deeper references.
+    IrLower l = { .share = true };
+    ir_lower(&l);
+    l.share = !l.overflow;
+    l.chunk = c;
+    ir_lower(&l);
+
+    buf_free(l.uses);
+    buf_free(l.held);
+    buf_free(l.sim);
+    buf_free(l.work);
+    ir_reset();
+}
+
+static void ir_constant(Value v, int line)
+{
+    buf_push(ir.stack, ir_make_constant(v, line));
+}
+
+// Adds a load of a global or local slot, OP_GET_GLOBAL or OP_GET_LOCAL.
+// Anything that could change the loaded value flushes the IR first, so equal
+// loads can be shared. Only globals can be undefined.
+static void ir_load(byte op, int operand, int line)
+{
+    buf_push(ir.stack, ir_intern((IrNode){
+        .op      = op,
+        .pure    = op == OP_GET_LOCAL,
+        .type    = TYPE_UNKNOWN,
+        .a       = -1,
+        .b       = -1,
+        .line    = line,
+        .operand = operand,
+    }));
+}
+
+// Discards the value on top of the stack: dropped from the IR if computing it
+// can't fail, otherwise computed and popped.
+static void ir_pop(Chunk *c, int line)
+{
+    if (!ir_empty() && ir.nodes[*buf_last(ir.stack)].pure) {
+        buf_pop(ir.stack);
+        return;
+    }
+    ir_flush(c);
+    chunk_write(c, (byte[]){ OP_POP }, 1, line);
+}
+
+// Adds unary or binary operator op. If an operand was already written to the
+// chunk the IR is flushed and op is written as is.
+static void ir_op(Chunk *c, byte op, int line)
+{
+    int arity = op_arity(op);
+    if (buf_len(ir.stack) < arity) {
+        ir_flush(c);
+        chunk_write(c, &op, 1, line);
+        return;
+    }
+
+    int b = *buf_pop(ir.stack);
+    int id = arity == 1 ? ir_make_unary(op, b, line)
+                        : ir_make_binary(op, *buf_pop(ir.stack), b, line);
+    buf_push(ir.stack, id);
+}
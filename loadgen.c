@@ -0,0 +1,208 @@
+// Load generator for the evaluation daemon (xol --serve).
+//
+//     make loadgen
+//     ./xol-loadgen [--connections N] [--requests N] [--pipeline N] [--expr source] path.sock
+//
+// Each connection runs on its own thread and keeps up to --pipeline requests
+// in flight, sending a new one as each response arrives. Latency is measured
+// from writing a request to reading its response. Results are printed as JSON
+// like xol-bench.
+
+#include "common.h"
+
+#include <errno.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include "buf.h"
+#include "clock.c"
+
+typedef struct {
+    const char *path;
+    const char *expr;
+    int         requests; // per connection
+    int         pipeline;
+    uint64_t   *latencies; // ns, one per response
+    int64_t     errors;    // responses with a non-zero status
+    bool        failed;
+} LoadConn;
+
+static bool load_write_all(int fd, const char *p, size_t len)
+{
+    while (len > 0) {
+        ssize_t n = send(fd, p, len, MSG_NOSIGNAL);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            return false;
+        }
+        p += n;
+        len -= n;
+    }
+    return true;
+}
+
+static void *load_run(void *arg)
+{
+    LoadConn *lc = arg;
+    struct sockaddr_un addr = { .sun_family = AF_UNIX };
+    strncpy(addr.sun_path, lc->path, sizeof(addr.sun_path) - 1);
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0 || connect(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+        fprintf(stderr, "Could not connect to \"%s\": %s\n", lc->path, strerror(errno));
+        lc->failed = true;
+        if (fd >= 0) close(fd);
+        return NULL;
+    }
+
+    uint32_t len = (uint32_t)strlen(lc->expr);
+    char *frame = NULL;
+    char *p = buf_append(frame, 4 + (int)len);
+    for (int i = 0; i < 4; ++i) {
+        p[i] = (char)(len >> (8 * i));
+    }
+    memcpy(p + 4, lc->expr, len);
+
+    // Send times of the requests in flight, indexed by request number
+    uint64_t *sent = calloc(lc->requests, sizeof(uint64_t));
+    lc->latencies = calloc(lc->requests, sizeof(uint64_t));
+    char *in = NULL;
+    int next = 0;     // next request to send
+    int received = 0;
+
+    while (received < lc->requests) {
+        // Top up the pipeline with as many requests as one write can carry
+        char *out = NULL;
+        uint64_t now = clock_ns();
+        while (next < lc->requests && next - received < lc->pipeline) {
+            memcpy(buf_append(out, buf_len(frame)), frame, buf_len(frame));
+            sent[next++] = now;
+        }
+        bool ok = buf_empty(out) || load_write_all(fd, out, buf_len(out));
+        buf_free(out);
+
+        int have = buf_len(in);
+        buf_append(in, 64 << 10);
+        ssize_t n = ok ? read(fd, in + have, 64 << 10) : -1;
+        if (n <= 0) {
+            if (n < 0 && errno == EINTR) {
+                buf_take(in, have);
+                continue;
+            }
+            fprintf(stderr, "Connection closed after %d responses\n", received);
+            lc->failed = true;
+            break;
+        }
+        now = clock_ns();
+        buf_take(in, have + (int)n);
+
+        int pos = 0;
+        int end = buf_len(in);
+        while (end - pos >= 4) {
+            const byte *b = (const byte *)in + pos;
+            uint32_t size = b[0] | b[1] << 8 | b[2] << 16 | (uint32_t)b[3] << 24;
+            if ((uint32_t)(end - pos - 4) < size) break;
+            if (size == 0 || b[4] != 0) ++lc->errors;
+            lc->latencies[received] = now - sent[received];
+            ++received;
+            pos += 4 + (int)size;
+        }
+        memmove(in, in + pos, end - pos);
+        buf_take(in, end - pos);
+    }
+    lc->requests = received;
+
+    buf_free(in);
+    buf_free(frame);
+    free(sent);
+    close(fd);
+    return NULL;
+}
+
+static int compare_u64(const void *a, const void *b)
+{
+    uint64_t x = *(const uint64_t *)a;
+    uint64_t y = *(const uint64_t *)b;
+    return (x > y) - (x < y);
+}
+
+static uint64_t percentile(const uint64_t *sorted, int n, double p)
+{
+    if (n == 0) return 0;
+    int i = (int)(p * (n - 1) + 0.5);
+    return sorted[i];
+}
+
+int main(int argc, const char *argv[])
+{
+    int connections = 1;
+    int requests = 100000;
+    int pipeline = 16;
+    const char *expr = "(1 + 2) * 3 - 4 / 5";
+    const char *path = NULL;
+    for (int i = 1; i < argc; ++i) {
+        if (strcmp(argv[i], "--connections") == 0 && i + 1 < argc) {
+            connections = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--requests") == 0 && i + 1 < argc) {
+            requests = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--pipeline") == 0 && i + 1 < argc) {
+            pipeline = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--expr") == 0 && i + 1 < argc) {
+            expr = argv[++i];
+        } else if (argv[i][0] != '-' && !path) {
+            path = argv[i];
+        } else {
+            path = NULL;
+            break;
+        }
+    }
+    if (!path || connections < 1 || requests < 1 || pipeline < 1) {
+        fputs("Usage: xol-loadgen [--connections N] [--requests N] [--pipeline N] "
+              "[--expr source] path.sock\n", stderr);
+        return ERR_USAGE;
+    }
+
+    LoadConn *conns = calloc(connections, sizeof(LoadConn));
+    pthread_t *threads = calloc(connections, sizeof(pthread_t));
+    uint64_t start = clock_ns();
+    for (int i = 0; i < connections; ++i) {
+        conns[i] = (LoadConn){ path, expr, requests, pipeline, NULL, 0, false };
+        pthread_create(&threads[i], NULL, load_run, &conns[i]);
+    }
+    for (int i = 0; i < connections; ++i) {
+        pthread_join(threads[i], NULL);
+    }
+    uint64_t elapsed = clock_ns() - start;
+
+    uint64_t *all = NULL;
+    int64_t errors = 0;
+    bool failed = false;
+    for (int i = 0; i < connections; ++i) {
+        LoadConn *lc = &conns[i];
+        if (lc->latencies) {
+            memcpy(buf_append(all, lc->requests), lc->latencies, lc->requests * sizeof(uint64_t));
+        }
+        errors += lc->errors;
+        failed |= lc->failed;
+        free(lc->latencies);
+    }
+    int n = buf_len(all);
+    if (n > 0) qsort(all, n, sizeof(*all), compare_u64);
+
+    printf("{\n");
+    printf("  \"connections\": %d,\n", connections);
+    printf("  \"pipeline\": %d,\n", pipeline);
+    printf("  \"responses\": %d,\n", n);
+    printf("  \"errors\": %lld,\n", (long long)errors);
+    printf("  \"requests_per_sec\": %.0f,\n", n / (elapsed / 1e9));
+    printf("  \"p50_ns\": %llu,\n", (unsigned long long)percentile(all, n, 0.50));
+    printf("  \"p99_ns\": %llu,\n", (unsigned long long)percentile(all, n, 0.99));
+    printf("  \"max_ns\": %llu\n", (unsigned long long)(n ? all[n - 1] : 0));
+    printf("}\n");
+
+    buf_free(all);
+    free(threads);
+    free(conns);
+    return failed ? ERR_RUNTIME : 0;
+}
@@ -1,51 +1,190 @@
 #include "common.h"
 #include "buf.h"
+#include "batch.c"
+#include "edit.c"
+#include "file.c"
+#include "filter.c"
+#include "output.c"
+#include "sched.c"
+#include "serve.c"
 #include "vm.c"
 
-static size_t fsize(FILE *stream)
+typedef struct {
+    const char  **paths;  // stretchy buffer
+    int           jobs;   // 0 unless batch mode was requested
+    uint64_t      slice;  // batch scripts take turns of this many instructions
+    const char   *socket; // serve requests on this path, see serve.c
+    const char   *edits;  // edits to apply to the script, see replay_edits
+    const char   *expr;   // evaluate for every record on stdin, see filter.c
+    char          delim;  // ends records read and written by -e
+    const char   *profile;    // folded call stacks are written here, see profile.c
+    int           profile_hz; // samples per second of CPU time
+    ReportFlags   report; // instrumentation printed to stderr
+    bool          self_test;  // run the unit tests instead, see self_test
+} Options;
+
+static void usage(void)
 {
-    fseek(stream, 0L, SEEK_END);
-    long size = ftell(stream);
-    rewind(stream);
-    return size;
+    fputs("Usage: xol [options] [path]\n"
+          "       xol [options] [--jobs N] [--slice N] [--manifest file] path...\n"
+          "       xol [options] --serve socket\n"
+          "       xol [options] --edits file path\n"
+          "       xol [options] [-0] -e expression\n"
+          "       xol --self-test\n"
+          "\n"
+          "Options:\n"
+          "  --time           report time and throughput per phase\n"
+          "  --mem            report buffer and heap object allocations\n"
+          "  --cache N        keep up to N compiled scripts per VM (default 256, 0 disables)\n"
+          "  --cache-stats    report compiled script cache hits, misses and evictions\n"
+          "  --loops          report the loops that ran hot, with their backward branches\n"
+          "  --fields         report field cache hits and misses\n"
+          "  --iterative      parse expressions without recursion\n"
+          "  --max-depth N    limit expression nesting to N levels\n"
+          "  --profile file   sample the running script, write a line histogram to stderr\n"
+          "                   and folded call stacks for flame graphs to file\n"
+          "  --profile-hz N   take N samples per second of CPU time (default 1000)\n"
+          "  -O               optimize expressions (folding, shared subexpressions)\n", stderr);
+    exit(ERR_USAGE);
 }
 
-static int read_file(char *restrict buf, const char *restrict path)
+// Appends each non-blank line of the manifest file to paths. The manifest
+// buffer is kept alive for the lifetime of the process.
+static void read_manifest(Options *opts, const char *path)
 {
-    FILE *file = fopen(path, "rb");
-    if (!file) {
-        fprintf(stderr, "Could not open file \"%s\".\n", path);
-        exit(ERR_FILE);
+    char *manifest = read_file(path);
+    if (!manifest) exit(ERR_FILE);
+
+    for (char *line = manifest; *line;) {
+        char *end = line + strcspn(line, "\r\n");
+        char *next = *end ? end + 1 : end;
+        *end = '\0';
+        if (line[strspn(line, " \t")] != '\0') {
+            buf_push(opts->paths, line);
+        }
+        line = next;
     }
+}
 
-    size_t sz = fsize(file);
-    buf_reserve(buf, (int)(sz + 1)); // extra byte for NUL
-    size_t bytes_read = fread(buf, sizeof(char), sz, file);
-    if (bytes_read < sz) {
-        fprintf(stderr, "Could not read file \"%s\".\n", path);
-        fclose(file);
-        exit(ERR_FILE);
+static Options parse_args(int argc, const char *argv[])
+{
+    Options opts = { .delim = '\n', .profile_hz = PROFILE_HZ };
+    for (int i = 1; i < argc; ++i) {
+        const char *arg = argv[i];
+        if (strcmp(arg, "--jobs") == 0 || strcmp(arg, "-j") == 0) {
+            if (++i == argc) usage();
+            opts.jobs = atoi(argv[i]);
+            if (opts.jobs < 1) usage();
+        } else if (strcmp(arg, "--manifest") == 0) {
+            if (++i == argc) usage();
+            read_manifest(&opts, argv[i]);
+            if (!opts.jobs) opts.jobs = batch_default_jobs();
+        } else if (strcmp(arg, "--slice") == 0) {
+            if (++i == argc) usage();
+            long long slice = atoll(argv[i]);
+            if (slice < 1) usage();
+            opts.slice = (uint64_t)slice;
+            if (!opts.jobs) opts.jobs = batch_default_jobs();
+        } else if (strcmp(arg, "--serve") == 0) {
+            if (++i == argc) usage();
+            opts.socket = argv[i];
+        } else if (strcmp(arg, "--edits") == 0) {
+            if (++i == argc) usage();
+            opts.edits = argv[i];
+        } else if (strcmp(arg, "-e") == 0) {
+            if (++i == argc) usage();
+            opts.expr = argv[i];
+        } else if (strcmp(arg, "-0") == 0) {
+            opts.delim = '\0';
+        } else if (strcmp(arg, "--time") == 0) {
+            opts.report |= REPORT_TIME;
+        } else if (strcmp(arg, "--mem") == 0) {
+            opts.report |= REPORT_MEM;
+        } else if (strcmp(arg, "--cache") == 0) {
+            if (++i == argc) usage();
+            cache_capacity = atoi(argv[i]);
+            if (cache_capacity < 0) usage();
+        } else if (strcmp(arg, "--cache-stats") == 0) {
+            opts.report |= REPORT_CACHE;
+        } else if (strcmp(arg, "--loops") == 0) {
+            opts.report |= REPORT_LOOPS;
+        } else if (strcmp(arg, "--fields") == 0) {
+            opts.report |= REPORT_FIELDS;
+        } else if (strcmp(arg, "--iterative") == 0) {
+            compiler_options.iterative = true;
+        } else if (strcmp(arg, "--max-depth") == 0) {
+            if (++i == argc) usage();
+            compiler_options.max_depth = atoi(argv[i]);
+            if (compiler_options.max_depth < 1) usage();
+        } else if (strcmp(arg, "--profile") == 0) {
+            if (++i == argc) usage();
+            opts.profile = argv[i];
+        } else if (strcmp(arg, "--profile-hz") == 0) {
+            if (++i == argc) usage();
+            opts.profile_hz = atoi(argv[i]);
+            if (opts.profile_hz < 1) usage();
+        } else if (strcmp(arg, "--self-test") == 0) {
+            opts.self_test = true;
+        } else if (strcmp(arg, "-O") == 0) {
+            compiler_options.optimize = true;
+        } else if (arg[0] == '-' && arg[1] != '\0') {
+            usage();
+        } else {
+            buf_push(opts.paths, arg);
+        }
     }
-    buf[bytes_read] = '\0';
+    if (buf_len(opts.paths) > 1 && !opts.jobs) {
+        opts.jobs = batch_default_jobs();
+    }
+    return opts;
+}
+
+// Profiler of the VM run by main with --profile, reported at exit so that a
+// script that fails is profiled too
+static Profiler *profile;
+static FILE *profile_out;
 
-    fclose(file);
-    return (int)bytes_read;
+static void report_profile(void)
+{
+    profile_stop();
+    profile_print(stderr, profile);
+    profile_write_folded(profile_out, profile);
+    fclose(profile_out);
+    profile_free(profile);
+    free(profile);
 }
 
-static void eval_file(VM *vm, const char *path)
+static void eval_file(VM *vm, Output *out, const char *path, ReportFlags report)
 {
-    char *source = NULL;
-    buf_reserve(source, 16384);
-    read_file(source, path);
-    VMInterpretResult result = vm_interpret(vm, source).result;
+    Stats stats = { 0 };
+    vm->stats = report ? &stats : NULL;
+    if (report & REPORT_MEM) stats_mem_begin();
+
+    uint64_t start = clock_ns();
+    char *source = read_file(path);
+    if (!source) exit(ERR_FILE);
+    stats.ns[PHASE_READ] = clock_ns() - start;
 
-    if (result == INTERPRET_COMPILE_ERROR) exit(ERR_COMPILE);
-    if (result == INTERPRET_RUNTIME_ERROR) exit(ERR_RUNTIME);
+    VMResult result = vm_interpret(vm, source);
+    buf_free(source);
+
+    if (report & REPORT_MEM) stats_mem_end(&stats);
+    stats_print(stderr, &stats, report);
+    if (report & REPORT_CACHE) cache_print_stats(stderr, &vm->cache.stats);
+    if (report & REPORT_LOOPS) vm_print_hot_loops(stderr, vm);
+    if (report & REPORT_FIELDS) vm_print_field_caches(stderr, vm);
+
+    if (result.result == INTERPRET_COMPILE_ERROR) exit(ERR_COMPILE);
+    if (result.result == INTERPRET_RUNTIME_ERROR) exit(ERR_RUNTIME);
+
+    out_char(out, '\n'); out_value(out, result.value); out_char(out, '\n');
 }
 
-static void repl(VM *vm)
+static void repl(VM *vm, Output *out, ReportFlags report)
 {
     char line[1024];
+    Stats stats;
+    vm->stats = report ? &stats : NULL;
     for (;;) {
         fputs(ANSI_BOLD "xol> " ANSI_RESET, stdout);
         if (!fgets(line, sizeof(line), stdin)) {
@@ -53,25 +192,155 @@ static void repl(VM *vm)
             break;
         }
 
-        vm_interpret(vm, line);
+        stats = (Stats){ 0 };
+        if (report & REPORT_MEM) stats_mem_begin();
+        VMResult result = vm_interpret(vm, line);
+        if (report & REPORT_MEM) stats_mem_end(&stats);
+
+        if (result.result == INTERPRET_OK) {
+            out_char(out, '\n'); out_value(out, result.value); out_char(out, '\n');
+            out_flush(out);
+        }
+        stats_print(stderr, &stats, report);
+        if (report & REPORT_CACHE) cache_print_stats(stderr, &vm->cache.stats);
+        if (report & REPORT_LOOPS) vm_print_hot_loops(stderr, vm);
+        if (report & REPORT_FIELDS) vm_print_field_caches(stderr, vm);
     }
 }
 
-int main(int argc, const char *argv[])
+// Compiles the script at path, then applies each line of the edits file to it
+// the way an editor would and recompiles incrementally, see edit.c. A line is
+// "offset removed text": removed bytes at offset are replaced by the rest of
+// the line, in which \n and \\ stand for a newline and a backslash. With
+// --time the cost of every edit is reported. Runs the final script.
+static void replay_edits(VM *vm, Output *out, const char *path, const char *edits, ReportFlags report)
 {
+    char *source = read_file(path);
+    char *lines = source ? read_file(edits) : NULL;
+    if (!lines) exit(ERR_FILE);
+
+    EditBuffer e;
+    edit_init(&e, &vm->heap, &vm->global_names);
+    compile_errors = vm->errors;
+    edit_apply(&e, 0, 0, source, buf_len(source));
+    if (report & REPORT_TIME) edit_print_stats(stderr, &e.stats);
+
+    char *text = NULL;
+    int number = 0;
+    for (char *line = lines; *line;) {
+        char *end = line + strcspn(line, "\n");
+        char *next = *end ? end + 1 : end;
+        *end = '\0';
+        ++number;
+
+        int offset, removed, n = 0;
+        if (sscanf(line, "%d %d%n", &offset, &removed, &n) != 2 || offset < 0 || removed < 0 ||
+                offset + removed > edit_length(&e)) {
+            fprintf(stderr, "Invalid edit on line %d of \"%s\".\n", number, edits);
+            exit(ERR_USAGE);
+        }
+        buf_take(text, 0);
+        for (const char *p = line + n + (line[n] == ' '); *p; ++p) {
+            char c = *p;
+            if (c == '\\' && (p[1] == 'n' || p[1] == '\\')) {
+                c = *++p == 'n' ? '\n' : '\\';
+            }
+            buf_push(text, c);
+        }
+        edit_apply(&e, offset, removed, text, buf_len(text));
+        if (report & REPORT_TIME) edit_print_stats(stderr, &e.stats);
+        line = next;
+    }
+    buf_free(text);
+    buf_free(lines);
+    buf_free(source);
+
+    if (!e.ok) exit(ERR_COMPILE);
+    VMResult result = vm_execute(vm, &e.chunk);
+    edit_free(&e);
+    if (result.result == INTERPRET_COMPILE_ERROR) exit(ERR_COMPILE);
+    if (result.result == INTERPRET_RUNTIME_ERROR) exit(ERR_RUNTIME);
+
+    out_char(out, '\n'); out_value(out, result.value); out_char(out, '\n');
+}
+
+// Runs the unit tests of every module, which release builds leave out
+static int self_test(void)
+{
+#ifndef NDEBUG
     buf_test();
+    number_test();
+    array_test();
+    shape_test();
+    compiler_test();
+    verify_test();
     vm_test();
+    edit_test();
+    sched_test();
+    filter_test();
+    return 0;
+#else
+    fputs("Self-tests are not compiled into release builds.\n", stderr);
+    return ERR_USAGE;
+#endif
+}
+
+int main(int argc, const char *argv[])
+{
+    Options opts = parse_args(argc, argv);
+    if (opts.self_test) return self_test();
+    Output out = { .fd = STDOUT_FILENO };
+    if (opts.socket) {
+        if (!buf_empty(opts.paths) || opts.profile) usage();
+        return serve(opts.socket, opts.report);
+    }
+    if (opts.jobs) {
+        if (buf_empty(opts.paths) || opts.profile) usage();
+        int status = batch_eval(&out, opts.paths, buf_len(opts.paths), opts.jobs, opts.slice,
+            opts.report);
+        out_close(&out);
+        buf_free(opts.paths);
+        return status;
+    }
 
     VM *vm = calloc(1, sizeof(VM));
     vm_init(vm);
+    if (opts.profile) {
+        profile_out = fopen(opts.profile, "w");
+        if (!profile_out) {
+            fprintf(stderr, "Could not open file \"%s\".\n", opts.profile);
+            exit(ERR_FILE);
+        }
+        profile = calloc(1, sizeof(Profiler));
+        vm->profile = profile;
+        if (!profile_start(opts.profile_hz)) {
+            fputs("Could not start the profiler.\n", stderr);
+            exit(ERR_USAGE);
+        }
+        atexit(report_profile);
+    }
 
-    switch (argc) {
-        case 1:  { repl(vm); break; }
-        case 2:  { eval_file(vm, argv[1]); break; }
-        default: { fputs("Usage: xol [path]\n", stderr); exit(ERR_USAGE); }
+    int status = 0;
+    switch (buf_len(opts.paths)) {
+        case 0: {
+            if (opts.edits) usage();
+            if (opts.expr) status = filter_eval(vm, &out, STDIN_FILENO, opts.expr, opts.delim, opts.report);
+            else repl(vm, &out, opts.report);
+            break;
+        }
+        case 1: {
+            if (opts.expr) usage();
+            if (opts.edits) replay_edits(vm, &out, opts.paths[0], opts.edits, opts.report);
+            else eval_file(vm, &out, opts.paths[0], opts.report);
+            break;
+        }
+        default: { usage(); }
     }
 
+    out_close(&out);
     vm_free(vm);
+    free(vm);
+    buf_free(opts.paths);
 
-    return 0;
+    return status;
 }
@@ -0,0 +1,158 @@
+#pragma once
+
+#include "common.h"
+#include "array.c"
+#include "clock.c"
+#include "value.c"
+
+// Registry of the functions scripts can call on the host. The compiler
+// resolves a call by name to an index into natives and emits OP_CALL_NATIVE,
+// which runs the function on the arguments where they are on the VM stack.
+// Calls to the math intrinsics with as many arguments as their instruction
+// takes are emitted as that instruction instead, and folded by -O. min and
+// max of a single array reduce it, like sum.
+
+#define NATIVES_MAX 256
+
+static const char *native_numbers(const Value *args, int argc)
+{
+    for (int i = 0; i < argc; ++i) {
+        if (!IS_NUMBER(args[i])) return argc == 1 ? "Operand must be a number." : "Operands must be numbers.";
+    }
+    return NULL;
+}
+
+static const char *native_sqrt(Heap *heap, const Value *args, int argc, Value *result)
+{
+    (void)heap;
+    const char *error = native_numbers(args, argc);
+    if (!error) *result = number_sqrt(args[0]);
+    return error;
+}
+
+static const char *native_floor(Heap *heap, const Value *args, int argc, Value *result)
+{
+    (void)heap;
+    const char *error = native_numbers(args, argc);
+    if (!error) *result = number_floor(args[0]);
+    return error;
+}
+
+// The array a reduction was called with
+static const char *native_array(const Value *args, int argc, bool nonempty)
+{
+    if (argc != 1 || !IS_ARRAY(args[0])) return "Operand must be an array.";
+    if (nonempty && AS_ARRAY(args[0])->length == 0) return "Array must not be empty.";
+    return NULL;
+}
+
+static const char *native_min(Heap *heap, const Value *args, int argc, Value *result)
+{
+    (void)heap;
+    if (argc == 1 && IS_ARRAY(args[0])) {
+        const char *error = native_array(args, argc, true);
+        if (!error) *result = NUMBER_VAL(array_extreme(AS_ARRAY(args[0]), false));
+        return error;
+    }
+    const char *error = native_numbers(args, argc);
+    if (error) return error;
+    Value v = args[0];
+    for (int i = 1; i < argc; ++i) {
+        v = number_min(v, args[i]);
+    }
+    *result = v;
+    return NULL;
+}
+
+static const char *native_max(Heap *heap, const Value *args, int argc, Value *result)
+{
+    (void)heap;
+    if (argc == 1 && IS_ARRAY(args[0])) {
+        const char *error = native_array(args, argc, true);
+        if (!error) *result = NUMBER_VAL(array_extreme(AS_ARRAY(args[0]), true));
+        return error;
+    }
+    const char *error = native_numbers(args, argc);
+    if (error) return error;
+    Value v = args[0];
+    for (int i = 1; i < argc; ++i) {
+        v = number_max(v, args[i]);
+    }
+    *result = v;
+    return NULL;
+}
+
+static const char *native_sum(Heap *heap, const Value *args, int argc, Value *result)
+{
+    (void)heap;
+    const char *error = native_array(args, argc, false);
+    if (!error) *result = NUMBER_VAL(array_sum(AS_ARRAY(args[0])));
+    return error;
+}
+
+static const char *native_len(Heap *heap, const Value *args, int argc, Value *result)
+{
+    (void)heap;
+    const char *error = native_array(args, argc, false);
+    if (!error) *result = INT_VAL(AS_ARRAY(args[0])->length);
+    return error;
+}
+
+// Array of n zeros
+static const char *native_array_new(Heap *heap, const Value *args, int argc, Value *result)
+{
+    const char *error = native_numbers(args, argc);
+    if (error) return error;
+    double n = AS_NUMBER(args[0]);
+    if (n != floor(n) || n < 0 || n > ARRAY_MAX) return "Array length out of range.";
+    if (heap->limit && array_object_size((int)n) > heap->limit) return "Heap limit exceeded.";
+    *result = OBJ_VAL(array_new(heap, (int)n));
+    return NULL;
+}
+
+// Seconds on the monotonic clock
+static const char *native_clock(Heap *heap, const Value *args, int argc, Value *result)
+{
+    (void)heap, (void)args, (void)argc;
+    *result = NUMBER_VAL((double)clock_ns() / 1e9);
+    return NULL;
+}
+
+// Written by native_define at startup only, read by every compiling and
+// running thread
+static Native natives[NATIVES_MAX] = {
+    { "sqrt",  native_sqrt,  1,  OP_SQRT,  TYPE_NUMBER },
+    { "floor", native_floor, 1,  OP_FLOOR, TYPE_NUMBER },
+    { "min",   native_min,   -1, OP_MIN,   TYPE_NUMBER },
+    { "max",   native_max,   -1, OP_MAX,   TYPE_NUMBER },
+    { "clock", native_clock, 0,  -1,       TYPE_NUMBER },
+    { "sum",   native_sum,   1,  -1,       TYPE_NUMBER },
+    { "len",   native_len,   1,  -1,       TYPE_NUMBER },
+    { "array", native_array_new, 1, -1,    TYPE_UNKNOWN },
+};
+static int native_count = 8;
+
+// Returns the index of the native called name, or -1
+static int native_find(const char *name, int length)
+{
+    for (int i = 0; i < native_count; ++i) {
+        if ((int)strlen(natives[i].name) == length && memcmp(natives[i].name, name, length) == 0) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+// Registers a host callback taking arity arguments, -1 for one or more, or
+// replaces the one of the same name. Must be called before any script is
+// compiled. Returns its index, or -1 if the registry is full.
+MAYBE_UNUSED static int native_define(const char *name, int arity, NativeFn fn, StaticType result)
+{
+    int i = native_find(name, (int)strlen(name));
+    if (i < 0) {
+        if (native_count == NATIVES_MAX) return -1;
+        i = native_count++;
+    }
+    natives[i] = (Native){ name, fn, arity, -1, result };
+    return i;
+}
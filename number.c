@@ -0,0 +1,299 @@
+#pragma once
+
+#include <assert.h>
+#include <math.h>
+
+#include "common.h"
+
+// Shortest round-trip formatting of doubles with Grisu2 (Florian Loitsch,
+// "Printing Floating-Point Numbers Quickly and Accurately with Integers",
+// 2010). The digits always parse back to the same double; in rare cases they
+// are one digit longer than the shortest such string.
+
+// Longest output of number_format: sign, 17 digits, point, "e-308" and NUL
+#define NUMBER_FORMAT_MAX 32
+
+typedef struct {
+    uint64_t f;
+    int      e;
+} DiyFp; // f * 2^e
+
+// Normalized 10^k for k = -348, -340, ..., 340
+static const uint64_t cached_powers_f[] = {
+    0xfa8fd5a0081c0288ull, 0xbaaee17fa23ebf76ull, 0x8b16fb203055ac76ull,
+    0xcf42894a5dce35eaull, 0x9a6bb0aa55653b2dull, 0xe61acf033d1a45dfull,
+    0xab70fe17c79ac6caull, 0xff77b1fcbebcdc4full, 0xbe5691ef416bd60cull,
+    0x8dd01fad907ffc3cull, 0xd3515c2831559a83ull, 0x9d71ac8fada6c9b5ull,
+    0xea9c227723ee8bcbull, 0xaecc49914078536dull, 0x823c12795db6ce57ull,
+    0xc21094364dfb5637ull, 0x9096ea6f3848984full, 0xd77485cb25823ac7ull,
+    0xa086cfcd97bf97f4ull, 0xef340a98172aace5ull, 0xb23867fb2a35b28eull,
+    0x84c8d4dfd2c63f3bull, 0xc5dd44271ad3cdbaull, 0x936b9fcebb25c996ull,
+    0xdbac6c247d62a584ull, 0xa3ab66580d5fdaf6ull, 0xf3e2f893dec3f126ull,
+    0xb5b5ada8aaff80b8ull, 0x87625f056c7c4a8bull, 0xc9bcff6034c13053ull,
+    0x964e858c91ba2655ull, 0xdff9772470297ebdull, 0xa6dfbd9fb8e5b88full,
+    0xf8a95fcf88747d94ull, 0xb94470938fa89bcfull, 0x8a08f0f8bf0f156bull,
+    0xcdb02555653131b6ull, 0x993fe2c6d07b7facull, 0xe45c10c42a2b3b06ull,
+    0xaa242499697392d3ull, 0xfd87b5f28300ca0eull, 0xbce5086492111aebull,
+    0x8cbccc096f5088ccull, 0xd1b71758e219652cull, 0x9c40000000000000ull,
+    0xe8d4a51000000000ull, 0xad78ebc5ac620000ull, 0x813f3978f8940984ull,
+    0xc097ce7bc90715b3ull, 0x8f7e32ce7bea5c70ull, 0xd5d238a4abe98068ull,
+    0x9f4f2726179a2245ull, 0xed63a231d4c4fb27ull, 0xb0de65388cc8ada8ull,
+    0x83c7088e1aab65dbull, 0xc45d1df942711d9aull, 0x924d692ca61be758ull,
+    0xda01ee641a708deaull, 0xa26da3999aef774aull, 0xf209787bb47d6b85ull,
+    0xb454e4a179dd1877ull, 0x865b86925b9bc5c2ull, 0xc83553c5c8965d3dull,
+    0x952ab45cfa97a0b3ull, 0xde469fbd99a05fe3ull, 0xa59bc234db398c25ull,
+    0xf6c69a72a3989f5cull, 0xb7dcbf5354e9beceull, 0x88fcf317f22241e2ull,
+    0xcc20ce9bd35c78a5ull, 0x98165af37b2153dfull, 0xe2a0b5dc971f303aull,
+    0xa8d9d1535ce3b396ull, 0xfb9b7cd9a4a7443cull, 0xbb764c4ca7a44410ull,
+    0x8bab8eefb6409c1aull, 0xd01fef10a657842cull, 0x9b10a4e5e9913129ull,
+    0xe7109bfba19c0c9dull, 0xac2820d9623bf429ull, 0x80444b5e7aa7cf85ull,
+    0xbf21e44003acdd2dull, 0x8e679c2f5e44ff8full, 0xd433179d9c8cb841ull,
+    0x9e19db92b4e31ba9ull, 0xeb96bf6ebadf77d9ull, 0xaf87023b9bf0ee6bull,
+};
+
+static const int16_t cached_powers_e[] = {
+    -1220, -1193, -1166, -1140, -1113, -1087, -1060, -1034, -1007, -980,
+    -954, -927, -901, -874, -847, -821, -794, -768, -741, -715,
+    -688, -661, -635, -608, -582, -555, -529, -502, -475, -449,
+    -422, -396, -369, -343, -316, -289, -263, -236, -210, -183,
+    -157, -130, -103, -77, -50, -24, 3, 30, 56, 83,
+    109, 136, 162, 189, 216, 242, 269, 295, 322, 348,
+    375, 402, 428, 455, 481, 508, 534, 561, 588, 614,
+    641, 667, 694, 720, 747, 774, 800, 827, 853, 880,
+    907, 933, 960, 986, 1013, 1039, 1066,
+};
+
+static const uint64_t pow10_u64[] = {
+    1ull, 10ull, 100ull, 1000ull, 10000ull, 100000ull, 1000000ull, 10000000ull,
+    100000000ull, 1000000000ull, 10000000000ull, 100000000000ull, 1000000000000ull,
+    10000000000000ull, 100000000000000ull, 1000000000000000ull, 10000000000000000ull,
+    100000000000000000ull, 1000000000000000000ull, 10000000000000000000ull,
+};
+
+static DiyFp diyfp_normalize(DiyFp x)
+{
+    while (!(x.f & (1ull << 63))) {
+        x.f <<= 1;
+        x.e--;
+    }
+    return x;
+}
+
+// Upper 64 bits of the 128 bit product, rounded
+static DiyFp diyfp_mul(DiyFp x, DiyFp y)
+{
+    const uint64_t mask = 0xFFFFFFFFull;
+    uint64_t a = x.f >> 32, b = x.f & mask, c = y.f >> 32, d = y.f & mask;
+    uint64_t ac = a * c, bc = b * c, ad = a * d, bd = b * d;
+    uint64_t mid = (bd >> 32) + (ad & mask) + (bc & mask) + (1ull << 31);
+    return (DiyFp){ ac + (ad >> 32) + (bc >> 32) + (mid >> 32), x.e + y.e + 64 };
+}
+
+// Cached power c = 10^-k such that the product with a number of binary
+// exponent e has its exponent in [-60, -32].
+static DiyFp cached_power(int e, int *k)
+{
+    double dk = (-61 - e) * 0.30102999566398114 + 347; // log10(2)
+    int ik = (int)dk;
+    if (dk - ik > 0.0) ik++;
+    int index = (ik >> 3) + 1;
+    *k = -(-348 + index * 8);
+    return (DiyFp){ cached_powers_f[index], cached_powers_e[index] };
+}
+
+static void grisu_round(char *digits, int len, uint64_t delta, uint64_t rest, uint64_t ten_kappa,
+    uint64_t wp_w)
+{
+    while (rest < wp_w && delta - rest >= ten_kappa &&
+           (rest + ten_kappa < wp_w || wp_w - rest > rest + ten_kappa - wp_w)) {
+        digits[len - 1]--;
+        rest += ten_kappa;
+    }
+}
+
+static int count_digits(uint32_t n)
+{
+    int digits = 1;
+    while (digits < 10 && n >= pow10_u64[digits]) digits++;
+    return digits;
+}
+
+// Generates the digits of w within [w - delta, mp], returning their count and
+// adding the decimal exponent to *k.
+static int grisu_digits(DiyFp w, DiyFp mp, uint64_t delta, char *digits, int *k)
+{
+    DiyFp one = { 1ull << -mp.e, mp.e };
+    uint64_t wp_w = mp.f - w.f;
+    uint32_t p1 = (uint32_t)(mp.f >> -one.e);
+    uint64_t p2 = mp.f & (one.f - 1);
+    int len = 0;
+
+    for (int kappa = count_digits(p1); kappa > 0;) {
+        uint32_t d = p1 / (uint32_t)pow10_u64[kappa - 1];
+        p1 %= (uint32_t)pow10_u64[kappa - 1];
+        if (d || len) digits[len++] = (char)('0' + d);
+        kappa--;
+        uint64_t rest = ((uint64_t)p1 << -one.e) + p2;
+        if (rest <= delta) {
+            *k += kappa;
+            grisu_round(digits, len, delta, rest, pow10_u64[kappa] << -one.e, wp_w);
+            return len;
+        }
+    }
+
+    for (int kappa = 0;;) {
+        p2 *= 10;
+        delta *= 10;
+        char d = (char)(p2 >> -one.e);
+        if (d || len) digits[len++] = (char)('0' + d);
+        p2 &= one.f - 1;
+        kappa--;
+        if (p2 < delta) {
+            *k += kappa;
+            grisu_round(digits, len, delta, p2, one.f, wp_w * (-kappa < 20 ? pow10_u64[-kappa] : 0));
+            return len;
+        }
+    }
+}
+
+// Shortest digits of a positive finite v: v = digits * 10^k.
+static int grisu2(double v, char *digits, int *k)
+{
+    uint64_t bits;
+    memcpy(&bits, &v, sizeof(bits));
+    const uint64_t hidden = 1ull << 52;
+    int biased = (int)(bits >> 52 & 0x7FF);
+    uint64_t frac = bits & (hidden - 1);
+    DiyFp w = biased ? (DiyFp){ frac + hidden, biased - 1075 } : (DiyFp){ frac, -1074 };
+
+    // Boundaries halfway to the neighbouring doubles
+    DiyFp plus = diyfp_normalize((DiyFp){ (w.f << 1) + 1, w.e - 1 });
+    DiyFp minus = w.f == hidden ? (DiyFp){ (w.f << 2) - 1, w.e - 2 }
+                                : (DiyFp){ (w.f << 1) - 1, w.e - 1 };
+    minus.f <<= minus.e - plus.e;
+    minus.e = plus.e;
+
+    DiyFp c = cached_power(plus.e, k);
+    DiyFp W = diyfp_mul(diyfp_normalize(w), c);
+    DiyFp Wp = diyfp_mul(plus, c);
+    DiyFp Wm = diyfp_mul(minus, c);
+    Wm.f++;
+    Wp.f--;
+    return grisu_digits(W, Wp, Wp.f - Wm.f, digits, k);
+}
+
+// Writes digits * 10^k to dest the way JavaScript prints numbers: plain
+// notation for 1e-7 < |v| < 1e21, otherwise like 1.5e+300.
+static int number_layout(char *dest, const char *digits, int len, int k)
+{
+    int point = len + k; // digits before the decimal point
+    char *p = dest;
+    if (k >= 0 && point <= 21) {
+        memcpy(p, digits, len);
+        memset(p + len, '0', k);
+        p += point;
+    } else if (point > 0 && point <= 21) {
+        memcpy(p, digits, point);
+        p[point] = '.';
+        memcpy(p + point + 1, digits + point, len - point);
+        p += len + 1;
+    } else if (point > -6 && point <= 0) {
+        *p++ = '0';
+        *p++ = '.';
+        memset(p, '0', -point);
+        memcpy(p - point, digits, len);
+        p += len - point;
+    } else {
+        *p++ = digits[0];
+        if (len > 1) {
+            *p++ = '.';
+            memcpy(p, digits + 1, len - 1);
+            p += len - 1;
+        }
+        p += sprintf(p, "e%+d", point - 1);
+    }
+    *p = '\0';
+    return (int)(p - dest);
+}
+
+static int number_format_digits(uint64_t n, char *dest)
+{
+    char tmp[20];
+    int len = 0;
+    do {
+        tmp[len++] = (char)('0' + n % 10);
+        n /= 10;
+    } while (n);
+    for (int i = 0; i < len; ++i) {
+        dest[i] = tmp[len - 1 - i];
+    }
+    dest[len] = '\0';
+    return len;
+}
+
+// Formats integer n into dest, which must hold NUMBER_FORMAT_MAX bytes, and
+// returns the length.
+static int number_format_int(int64_t n, char *dest)
+{
+    if (n >= 0) return number_format_digits((uint64_t)n, dest);
+    dest[0] = '-';
+    return 1 + number_format_digits(-(uint64_t)n, dest + 1);
+}
+
+// Formats v into dest, which must hold NUMBER_FORMAT_MAX bytes, and returns
+// the length. strtod of the result gives back v exactly.
+static int number_format(double v, char *dest)
+{
+    if (isnan(v)) return sprintf(dest, "nan");
+    char *p = dest;
+    if (signbit(v)) {
+        *p++ = '-';
+        v = -v;
+    }
+    if (isinf(v)) return (int)(p - dest) + sprintf(p, "inf");
+    if (v == 0) return (int)(p - dest) + sprintf(p, "0");
+
+    // Integers are the common case and need no search
+    if (v < 9007199254740992.0 && v == (double)(uint64_t)v) {
+        return (int)(p - dest) + number_format_digits((uint64_t)v, p);
+    }
+
+    char digits[18];
+    int k;
+    int len = grisu2(v, digits, &k);
+    return (int)(p - dest) + number_layout(p, digits, len, k);
+}
+
+#ifndef NDEBUG
+static void number_test(void)
+{
+    static const struct { double v; const char *s; } cases[] = {
+        { 0, "0" }, { -0.0, "-0" }, { 7, "7" }, { -42, "-42" }, { 0.1, "0.1" },
+        { 1.0 / 3, "0.3333333333333333" }, { 0.1 + 0.2, "0.30000000000000004" },
+        { 1e21, "1e+21" }, { 1e20, "100000000000000000000" }, { 123.456, "123.456" },
+        { 1e-7, "1e-7" }, { 0.000001, "0.000001" }, { 5e-324, "5e-324" },
+        { 1.7976931348623157e308, "1.7976931348623157e+308" }, { 9007199254740993.0, "9007199254740992" },
+        { 2.5e-5, "0.000025" }, { -1.5e300, "-1.5e+300" },
+    };
+    char buf[NUMBER_FORMAT_MAX];
+    for (int i = 0; i < (int)countof(cases); ++i) {
+        number_format(cases[i].v, buf);
+        assert(strcmp(buf, cases[i].s) == 0);
+    }
+    number_format_int(INT64_MIN, buf);
+    assert(strcmp(buf, "-9223372036854775808") == 0);
+
+    // Every output parses back to the same bits
+    uint64_t x = 0x9E3779B97F4A7C15ull;
+    for (int i = 0; i < 10000; ++i) {
+        x ^= x << 13, x ^= x >> 7, x ^= x << 17;
+        double v;
+        memcpy(&v, &x, sizeof(v));
+        if (isnan(v)) continue;
+        int len = number_format(v, buf);
+        assert(len < NUMBER_FORMAT_MAX);
+        double back = strtod(buf, NULL);
+        assert(memcmp(&back, &v, sizeof(v)) == 0);
+    }
+}
+#endif
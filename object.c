@@ -0,0 +1,268 @@
+#pragma once
+
+#include "common.h"
+#include "buf.h"
+#include "chunk.c"
+
+// Strings of up to SMALL_STRING_MAX bytes live inline in the Value. Longer ones
+// are heap objects interned in a Heap, so equal strings are the same object
+// and compare by pointer. Concatenation builds a rope instead of copying; its
+// contents are copied out and interned the first time they are needed.
+
+#define ROPE_MIN_LENGTH 32 // shorter concatenations are copied right away
+
+static uint32_t string_hash(const char *chars, int length)
+{
+    uint32_t hash = 2166136261u; // FNV-1a
+    for (int i = 0; i < length; ++i) {
+        hash ^= (byte)chars[i];
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+static size_t array_object_size(int length); // see array.c, which needs the objects first
+
+// Bytes heap_alloc allocated o with, as counted in Heap.bytes
+static size_t obj_size(const Obj *o)
+{
+    switch (o->type) {
+        case OBJ_STRING:   return sizeof(ObjString) + ((const ObjString *)o)->length + 1;
+        case OBJ_ROPE:     return sizeof(ObjRope);
+        case OBJ_FUNCTION: return sizeof(ObjFunction);
+        case OBJ_ARRAY:    return array_object_size(((const ObjArray *)o)->length);
+        case OBJ_SHAPE:    return sizeof(Shape);
+        case OBJ_CLASS:    return sizeof(ObjClass);
+        case OBJ_INSTANCE: return sizeof(ObjInstance);
+    }
+    return 0;
+}
+
+// Objects are counted with the buffers by --mem, see buf_stats
+static Obj *heap_alloc(Heap *h, size_t size, ObjType type)
+{
+    Obj *o = malloc(size);
+    *o = (Obj){ .type = type, .next = h->objects };
+    h->objects = o;
+    h->bytes += size;
+    if (buf_stats_enabled) {
+        buf_stats.objects++;
+        buf_stats.bytes += size;
+        buf_stats.live += size;
+        buf_stats.peak = BUF_MAX(buf_stats.peak, buf_stats.live);
+    }
+    return o;
+}
+
+// Frees o and what it owns, but not the objects it points to
+static void obj_free(Obj *o)
+{
+    if (buf_stats_enabled) {
+        buf_stats.object_frees++;
+        buf_stats.live -= obj_size(o);
+    }
+    if (o->type == OBJ_FUNCTION) {
+        ObjFunction *f = (ObjFunction *)o;
+        free(f->source);
+        chunk_free(&f->chunk);
+    } else if (o->type == OBJ_SHAPE) {
+        buf_free(((Shape *)o)->transitions);
+    } else if (o->type == OBJ_INSTANCE) {
+        buf_free(((ObjInstance *)o)->fields);
+    }
+    free(o);
+}
+
+static void heap_free(Heap *h)
+{
+    for (Obj *o = h->objects; o;) {
+        Obj *next = o->next;
+        obj_free(o);
+        o = next;
+    }
+    buf_free(h->strings);
+    buf_free(h->gray);
+    *h = (Heap){ 0 };
+}
+
+static ObjString **heap_find_string(ObjString **table, const char *chars, int length,
+    uint32_t hash)
+{
+    int mask = buf_len(table) - 1;
+    for (int i = (int)(hash & (uint32_t)mask);; i = (i + 1) & mask) {
+        ObjString *s = table[i];
+        if (!s || (s->hash == hash && s->length == length &&
+                      memcmp(s->chars, chars, length) == 0)) {
+            return &table[i];
+        }
+    }
+}
+
+static void heap_grow_strings(Heap *h)
+{
+    int cap = BUF_MAX(64, 2 * buf_len(h->strings));
+    ObjString **table = NULL;
+    memset(buf_append(table, cap), 0, cap * sizeof(*table));
+    for (int i = 0; i < buf_len(h->strings); ++i) {
+        ObjString *s = h->strings[i];
+        if (s) {
+            *heap_find_string(table, s->chars, s->length, s->hash) = s;
+        }
+    }
+    buf_free(h->strings);
+    h->strings = table;
+}
+
+// Returns the interned string with these contents, copying them if it is new.
+static ObjString *heap_intern(Heap *h, const char *chars, int length)
+{
+    if (2 * (h->string_count + 1) > buf_len(h->strings)) {
+        heap_grow_strings(h);
+    }
+    uint32_t hash = string_hash(chars, length);
+    ObjString **slot = heap_find_string(h->strings, chars, length, hash);
+    if (!*slot) {
+        ObjString *s = (ObjString *)heap_alloc(h, sizeof(ObjString) + length + 1, OBJ_STRING);
+        s->length = length;
+        s->hash = hash;
+        memcpy(s->chars, chars, length);
+        s->chars[length] = '\0';
+        *slot = s;
+        ++h->string_count;
+    }
+    return *slot;
+}
+
+static Value string_value(Heap *h, const char *chars, int length)
+{
+    if (length > SMALL_STRING_MAX) {
+        return OBJ_VAL(heap_intern(h, chars, length));
+    }
+    Value v = { VAL_SMALL_STRING, { 0 } };
+    memcpy(v.as.small, chars, length);
+    return v;
+}
+
+static int string_length(Value v)
+{
+    if (IS_SMALL_STRING(v)) return (int)strnlen(v.as.small, SMALL_STRING_MAX);
+    if (IS_ROPE(v)) return AS_ROPE(v)->length;
+    return AS_STRING(v)->length;
+}
+
+// Contents of flat string *v, not NUL terminated when small
+static const char *string_chars(const Value *v)
+{
+    assert(!IS_ROPE(*v));
+    return IS_SMALL_STRING(*v) ? v->as.small : AS_STRING(*v)->chars;
+}
+
+// Calls fn on each flat piece of string v, in order. Iterative so deep ropes
+// don't recurse.
+static void string_visit(Value v, void (*fn)(const char *chars, int length, void *ctx),
+    void *ctx)
+{
+    Value *pending = NULL;
+    for (;;) {
+        if (IS_ROPE(v) && !AS_ROPE(v)->flat) {
+            buf_push(pending, AS_ROPE(v)->right);
+            v = AS_ROPE(v)->left;
+            continue;
+        }
+
+        if (IS_SMALL_STRING(v)) {
+            fn(v.as.small, string_length(v), ctx);
+        } else {
+            ObjString *s = IS_ROPE(v) ? AS_ROPE(v)->flat : AS_STRING(v);
+            fn(s->chars, s->length, ctx);
+        }
+
+        if (buf_empty(pending)) break;
+        v = *buf_pop(pending);
+    }
+    buf_free(pending);
+}
+
+static void string_copy_piece(const char *chars, int length, void *ctx)
+{
+    char **dest = ctx;
+    memcpy(*dest, chars, length);
+    *dest += length;
+}
+
+static void string_print_piece(const char *chars, int length, void *ctx)
+{
+    fwrite(chars, 1, length, ctx);
+}
+
+// Copies the contents of string v to dest, without a terminator.
+static void string_copy(Value v, char *dest)
+{
+    string_visit(v, string_copy_piece, &dest);
+}
+
+static void string_print(FILE *out, Value v)
+{
+    string_visit(v, string_print_piece, out);
+}
+
+// Returns v with a rope replaced by its interned flat string.
+static Value string_flatten(Heap *h, Value v)
+{
+    if (!IS_ROPE(v)) return v;
+    ObjRope *r = AS_ROPE(v);
+    if (!r->flat) {
+        char *chars = malloc(r->length);
+        string_copy(v, chars);
+        r->flat = heap_intern(h, chars, r->length);
+        free(chars);
+    }
+    return OBJ_VAL(r->flat);
+}
+
+static Value string_concat(Heap *h, Value a, Value b)
+{
+    int a_length = string_length(a);
+    int b_length = string_length(b);
+    if (a_length == 0) return b;
+    if (b_length == 0) return a;
+
+    int length = a_length + b_length;
+    if (length < ROPE_MIN_LENGTH) {
+        char chars[ROPE_MIN_LENGTH];
+        string_copy(a, chars);
+        string_copy(b, chars + a_length);
+        return string_value(h, chars, length);
+    }
+
+    ObjRope *r = (ObjRope *)heap_alloc(h, sizeof(ObjRope), OBJ_ROPE);
+    r->length = length;
+    r->left = a;
+    r->right = b;
+    r->flat = NULL;
+    return OBJ_VAL(r);
+}
+
+// Function whose parameter list and body are source [0, length), declared on
+// line with the heap and global table its body is to be compiled with
+static ObjFunction *function_new(Heap *h, Value name, int arity, const char *source, int length,
+    int line, GlobalTable *g)
+{
+    ObjFunction *f = (ObjFunction *)heap_alloc(h, sizeof(ObjFunction), OBJ_FUNCTION);
+    *f = (ObjFunction){ .obj = f->obj, .name = name, .arity = arity, .line = line,
+                        .heap = h, .globals = g };
+    f->source = malloc(length + 1);
+    memcpy(f->source, source, length);
+    f->source[length] = '\0';
+    return f;
+}
+
+static void function_print(FILE *out, const ObjFunction *f)
+{
+    fputs("<fn", out);
+    if (!IS_NIL(f->name)) {
+        fputs(" ", out);
+        string_print(out, f->name);
+    }
+    fputs(">", out);
+}
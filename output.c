@@ -0,0 +1,145 @@
+#pragma once
+
+#include <errno.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+#include "common.h"
+#include "number.c"
+#include "object.c"
+
+// Buffered output of results, written to a file descriptor in large blocks.
+// Nothing reaches the descriptor until the buffer is full or out_flush is
+// called. Debug printing keeps using stdio and is flushed first so the two
+// don't interleave out of order.
+
+#define OUTPUT_BUFFER_SIZE (1 << 20)
+
+typedef struct {
+    int   fd;
+    char *buf; // OUTPUT_BUFFER_SIZE bytes, allocated on first write
+    int   len;
+    bool  failed; // a write failed, later output is dropped
+} Output;
+
+// Writes the buffered bytes followed by extra[0, extra_len) with as few
+// writev calls as the descriptor allows.
+static void out_write_through(Output *o, const char *extra, size_t extra_len)
+{
+    if (o->fd == STDOUT_FILENO) fflush(stdout);
+
+    struct iovec iov[2] = {
+        { o->buf, (size_t)o->len },
+        { (void *)extra, extra_len },
+    };
+    struct iovec *v = iov;
+    int count = 2;
+    while (!o->failed && count > 0) {
+        if (v->iov_len == 0) {
+            ++v, --count;
+            continue;
+        }
+        ssize_t n = writev(o->fd, v, count);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            o->failed = true;
+            break;
+        }
+        for (; count > 0 && (size_t)n >= v->iov_len; ++v, --count) {
+            n -= v->iov_len;
+        }
+        if (count > 0) {
+            v->iov_base = (char *)v->iov_base + n;
+            v->iov_len -= n;
+        }
+    }
+    o->len = 0;
+}
+
+static void out_flush(Output *o)
+{
+    if (o->len > 0) out_write_through(o, NULL, 0);
+}
+
+// Copies small pieces into the buffer; a piece that doesn't fit is written
+// directly after the buffered bytes instead of being copied.
+static void out_write(Output *o, const char *chars, size_t len)
+{
+    if (!o->buf) o->buf = malloc(OUTPUT_BUFFER_SIZE);
+    if (len <= (size_t)(OUTPUT_BUFFER_SIZE - o->len)) {
+        memcpy(o->buf + o->len, chars, len);
+        o->len += (int)len;
+        return;
+    }
+    out_write_through(o, chars, len);
+}
+
+static void out_str(Output *o, const char *s)
+{
+    out_write(o, s, strlen(s));
+}
+
+static void out_char(Output *o, char c)
+{
+    out_write(o, &c, 1);
+}
+
+static void out_number(Output *o, Value n)
+{
+    char buf[NUMBER_FORMAT_MAX];
+    int len = IS_INT(n) ? number_format_int(AS_INT(n), buf) : number_format(AS_DOUBLE(n), buf);
+    out_write(o, buf, len);
+}
+
+static void out_string_piece(const char *chars, int length, void *ctx)
+{
+    out_write(ctx, chars, length);
+}
+
+static void out_value(Output *o, Value v)
+{
+    switch (v.type) {
+        case VAL_NIL:    out_str(o, "nil"); break;
+        case VAL_BOOL:   out_str(o, AS_BOOL(v) ? "true" : "false"); break;
+        case VAL_NUMBER:
+        case VAL_INT:    out_number(o, v); break;
+        case VAL_SMALL_STRING: string_visit(v, out_string_piece, o); break;
+        case VAL_OBJ:
+            if (IS_FUNCTION(v)) {
+                Value name = AS_FUNCTION(v)->name;
+                out_str(o, "<fn");
+                if (!IS_NIL(name)) {
+                    out_char(o, ' ');
+                    string_visit(name, out_string_piece, o);
+                }
+                out_char(o, '>');
+            } else if (IS_CLASS(v)) {
+                out_str(o, "<class ");
+                string_visit(AS_CLASS(v)->name, out_string_piece, o);
+                out_char(o, '>');
+            } else if (IS_INSTANCE(v)) {
+                out_char(o, '<');
+                string_visit(AS_INSTANCE(v)->klass->name, out_string_piece, o);
+                out_str(o, " instance>");
+            } else if (IS_ARRAY(v)) {
+                const ObjArray *a = AS_ARRAY(v);
+                out_char(o, '[');
+                for (int i = 0; i < a->length; ++i) {
+                    if (i > 0) out_str(o, ", ");
+                    out_number(o, NUMBER_VAL(a->data[i]));
+                }
+                out_char(o, ']');
+            } else {
+                string_visit(v, out_string_piece, o);
+            }
+            break;
+        case VAL_UNDEFINED: out_str(o, "undefined"); break;
+    }
+}
+
+static void out_close(Output *o)
+{
+    out_flush(o);
+    free(o->buf);
+    o->buf = NULL;
+}
@@ -0,0 +1,198 @@
+#pragma once
+
+#include <signal.h>
+#include <sys/time.h>
+
+#include "common.h"
+#include "buf.h"
+#include "chunk.c"
+#include "object.c"
+
+// Sampling profiler (--profile). setitimer sends SIGPROF at a fixed rate of
+// CPU time, and the handler copies the call stack of the VM running on the
+// interrupted thread into the ring of its profiler: one producer, the
+// handler, and one consumer, the VM, so it needs no lock. vm_run drains the
+// ring every VM_CLOCK_INTERVAL instructions and when it returns, while the
+// sampled chunks are alive, resolving each frame to a line. Runs of a VM
+// without a profiler pay nothing: vm_run has a copy of its loop for profiled
+// runs, the only one that keeps the ip of the frame up to date.
+
+#define PROFILE_HZ 1000
+
+// VM that vm_run is running on this thread, while it is profiled
+static _Thread_local VM *profile_vm;
+
+static void profile_signal(int sig)
+{
+    (void)sig;
+    VM *vm = profile_vm;
+    if (!vm) return;
+    Profiler *p = vm->profile;
+    unsigned head = atomic_load_explicit(&p->head, memory_order_relaxed);
+    unsigned tail = atomic_load_explicit(&p->tail, memory_order_acquire);
+    if (head - tail == PROFILE_RING) {
+        atomic_fetch_add_explicit(&p->dropped, 1, memory_order_relaxed);
+        return;
+    }
+    ProfileSample *s = &p->ring[head % PROFILE_RING];
+    int count = vm->frame_count;
+    s->depth = count < PROFILE_DEPTH ? count : PROFILE_DEPTH;
+    s->truncated = count > PROFILE_DEPTH;
+    for (int i = 0; i < s->depth; ++i) {
+        const CallFrame *f = &vm->frames[count - 1 - i];
+        s->frames[i] = (ProfileFrame){ f->function, f->chunk, (int)(f->ip - f->chunk->code) };
+    }
+    atomic_store_explicit(&p->head, head + 1, memory_order_release);
+}
+
+// Installs the handler and has SIGPROF sent hz times per second of CPU time
+// the process uses; with hz 0 samples are only taken on raise(SIGPROF).
+// Returns false if either fails.
+MAYBE_UNUSED static bool profile_start(int hz)
+{
+    struct sigaction sa = { .sa_handler = profile_signal, .sa_flags = SA_RESTART };
+    sigemptyset(&sa.sa_mask);
+    if (sigaction(SIGPROF, &sa, NULL) != 0) return false;
+    if (hz <= 0) return true;
+    int usec = hz > 1000000 ? 1 : 1000000 / hz;
+    struct itimerval timer = { .it_interval = { usec / 1000000, usec % 1000000 } };
+    timer.it_value = timer.it_interval;
+    return setitimer(ITIMER_PROF, &timer, NULL) == 0;
+}
+
+MAYBE_UNUSED static void profile_stop(void)
+{
+    struct itimerval timer = { 0 };
+    setitimer(ITIMER_PROF, &timer, NULL);
+    signal(SIGPROF, SIG_IGN); // one may still be pending
+}
+
+static void profile_append(char **buf, const char *chars, int length)
+{
+    memcpy(buf_append(*buf, length), chars, length);
+}
+
+// Line of frame i of s, innermost first. The ip of a caller is past its call.
+static int profile_line(const ProfileSample *s, int i)
+{
+    const ProfileFrame *f = &s->frames[i];
+    return chunk_get_line(f->chunk, f->offset - (i > 0));
+}
+
+static int *profile_find(const Profiler *p, int *table, const char *stack, uint32_t hash)
+{
+    int mask = buf_len(table) - 1;
+    for (int i = (int)(hash & (uint32_t)mask);; i = (i + 1) & mask) {
+        int k = table[i];
+        if (k < 0 || (p->stacks[k].hash == hash && strcmp(p->stacks[k].stack, stack) == 0)) {
+            return &table[i];
+        }
+    }
+}
+
+static void profile_grow(Profiler *p)
+{
+    int cap = BUF_MAX(64, 2 * buf_len(p->table));
+    int *table = NULL;
+    buf_append(table, cap);
+    for (int i = 0; i < cap; ++i) {
+        table[i] = -1;
+    }
+    for (int k = 0; k < buf_len(p->stacks); ++k) {
+        *profile_find(p, table, p->stacks[k].stack, p->stacks[k].hash) = k;
+    }
+    buf_free(p->table);
+    p->table = table;
+}
+
+// Counts sample s for the line it was on and for its folded call stack
+static void profile_add(Profiler *p, const ProfileSample *s)
+{
+    if (s->depth == 0) return; // between a runtime error and the return
+    ++p->samples;
+    int line = profile_line(s, 0);
+    while (buf_len(p->lines) <= line) {
+        buf_push(p->lines, 0);
+    }
+    ++p->lines[line];
+
+    char *stack = NULL;
+    if (s->truncated) profile_append(&stack, "...", 3);
+    for (int i = s->depth - 1; i >= 0; --i) {
+        const ObjFunction *f = s->frames[i].function;
+        if (buf_len(stack) > 0) buf_push(stack, ';');
+        if (!f) {
+            profile_append(&stack, "script", 6);
+        } else if (IS_NIL(f->name)) {
+            profile_append(&stack, "fn", 2);
+        } else {
+            profile_append(&stack, string_chars(&f->name), string_length(f->name));
+        }
+        char number[16];
+        profile_append(&stack, number, snprintf(number, sizeof(number), ":%d", profile_line(s, i)));
+    }
+    buf_push(stack, '\0');
+
+    uint32_t hash = string_hash(stack, buf_len(stack) - 1);
+    if (2 * (buf_len(p->stacks) + 1) > buf_len(p->table)) {
+        profile_grow(p);
+    }
+    int *slot = profile_find(p, p->table, stack, hash);
+    if (*slot < 0) {
+        *slot = buf_len(p->stacks);
+        buf_push(p->stacks, ((ProfileStack){ stack, hash, 0 }));
+    } else {
+        buf_free(stack);
+    }
+    ++p->stacks[*slot].count;
+}
+
+// Resolves the samples taken since the last drain. Called on the thread the
+// VM runs on, while the chunks in them are alive.
+static void profile_drain(Profiler *p)
+{
+    unsigned tail = atomic_load_explicit(&p->tail, memory_order_relaxed);
+    unsigned head = atomic_load_explicit(&p->head, memory_order_acquire);
+    for (; tail != head; ++tail) {
+        profile_add(p, &p->ring[tail % PROFILE_RING]);
+    }
+    atomic_store_explicit(&p->tail, tail, memory_order_release);
+}
+
+// Samples per line, with their share of the total
+MAYBE_UNUSED static void profile_print(FILE *out, const Profiler *p)
+{
+    static const char bar[] = "########################################";
+    fprintf(out, "profile: %lld samples, %d dropped\n", (long long)p->samples,
+        atomic_load_explicit(&p->dropped, memory_order_relaxed));
+    int64_t max = 0;
+    for (int line = 0; line < buf_len(p->lines); ++line) {
+        max = BUF_MAX(max, p->lines[line]);
+    }
+    fprintf(out, "%6s %8s %6s\n", "line", "samples", "%");
+    for (int line = 0; line < buf_len(p->lines); ++line) {
+        int64_t n = p->lines[line];
+        if (n == 0) continue;
+        fprintf(out, "%6d %8lld %5.1f%% %.*s\n", line, (long long)n, 100.0 * n / p->samples,
+            (int)(n * (int64_t)(sizeof(bar) - 1) / max), bar);
+    }
+}
+
+// One line per call stack, "frame;frame;... count", which is what
+// flamegraph.pl and similar tools read
+MAYBE_UNUSED static void profile_write_folded(FILE *out, const Profiler *p)
+{
+    for (int k = 0; k < buf_len(p->stacks); ++k) {
+        fprintf(out, "%s %lld\n", p->stacks[k].stack, (long long)p->stacks[k].count);
+    }
+}
+
+MAYBE_UNUSED static void profile_free(Profiler *p)
+{
+    for (int k = 0; k < buf_len(p->stacks); ++k) {
+        buf_free(p->stacks[k].stack);
+    }
+    buf_free(p->stacks);
+    buf_free(p->table);
+    buf_free(p->lines);
+}
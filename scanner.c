@@ -25,7 +25,7 @@ static char scanner_advance(Scanner *s)
     return s->current[-1];
 }
 
-static bool inline scanner_eof(Scanner *s)
+static inline bool scanner_eof(Scanner *s)
 {
     return *s->current == '\0';
 }
@@ -211,8 +211,12 @@ static Token scanner_scan_token(Scanner *s)
         case ')': return scanner_make_token(s, TOKEN_RIGHT_PAREN);
         case '{': return scanner_make_token(s, TOKEN_LEFT_BRACE);
         case '}': return scanner_make_token(s, TOKEN_RIGHT_BRACE);
+        case '[': return scanner_make_token(s, TOKEN_LEFT_BRACKET);
+        case ']': return scanner_make_token(s, TOKEN_RIGHT_BRACKET);
         case ';': return scanner_make_token(s, TOKEN_SEMICOLON);
         case ',': return scanner_make_token(s, TOKEN_COMMA);
+        case ':': return scanner_make_token(s, TOKEN_COLON);
+        case '?': return scanner_make_token(s, TOKEN_QUESTION);
         case '.': return scanner_make_token(s, TOKEN_DOT);
         case '-': return scanner_make_token(s, TOKEN_MINUS);
         case '+': return scanner_make_token(s, TOKEN_PLUS);
@@ -0,0 +1,188 @@
+#pragma once
+
+#include <pthread.h>
+
+#include "common.h"
+#include "buf.h"
+#include "clock.c"
+#include "vm.c"
+
+// A script run by the scheduler on a VM of its own
+typedef struct {
+    const char *source;
+    VM          vm;
+    Chunk       chunk;   // compiled on its first slice
+    VMResult    result;  // of its last slice, final once it finished
+    int         slices;  // times it was run
+    uint64_t    run_ns;  // spent in its slices, compiling included
+    uint64_t    done_ns; // when it finished, since sched_run started
+} SchedTask;
+
+// Runs many VMs on a few threads, cooperatively: a worker takes the task at
+// the front of the run queue, runs it for one slice and puts it at the back
+// unless it finished. Slices end after a number of instructions or a time,
+// see vm_run, so a long script cannot hold back short ones.
+typedef struct {
+    SchedTask      *tasks;
+    int             count;
+    uint64_t        slice;      // instructions per slice, 0 for no limit
+    uint64_t        slice_ns;   // time per slice, 0 for no limit
+    pthread_mutex_t lock;       // guards the fields below
+    pthread_cond_t  ready;      // a task was queued or the last one finished
+    int            *queue;      // ring of the count task indexes
+    int             head;
+    int             queued;
+    int             unfinished;
+    int64_t         switches;   // slices that yielded
+    uint64_t        start;
+} Sched;
+
+static void sched_init(Sched *s, const char **sources, int count, uint64_t slice, uint64_t slice_ns)
+{
+    *s = (Sched){
+        .tasks      = calloc(count, sizeof(SchedTask)),
+        .count      = count,
+        .slice      = slice,
+        .slice_ns   = slice_ns,
+        .queue      = calloc(count, sizeof(int)),
+        .queued     = count,
+        .unfinished = count,
+    };
+    pthread_mutex_init(&s->lock, NULL);
+    pthread_cond_init(&s->ready, NULL);
+    for (int i = 0; i < count; ++i) {
+        SchedTask *t = &s->tasks[i];
+        t->source = sources[i];
+        vm_init(&t->vm);
+        chunk_init(&t->chunk);
+        s->queue[i] = i;
+    }
+}
+
+static void sched_free(Sched *s)
+{
+    for (int i = 0; i < s->count; ++i) {
+        vm_free(&s->tasks[i].vm);
+        chunk_free(&s->tasks[i].chunk);
+    }
+    pthread_cond_destroy(&s->ready);
+    pthread_mutex_destroy(&s->lock);
+    free(s->queue);
+    free(s->tasks);
+}
+
+// Runs one slice of task t, compiling it first if it has not run yet.
+// Returns whether it finished.
+static bool sched_slice(Sched *s, SchedTask *t)
+{
+    VM *vm = &t->vm;
+    Stats *stats = vm->stats;
+    uint64_t start = clock_ns();
+    if (t->slices++ == 0) {
+        if (stats) stats_scan(stats, t->source);
+        uint64_t compile_start = clock_ns();
+        compile_errors = vm->errors;
+        bool ok = compile(t->source, &t->chunk, &vm->heap, &vm->global_names) &&
+                  chunk_verify(&t->chunk, vm_errors(vm));
+        if (stats) stats->ns[PHASE_COMPILE] = clock_ns() - compile_start;
+        if (!ok) {
+            t->result = (VMResult){ INTERPRET_COMPILE_ERROR, {0} };
+            t->run_ns = clock_ns() - start;
+            t->done_ns = clock_ns() - s->start;
+            return true;
+        }
+        vm_start(vm, &t->chunk);
+    }
+
+    uint64_t run_start = clock_ns();
+    vm->budget = s->slice;
+    vm->deadline_ns = s->slice_ns ? run_start + s->slice_ns : 0;
+    t->result = vm_resume(vm);
+    uint64_t end = clock_ns();
+    if (stats) stats->ns[PHASE_RUN] += end - run_start;
+    t->run_ns += end - start;
+    if (t->result.result == INTERPRET_YIELD) return false;
+    t->done_ns = end - s->start;
+    return true;
+}
+
+static void *sched_worker(void *arg)
+{
+    Sched *s = arg;
+    pthread_mutex_lock(&s->lock);
+    for (;;) {
+        while (s->queued == 0 && s->unfinished > 0) {
+            pthread_cond_wait(&s->ready, &s->lock);
+        }
+        if (s->unfinished == 0) break;
+        int task = s->queue[s->head];
+        s->head = (s->head + 1) % s->count;
+        --s->queued;
+        pthread_mutex_unlock(&s->lock);
+
+        bool finished = sched_slice(s, &s->tasks[task]);
+
+        pthread_mutex_lock(&s->lock);
+        if (finished) {
+            if (--s->unfinished == 0) pthread_cond_broadcast(&s->ready);
+        } else {
+            s->queue[(s->head + s->queued++) % s->count] = task;
+            ++s->switches;
+            pthread_cond_signal(&s->ready);
+        }
+    }
+    pthread_mutex_unlock(&s->lock);
+    return NULL;
+}
+
+// Runs every task to completion on thread_count threads
+static void sched_run(Sched *s, int thread_count)
+{
+    if (s->count == 0) return;
+    if (thread_count < 1) thread_count = 1;
+
+    pthread_t *threads = calloc(thread_count, sizeof(pthread_t));
+    s->start = clock_ns();
+    int started = 0;
+    while (started < thread_count && pthread_create(&threads[started], NULL, sched_worker, s) == 0) {
+        ++started;
+    }
+    if (started == 0) {
+        sched_worker(s);
+    }
+    for (int i = 0; i < started; ++i) {
+        pthread_join(threads[i], NULL);
+    }
+    free(threads);
+}
+
+#ifndef NDEBUG
+static void sched_test(void)
+{
+    // Scripts of very different lengths, interleaved one instruction at a time
+    char long_source[2048] = "0";
+    for (int i = 1, n = 1; i < 200; ++i) {
+        n += snprintf(long_source + n, sizeof(long_source) - n, " + %d", i);
+    }
+    const char *sources[] = { long_source, "1 + 2", "var a = 3; a * a", "b", "1 +", "2 * 3 - 4" };
+    int count = (int)countof(sources);
+
+    Sched s;
+    sched_init(&s, sources, count, 1, 0);
+    FILE *errors = fopen("/dev/null", "w");
+    for (int i = 0; i < count; ++i) {
+        s.tasks[i].vm.errors = errors;
+    }
+    sched_run(&s, 3);
+    fclose(errors);
+
+    const SchedTask *t = s.tasks;
+    assert(t[0].result.result == INTERPRET_OK && AS_NUMBER(t[0].result.value) == 199 * 200 / 2);
+    assert(AS_NUMBER(t[1].result.value) == 3 && AS_NUMBER(t[2].result.value) == 9);
+    assert(t[3].result.result == INTERPRET_RUNTIME_ERROR);
+    assert(t[4].result.result == INTERPRET_COMPILE_ERROR && t[4].slices == 1);
+    assert(AS_NUMBER(t[5].result.value) == 2);
+    assert(t[0].slices > 200 && t[1].slices < 10 && s.switches > 200);
+    sched_free(&s);
+}
+#endif
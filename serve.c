@@ -0,0 +1,329 @@
+#pragma once
+
+#include <errno.h>
+#include <signal.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "common.h"
+#include "buf.h"
+#include "cache.c"
+#include "debug.c"
+#include "stats.c"
+#include "vm.c"
+
+// Evaluation daemon on a Unix domain socket (--serve path).
+//
+// Requests and responses are frames: a u32 little-endian length followed by
+// that many bytes. A request holds the source to evaluate. A response holds a
+// status byte (0, ERR_COMPILE or ERR_RUNTIME, as for batch mode) followed by
+// the printed value or the error messages. Clients may pipeline any number of
+// requests; responses come back in request order.
+//
+// One thread multiplexes every connection with epoll. Each connection has its
+// own VM, so globals and cached chunks persist between its requests. Its heap
+// is collected as it grows and may keep SERVE_HEAP_MAX bytes: a request that
+// needs more fails with a runtime error, and a VM whose globals and compiled
+// scripts keep more once a request is done is replaced by a new one.
+
+#define SERVE_FRAME_MAX  (16 << 20) // larger requests close the connection
+#define SERVE_READ_SIZE  (64 << 10)
+#define SERVE_OUTPUT_MAX (1 << 20)  // stop reading while this much output is unsent
+#define SERVE_EVENTS     64
+#define SERVE_HEAP_MAX   (64 << 20) // per connection, see Heap.limit
+
+typedef struct {
+    int      fd;
+    int      index;    // in Server.conns
+    uint32_t events;   // registered with epoll
+    bool     eof;      // the client shut down its side
+    char    *in;       // received bytes, stretchy buffer
+    char    *out;      // unsent response bytes, stretchy buffer
+    int      out_pos;  // first unsent byte
+    FILE    *capture;  // memory stream for the payload of one response
+    char    *text;     // buffer of capture
+    size_t   text_size;
+    VM       vm;
+} ServeConn;
+
+typedef struct {
+    int         listener;
+    int         epoll;
+    ServeConn **conns;     // stretchy buffer
+    int64_t     accepted;
+    int64_t     requests;
+    CacheStats  cache;     // of closed connections
+} Server;
+
+static volatile sig_atomic_t serve_stopping;
+
+static void serve_on_signal(int sig)
+{
+    (void)sig;
+    serve_stopping = 1;
+}
+
+static uint32_t serve_get_u32(const char *p)
+{
+    const byte *b = (const byte *)p;
+    return (uint32_t)b[0] | (uint32_t)b[1] << 8 | (uint32_t)b[2] << 16 | (uint32_t)b[3] << 24;
+}
+
+static void serve_put_u32(char *p, uint32_t n)
+{
+    for (int i = 0; i < 4; ++i) {
+        p[i] = (char)(n >> (8 * i));
+    }
+}
+
+static bool serve_set_nonblocking(int fd)
+{
+    int flags = fcntl(fd, F_GETFL);
+    return flags >= 0 && fcntl(fd, F_SETFL, flags | O_NONBLOCK) == 0;
+}
+
+static void serve_add_cache_stats(Server *s, const VM *vm)
+{
+    const CacheStats *t = &vm->cache.stats;
+    s->cache.hits += t->hits;
+    s->cache.misses += t->misses;
+    s->cache.evictions += t->evictions;
+}
+
+static void serve_init_vm(ServeConn *c)
+{
+    vm_init(&c->vm);
+    c->vm.errors = c->capture;
+    c->vm.heap.limit = SERVE_HEAP_MAX;
+}
+
+// Replaces the VM of c by a new one if its heap is still over the limit once
+// collected after a request, see vm_collect
+static void serve_trim(Server *s, ServeConn *c)
+{
+    if (c->vm.heap.bytes <= SERVE_HEAP_MAX) return;
+    vm_reset_stack(&c->vm);
+    if (vm_collect(&c->vm)) return;
+    serve_add_cache_stats(s, &c->vm);
+    vm_free(&c->vm);
+    c->vm = (VM){ 0 };
+    serve_init_vm(c);
+}
+
+static void serve_close(Server *s, int index)
+{
+    ServeConn *c = s->conns[index];
+    ServeConn *last = *buf_pop(s->conns);
+    if (last != c) {
+        s->conns[index] = last;
+        last->index = index;
+    }
+
+    serve_add_cache_stats(s, &c->vm);
+    close(c->fd); // also removes it from the epoll set
+    vm_free(&c->vm);
+    if (c->capture) fclose(c->capture);
+    free(c->text);
+    buf_free(c->in);
+    buf_free(c->out);
+    free(c);
+}
+
+static void serve_accept(Server *s)
+{
+    for (;;) {
+        int fd = accept(s->listener, NULL, NULL);
+        if (fd < 0) {
+            if (errno == EINTR) continue;
+            if (errno != EAGAIN && errno != EWOULDBLOCK) {
+                fprintf(stderr, "accept: %s\n", strerror(errno));
+            }
+            return;
+        }
+
+        ServeConn *c = calloc(1, sizeof(ServeConn));
+        c->fd = fd;
+        c->index = buf_len(s->conns);
+        c->events = EPOLLIN;
+        c->capture = open_memstream(&c->text, &c->text_size);
+        serve_init_vm(c);
+
+        struct epoll_event ev = { .events = c->events, .data.ptr = c };
+        if (!c->capture || !serve_set_nonblocking(fd) ||
+                epoll_ctl(s->epoll, EPOLL_CTL_ADD, fd, &ev) < 0) {
+            fprintf(stderr, "Could not accept connection: %s\n", strerror(errno));
+            buf_push(s->conns, c);
+            serve_close(s, c->index);
+            continue;
+        }
+        buf_push(s->conns, c);
+        ++s->accepted;
+    }
+}
+
+// Evaluates one request and appends its response to c->out. source[length]
+// is temporarily overwritten with the terminator compile expects.
+static void serve_eval(ServeConn *c, char *source, int length)
+{
+    char saved = source[length];
+    source[length] = '\0';
+    VMResult r = vm_interpret(&c->vm, source);
+    source[length] = saved;
+
+    if (r.result == INTERPRET_OK) {
+        fprint_value(c->capture, r.value);
+    }
+    fflush(c->capture);
+    int size = (int)ftell(c->capture);
+    rewind(c->capture);
+
+    byte status = 0;
+    if (r.result == INTERPRET_COMPILE_ERROR) status = ERR_COMPILE;
+    if (r.result == INTERPRET_RUNTIME_ERROR) status = ERR_RUNTIME;
+
+    char *frame = buf_append(c->out, 5 + size);
+    serve_put_u32(frame, (uint32_t)size + 1);
+    frame[4] = (char)status;
+    memcpy(frame + 5, c->text, size);
+}
+
+// Reads what is available and answers every complete request. Returns false
+// if the connection has failed.
+static bool serve_read(Server *s, ServeConn *c)
+{
+    int len = buf_len(c->in);
+    // One spare byte so the last request can be terminated in place
+    buf_append(c->in, SERVE_READ_SIZE + 1);
+    ssize_t n = read(c->fd, c->in + len, SERVE_READ_SIZE);
+    buf_take(c->in, len + (n > 0 ? (int)n : 0));
+    if (n == 0) {
+        c->eof = true;
+    } else if (n < 0) {
+        return errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR;
+    }
+
+    int pos = 0;
+    len = buf_len(c->in);
+    while (len - pos >= 4) {
+        uint32_t size = serve_get_u32(c->in + pos);
+        if (size > SERVE_FRAME_MAX) return false;
+        if ((uint32_t)(len - pos - 4) < size) break;
+        serve_eval(c, c->in + pos + 4, (int)size);
+        serve_trim(s, c);
+        pos += 4 + (int)size;
+        ++s->requests;
+    }
+    if (pos > 0) {
+        memmove(c->in, c->in + pos, len - pos);
+        buf_take(c->in, len - pos);
+    }
+    return true;
+}
+
+// Sends as much pending output as the socket takes. Returns false if the
+// connection has failed.
+static bool serve_write(ServeConn *c)
+{
+    int len = buf_len(c->out);
+    while (c->out_pos < len) {
+        ssize_t n = send(c->fd, c->out + c->out_pos, len - c->out_pos, MSG_NOSIGNAL);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            return errno == EAGAIN || errno == EWOULDBLOCK;
+        }
+        c->out_pos += (int)n;
+    }
+    buf_clear(c->out);
+    c->out_pos = 0;
+    return true;
+}
+
+// Handles events for connection index and closes it when it is done.
+static void serve_update(Server *s, int index, uint32_t events)
+{
+    ServeConn *c = s->conns[index];
+    bool ok = !(events & EPOLLERR);
+    if (ok && (events & (EPOLLIN | EPOLLHUP)) && !c->eof) ok = serve_read(s, c);
+    if (ok) ok = serve_write(c);
+
+    int pending = buf_len(c->out) - c->out_pos;
+    if (!ok || (c->eof && pending == 0)) {
+        serve_close(s, index);
+        return;
+    }
+
+    uint32_t wanted = (!c->eof && pending <= SERVE_OUTPUT_MAX ? EPOLLIN : 0) |
+                      (pending ? EPOLLOUT : 0);
+    if (wanted != c->events) {
+        struct epoll_event ev = { .events = wanted, .data.ptr = c };
+        epoll_ctl(s->epoll, EPOLL_CTL_MOD, c->fd, &ev);
+        c->events = wanted;
+    }
+}
+
+// Serves requests on a Unix domain socket at path until SIGINT or SIGTERM.
+// Returns the process exit status.
+static int serve(const char *path, ReportFlags report)
+{
+    struct sockaddr_un addr = { .sun_family = AF_UNIX };
+    if (strlen(path) >= sizeof(addr.sun_path)) {
+        fprintf(stderr, "Socket path \"%s\" is too long.\n", path);
+        return ERR_USAGE;
+    }
+    memcpy(addr.sun_path, path, strlen(path));
+
+    // A socket left behind by an earlier server would make bind fail
+    struct stat st;
+    if (stat(path, &st) == 0 && S_ISSOCK(st.st_mode)) {
+        unlink(path);
+    }
+
+    Server s = { .listener = socket(AF_UNIX, SOCK_STREAM, 0), .epoll = epoll_create1(0) };
+    struct epoll_event ev = { .events = EPOLLIN, .data.ptr = NULL };
+    if (s.listener < 0 || s.epoll < 0 || !serve_set_nonblocking(s.listener) ||
+            bind(s.listener, (struct sockaddr *)&addr, sizeof(addr)) < 0 ||
+            listen(s.listener, SOMAXCONN) < 0 ||
+            epoll_ctl(s.epoll, EPOLL_CTL_ADD, s.listener, &ev) < 0) {
+        fprintf(stderr, "Could not listen on \"%s\": %s\n", path, strerror(errno));
+        return ERR_FILE;
+    }
+
+    struct sigaction sa = { .sa_handler = serve_on_signal };
+    sigaction(SIGINT, &sa, NULL);
+    sigaction(SIGTERM, &sa, NULL);
+    fprintf(stderr, "Listening on %s\n", path);
+
+    struct epoll_event events[SERVE_EVENTS];
+    while (!serve_stopping) {
+        int n = epoll_wait(s.epoll, events, SERVE_EVENTS, -1);
+        if (n < 0 && errno != EINTR) {
+            fprintf(stderr, "epoll_wait: %s\n", strerror(errno));
+            break;
+        }
+        for (int i = 0; i < n; ++i) {
+            ServeConn *c = events[i].data.ptr;
+            if (!c) {
+                serve_accept(&s);
+                continue;
+            }
+            serve_update(&s, c->index, events[i].events);
+        }
+    }
+
+    while (!buf_empty(s.conns)) {
+        serve_close(&s, buf_len(s.conns) - 1);
+    }
+    buf_free(s.conns);
+    close(s.epoll);
+    close(s.listener);
+    unlink(path);
+
+    fprintf(stderr, "%lld connections, %lld requests\n", (long long)s.accepted,
+        (long long)s.requests);
+    if (report & REPORT_CACHE) cache_print_stats(stderr, &s.cache);
+    return 0;
+}
@@ -0,0 +1,115 @@
+#pragma once
+
+#include "common.h"
+#include "buf.h"
+#include "object.c"
+#include "value.c"
+
+// Instances keep their fields in an array indexed by slot, and a shape that
+// names them. Adding a field moves an instance to the shape with one more
+// field, made the first time that field is added to an instance of the
+// shape and reused after that: instances that got the same fields in the same
+// order have the same shape, so a field access only needs to compare shapes
+// to know the slot (see vm_get_field). Shapes live as long as their class,
+// which reaches them all through the transitions.
+
+static Shape *shape_new(Heap *h, Shape *parent, Value name)
+{
+    Shape *s = (Shape *)heap_alloc(h, sizeof(Shape), OBJ_SHAPE);
+    *s = (Shape){ .obj = s->obj, .parent = parent, .name = name,
+                  .count = parent ? parent->count + 1 : 0 };
+    return s;
+}
+
+// Slot of field name in instances of shape s, or -1 if they don't have it.
+// Walks back from the last field added.
+static int shape_slot(const Shape *s, Value name)
+{
+    for (; s->parent; s = s->parent) {
+        if (values_equal(s->name, name)) return s->count - 1;
+    }
+    return -1;
+}
+
+// Shape of an instance of shape s after field name, which it doesn't have,
+// is added. The name is copied into h if it lives in another heap.
+static Shape *shape_add(Heap *h, Shape *s, Value name)
+{
+    for (int i = 0; i < buf_len(s->transitions); ++i) {
+        if (values_equal(s->transitions[i]->name, name)) return s->transitions[i];
+    }
+    Shape *next = shape_new(h, s, string_value(h, string_chars(&name), string_length(name)));
+    buf_push(s->transitions, next);
+    return next;
+}
+
+static ObjClass *class_new(Heap *h, Value name)
+{
+    ObjClass *c = (ObjClass *)heap_alloc(h, sizeof(ObjClass), OBJ_CLASS);
+    c->name = string_value(h, string_chars(&name), string_length(name));
+    c->shape = shape_new(h, NULL, NIL_VAL);
+    return c;
+}
+
+static ObjInstance *instance_new(Heap *h, ObjClass *c)
+{
+    ObjInstance *o = (ObjInstance *)heap_alloc(h, sizeof(ObjInstance), OBJ_INSTANCE);
+    *o = (ObjInstance){ .obj = o->obj, .klass = c, .shape = c->shape };
+    return o;
+}
+
+// Sets field name of o, adding it if o doesn't have it yet. Returns its slot.
+static int instance_set(Heap *h, ObjInstance *o, Value name, Value value)
+{
+    int slot = shape_slot(o->shape, name);
+    if (slot >= 0) {
+        o->fields[slot] = value;
+        return slot;
+    }
+    o->shape = shape_add(h, o->shape, name);
+    buf_push(o->fields, value);
+    return o->shape->count - 1;
+}
+
+static void class_print(FILE *out, const ObjClass *c)
+{
+    fputs("<class ", out);
+    string_print(out, c->name);
+    fputs(">", out);
+}
+
+static void instance_print(FILE *out, const ObjInstance *o)
+{
+    fputs("<", out);
+    string_print(out, o->klass->name);
+    fputs(" instance>", out);
+}
+
+#ifndef NDEBUG
+static void shape_test(void)
+{
+    Heap h = { 0 };
+    ObjClass *c = class_new(&h, string_value(&h, "Point", 5));
+    ObjInstance *a = instance_new(&h, c), *b = instance_new(&h, c);
+    Value x = string_value(&h, "x", 1), y = string_value(&h, "y", 1);
+    Value long_name = string_value(&h, "a_long_field_name", 17);
+
+    // The same fields in the same order share a shape, in another order not
+    instance_set(&h, a, x, INT_VAL(1));
+    instance_set(&h, a, y, INT_VAL(2));
+    instance_set(&h, b, x, INT_VAL(3));
+    instance_set(&h, b, y, INT_VAL(4));
+    instance_set(&h, a, x, INT_VAL(5));
+    assert(a->shape == b->shape && a->shape->count == 2 && shape_slot(a->shape, y) == 1);
+    assert(buf_len(c->shape->transitions) == 1);
+    ObjInstance *d = instance_new(&h, c);
+    instance_set(&h, d, y, INT_VAL(6));
+    instance_set(&h, d, long_name, INT_VAL(7));
+    assert(d->shape != a->shape && shape_slot(d->shape, x) < 0 && buf_len(c->shape->transitions) == 2);
+
+    assert(AS_INT(a->fields[shape_slot(a->shape, x)]) == 5);
+    Value copy = string_value(&h, "a_long_field_name", 17);
+    assert(AS_INT(d->fields[shape_slot(d->shape, copy)]) == 7 && shape_slot(b->shape, copy) < 0);
+    heap_free(&h);
+}
+#endif
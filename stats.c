@@ -0,0 +1,111 @@
+#pragma once
+
+#include "common.h"
+#include "buf.h"
+#include "clock.c"
+#include "scanner.c"
+
+typedef enum {
+    PHASE_READ,
+    PHASE_SCAN,
+    PHASE_COMPILE,
+    PHASE_RUN,
+    phase__count,
+} Phase;
+
+static const char *phase_names[phase__count] = {
+    [PHASE_READ]    = "read",
+    [PHASE_SCAN]    = "scan",
+    [PHASE_COMPILE] = "compile",
+    [PHASE_RUN]     = "run",
+};
+
+// Per-evaluation instrumentation, filled in when VM.stats is set
+struct Stats {
+    uint64_t ns[phase__count];
+    int64_t  bytes;        // source bytes
+    int64_t  tokens;       // tokens produced by the scan phase
+    int64_t  instructions; // instructions dispatched by vm_run
+    BufStats mem;          // buffer and heap object accounting (--mem)
+};
+
+typedef enum {
+    REPORT_TIME   = 1 << 0, // --time
+    REPORT_MEM    = 1 << 1, // --mem
+    REPORT_CACHE  = 1 << 2, // --cache-stats, per VM rather than per script
+    REPORT_LOOPS  = 1 << 3, // --loops, per VM too
+    REPORT_FIELDS = 1 << 4, // --fields, per VM too
+} ReportFlags;
+
+// Scans source without compiling it to measure the scanner on its own.
+static void stats_scan(Stats *s, const char *source)
+{
+    uint64_t start = clock_ns();
+    Scanner scanner;
+    scanner_init(&scanner, source);
+    int64_t tokens = 0;
+    for (;;) {
+        Token t = scanner_scan_token(&scanner);
+        ++tokens;
+        if (t.type == TOKEN_EOF) break;
+    }
+    s->ns[PHASE_SCAN] = clock_ns() - start;
+    s->bytes = (int64_t)(scanner.current - source);
+    s->tokens = tokens;
+}
+
+// Starts allocation accounting for the current thread.
+MAYBE_UNUSED static void stats_mem_begin(void)
+{
+    buf_stats = (BufStats){ 0 };
+    buf_stats_enabled = true;
+}
+
+MAYBE_UNUSED static void stats_mem_end(Stats *s)
+{
+    s->mem = buf_stats;
+    buf_stats_enabled = false;
+}
+
+static double stats_rate(double count, uint64_t ns)
+{
+    return ns ? count * 1e9 / (double)ns : 0;
+}
+
+static void stats_print_time(FILE *out, const Stats *s)
+{
+    // The scan phase is a separate pass over the source for measurement only;
+    // compile does its own scanning, so scan is not part of the total.
+    uint64_t total = s->ns[PHASE_READ] + s->ns[PHASE_COMPILE] + s->ns[PHASE_RUN];
+
+    fprintf(out, "%-8s %12s  %s\n", "phase", "ms", "throughput");
+    fprintf(out, "%-8s %12.3f  %.1f MB/s\n", phase_names[PHASE_READ],
+        clock_ms(s->ns[PHASE_READ]), stats_rate(s->bytes, s->ns[PHASE_READ]) / 1e6);
+    fprintf(out, "%-8s %12.3f  %.1f MB/s, %.2f Mtokens/s\n", phase_names[PHASE_SCAN],
+        clock_ms(s->ns[PHASE_SCAN]), stats_rate(s->bytes, s->ns[PHASE_SCAN]) / 1e6,
+        stats_rate(s->tokens, s->ns[PHASE_SCAN]) / 1e6);
+    fprintf(out, "%-8s %12.3f  %.1f MB/s, %.2f Mtokens/s\n", phase_names[PHASE_COMPILE],
+        clock_ms(s->ns[PHASE_COMPILE]), stats_rate(s->bytes, s->ns[PHASE_COMPILE]) / 1e6,
+        stats_rate(s->tokens, s->ns[PHASE_COMPILE]) / 1e6);
+    fprintf(out, "%-8s %12.3f  %.2f Minstr/s (%lld instructions)\n", phase_names[PHASE_RUN],
+        clock_ms(s->ns[PHASE_RUN]), stats_rate(s->instructions, s->ns[PHASE_RUN]) / 1e6,
+        (long long)s->instructions);
+    fprintf(out, "%-8s %12.3f\n", "total", clock_ms(total));
+}
+
+static void stats_print_mem(FILE *out, const Stats *s)
+{
+    const BufStats *m = &s->mem;
+    fprintf(out,
+        "buffers: allocs %lld, reallocs %lld, frees %lld; objects: allocs %lld, frees %lld\n"
+        "bytes %lld, peak %lld, live %lld\n",
+        (long long)m->allocs, (long long)m->reallocs, (long long)m->frees,
+        (long long)m->objects, (long long)m->object_frees,
+        (long long)m->bytes, (long long)m->peak, (long long)m->live);
+}
+
+MAYBE_UNUSED static void stats_print(FILE *out, const Stats *s, ReportFlags report)
+{
+    if (report & REPORT_TIME) stats_print_time(out, s);
+    if (report & REPORT_MEM) stats_print_mem(out, s);
+}
@@ -7,6 +7,7 @@ static const char *token_type_names[] = {
 
     [TOKEN_BANG]          = "TOKEN_BANG",
     [TOKEN_BANG_EQUAL]    = "TOKEN_BANG_EQUAL",
+    [TOKEN_COLON]         = "TOKEN_COLON",
     [TOKEN_COMMA]         = "TOKEN_COMMA",
     [TOKEN_DOT]           = "TOKEN_DOT",
     [TOKEN_EQUAL]         = "TOKEN_EQUAL",
@@ -14,12 +15,15 @@ static const char *token_type_names[] = {
     [TOKEN_GREATER]       = "TOKEN_GREATER",
     [TOKEN_GREATER_EQUAL] = "TOKEN_GREATER_EQUAL",
     [TOKEN_LEFT_BRACE]    = "TOKEN_LEFT_BRACE",
+    [TOKEN_LEFT_BRACKET]  = "TOKEN_LEFT_BRACKET",
     [TOKEN_LEFT_PAREN]    = "TOKEN_LEFT_PAREN",
     [TOKEN_LESS]          = "TOKEN_LESS",
     [TOKEN_LESS_EQUAL]    = "TOKEN_LESS_EQUAL",
     [TOKEN_MINUS]         = "TOKEN_MINUS",
     [TOKEN_PLUS]          = "TOKEN_PLUS",
+    [TOKEN_QUESTION]      = "TOKEN_QUESTION",
     [TOKEN_RIGHT_BRACE]   = "TOKEN_RIGHT_BRACE",
+    [TOKEN_RIGHT_BRACKET] = "TOKEN_RIGHT_BRACKET",
     [TOKEN_RIGHT_PAREN]   = "TOKEN_RIGHT_PAREN",
     [TOKEN_SEMICOLON]     = "TOKEN_SEMICOLON",
     [TOKEN_SLASH]         = "TOKEN_SLASH",
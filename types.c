@@ -0,0 +1,118 @@
+#pragma once
+
+#include "common.h"
+
+// Static types of stack values, shared by the compiler and the verifier
+
+static StaticType value_type(Value v)
+{
+    switch (v.type) {
+        case VAL_NIL:    return TYPE_NIL;
+        case VAL_BOOL:   return TYPE_BOOL;
+        case VAL_NUMBER:
+        case VAL_INT:    return TYPE_NUMBER;
+        case VAL_SMALL_STRING: return TYPE_STRING;
+        case VAL_OBJ:    return IS_STRING(v) ? TYPE_STRING : TYPE_UNKNOWN;
+        case VAL_UNDEFINED: return TYPE_UNKNOWN;
+    }
+    return TYPE_UNKNOWN;
+}
+
+// Type of a value that comes from either of two paths
+static StaticType type_merge(StaticType a, StaticType b)
+{
+    return a == b ? a : TYPE_UNKNOWN;
+}
+
+// Operands of the expression operators
+static int op_arity(byte op)
+{
+    switch (op) {
+        case OP_NOT:
+        case OP_NEG:
+        case OP_SQRT:
+        case OP_FLOOR:
+        case OP_NEG_N:
+            return 1;
+        default:
+            return 2;
+    }
+}
+
+// Type of the value op pushes given operand types a and b, whether checked or
+// not. Checked operators only produce a value when their operands had the
+// right type: OP_ADD adds two numbers or concatenates two strings. An operand
+// of unknown type may be an array, which the arithmetic operators, the
+// comparisons and OP_NOT apply to element-wise, giving an array.
+static StaticType op_result_type(byte op, StaticType a, StaticType b)
+{
+    switch (op) {
+        case OP_EQ:
+        case OP_GT_NN:
+        case OP_LT_NN:
+            return TYPE_BOOL;
+        case OP_GT:
+        case OP_LT:
+        case OP_NOT:
+            return a == TYPE_UNKNOWN || b == TYPE_UNKNOWN ? TYPE_UNKNOWN : TYPE_BOOL;
+        case OP_ADD:
+            if (a == TYPE_STRING || b == TYPE_STRING) return TYPE_STRING;
+            if (a == TYPE_UNKNOWN || b == TYPE_UNKNOWN) return TYPE_UNKNOWN;
+            return TYPE_NUMBER;
+        case OP_SUB:
+        case OP_MUL:
+        case OP_DIV:
+            return a == TYPE_UNKNOWN || b == TYPE_UNKNOWN ? TYPE_UNKNOWN : TYPE_NUMBER;
+        case OP_NEG:
+        case OP_SQRT:
+        case OP_FLOOR:
+        case OP_MIN:
+        case OP_MAX:
+        case OP_ADD_NN:
+        case OP_SUB_NN:
+        case OP_MUL_NN:
+        case OP_DIV_NN:
+        case OP_NEG_N:
+        case OP_GET_INDEX:
+        case OP_SET_INDEX:
+            return TYPE_NUMBER;
+        default:
+            return TYPE_UNKNOWN;
+    }
+}
+
+// Returns the variant of op that skips operand type checks if the operand
+// types a (and b for binary operators) allow it, otherwise op itself.
+static byte op_unchecked(byte op, StaticType a, StaticType b)
+{
+    if (op == OP_NEG) {
+        return a == TYPE_NUMBER ? OP_NEG_N : op;
+    }
+    if (a != TYPE_NUMBER || b != TYPE_NUMBER) {
+        return op;
+    }
+    switch (op) {
+        case OP_GT:  return OP_GT_NN;
+        case OP_LT:  return OP_LT_NN;
+        case OP_ADD: return OP_ADD_NN;
+        case OP_SUB: return OP_SUB_NN;
+        case OP_MUL: return OP_MUL_NN;
+        case OP_DIV: return OP_DIV_NN;
+        default:     return op;
+    }
+}
+
+// Whether op, given operand types a and b, always produces a value instead of
+// a runtime error
+static bool op_cannot_fail(byte op, StaticType a, StaticType b)
+{
+    switch (op) {
+        case OP_EQ:
+        case OP_NOT:
+            return true;
+        case OP_ADD:
+            return a == b && (a == TYPE_NUMBER || a == TYPE_STRING);
+        default:
+            return a == TYPE_NUMBER && b == TYPE_NUMBER;
+    }
+}
@@ -0,0 +1,122 @@
+#pragma once
+
+#include <math.h>
+
+#include "common.h"
+
+// Whether numbers a and b have the same value, exactly, whatever their kind
+static bool numbers_equal(Value a, Value b)
+{
+    if (IS_INT(a) && IS_INT(b)) return AS_INT(a) == AS_INT(b);
+    if (IS_DOUBLE(a) && IS_DOUBLE(b)) return AS_DOUBLE(a) == AS_DOUBLE(b);
+    int64_t i = IS_INT(a) ? AS_INT(a) : AS_INT(b);
+    double d = IS_INT(a) ? AS_DOUBLE(b) : AS_DOUBLE(a);
+    return d >= -0x1p63 && d < 0x1p63 && (int64_t)d == i && (double)(int64_t)d == d;
+}
+
+// Arithmetic on numbers. Integer operands give an integer unless the result
+// overflows, then the operation is done in doubles instead. Mixed operands
+// are converted to double. Division always gives a double.
+static Value number_add(Value a, Value b)
+{
+    int64_t r;
+    if (IS_INT(a) && IS_INT(b) && !__builtin_add_overflow(AS_INT(a), AS_INT(b), &r)) {
+        return INT_VAL(r);
+    }
+    return NUMBER_VAL(AS_NUMBER(a) + AS_NUMBER(b));
+}
+
+static Value number_sub(Value a, Value b)
+{
+    int64_t r;
+    if (IS_INT(a) && IS_INT(b) && !__builtin_sub_overflow(AS_INT(a), AS_INT(b), &r)) {
+        return INT_VAL(r);
+    }
+    return NUMBER_VAL(AS_NUMBER(a) - AS_NUMBER(b));
+}
+
+static Value number_mul(Value a, Value b)
+{
+    int64_t r;
+    if (IS_INT(a) && IS_INT(b) && !__builtin_mul_overflow(AS_INT(a), AS_INT(b), &r)) {
+        return INT_VAL(r);
+    }
+    return NUMBER_VAL(AS_NUMBER(a) * AS_NUMBER(b));
+}
+
+static Value number_div(Value a, Value b)
+{
+    return NUMBER_VAL(AS_NUMBER(a) / AS_NUMBER(b));
+}
+
+static Value number_neg(Value a)
+{
+    if (IS_INT(a) && AS_INT(a) != INT64_MIN) return INT_VAL(-AS_INT(a));
+    return NUMBER_VAL(-AS_NUMBER(a));
+}
+
+static Value number_gt(Value a, Value b)
+{
+    if (IS_INT(a) && IS_INT(b)) return BOOL_VAL(AS_INT(a) > AS_INT(b));
+    return BOOL_VAL(AS_NUMBER(a) > AS_NUMBER(b));
+}
+
+static Value number_lt(Value a, Value b)
+{
+    if (IS_INT(a) && IS_INT(b)) return BOOL_VAL(AS_INT(a) < AS_INT(b));
+    return BOOL_VAL(AS_NUMBER(a) < AS_NUMBER(b));
+}
+
+static Value number_sqrt(Value a)
+{
+    return NUMBER_VAL(sqrt(AS_NUMBER(a)));
+}
+
+// An integer when the result fits one, so floor(7 / 2) is 3 rather than 3.0
+static Value number_floor(Value a)
+{
+    if (IS_INT(a)) return a;
+    double d = floor(AS_DOUBLE(a));
+    return d >= -0x1p63 && d < 0x1p63 ? INT_VAL((int64_t)d) : NUMBER_VAL(d);
+}
+
+// The smaller operand itself, a when they are equal or unordered
+static Value number_min(Value a, Value b)
+{
+    return AS_BOOL(number_lt(b, a)) ? b : a;
+}
+
+static Value number_max(Value a, Value b)
+{
+    return AS_BOOL(number_gt(b, a)) ? b : a;
+}
+
+// Strings of different lengths can't both be small, so comparing the type
+// and then the bytes or pointer is enough.
+static bool values_equal(Value a, Value b)
+{
+    if (IS_NUMBER(a) && IS_NUMBER(b)) return numbers_equal(a, b);
+    if (a.type != b.type) return false;
+
+    switch (a.type) {
+        case VAL_NIL:    return true;
+        case VAL_BOOL:   return AS_BOOL(a) == AS_BOOL(b);
+        case VAL_NUMBER:
+        case VAL_INT:    return false; // handled above
+        case VAL_SMALL_STRING:
+            return memcmp(a.as.small, b.as.small, SMALL_STRING_MAX) == 0;
+        case VAL_OBJ: {
+            // Strings are interned, so equal strings of one heap are one
+            // object. Those of different heaps, a shared image's constants and
+            // a VM's own strings, are compared by contents. Ropes must be
+            // flattened first.
+            if (AS_OBJ(a) == AS_OBJ(b)) return true;
+            if (AS_OBJ(a)->type != OBJ_STRING || AS_OBJ(b)->type != OBJ_STRING) return false;
+            const ObjString *x = AS_STRING(a), *y = AS_STRING(b);
+            return x->hash == y->hash && x->length == y->length &&
+                   memcmp(x->chars, y->chars, x->length) == 0;
+        }
+        case VAL_UNDEFINED: return true;
+    }
+    return false;
+}
@@ -0,0 +1,500 @@
+#pragma once
+
+#include "common.h"
+#include "buf.h"
+#include "chunk.c"
+#include "debug.c"
+#include "natives.c"
+#include "types.c"
+
+// Values each instruction pops and then pushes
+typedef struct {
+    int8_t pop;
+    int8_t push;
+} StackEffect;
+
+static const StackEffect stack_effects[op__count] = {
+    [OP_CONSTANT]   = { 0, 1 },
+    [OP_CONSTANT_X] = { 0, 1 },
+    [OP_ZERO]       = { 0, 1 },
+    [OP_ONE]        = { 0, 1 },
+    [OP_SMALLINT]   = { 0, 1 },
+    [OP_SMALLINT_X] = { 0, 1 },
+    [OP_NIL]        = { 0, 1 },
+    [OP_FALSE]      = { 0, 1 },
+    [OP_TRUE]       = { 0, 1 },
+    [OP_DUP]        = { 1, 2 },
+    [OP_PICK]       = { 0, 1 }, // operand checked separately
+    [OP_ROLL]       = { 0, 0 }, // operand checked separately
+    [OP_POP]        = { 1, 0 },
+    [OP_DEFINE_GLOBAL] = { 1, 0 },
+    [OP_GET_GLOBAL]    = { 0, 1 },
+    [OP_SET_GLOBAL]    = { 1, 1 },
+    [OP_GET_LOCAL]     = { 0, 1 }, // slot checked separately
+    [OP_SET_LOCAL]     = { 1, 1 },
+    [OP_EQ]         = { 2, 1 },
+    [OP_GT]         = { 2, 1 },
+    [OP_LT]         = { 2, 1 },
+    [OP_ADD]        = { 2, 1 },
+    [OP_SUB]        = { 2, 1 },
+    [OP_MUL]        = { 2, 1 },
+    [OP_DIV]        = { 2, 1 },
+    [OP_NOT]        = { 1, 1 },
+    [OP_NEG]        = { 1, 1 },
+    [OP_SQRT]       = { 1, 1 },
+    [OP_FLOOR]      = { 1, 1 },
+    [OP_MIN]        = { 2, 1 },
+    [OP_MAX]        = { 2, 1 },
+    [OP_GT_NN]      = { 2, 1 },
+    [OP_LT_NN]      = { 2, 1 },
+    [OP_ADD_NN]     = { 2, 1 },
+    [OP_SUB_NN]     = { 2, 1 },
+    [OP_MUL_NN]     = { 2, 1 },
+    [OP_DIV_NN]     = { 2, 1 },
+    [OP_NEG_N]      = { 1, 1 },
+    [OP_JUMP]                = { 0, 0 },
+    [OP_JUMP_IF_FALSE]       = { 1, 0 },
+    [OP_JUMP_IF_TRUE]        = { 1, 0 },
+    [OP_JUMP_IF_FALSE_OR_POP] = { 1, 0 }, // when it falls through
+    [OP_JUMP_IF_TRUE_OR_POP]  = { 1, 0 },
+    [OP_LOOP]                 = { 0, 0 },
+    [OP_LOOP_IF_TRUE]         = { 1, 0 },
+    [OP_SELECT]     = { 3, 1 },
+    [OP_ARRAY]      = { 0, 0 }, // operand checked separately
+    [OP_GET_INDEX]  = { 2, 1 },
+    [OP_SET_INDEX]  = { 3, 1 },
+    [OP_CLASS]      = { 0, 1 }, // name checked separately, like the two below
+    [OP_GET_FIELD]  = { 1, 1 },
+    [OP_SET_FIELD]  = { 2, 1 },
+    [OP_CALL_NATIVE] = { 0, 0 }, // operands checked separately
+    [OP_CALL]       = { 0, 0 },
+    [OP_RETURN]     = { 1, 0 },
+};
+
+static bool verify_error(FILE *out, int offset, const char *format, ...)
+{
+    if (!out) return false;
+    fprintf(out, "Invalid bytecode at %06X: ", offset);
+    va_list args;
+    va_start(args, format);
+    vfprintf(out, format, args);
+    va_end(args);
+    fputs("\n", out);
+    return false;
+}
+
+// Stack at a jump target, as left by the jumps to it seen so far
+typedef struct {
+    StaticType *types;
+    bool        set;
+    bool        head; // target of a backward jump
+} VerifyEntry;
+
+// Merges stack types into the entry of a jump target. Slots the paths disagree
+// on become unknown. Returns false if the heights differ. Sets *changed, if
+// not NULL, when the entry was not set or a slot became unknown.
+static bool verify_merge(VerifyEntry *entry, const StaticType *types, int height, bool *changed)
+{
+    if (changed) *changed = !entry->set;
+    if (!entry->set) {
+        entry->set = true;
+        for (int i = 0; i < height; ++i) {
+            buf_push(entry->types, types[i]);
+        }
+        return true;
+    }
+    if (buf_len(entry->types) != height) return false;
+    for (int i = 0; i < height; ++i) {
+        StaticType t = type_merge(entry->types[i], types[i]);
+        if (changed && t != entry->types[i]) *changed = true;
+        entry->types[i] = t;
+    }
+    return true;
+}
+
+// Marks the targets of backward jumps in c that are instructions as loop
+// heads. Returns the entries, or NULL if there are no backward jumps.
+static VerifyEntry *verify_loop_heads(const Chunk *c)
+{
+    const byte *code = c->code;
+    int len = buf_len(code);
+    VerifyEntry *entries = NULL;
+    bool *starts = NULL;
+    for (int offset = 0; offset < len;) {
+        byte op = code[offset];
+        if (op >= op__count) break;
+        int size = InstrSize[op] ? InstrSize[op] : 1;
+        if (offset + size > len) break;
+        if (op_is_loop(op) && !entries) {
+            entries = calloc(len, sizeof(*entries));
+            starts = calloc(len, sizeof(*starts));
+            for (int o = 0; o < offset; o += InstrSize[code[o]] ? InstrSize[code[o]] : 1) {
+                starts[o] = true;
+            }
+        }
+        if (starts) starts[offset] = true;
+        if (op_is_loop(op)) {
+            int target = chunk_loop_target(c, offset);
+            if (target >= 0 && target <= offset && starts[target]) entries[target].head = true;
+        }
+        offset += size;
+    }
+    free(starts);
+    return entries;
+}
+
+// Checks that every instruction in c is well formed, that its operands are in
+// bounds, that the stack never underflows and that unchecked operators only
+// see numbers, then records the exact maximum stack depth in c->max_stack
+// and gives c a new id.
+// Forward jumps are seen before the instruction they go to, and the stack
+// must have the same height on every way into it. A backward jump that
+// brings a loop head a new state, or types the head had not seen, sends the
+// pass back to the head; types only ever widen to unknown, so this ends.
+// vm_run relies on all of this and does no checking of its own.
+// A function's chunk starts with its c->arity arguments on the stack, of
+// unknown types; locals are the stack slots from there on.
+// Problems are reported to out unless it is NULL.
+static bool chunk_verify(Chunk *c, FILE *out)
+{
+    const byte *code = c->code;
+    int len = buf_len(code);
+    int constants = buf_len(c->constants);
+    StaticType *types = NULL; // static type of each stack slot
+    VerifyEntry *entries = verify_loop_heads(c); // by offset, for jump targets
+    for (int i = 0; i < c->arity; ++i) {
+        buf_push(types, TYPE_UNKNOWN);
+    }
+    int max = c->arity;
+    int restart = -1; // loop head to go back to
+    bool reachable = true;
+    bool ok = true;
+
+    for (int offset = 0; ok && offset < len;) {
+        VerifyEntry *entry = entries ? &entries[offset] : NULL;
+        if (entry && (entry->set || (entry->head && reachable))) {
+            if (reachable && !verify_merge(entry, types, buf_len(types), NULL)) {
+                ok = verify_error(out, offset, "stack height differs between paths");
+                break;
+            }
+            buf_take(types, 0);
+            for (int i = 0; i < buf_len(entry->types); ++i) {
+                buf_push(types, entry->types[i]);
+            }
+            reachable = true;
+        }
+
+        byte op = code[offset];
+        if (op >= op__count) {
+            ok = verify_error(out, offset, "unknown opcode %d", op);
+            break;
+        }
+        int size = InstrSize[op] ? InstrSize[op] : 1;
+        if (offset + size > len) {
+            ok = verify_error(out, offset, "truncated instruction");
+            break;
+        }
+
+        for (int i = 1; entries && i < size; ++i) {
+            if (entries[offset + i].set) {
+                ok = verify_error(out, offset, "jump into the middle of an instruction");
+            }
+        }
+        if (!ok) break;
+
+        // Code after a return or jump that no jump goes to is never executed;
+        // its operands must still decode.
+        if (!reachable) {
+            offset += size;
+            continue;
+        }
+
+        const StackEffect *e = &stack_effects[op];
+        int height = buf_len(types);
+        if (height < e->pop) {
+            ok = verify_error(out, offset, "stack underflow");
+            break;
+        }
+
+        switch (op) {
+            case OP_CONSTANT:
+            case OP_CONSTANT_X: {
+                int constant = code[offset + 1];
+                if (op == OP_CONSTANT_X) {
+                    constant |= code[offset + 2] << 8 | code[offset + 3] << 16;
+                }
+                if (constant >= constants) {
+                    ok = verify_error(out, offset, "constant %d out of range", constant);
+                    break;
+                }
+                buf_push(types, value_type(c->constants[constant]));
+                break;
+            }
+            case OP_ZERO:
+            case OP_ONE:
+            case OP_SMALLINT:
+            case OP_SMALLINT_X: buf_push(types, TYPE_NUMBER); break;
+            case OP_NIL:   buf_push(types, TYPE_NIL); break;
+            case OP_FALSE: buf_push(types, TYPE_BOOL); break;
+            case OP_TRUE:  buf_push(types, TYPE_BOOL); break;
+            case OP_DUP:   buf_push(types, types[height - 1]); break;
+            case OP_PICK:
+            case OP_ROLL: {
+                int n = code[offset + 1];
+                if (n >= height) {
+                    ok = verify_error(out, offset, "stack depth %d out of range", n);
+                    break;
+                }
+                StaticType t = types[height - 1 - n];
+                if (op == OP_ROLL) {
+                    memmove(&types[height - 1 - n], &types[height - n], n * sizeof(*types));
+                    buf_pop(types);
+                }
+                buf_push(types, t);
+                break;
+            }
+            case OP_POP:
+                buf_pop(types);
+                break;
+            case OP_DEFINE_GLOBAL:
+            case OP_GET_GLOBAL:
+            case OP_SET_GLOBAL: {
+                int slot = code[offset + 1] | code[offset + 2] << 8;
+                if (slot >= c->global_count) {
+                    ok = verify_error(out, offset, "global slot %d out of range", slot);
+                    break;
+                }
+                if (op == OP_DEFINE_GLOBAL) buf_pop(types);
+                if (op == OP_GET_GLOBAL) buf_push(types, TYPE_UNKNOWN);
+                break;
+            }
+            case OP_GET_LOCAL:
+            case OP_SET_LOCAL: {
+                // Slot types are tracked like any other, so a local keeps the
+                // type of the value last stored in it
+                int slot = code[offset + 1];
+                if (slot >= height - (op == OP_SET_LOCAL)) {
+                    ok = verify_error(out, offset, "local slot %d out of range", slot);
+                    break;
+                }
+                if (op == OP_GET_LOCAL) buf_push(types, types[slot]);
+                else types[slot] = types[height - 1];
+                break;
+            }
+            case OP_JUMP:
+            case OP_JUMP_IF_FALSE:
+            case OP_JUMP_IF_TRUE:
+            case OP_JUMP_IF_FALSE_OR_POP:
+            case OP_JUMP_IF_TRUE_OR_POP: {
+                int target = chunk_jump_target(c, offset);
+                if (target >= len) {
+                    ok = verify_error(out, offset, "jump target %06X out of range", target);
+                    break;
+                }
+                if (!entries) {
+                    entries = calloc(len, sizeof(*entries));
+                }
+                bool keep = op == OP_JUMP_IF_FALSE_OR_POP || op == OP_JUMP_IF_TRUE_OR_POP;
+                if (op != OP_JUMP && !keep) buf_pop(types);
+                if (!verify_merge(&entries[target], types, buf_len(types), NULL)) {
+                    ok = verify_error(out, offset, "stack height differs between paths");
+                    break;
+                }
+                if (keep) buf_pop(types);
+                reachable = op != OP_JUMP;
+                break;
+            }
+            case OP_LOOP:
+            case OP_LOOP_IF_TRUE: {
+                int target = chunk_loop_target(c, offset);
+                if (target < 0 || target > offset) {
+                    ok = verify_error(out, offset, "jump target %06X out of range", target);
+                    break;
+                }
+                if (!entries[target].head) {
+                    ok = verify_error(out, offset, "jump into the middle of an instruction");
+                    break;
+                }
+                if (op == OP_LOOP_IF_TRUE) buf_pop(types);
+                bool changed;
+                if (!verify_merge(&entries[target], types, buf_len(types), &changed)) {
+                    ok = verify_error(out, offset, "stack height differs between paths");
+                    break;
+                }
+                reachable = op != OP_LOOP;
+                if (changed) restart = target;
+                break;
+            }
+            case OP_SELECT: {
+                StaticType b = *buf_pop(types);
+                StaticType a = *buf_pop(types);
+                *buf_last(types) = type_merge(a, b);
+                break;
+            }
+            case OP_CALL_NATIVE: {
+                int native = code[offset + 1], argc = code[offset + 2];
+                if (native >= native_count) {
+                    ok = verify_error(out, offset, "native %d out of range", native);
+                    break;
+                }
+                int arity = natives[native].arity;
+                if (arity >= 0 ? argc != arity : argc == 0) {
+                    ok = verify_error(out, offset, "%d arguments to '%s'", argc, natives[native].name);
+                    break;
+                }
+                if (argc > height) {
+                    ok = verify_error(out, offset, "stack underflow");
+                    break;
+                }
+                buf_take(types, height - argc);
+                buf_push(types, natives[native].result);
+                break;
+            }
+            case OP_ARRAY: {
+                int count = code[offset + 1];
+                if (count > height) {
+                    ok = verify_error(out, offset, "stack underflow");
+                    break;
+                }
+                buf_take(types, height - count);
+                buf_push(types, TYPE_UNKNOWN);
+                break;
+            }
+            case OP_CLASS:
+            case OP_GET_FIELD:
+            case OP_SET_FIELD: {
+                int constant = code[offset + 1] | code[offset + 2] << 8 | code[offset + 3] << 16;
+                if (constant >= constants) {
+                    ok = verify_error(out, offset, "constant %d out of range", constant);
+                    break;
+                }
+                Value name = c->constants[constant];
+                if (!IS_SMALL_STRING(name) && !IS_OBJ_TYPE(name, OBJ_STRING)) {
+                    ok = verify_error(out, offset, "constant %d is not a name", constant);
+                    break;
+                }
+                // A stored field keeps the type of the value
+                StaticType t = op == OP_SET_FIELD ? *buf_pop(types) : TYPE_UNKNOWN;
+                if (op != OP_CLASS) buf_pop(types);
+                buf_push(types, t);
+                break;
+            }
+            case OP_CALL: {
+                int argc = code[offset + 1];
+                if (argc + 1 > height) {
+                    ok = verify_error(out, offset, "stack underflow");
+                    break;
+                }
+                buf_take(types, height - argc - 1);
+                buf_push(types, TYPE_UNKNOWN);
+                break;
+            }
+            case OP_RETURN:
+                buf_pop(types);
+                reachable = false;
+                break;
+            default:
+                for (int i = 0; op >= OP_GT_NN && op <= OP_NEG_N && i < e->pop; ++i) {
+                    if (types[height - 1 - i] != TYPE_NUMBER) {
+                        ok = verify_error(out, offset, "operand %d may not be a number",
+                            e->pop - i);
+                        break;
+                    }
+                }
+                StaticType a = types[height - e->pop];
+                StaticType b = types[height - 1];
+                buf_take(types, height - e->pop);
+                buf_push(types, op_result_type(op, a, b));
+                break;
+        }
+
+        max = BUF_MAX(max, buf_len(types));
+        offset += size;
+        if (restart >= 0) {
+            offset = restart;
+            restart = -1;
+            reachable = false; // takes the types of the head
+        }
+    }
+
+    if (ok && reachable) {
+        ok = verify_error(out, len, "missing return");
+    }
+    if (ok) {
+        c->max_stack = max;
+        chunk_new_id(c);
+    }
+    for (int i = 0; entries && i < len; ++i) {
+        buf_free(entries[i].types);
+    }
+    free(entries);
+    buf_free(types);
+    return ok;
+}
+
+#ifndef NDEBUG
+static void verify_test(void)
+{
+    static const struct { byte code[16]; int len; int max_stack; } cases[] = {
+        { { OP_CONSTANT, 0, OP_DUP, OP_PICK, 1, OP_ADD, OP_ADD, OP_RETURN }, 8, 3 },
+        { { OP_NIL, OP_TRUE, OP_ROLL, 1, OP_EQ, OP_RETURN }, 6, 2 },
+        { { OP_ADD, OP_RETURN }, 2, -1 },                 // underflow
+        { { OP_NIL, OP_PICK, 1, OP_RETURN }, 4, -1 },     // depth out of range
+        { { OP_CONSTANT, 1, OP_RETURN }, 3, -1 },         // no such constant
+        { { OP_CONSTANT_X, 0, 0 }, 3, -1 },               // truncated
+        { { OP_NIL, op__count, OP_RETURN }, 3, -1 },      // unknown opcode
+        { { OP_NIL }, 1, -1 },                            // missing return
+        { { OP_CONSTANT, 0, OP_NEG_N, OP_DUP, OP_LT_NN, OP_RETURN }, 6, 2 },
+        { { OP_CONSTANT, 0, OP_NIL, OP_ADD_NN, OP_RETURN }, 5, -1 }, // not a number
+        { { OP_NIL, OP_DEFINE_GLOBAL, 0, 0, OP_GET_GLOBAL, 0, 0, OP_RETURN }, 8, 1 },
+        { { OP_GET_GLOBAL, 0, 0, OP_NEG_N, OP_RETURN }, 5, -1 },     // may not be a number
+        { { OP_GET_GLOBAL, 1, 0, OP_RETURN }, 4, -1 },               // no such global
+        { { OP_ONE, OP_SMALLINT, 0xFF, OP_SMALLINT_X, 0, 0x80, OP_ADD_NN, OP_RETURN }, 8, 3 },
+        { { OP_ZERO, OP_SMALLINT_X, 0 }, 3, -1 },                    // truncated
+        { { OP_TRUE, OP_JUMP_IF_FALSE_OR_POP, 1, 0, OP_ONE, OP_RETURN }, 6, 1 },
+        { { OP_NIL, OP_JUMP, 1, 0, OP_POP, OP_RETURN }, 6, 1 },      // skips dead code
+        { { OP_TRUE, OP_JUMP_IF_FALSE, 1, 0, OP_ONE, OP_RETURN }, 6, -1 }, // heights differ
+        { { OP_NIL, OP_JUMP, 1, 0, OP_SMALLINT, 1, OP_RETURN }, 7, -1 },   // into an operand
+        { { OP_NIL, OP_JUMP, 9, 0, OP_RETURN }, 5, -1 },             // out of range
+        { { OP_TRUE, OP_JUMP_IF_TRUE_OR_POP, 1, 0, OP_ONE, OP_NEG_N, OP_RETURN }, 7, -1 },
+        { { OP_TRUE, OP_ONE, OP_NIL, OP_SELECT, OP_RETURN }, 5, 3 },
+        { { OP_ONE, OP_ZERO, OP_CALL_NATIVE, 2, 2, OP_NEG_N, OP_RETURN }, 7, 2 }, // min
+        { { OP_CALL_NATIVE, 4, 0, OP_RETURN }, 4, 1 },                // clock
+        { { OP_ONE, OP_CALL_NATIVE, 0, 2, OP_RETURN }, 5, -1 },      // wrong arity
+        { { OP_ONE, OP_CALL_NATIVE, 2, 2, OP_RETURN }, 5, -1 },      // underflow
+        { { OP_CALL_NATIVE, 0xFF, 0, OP_RETURN }, 4, -1 },           // no such native
+        { { OP_NIL, OP_ONE, OP_CALL, 1, OP_RETURN }, 5, 2 },
+        { { OP_ONE, OP_CALL, 1, OP_RETURN }, 4, -1 },                // underflow
+        { { OP_ONE, OP_GET_LOCAL, 0, OP_NEG_N, OP_RETURN }, 5, 2 },  // slot 0 is a number
+        { { OP_ONE, OP_GET_LOCAL, 1, OP_RETURN }, 4, -1 },           // no such local
+        { { OP_ONE, OP_NIL, OP_SET_LOCAL, 0, OP_GET_LOCAL, 0, OP_NEG_N, OP_RETURN }, 8, -1 },
+        { { OP_ONE, OP_GET_LOCAL, 0, OP_NOT, OP_LOOP_IF_TRUE, 6, 0, OP_RETURN }, 8, 2 },
+        { { OP_ONE, OP_GET_LOCAL, 0, OP_NOT, OP_LOOP_IF_TRUE, 5, 0, OP_RETURN }, 8, -1 }, // into an operand
+        { { OP_ONE, OP_GET_LOCAL, 0, OP_NOT, OP_LOOP_IF_TRUE, 8, 0, OP_RETURN }, 8, -1 }, // out of range
+        { { OP_ONE, OP_GET_LOCAL, 0, OP_NOT, OP_LOOP_IF_TRUE, 0, 0, OP_RETURN }, 8, -1 }, // forward
+        { { OP_ONE, OP_ONE, OP_ONE, OP_LOOP_IF_TRUE, 5, 0, OP_RETURN }, 7, -1 },          // heights differ
+        { { OP_ONE, OP_LOOP, 3, 0, OP_RETURN }, 5, 1 },                                   // spins, then dead code
+        { { OP_ONE, OP_ZERO, OP_ARRAY, 2, OP_ZERO, OP_GET_INDEX, OP_NEG_N, OP_RETURN }, 8, 2 },
+        { { OP_ONE, OP_ARRAY, 2, OP_RETURN }, 4, -1 },                                    // underflow
+        { { OP_ONE, OP_ARRAY, 1, OP_NEG_N, OP_RETURN }, 5, -1 },                          // not a number
+        { { OP_ZERO, OP_ARRAY, 1, OP_ZERO, OP_ONE, OP_SET_INDEX, OP_NEG_N, OP_RETURN }, 8, 3 },
+        { { OP_NIL, OP_GET_FIELD, 0, 0, 0, OP_RETURN }, 6, -1 },         // not a name
+        { { OP_NIL, OP_NIL, OP_SET_FIELD, 1, 0, 0, OP_RETURN }, 7, -1 }, // no such constant
+        { { OP_NIL, OP_SET_FIELD, 0, 0, 0, OP_RETURN }, 6, -1 },         // underflow
+        // Slot 0 is a number on the way in only
+        { { OP_ONE, OP_GET_LOCAL, 0, OP_NEG_N, OP_POP, OP_NIL, OP_SET_LOCAL, 0, OP_POP, OP_TRUE,
+            OP_LOOP_IF_TRUE, 12, 0, OP_RETURN }, 14, -1 },
+    };
+    for (int i = 0; i < (int)countof(cases); ++i) {
+        Chunk c = { 0 };
+        chunk_write_constant(&c, NUMBER_VAL(1), 1);
+        buf_clear(c.code);
+        chunk_write(&c, cases[i].code, cases[i].len, 1);
+        c.global_count = 1;
+        bool ok = chunk_verify(&c, NULL);
+        assert(ok == (cases[i].max_stack >= 0));
+        assert(!ok || c.max_stack == cases[i].max_stack);
+        chunk_free(&c);
+    }
+}
+#endif
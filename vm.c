@@ -1,154 +1,1288 @@
 #pragma once
 
+#include <pthread.h>
+#include <unistd.h>
+
 #include "common.h"
 #include "buf.h"
 
+#include "cache.c"
 #include "chunk.c"
+#include "clock.c"
 #include "compiler.c"
 #include "debug.c"
-
-static bool values_equal(Value a, Value b)
-{
-    if (a.type != b.type) return false;
-
-    switch (a.type) {
-        case VAL_NIL:    return true;
-        case VAL_BOOL:   return AS_BOOL(a) == AS_BOOL(b);
-        case VAL_NUMBER: return AS_NUMBER(a) == AS_NUMBER(b);
-    }
-}
+#include "gc.c"
+#include "globals.c"
+#include "image.c"
+#include "natives.c"
+#include "profile.c"
+#include "shape.c"
+#include "stats.c"
+#include "value.c"
+#include "verify.c"
 
 static void vm_reset_stack(VM *vm)
 {
-    buf_clear(vm->stack);
+    vm->stack_top = vm->stack;
+    vm->frame_count = 0;
 }
 
 static void vm_init(VM *vm)
 {
     buf_reserve(vm->stack, 256);
     vm_reset_stack(vm);
+    cache_init(&vm->cache, cache_capacity);
+    vm->heap.next_gc = GC_MIN_BYTES;
+}
+
+// Undefines every global variable, for running unrelated scripts on one VM.
+// Names keep their slots so cached chunks stay valid, unless the table is
+// getting full: then the names and the chunks that use them are dropped.
+MAYBE_UNUSED static void vm_reset_globals(VM *vm)
+{
+    if (buf_len(vm->global_names.names) > GLOBAL_SLOTS_MAX / 2) {
+        cache_free(&vm->cache);
+        global_table_free(&vm->global_names);
+        buf_free(vm->globals);
+    }
+    for (int i = 0; i < buf_len(vm->globals); ++i) {
+        vm->globals[i] = UNDEFINED_VAL;
+    }
 }
 
 static void vm_free(VM *vm)
 {
+    if (vm->image) image_release(vm->image);
     buf_free(vm->stack);
+    cache_free(&vm->cache);
+    global_table_free(&vm->global_names);
+    buf_free(vm->globals);
+    buf_free(vm->hot_loops);
+    buf_free(vm->field_caches);
+    heap_free(&vm->heap);
+}
+
+static FILE *vm_errors(VM *vm)
+{
+    return vm->errors ? vm->errors : stderr;
 }
 
 static void vm_runtime_error(VM *vm, const char *format, ...)
 {
+    FILE *out = vm_errors(vm);
     va_list args;
     va_start(args, format);
-    vfprintf(stderr, format, args);
+    vfprintf(out, format, args);
     va_end(args);
-    fputs("\n", stderr);
+    fputs("\n", out);
 
-    size_t instr = vm->ip - vm->chunk->code;
-    int line = vm->chunk->lines[instr];
-    fprintf(stderr, "[line %d] in script\n", line);
+    // Innermost call first
+    for (int i = vm->frame_count - 1; i >= 0; --i) {
+        const CallFrame *frame = &vm->frames[i];
+        int instr = (int)(frame->ip - frame->chunk->code) - 1;
+        fprintf(out, "[line %d] in ", chunk_get_line(frame->chunk, instr));
+        if (!frame->function) {
+            fputs("script\n", out);
+        } else {
+            function_print(out, frame->function);
+            fputs("\n", out);
+        }
+    }
 
     vm_reset_stack(vm);
 }
 
-static VMResult vm_run(VM *vm)
+static void vm_undefined_error(VM *vm, int slot)
 {
-#define IS_FALSEY(v) (IS_NIL(v) || (IS_BOOL(v) && !AS_BOOL(v)))
-#define PEEK(dist) (*buf_peek(vm->stack, dist))
-#define PUSH(value) (buf_push(vm->stack, value))
-#define POP() (*buf_pop(vm->stack))
-#define NEXT() (*vm->ip++)
-#define READ_CONSTANT() (vm->chunk->constants[NEXT()])
-#define READ_CONSTANT_X(b0, b1, b2) \
-    (vm->chunk->constants[(b0) << 0 | (b1) << 8 | (b2) << 16])
-#define BINARY_OP(TO_VAL, op)                                  \
+    // Functions compiled after the image was made may use slots it has no
+    // names for, but only on the VM whose global table they were added to
+    bool in_image = vm->image && slot < buf_len(vm->image->names);
+    Value name = in_image ? vm->image->names[slot] : vm->global_names.names[slot];
+    vm_runtime_error(vm, "Undefined variable '%.*s'.", string_length(name), string_chars(&name));
+}
+
+// Instructions between two reads of the clock when vm->deadline_ns is set
+#define VM_CLOCK_INTERVAL 1024
+
+// Called by the backward branch at offset in c each time its counter reaches
+// VM_HOT_LOOP. The first call marks the loop hot; tiers that optimize loops
+// would pick it up from vm->hot_loops. Loops are told apart by the id of
+// their chunk, like field access sites, since another chunk may be at the
+// address of one freed since.
+static void vm_hot_loop(VM *vm, const Chunk *c, int offset)
+{
+    for (int i = 0; i < buf_len(vm->hot_loops); ++i) {
+        HotLoop *l = &vm->hot_loops[i];
+        if (l->chunk == c->id && l->offset == offset) {
+            l->branches += VM_HOT_LOOP;
+            return;
+        }
+    }
+    int line = chunk_get_line(c, chunk_loop_target(c, offset)); // where the body starts
+    buf_push(vm->hot_loops, ((HotLoop){ c->id, offset, line, VM_HOT_LOOP }));
+}
+
+// Counts a backward branch taken from just before ip, by a hash of its
+// address: cheap enough for every iteration, at the price of loops sharing
+// a counter now and then
+static inline void vm_back_branch(VM *vm, const CallFrame *frame, const byte *ip)
+{
+    uintptr_t at = (uintptr_t)ip;
+    uint16_t *count = &vm->hot_counts[(at ^ at >> 6) % VM_HOT_SLOTS];
+    if (++*count == VM_HOT_LOOP) {
+        *count = 0;
+        vm_hot_loop(vm, frame->chunk, (int)(ip - frame->chunk->code) - 3);
+    }
+}
+
+// Hot loops in the order they got hot (--loops)
+MAYBE_UNUSED static void vm_print_hot_loops(FILE *out, const VM *vm)
+{
+    fprintf(out, "hot loops: %d, at %d backward branches\n", buf_len(vm->hot_loops), VM_HOT_LOOP);
+    if (buf_empty(vm->hot_loops)) return;
+    fprintf(out, "%6s %12s\n", "line", "branches");
+    for (int i = 0; i < buf_len(vm->hot_loops); ++i) {
+        const HotLoop *l = &vm->hot_loops[i];
+        fprintf(out, "%6d %12lld\n", l->line, (long long)l->branches);
+    }
+}
+
+static FieldCache *vm_find_field_cache(FieldCache *table, uint64_t site)
+{
+    int mask = buf_len(table) - 1;
+    for (int i = (int)(site * 0x9E3779B97F4A7C15u >> 33) & mask;; i = (i + 1) & mask) {
+        if (table[i].site == site || table[i].site == 0) return &table[i];
+    }
+}
+
+static void vm_grow_field_caches(VM *vm)
+{
+    int cap = BUF_MAX(64, 2 * buf_len(vm->field_caches));
+    FieldCache *table = NULL;
+    memset(buf_append(table, cap), 0, cap * sizeof(*table));
+    for (int i = 0; i < buf_len(vm->field_caches); ++i) {
+        FieldCache *c = &vm->field_caches[i];
+        if (c->site) *vm_find_field_cache(table, c->site) = *c;
+    }
+    buf_free(vm->field_caches);
+    vm->field_caches = table;
+}
+
+// The cache of the field access whose name is constant k of chunk c. Every
+// access has a constant of its own, so the two number the site; caches of
+// code that is gone are only dropped by vm_start.
+static inline FieldCache *vm_field_cache(VM *vm, const Chunk *c, int k)
+{
+    uint64_t site = c->id << 24 | (uint64_t)k;
+    if (buf_empty(vm->field_caches)) vm_grow_field_caches(vm);
+    FieldCache *cache = vm_find_field_cache(vm->field_caches, site);
+    if (cache->site == 0) {
+        if (2 * (vm->field_sites + 1) > buf_len(vm->field_caches)) {
+            vm_grow_field_caches(vm);
+            cache = vm_find_field_cache(vm->field_caches, site);
+        }
+        cache->site = site;
+        ++vm->field_sites;
+    }
+    return cache;
+}
+
+// Remembers the slot of the site's field in shape s, in the way used longest
+// ago once they are all in use
+static void vm_field_cache_add(FieldCache *c, Shape *s, int slot, Shape *added)
+{
+    int way = c->count < VM_FIELD_WAYS ? c->count++ : c->next++ % VM_FIELD_WAYS;
+    c->shapes[way] = s;
+    c->slots[way] = slot;
+    c->added[way] = added;
+}
+
+// Slot of field name in o for the OP_GET_FIELD with cache c, or -1 if o has
+// none. A shape the site saw before gives it without looking the name up.
+static inline int vm_get_field(VM *vm, FieldCache *c, Value name, const ObjInstance *o)
+{
+    for (int i = 0; i < c->count; ++i) {
+        if (c->shapes[i] == o->shape) {
+            ++vm->field_hits;
+            return c->slots[i];
+        }
+    }
+    ++vm->field_misses;
+    int slot = shape_slot(o->shape, name);
+    if (slot >= 0) vm_field_cache_add(c, o->shape, slot, NULL);
+    return slot;
+}
+
+// Stores value in field name of o for the OP_SET_FIELD with cache c, adding
+// the field if o doesn't have it yet
+static inline void vm_set_field(VM *vm, FieldCache *c, Value name, ObjInstance *o, Value value)
+{
+    for (int i = 0; i < c->count; ++i) {
+        if (c->shapes[i] != o->shape) continue;
+        ++vm->field_hits;
+        if (c->added[i]) {
+            buf_push(o->fields, value);
+            o->shape = c->added[i];
+        } else {
+            o->fields[c->slots[i]] = value;
+        }
+        return;
+    }
+    ++vm->field_misses;
+    Shape *s = o->shape;
+    int slot = instance_set(&vm->heap, o, name, value);
+    vm_field_cache_add(c, s, slot, o->shape != s ? o->shape : NULL);
+}
+
+// Field cache hits and misses (--fields)
+MAYBE_UNUSED static void vm_print_field_caches(FILE *out, const VM *vm)
+{
+    int64_t total = vm->field_hits + vm->field_misses;
+    fprintf(out, "field caches: %lld hits, %lld misses (%.1f%% hits)\n", (long long)vm->field_hits,
+        (long long)vm->field_misses, total ? 100.0 * (double)vm->field_hits / (double)total : 0.0);
+}
+
+// Frees the objects of the heap that the run can't reach any more, see gc.c.
+// The roots are the stack, the functions called, the globals and their names,
+// and the shapes in the field caches, which must not be freed and another made
+// at their address while a cache has them; constants are pinned. Returns false
+// if the heap is still over its limit, which fails the run.
+static bool vm_collect(VM *vm)
+{
+    Heap *h = &vm->heap;
+    gc_mark_values(h, vm->stack, (int)(vm->stack_top - vm->stack));
+    for (int i = 0; i < vm->frame_count; ++i) {
+        gc_mark(h, (Obj *)vm->frames[i].function);
+    }
+    gc_mark_values(h, vm->globals, buf_len(vm->globals));
+    gc_mark_values(h, vm->global_names.names, buf_len(vm->global_names.names));
+    for (int i = 0; i < buf_len(vm->field_caches); ++i) {
+        const FieldCache *c = &vm->field_caches[i];
+        for (int way = 0; way < c->count; ++way) {
+            gc_mark(h, (Obj *)c->shapes[way]);
+            gc_mark(h, (Obj *)c->added[way]);
+        }
+    }
+    return gc_collect(h);
+}
+
+// Compiles the body of f on its first call, see compile_function, and makes
+// room for any globals it added. A failure is traced like a runtime error,
+// with the calls that led to it, but ends the run as a compile error.
+static bool vm_compile_function(VM *vm, ObjFunction *f)
+{
+    if (!f->compiled) {
+        Stats *stats = vm->stats;
+        uint64_t start = stats ? clock_ns() : 0;
+        compile_errors = vm->errors;
+        bool ok = compile_function(f);
+        if (stats) stats->ns[PHASE_COMPILE] += clock_ns() - start;
+        if (!ok) {
+            vm_runtime_error(vm, "Could not compile function.");
+            return false;
+        }
+    }
+    while (buf_len(vm->globals) < f->chunk.global_count) {
+        buf_push(vm->globals, UNDEFINED_VAL);
+    }
+    return true;
+}
+
+// Makes sure the stack has room for count more values above top, moving it if
+// it must. Returns where top is now; frames are moved along.
+static Value *vm_grow_stack(VM *vm, Value *top, int count)
+{
+    int used = (int)(top - vm->stack);
+    if (used + count <= buf_cap(vm->stack)) return top;
+    Value *old = vm->stack;
+    buf_reserve(vm->stack, used + count);
+    for (int i = 0; i < vm->frame_count; ++i) {
+        vm->frames[i].slots = vm->stack + (vm->frames[i].slots - old);
+    }
+    return vm->stack + used;
+}
+
+// Runs the innermost frame from its ip. Its chunk must have passed
+// chunk_verify and the stack must have room for chunk->max_stack values above
+// its slots: nothing is checked here. Calls check their callee and compile it
+// first if needed, and make room on the stack for it.
+// Yields before an instruction once vm->budget instructions ran or, checked
+// every VM_CLOCK_INTERVAL instructions, vm->deadline_ns passed. Inlined twice
+// by vm_run, so that only the copy for a profiled VM keeps frame->ip current
+// and drains the samples between windows.
+static inline __attribute__((always_inline)) VMResult vm_run_loop(VM *vm, const bool profiling)
+{
+    CallFrame *frame = &vm->frames[vm->frame_count - 1];
+    byte *ip = frame->ip;
+    Value *slots = frame->slots;
+    Value *sp = vm->stack_top;
+    const Value *constants = frame->chunk->constants;
+    Value *globals = vm->globals;
+
+#define PEEK(dist) (sp[-1 - (dist)])
+#define PUSH(value) (*sp++ = (value))
+#define POP() (*--sp)
+#define NEXT() (*ip++)
+#define READ_CONSTANT() (constants[NEXT()])
+#define READ_CONSTANT_X() \
+    (ip += 3, constants[ip[-3] << 0 | ip[-2] << 8 | ip[-1] << 16])
+#define READ_U16() (ip += 2, ip[-2] | ip[-1] << 8)
+#define SYNC() (frame->ip = ip, vm->stack_top = sp)
+#define RETURN(result, value)                                               \
+    do {                                                                    \
+        SYNC();                                                             \
+        if (vm->stats) vm->stats->instructions += executed + window - left; \
+        return (VMResult){ (result), (value) };                             \
+    } while (false)
+// Before an instruction that allocates, while its operands are still on the
+// stack: collects once the heap has grown enough since the last time
+#define COLLECT()                                              \
+    do {                                                       \
+        if (vm->heap.bytes >= vm->heap.next_gc) {              \
+            SYNC();                                            \
+            if (!vm_collect(vm)) {                             \
+                RUNTIME_ERROR("Heap limit exceeded.");         \
+            }                                                  \
+        }                                                      \
+    } while (false)
+#define RUNTIME_ERROR(...)                                     \
+    do {                                                       \
+        SYNC();                                                \
+        vm_runtime_error(vm, __VA_ARGS__);                     \
+        RETURN(INTERPRET_RUNTIME_ERROR, NIL_VAL);              \
+    } while (false)
+#define BINARY_OP(fn)                                          \
     do {                                                       \
         if (!IS_NUMBER(PEEK(0)) || !IS_NUMBER(PEEK(1))) {      \
-            vm_runtime_error(vm, "Operands must be numbers."); \
-            return (VMResult){ INTERPRET_RUNTIME_ERROR, {0} }; \
+            RUNTIME_ERROR("Operands must be numbers.");        \
+        }                                                      \
+        BINARY_OP_NN(fn);                                      \
+    } while (false)
+#define BINARY_OP_NN(fn)                                       \
+    do {                                                       \
+        Value b = POP();                                       \
+        Value a = POP();                                       \
+        PUSH(fn(a, b));                                        \
+    } while (false)
+// Element-wise when either operand is an array, see array.c
+#define ARRAY_OP(fn)                                           \
+    do {                                                       \
+        if (IS_NUMBER(PEEK(0)) && IS_NUMBER(PEEK(1))) {        \
+            BINARY_OP_NN(fn);                                  \
+            break;                                             \
         }                                                      \
-                                                               \
-        double b = AS_NUMBER(POP());                           \
-        double a = AS_NUMBER(POP());                           \
-        PUSH(TO_VAL(a op b));                                  \
+        if (!IS_ARRAY(PEEK(0)) && !IS_ARRAY(PEEK(1))) {        \
+            RUNTIME_ERROR("Operands must be numbers.");        \
+        }                                                      \
+        ARRAY_BINARY();                                        \
+    } while (false)
+#define ARRAY_BINARY()                                         \
+    do {                                                       \
+        Value result;                                          \
+        COLLECT();                                             \
+        const char *error = array_binary(&vm->heap, instr, PEEK(1), PEEK(0), &result); \
+        if (error) RUNTIME_ERROR("%s", error);                 \
+        sp -= 2;                                               \
+        PUSH(result);                                          \
     } while (false)
 
+    // Counted in locals and only published to vm->stats on return: executed
+    // before the current window, and left of its instructions. The window
+    // ends where the budget runs out or, with a deadline, where the clock is
+    // read next, so both checks cost one decrement and test per instruction.
+    uint64_t budget = vm->budget ? vm->budget : UINT64_MAX;
+    uint64_t window = (vm->deadline_ns || profiling) && budget > VM_CLOCK_INTERVAL ? VM_CLOCK_INTERVAL : budget;
+    uint64_t left = window;
+    uint64_t executed = 0;
+
     for (;;) {
+        if (left-- == 0) {
+            executed += window;
+            window = left = 0;
+            if (profiling) profile_drain(vm->profile);
+            if (executed == budget || (vm->deadline_ns && clock_ns() >= vm->deadline_ns)) {
+                RETURN(INTERPRET_YIELD, NIL_VAL);
+            }
+            window = budget - executed > VM_CLOCK_INTERVAL ? VM_CLOCK_INTERVAL : budget - executed;
+            left = window - 1;
+        }
+        if (profiling) {
+            // Where a SIGPROF finds this frame
+            frame->ip = ip;
+            atomic_signal_fence(memory_order_release);
+        }
 #ifdef DEBUG_TRACE_EXECUTION
-        // Print stack
-        if (!buf_empty(vm->stack)) {
+        // Print stack, after the previous instruction
+        if (ip != frame->chunk->code) {
             fputs("\t[ ", stdout);
-            for (Value *it = vm->stack; it != buf_end(vm->stack); ++it) {
+            for (Value *it = vm->stack; it != sp; ++it) {
                 print_value(*it);
                 fputs(" ", stdout);
             }
             fputs("]\n", stdout);
         }
-        instr_disassemble(vm->chunk, (int)(vm->ip - vm->chunk->code));
+        instr_disassemble(frame->chunk, (int)(ip - frame->chunk->code));
 #endif
         byte instr;
         switch (instr = NEXT()) { // clang-format off
             case OP_CONSTANT:   PUSH(READ_CONSTANT()); break;
-            case OP_CONSTANT_X: PUSH(READ_CONSTANT_X(NEXT(), NEXT(), NEXT())); break;
+            case OP_CONSTANT_X: PUSH(READ_CONSTANT_X()); break;
+            case OP_ZERO:       PUSH(INT_VAL(0)); break;
+            case OP_ONE:        PUSH(INT_VAL(1)); break;
+            case OP_SMALLINT:   PUSH(INT_VAL((int8_t)NEXT())); break;
+            case OP_SMALLINT_X: PUSH(INT_VAL((int16_t)READ_U16())); break;
             case OP_NIL:        PUSH(NIL_VAL); break;
             case OP_FALSE:      PUSH(BOOL_VAL(false)); break;
             case OP_TRUE:       PUSH(BOOL_VAL(true)); break;
-            case OP_EQ:         { Value b = POP(); Value a = POP(); PUSH(BOOL_VAL(values_equal(a, b))); } break;
-            case OP_GT:         BINARY_OP(BOOL_VAL, >); break;
-            case OP_LT:         BINARY_OP(BOOL_VAL, <); break;
-            case OP_ADD:        BINARY_OP(NUMBER_VAL, +); break;
-            case OP_SUB:        BINARY_OP(NUMBER_VAL, -); break;
-            case OP_MUL:        BINARY_OP(NUMBER_VAL, *); break;
-            case OP_DIV:        BINARY_OP(NUMBER_VAL, /); break;
-            case OP_NOT:        PUSH(BOOL_VAL(IS_FALSEY(POP()))); break;
+            case OP_DUP:        { Value v = PEEK(0); PUSH(v); } break;
+            case OP_PICK:       { int n = NEXT(); Value v = PEEK(n); PUSH(v); } break;
+            case OP_ROLL:       {
+                                    // Moves the value at depth n to the top
+                                    int n = NEXT();
+                                    Value *top = sp - 1;
+                                    Value v = top[-n];
+                                    memmove(top - n, top - n + 1, n * sizeof(Value));
+                                    *top = v;
+                                }
+                                break;
+            case OP_POP:        --sp; break;
+            case OP_DEFINE_GLOBAL: globals[READ_U16()] = POP(); break;
+            case OP_GET_GLOBAL: {
+                                    int slot = READ_U16();
+                                    if (IS_UNDEFINED(globals[slot])) {
+                                        SYNC();
+                                        vm_undefined_error(vm, slot);
+                                        RETURN(INTERPRET_RUNTIME_ERROR, NIL_VAL);
+                                    }
+                                    PUSH(globals[slot]);
+                                }
+                                break;
+            case OP_SET_GLOBAL: {
+                                    int slot = READ_U16();
+                                    if (IS_UNDEFINED(globals[slot])) {
+                                        SYNC();
+                                        vm_undefined_error(vm, slot);
+                                        RETURN(INTERPRET_RUNTIME_ERROR, NIL_VAL);
+                                    }
+                                    globals[slot] = PEEK(0);
+                                }
+                                break;
+            case OP_GET_LOCAL:  PUSH(slots[NEXT()]); break;
+            case OP_SET_LOCAL:  slots[NEXT()] = PEEK(0); break;
+            case OP_EQ:         {
+                                    Value b = string_flatten(&vm->heap, POP());
+                                    Value a = string_flatten(&vm->heap, POP());
+                                    PUSH(BOOL_VAL(values_equal(a, b)));
+                                }
+                                break;
+            case OP_GT:         ARRAY_OP(number_gt); break;
+            case OP_LT:         ARRAY_OP(number_lt); break;
+            case OP_ADD:        {
+                                    Value b = PEEK(0);
+                                    Value a = PEEK(1);
+                                    if (IS_STRING(a) && IS_STRING(b)) {
+                                        COLLECT();
+                                        sp -= 2;
+                                        PUSH(string_concat(&vm->heap, a, b));
+                                        break;
+                                    }
+                                    if (IS_ARRAY(a) || IS_ARRAY(b)) {
+                                        ARRAY_BINARY();
+                                        break;
+                                    }
+                                    if (!IS_NUMBER(a) || !IS_NUMBER(b)) {
+                                        RUNTIME_ERROR("Operands must be two numbers or two strings.");
+                                    }
+                                    sp -= 2;
+                                    PUSH(number_add(a, b));
+                                }
+                                break;
+            case OP_SUB:        ARRAY_OP(number_sub); break;
+            case OP_MUL:        ARRAY_OP(number_mul); break;
+            case OP_DIV:        ARRAY_OP(number_div); break;
+            case OP_NOT:        {
+                                    if (IS_ARRAY(PEEK(0))) COLLECT();
+                                    Value v = POP();
+                                    PUSH(IS_ARRAY(v) ? array_not(&vm->heap, AS_ARRAY(v)) : BOOL_VAL(IS_FALSEY(v)));
+                                }
+                                break;
             case OP_NEG:        {
                                     if (!IS_NUMBER(PEEK(0))) {
-                                        vm_runtime_error(vm, "Operand must be a number.");
-                                        return (VMResult){ INTERPRET_RUNTIME_ERROR, {0} };
+                                        RUNTIME_ERROR("Operand must be a number.");
+                                    }
+                                    Value v = POP();
+                                    PUSH(number_neg(v));
+                                }
+                                break;
+            case OP_SQRT:
+            case OP_FLOOR:      {
+                                    if (!IS_NUMBER(PEEK(0))) {
+                                        RUNTIME_ERROR("Operand must be a number.");
                                     }
-                                    double n = -AS_NUMBER(POP());
-                                    PUSH(NUMBER_VAL(n));
+                                    Value v = POP();
+                                    PUSH(instr == OP_SQRT ? number_sqrt(v) : number_floor(v));
+                                }
+                                break;
+            case OP_MIN:        BINARY_OP(number_min); break;
+            case OP_MAX:        BINARY_OP(number_max); break;
+            case OP_GT_NN:      BINARY_OP_NN(number_gt); break;
+            case OP_LT_NN:      BINARY_OP_NN(number_lt); break;
+            case OP_ADD_NN:     BINARY_OP_NN(number_add); break;
+            case OP_SUB_NN:     BINARY_OP_NN(number_sub); break;
+            case OP_MUL_NN:     BINARY_OP_NN(number_mul); break;
+            case OP_DIV_NN:     BINARY_OP_NN(number_div); break;
+            case OP_NEG_N:      { Value v = POP(); PUSH(number_neg(v)); } break;
+            case OP_JUMP:       { int n = READ_U16(); ip += n; } break;
+            case OP_JUMP_IF_FALSE: {
+                                    int n = READ_U16();
+                                    Value v = POP();
+                                    if (IS_FALSEY(v)) ip += n;
+                                }
+                                break;
+            case OP_JUMP_IF_TRUE: {
+                                    int n = READ_U16();
+                                    Value v = POP();
+                                    if (!IS_FALSEY(v)) ip += n;
+                                }
+                                break;
+            case OP_JUMP_IF_FALSE_OR_POP: {
+                                    int n = READ_U16();
+                                    if (IS_FALSEY(PEEK(0))) ip += n;
+                                    else --sp;
+                                }
+                                break;
+            case OP_JUMP_IF_TRUE_OR_POP: {
+                                    int n = READ_U16();
+                                    if (!IS_FALSEY(PEEK(0))) ip += n;
+                                    else --sp;
+                                }
+                                break;
+            case OP_LOOP:       { int n = READ_U16(); vm_back_branch(vm, frame, ip); ip -= n; } break;
+            case OP_LOOP_IF_TRUE: {
+                                    int n = READ_U16();
+                                    Value v = POP();
+                                    if (!IS_FALSEY(v)) {
+                                        vm_back_branch(vm, frame, ip);
+                                        ip -= n;
+                                    }
+                                }
+                                break;
+            case OP_SELECT:     {
+                                    // Branchless: both arms are already on the stack
+                                    Value b = POP();
+                                    Value a = POP();
+                                    sp[-1] = IS_FALSEY(sp[-1]) ? b : a;
+                                }
+                                break;
+            case OP_ARRAY:      {
+                                    int count = NEXT();
+                                    for (int i = 1; i <= count; ++i) {
+                                        if (!IS_NUMBER(sp[-i])) {
+                                            RUNTIME_ERROR("Array elements must be numbers.");
+                                        }
+                                    }
+                                    COLLECT();
+                                    ObjArray *a = array_from(&vm->heap, sp - count, count);
+                                    sp -= count;
+                                    PUSH(OBJ_VAL(a));
+                                }
+                                break;
+            case OP_GET_INDEX:  {
+                                    int index;
+                                    const char *error = array_index(PEEK(1), PEEK(0), &index);
+                                    if (error) RUNTIME_ERROR("%s", error);
+                                    double element = AS_ARRAY(PEEK(1))->data[index];
+                                    sp -= 2;
+                                    PUSH(NUMBER_VAL(element));
+                                }
+                                break;
+            case OP_SET_INDEX:  {
+                                    int index;
+                                    const char *error = array_index(PEEK(2), PEEK(1), &index);
+                                    if (error) RUNTIME_ERROR("%s", error);
+                                    if (!IS_NUMBER(PEEK(0))) {
+                                        RUNTIME_ERROR("Array elements must be numbers.");
+                                    }
+                                    Value v = POP();
+                                    AS_ARRAY(PEEK(1))->data[index] = AS_NUMBER(v);
+                                    sp -= 2;
+                                    PUSH(v);
+                                }
+                                break;
+            case OP_CLASS:      {
+                                    COLLECT();
+                                    Value name = READ_CONSTANT_X();
+                                    PUSH(OBJ_VAL(class_new(&vm->heap, name)));
+                                }
+                                break;
+            case OP_GET_FIELD:  {
+                                    int k = ip[0] | ip[1] << 8 | ip[2] << 16;
+                                    Value name = READ_CONSTANT_X();
+                                    if (!IS_INSTANCE(PEEK(0))) {
+                                        RUNTIME_ERROR("Only instances have fields.");
+                                    }
+                                    ObjInstance *o = AS_INSTANCE(PEEK(0));
+                                    int slot = vm_get_field(vm, vm_field_cache(vm, frame->chunk, k), name, o);
+                                    if (slot < 0) {
+                                        RUNTIME_ERROR("Undefined field '%.*s'.", string_length(name), string_chars(&name));
+                                    }
+                                    PEEK(0) = o->fields[slot];
+                                }
+                                break;
+            case OP_SET_FIELD:  {
+                                    int k = ip[0] | ip[1] << 8 | ip[2] << 16;
+                                    Value name = READ_CONSTANT_X();
+                                    if (!IS_INSTANCE(PEEK(1))) {
+                                        RUNTIME_ERROR("Only instances have fields.");
+                                    }
+                                    Value v = POP();
+                                    vm_set_field(vm, vm_field_cache(vm, frame->chunk, k), name, AS_INSTANCE(PEEK(0)), v);
+                                    PEEK(0) = v;
+                                }
+                                break;
+            case OP_CALL_NATIVE: {
+                                    // Arguments are passed where they are and
+                                    // replaced by the result
+                                    const Native *native = &natives[NEXT()];
+                                    int argc = NEXT();
+                                    Value *args = sp - argc;
+                                    COLLECT();
+                                    const char *error = native->fn(&vm->heap, args, argc, args);
+                                    if (error) {
+                                        SYNC();
+                                        vm_runtime_error(vm, "%s", error);
+                                        RETURN(INTERPRET_RUNTIME_ERROR, NIL_VAL);
+                                    }
+                                    sp = args + 1;
+                                }
+                                break;
+            case OP_CALL:       {
+                                    // The arguments stay where they are as
+                                    // the first slots of the new frame
+                                    int argc = NEXT();
+                                    Value callee = PEEK(argc);
+                                    if (IS_CLASS(callee)) {
+                                        // Replaces the class with a new instance
+                                        if (argc != 0) {
+                                            RUNTIME_ERROR("Expected 0 arguments but got %d.", argc);
+                                        }
+                                        COLLECT();
+                                        PEEK(0) = OBJ_VAL(instance_new(&vm->heap, AS_CLASS(callee)));
+                                        break;
+                                    }
+                                    if (!IS_FUNCTION(callee)) {
+                                        RUNTIME_ERROR("Can only call functions and classes.");
+                                    }
+                                    ObjFunction *f = AS_FUNCTION(callee);
+                                    if (argc != f->arity) {
+                                        RUNTIME_ERROR("Expected %d arguments but got %d.", f->arity, argc);
+                                    }
+                                    if (vm->frame_count == FRAMES_MAX) {
+                                        RUNTIME_ERROR("Stack overflow.");
+                                    }
+                                    if (!f->compiled) {
+                                        SYNC();
+                                        if (!vm_compile_function(vm, f)) {
+                                            RETURN(INTERPRET_COMPILE_ERROR, NIL_VAL);
+                                        }
+                                        globals = vm->globals;
+                                    }
+                                    frame->ip = ip;
+                                    sp = vm_grow_stack(vm, sp, f->chunk.max_stack - argc);
+                                    // Filled in before it is counted, for profile_signal
+                                    frame = &vm->frames[vm->frame_count];
+                                    *frame = (CallFrame){ f, &f->chunk, f->chunk.code, sp - argc };
+                                    atomic_signal_fence(memory_order_release);
+                                    ++vm->frame_count;
+                                    ip = frame->ip;
+                                    slots = frame->slots;
+                                    constants = f->chunk.constants;
                                 }
                                 break;
             case OP_RETURN:     {
                                     Value v = POP();
-                                    puts(""); print_value(v); puts("");
-                                    return (VMResult){ INTERPRET_OK, v };
+                                    if (vm->frame_count == 1) RETURN(INTERPRET_OK, v);
+                                    sp = frame->slots - 1; // drops the callee too
+                                    frame = &vm->frames[--vm->frame_count - 1];
+                                    ip = frame->ip;
+                                    slots = frame->slots;
+                                    constants = frame->chunk->constants;
+                                    PUSH(v);
                                 }
+                                break;
             default:            assert(0 && "unreachable");
         } // clang-format on
     }
 
-#undef IS_FALSEY
 #undef PEEK
 #undef PUSH
 #undef POP
 #undef NEXT
 #undef READ_CONSTANT
 #undef READ_CONSTANT_X
+#undef READ_U16
+#undef SYNC
+#undef RETURN
+#undef COLLECT
+#undef RUNTIME_ERROR
 #undef BINARY_OP
+#undef BINARY_OP_NN
+#undef ARRAY_OP
+#undef ARRAY_BINARY
+}
+
+// Lets the SIGPROF handler find vm while it runs, if it is profiled
+static VMResult vm_run(VM *vm)
+{
+    if (!vm->profile) return vm_run_loop(vm, false);
+    profile_vm = vm;
+    atomic_signal_fence(memory_order_seq_cst);
+    VMResult result = vm_run_loop(vm, true);
+    profile_vm = NULL;
+    atomic_signal_fence(memory_order_seq_cst);
+    profile_drain(vm->profile);
+    return result;
+}
+
+// Sets vm up to run chunk c, which must have passed chunk_verify, from the
+// start on the next vm_resume. A run that yielded is abandoned.
+static void vm_start(VM *vm, Chunk *c)
+{
+    if (vm->image) {
+        image_release(vm->image);
+        vm->image = NULL;
+    }
+    buf_reserve(vm->stack, c->max_stack);
+    while (buf_len(vm->globals) < c->global_count) {
+        buf_push(vm->globals, UNDEFINED_VAL);
+    }
+    vm_reset_stack(vm);
+    // With the caches and hot loops of code that may be gone
+    if (vm->field_sites > VM_FIELD_SITES) {
+        buf_free(vm->field_caches);
+        vm->field_sites = 0;
+    }
+    if (buf_len(vm->hot_loops) > VM_HOT_LOOPS) {
+        buf_free(vm->hot_loops);
+    }
+    vm->chunk = c;
+    vm->frames[0] = (CallFrame){ NULL, c, c->code, vm->stack };
+    vm->frame_count = 1;
+}
+
+// Like vm_start, for the chunk of image, which the VM holds a reference to
+// until the run finishes or is abandoned.
+static void vm_start_image(VM *vm, ChunkImage *image)
+{
+    vm_start(vm, &image->chunk);
+    vm->image = image_retain(image);
+}
+
+// Runs the chunk set up by vm_start until it returns or, with a budget or a
+// deadline set, yields. A yielded VM keeps its chunk, ip and stack; a chunk
+// that is not an image must outlive it until a later vm_resume finishes it.
+// The value returned may be collected by the next run, see vm_collect.
+static VMResult vm_resume(VM *vm)
+{
+    assert(vm->chunk);
+    VMResult result = vm_run(vm);
+    if (result.result != INTERPRET_YIELD) {
+        if (vm->image) image_release(vm->image);
+        vm->image = NULL;
+        vm->chunk = NULL;
+        vm->frame_count = 0;
+    }
+    return result;
+}
+
+// Runs chunk c, which must have passed chunk_verify.
+static VMResult vm_execute(VM *vm, Chunk *c)
+{
+    vm_start(vm, c);
+    return vm_resume(vm);
+}
+
+static VMResult vm_execute_image(VM *vm, ChunkImage *image)
+{
+    vm_start_image(vm, image);
+    return vm_resume(vm);
 }
 
+// Compiles and runs source, or runs the image cached for it if the same
+// source was compiled before. With a budget or a deadline set it may yield
+// like vm_resume, holding on to the image.
 static VMResult vm_interpret(VM *vm, const char *source)
 {
-    Chunk *chunk = calloc(1, sizeof(Chunk));
-    chunk_init(chunk);
+    Stats *stats = vm->stats;
+    size_t length = strlen(source);
+    uint64_t hash = 0;
+    if (vm->cache.capacity > 0) {
+        hash = source_hash(source, length);
+        ChunkImage *cached = cache_find(&vm->cache, source, length, hash);
+        if (cached) {
+            uint64_t start = stats ? clock_ns() : 0;
+            VMResult result = vm_execute_image(vm, cached);
+            if (stats) stats->ns[PHASE_RUN] = clock_ns() - start;
+            return result;
+        }
+    }
+
+    if (stats) stats_scan(stats, source);
+
+    Chunk chunk = { 0 };
+    chunk_init(&chunk);
 
-    if (!compile(source, chunk)) {
-        chunk_free(chunk);
+    uint64_t start = stats ? clock_ns() : 0;
+    compile_errors = vm->errors;
+    bool ok = compile(source, &chunk, &vm->heap, &vm->global_names) &&
+              chunk_verify(&chunk, vm_errors(vm));
+    if (stats) stats->ns[PHASE_COMPILE] = clock_ns() - start;
+
+    if (!ok) {
+        chunk_free(&chunk);
         return (VMResult){ INTERPRET_COMPILE_ERROR, {0} };
     }
 
-    vm->chunk = chunk;
-    vm->ip = vm->chunk->code;
-    VMResult result = vm_run(vm);
+    // Its strings stay in the VM's heap, like those of values it produces
+    ChunkImage *image = image_new(&chunk, &vm->global_names, false);
+    cache_insert(&vm->cache, source, length, hash, image);
 
-    chunk_free(chunk);
+    start = stats ? clock_ns() : 0;
+    VMResult result = vm_execute_image(vm, image);
+    if (stats) stats->ns[PHASE_RUN] = clock_ns() - start;
 
+    image_release(image);
     return result;
 }
 
+#ifndef NDEBUG
+typedef struct {
+    ChunkImage *image;
+    pthread_t   thread;
+    int         failed; // runs that didn't return true
+} VMImageRunner;
+
+static void *vm_image_runner(void *arg)
+{
+    VMImageRunner *r = arg;
+    VM vm = { 0 };
+    vm_init(&vm);
+    for (int i = 0; i < 64; ++i) {
+        VMResult result = vm_execute_image(&vm, r->image);
+        r->failed += result.result != INTERPRET_OK || !AS_BOOL(result.value);
+    }
+    vm_free(&vm);
+    return NULL;
+}
+
+// Runs one image on a VM per core at once. Its strings and functions were
+// copied out of the heap it was compiled with, which is gone by then, and the
+// functions compiled.
+static void vm_image_test(void)
+{
+    const char *source =
+        "var n = 6 * 7;\n"
+        "var s = \"0123456789\" + \"abcdefghij\" + \"0123456789\" + \"abcdefghij\";\n"
+        "class Box {}\n"
+        "fun square(x) { var y = Box(); y.squared_value = x * x; return y.squared_value; }\n"
+        "s == \"0123456789abcdefghij0123456789abcdefghij\" == (square(n) == 1764)";
+    VM compiler = { 0 };
+    Chunk chunk = { 0 };
+    chunk_init(&chunk);
+    bool ok = compile(source, &chunk, &compiler.heap, &compiler.global_names) &&
+              chunk_verify(&chunk, NULL);
+    assert(ok);
+    ChunkImage *image = image_new(&chunk, &compiler.global_names, true);
+    vm_free(&compiler);
+
+    long cores = sysconf(_SC_NPROCESSORS_ONLN);
+    int count = cores > 1 ? (int)cores : 2;
+    VMImageRunner *runners = calloc(count, sizeof(VMImageRunner));
+    for (int i = 0; i < count; ++i) {
+        runners[i].image = image;
+        ok = pthread_create(&runners[i].thread, NULL, vm_image_runner, &runners[i]) == 0;
+        assert(ok);
+    }
+    for (int i = 0; i < count; ++i) {
+        pthread_join(runners[i].thread, NULL);
+        assert(runners[i].failed == 0);
+    }
+    assert(atomic_load(&image->refs) == 1);
+    image_release(image);
+    free(runners);
+}
+
+static const char *vm_native_twice(Heap *heap, const Value *args, int argc, Value *result)
+{
+    (void)heap, (void)argc;
+    if (!IS_NUMBER(args[0])) return "Operand must be a number.";
+    *result = number_add(args[0], args[0]);
+    return NULL;
+}
+
+static const char *vm_native_sample(Heap *heap, const Value *args, int argc, Value *result)
+{
+    (void)heap, (void)args, (void)argc;
+    raise(SIGPROF);
+    *result = NIL_VAL;
+    return NULL;
+}
+
+// Samples are taken where a native raises SIGPROF, and only while a VM with
+// a profiler runs
+static void vm_profile_test(void)
+{
+    int count = native_count;
+    native_define("sample", 0, vm_native_sample, TYPE_UNKNOWN);
+    bool ok = profile_start(0);
+    assert(ok);
+    const char *source = "fun f(n) {\n  return n > 0 ? f(n - 1) : sample();\n}\nsample();\nf(2)";
+    VM vm = { 0 };
+    vm_init(&vm);
+    Profiler *p = calloc(1, sizeof(Profiler));
+    VMResult r = vm_interpret(&vm, source);
+    assert(r.result == INTERPRET_OK);
+    vm.profile = p;
+    r = vm_interpret(&vm, source);
+    assert(r.result == INTERPRET_OK);
+    vm.profile = NULL;
+    raise(SIGPROF);
+    assert(p->samples == 2 && buf_len(p->stacks) == 2 && atomic_load(&p->dropped) == 0);
+    assert(p->lines[4] == 1 && p->lines[2] == 1);
+    assert(strcmp(p->stacks[0].stack, "script:4") == 0 && p->stacks[0].count == 1);
+    assert(strcmp(p->stacks[1].stack, "script:5;f:2;f:2;f:2") == 0 && p->stacks[1].count == 1);
+    profile_free(p);
+    free(p);
+    vm_free(&vm);
+    profile_stop();
+    native_count = count;
+}
+
 static void vm_test(void)
 {
     VM *vm = calloc(1, sizeof(VM));
     vm_init(vm);
+    Stats stats = { 0 };
+    vm->stats = &stats;
+    assert(7 == AS_NUMBER(vm_interpret(vm, "(-1 + 2) * 3 - -4").value));
+    assert(stats.bytes == 17 && stats.tokens == 12 && stats.instructions == 10);
+    vm->stats = NULL;
+    assert(2 == AS_NUMBER(vm_interpret(vm, "1 - 2 + 3").value));
+
+    // A repeated source skips scanning and compiling
+    stats = (Stats){ 0 };
+    vm->stats = &stats;
     assert(7 == AS_NUMBER(vm_interpret(vm, "(-1 + 2) * 3 - -4").value));
+    assert(stats.tokens == 0 && stats.instructions == 10 && vm->cache.stats.hits == 1);
+    vm->stats = NULL;
+
+    // Stack shuffles emitted by the optimizer: [1 2 3] -> [2 3 1 2 2]
+    Chunk c = { 0 };
+    chunk_init(&c);
+    for (int i = 1; i <= 3; ++i) {
+        chunk_write_constant(&c, NUMBER_VAL(i), 1);
+    }
+    byte code[] = { OP_ROLL, 2, OP_PICK, 2, OP_DUP, OP_MUL, OP_ADD, OP_MUL, OP_SUB, OP_RETURN };
+    chunk_write(&c, code, sizeof(code), 1);
+    assert(chunk_verify(&c, NULL) && c.max_stack == 5);
+    assert(-13 == AS_NUMBER(vm_execute(vm, &c).value));
+
+    // A budget yields between instructions and vm_resume carries on from there
+    stats = (Stats){ 0 };
+    vm->stats = &stats;
+    vm->budget = 5;
+    vm_start(vm, &c);
+    VMResult r;
+    int slices = 1;
+    while ((r = vm_resume(vm)).result == INTERPRET_YIELD) {
+        assert(vm->chunk == &c && vm->stack_top > vm->stack);
+        ++slices;
+    }
+    assert(-13 == AS_NUMBER(r.value) && slices == 3 && stats.instructions == 11);
+    vm->budget = 0;
+    vm->deadline_ns = 1; // long past, but the clock is not read that often
+    assert(-13 == AS_NUMBER(vm_execute(vm, &c).value));
+    vm->deadline_ns = 0;
+    vm->stats = NULL;
+    chunk_free(&c);
+
+    // Globals keep their slots and values across scripts until reset
+    assert(7 == AS_NUMBER(vm_interpret(vm, "var a = 2; a = a * 3; a + 1").value));
+    assert(IS_NIL(vm_interpret(vm, "var b = a + 4;").value));
+    assert(16 == AS_NUMBER(vm_interpret(vm, "a + b").value));
+    vm_reset_globals(vm);
+
+    // Integers stay exact and overflow into doubles
+    assert(IS_INT(vm_interpret(vm, "2 * 3 - 1").value));
+    assert(1 == AS_INT(vm_interpret(vm, "9007199254740993 - 9007199254740992").value));
+    Value big = vm_interpret(vm, "9223372036854775807 + 1").value;
+    assert(IS_DOUBLE(big) && AS_DOUBLE(big) == 0x1p63);
+    assert(IS_DOUBLE(vm_interpret(vm, "-(-9223372036854775807 - 1)").value));
+    assert(1.5 == AS_NUMBER(vm_interpret(vm, "3 / 2").value));
+    assert(AS_BOOL(vm_interpret(vm, "1 == 1.0").value));
+    assert(AS_BOOL(vm_interpret(vm, "2 * 3 == 6.0").value));
+    assert(!AS_BOOL(vm_interpret(vm, "9007199254740993 == 9007199254740992.0").value));
+
+    // and/or give an operand and only evaluate the right one if needed;
+    // conditionals nest to the right
+    assert(IS_NIL(vm_interpret(vm, "nil and 1").value));
+    assert(2 == AS_NUMBER(vm_interpret(vm, "1 and 2").value));
+    assert(!AS_BOOL(vm_interpret(vm, "nil or false").value));
+    assert(0 == AS_NUMBER(vm_interpret(vm, "var n = 0; false and (n = 1); 1 or (n = 2); n").value));
+    assert(4 == AS_NUMBER(vm_interpret(vm, "n = 3; nil or n > 2 ? (n = 4) : (n = 5); n").value));
+    assert(1 == AS_NUMBER(vm_interpret(vm, "var s = 5; s < 0 ? -1 : s == 0 ? 0 : 1").value));
+    assert(AS_BOOL(vm_interpret(vm, "(s > 1 ? \"big\" : \"small\") == \"big\"").value));
+    vm_reset_globals(vm);
+
+    // Natives get their arguments in place on the stack, inlined or not
+    assert(IS_INT(vm_interpret(vm, "floor(-2.5)").value));
+    assert(-3 == AS_INT(vm_interpret(vm, "floor(-2.5)").value));
+    assert(1.5 == AS_NUMBER(vm_interpret(vm, "sqrt(2.25)").value));
+    assert(-1 == AS_NUMBER(vm_interpret(vm, "min(3, -1, 2.5) + max(0, 0.0) * 2").value));
+    assert(AS_BOOL(vm_interpret(vm, "clock() > 0").value));
+    int count = native_count;
+    assert(native_define("twice", 1, vm_native_twice, TYPE_UNKNOWN) == count);
+    assert(42 == AS_NUMBER(vm_interpret(vm, "1 + twice(20) + 1").value));
+    FILE *errors = vm->errors;
+    vm->errors = fopen("/dev/null", "w");
+    assert(vm_interpret(vm, "twice(\"a\")").result == INTERPRET_RUNTIME_ERROR);
+    assert(vm_interpret(vm, "min(1, nil, 2)").result == INTERPRET_RUNTIME_ERROR);
+    assert(vm_interpret(vm, "sqrt(1, 2)").result == INTERPRET_COMPILE_ERROR);
+    assert(vm_interpret(vm, "max()").result == INTERPRET_COMPILE_ERROR);
+    assert(vm_interpret(vm, "(sqrt)(1)").result == INTERPRET_RUNTIME_ERROR); // not a global
+    fclose(vm->errors);
+    vm->errors = errors;
+    native_count = count;
+
+    // Functions get their arguments in place on the stack, as locals, and are
+    // compiled on their first call
+    vm_reset_globals(vm);
+    r = vm_interpret(vm, "fun fib(n) { return n < 2 ? n : fib(n - 1) + fib(n - 2); }");
+    assert(r.result == INTERPRET_OK);
+    Value fib = vm->globals[global_slot(&vm->global_names, string_value(&vm->heap, "fib", 3))];
+    assert(IS_FUNCTION(fib) && !AS_FUNCTION(fib)->compiled);
+    assert(55 == AS_NUMBER(vm_interpret(vm, "fib(10)").value) && AS_FUNCTION(fib)->compiled);
+    assert(6 == AS_NUMBER(vm_interpret(vm,
+        "fun add(a, b) { var c = a + b; a = 0; return c + a; }\n"
+        "var twice = fun (f, x) { return f(f(x, 1), 1); };\n"
+        "twice(add, 3) + add(0, 1)").value));
+    assert(IS_NIL(vm_interpret(vm, "fun f() { 1; } f()").value));
+    assert(AS_BOOL(vm_interpret(vm, "fun g(x) { fun h(y) { return y * 2; } return h(x); } g(21) == 42").value));
+    errors = vm->errors;
+    vm->errors = fopen("/dev/null", "w");
+    assert(vm_interpret(vm, "fun r(n) { return r(n + 1); } r(0)").result == INTERPRET_RUNTIME_ERROR);
+    assert(vm_interpret(vm, "add(1)").result == INTERPRET_RUNTIME_ERROR);
+    assert(vm_interpret(vm, "1(2)").result == INTERPRET_RUNTIME_ERROR);
+    assert(vm_interpret(vm, "fun bad() { return +; } 1").result == INTERPRET_OK); // not called
+    assert(vm_interpret(vm, "bad()").result == INTERPRET_COMPILE_ERROR);
+    assert(vm_interpret(vm, "return 1;").result == INTERPRET_COMPILE_ERROR);
+    assert(vm_interpret(vm, "fun sqrt(x) { return x; }").result == INTERPRET_COMPILE_ERROR);
+    fclose(vm->errors);
+    vm->errors = errors;
+
+    // A yield inside a call resumes there
+    vm_reset_globals(vm);
+    vm->budget = 3;
+    VMResult yielded = vm_interpret(vm, "fun fib(n) { return n < 2 ? n : fib(n - 1) + fib(n - 2); } fib(12)");
+    for (slices = 1; yielded.result == INTERPRET_YIELD; ++slices) {
+        yielded = vm_resume(vm);
+    }
+    vm->budget = 0;
+    assert(144 == AS_NUMBER(yielded.value) && slices > 100);
+
+    char source[512];
+
+    // Loops, with locals that end with their body and constants hoisted out
+    // of them (folded with -O instead). Their backward branches are counted.
+    vm_reset_globals(vm);
+    const char *loops = "var s = 0; var i = 0; while (i < 10) { s = s + i * (2 * 3); i = i + 1; }\n"
+                        "fun f(n) { var t = 0; for (var j = 0; j < n; j = j + 1) {\n"
+                        "  var k = j * (1 + 2) - -1; t = t + k; } for (;;) return t; }\n"
+                        "for (var q = 0; q < 1100; q = q + 1) s = s + 1;\n"
+                        "s + f(5) + q";
+    r = vm_interpret(vm, loops);
+    assert(r.result == INTERPRET_OK && 2505 == AS_NUMBER(r.value));
+    assert(buf_len(vm->hot_loops) == 1 && vm->hot_loops[0].line == 4);
+    vm_reset_globals(vm);
+    compiler_options.optimize = true;
+    snprintf(source, sizeof(source), "%s ", loops);
+    r = vm_interpret(vm, source);
+    compiler_options.optimize = false;
+    assert(r.result == INTERPRET_OK && 2505 == AS_NUMBER(r.value));
+    errors = vm->errors;
+    vm->errors = fopen("/dev/null", "w");
+    r = vm_interpret(vm, "while (true) { var x = -nil; }");
+    assert(r.result == INTERPRET_RUNTIME_ERROR);
+    r = vm_interpret(vm, "while (1 { 1; }");
+    assert(r.result == INTERPRET_COMPILE_ERROR);
+    fclose(vm->errors);
+    vm->errors = errors;
+
+    // A hot loop is another one when its chunk is, even at the same address,
+    // and vm_start drops them all once there are too many
+    Chunk hot = { 0 };
+    chunk_init(&hot);
+    assert(compile("while (nil) 1;", &hot, &vm->heap, &vm->global_names) && chunk_verify(&hot, stderr));
+    buf_free(vm->hot_loops);
+    vm_hot_loop(vm, &hot, 6);
+    vm_hot_loop(vm, &hot, 6);
+    assert(buf_len(vm->hot_loops) == 1 && vm->hot_loops[0].branches == 2 * VM_HOT_LOOP);
+    for (int i = 0; i < VM_HOT_LOOPS; ++i) {
+        chunk_new_id(&hot);
+        vm_hot_loop(vm, &hot, 6);
+    }
+    assert(buf_len(vm->hot_loops) == VM_HOT_LOOPS + 1);
+    vm_start(vm, &hot);
+    assert(buf_empty(vm->hot_loops) && vm_resume(vm).result == INTERPRET_OK);
+    chunk_free(&hot);
+
+    // Arrays: element-wise operators that broadcast numbers, reductions, and
+    // elements set in place
+    vm_reset_globals(vm);
+    r = vm_interpret(vm, "var a = [1, 2, 3, 4, 5]; var b = a * 2 + 1; b");
+    assert(IS_ARRAY(r.value) && AS_ARRAY(r.value)->length == 5 && AS_ARRAY(r.value)->data[4] == 11);
+    assert(3 == AS_NUMBER(vm_interpret(vm, "sum(a >= 3)").value));
+    assert(59 == AS_NUMBER(vm_interpret(vm, "sum(a) + sum(b) + len(b) + min(b) - max(a * -1)").value));
+    assert(13 == AS_NUMBER(vm_interpret(vm, "var c = array(3); c[1] = a[4] + 1; c[0] = c[1] * 2 + c[2]; c[0] + c[2] + 1").value));
+    assert(AS_BOOL(vm_interpret(vm, "a == a and a != [1, 2, 3, 4, 5]").value));
+    // Each evaluation of an element-wise operator makes a new array, also
+    // where -O shares equal subexpressions
+    static const char *fresh[] = { "(a * 2) == (a * 2)", "(!a) == (!a)",
+        "fun g(x, y) { x[0] = 100; return y[0]; } g(a * 2, a * 2)" };
+    for (int i = 0; i < (int)countof(fresh); ++i) {
+        Value plain = vm_interpret(vm, fresh[i]).value;
+        compiler_options.optimize = true;
+        snprintf(source, sizeof(source), "%s ", fresh[i]);
+        Value optimized = vm_interpret(vm, source).value;
+        compiler_options.optimize = false;
+        assert(values_equal(plain, optimized) && !values_equal(plain, BOOL_VAL(true)));
+    }
+    errors = vm->errors;
+    vm->errors = fopen("/dev/null", "w");
+    static const char *bad[] = { "a + [1, 2]", "a[5]", "a[0.5] = 1", "a[0] = nil", "[1, nil]",
+        "1[0]", "a * \"s\"", "min([])", "array(-1)" };
+    for (int i = 0; i < (int)countof(bad); ++i) {
+        r = vm_interpret(vm, bad[i]);
+        assert(r.result == INTERPRET_RUNTIME_ERROR);
+    }
+    r = vm_interpret(vm, "a + 1 = b");
+    assert(r.result == INTERPRET_COMPILE_ERROR);
+    fclose(vm->errors);
+    vm->errors = errors;
+
+    // Temporaries are collected as the heap grows; what the globals hold
+    // survives, ropes and the strings interned for them too
+    VM collected = { 0 };
+    vm_init(&collected);
+    r = vm_interpret(&collected, "class K {} var k = K(); k.s = \"kept across collections\" + \" of the heap, as a rope\";\n"
+                                 "var big = array(100000); for (var i = 0; i < 100; i = i + 1) big = big + 1;\n"
+                                 "big[0] == 100 and k.s == \"kept across collections of the heap, as a rope\"");
+    assert(r.result == INTERPRET_OK && AS_BOOL(r.value));
+    assert(collected.heap.collections > 0 && collected.heap.bytes < 4 * GC_MIN_BYTES);
+    // A run that would keep more than the heap's limit fails, and runs keep
+    // failing while the globals hold that much
+    collected.heap.limit = 4 * GC_MIN_BYTES;
+    collected.errors = fopen("/dev/null", "w");
+    assert(vm_interpret(&collected, "var c = array(300000); c = c + 1; len(c)").result == INTERPRET_OK);
+    assert(vm_interpret(&collected, "var d = array(300000); d = d + 1").result == INTERPRET_RUNTIME_ERROR);
+    assert(vm_interpret(&collected, "[1] + 1").result == INTERPRET_RUNTIME_ERROR);
+    assert(vm_interpret(&collected, "array(1000000)").result == INTERPRET_RUNTIME_ERROR);
+    r = vm_interpret(&collected, "c = nil; d = nil; var e = array(300000) + 1; len(e)");
+    assert(r.result == INTERPRET_OK && AS_NUMBER(r.value) == 300000);
+    fclose(collected.errors);
+    vm_free(&collected);
+
+    // Instances that got the same fields in the same order share a shape, so
+    // each field access misses its cache once per shape it sees, then hits
+    vm_reset_globals(vm);
+    int64_t hits = vm->field_hits, misses = vm->field_misses;
+    r = vm_interpret(vm, "class P {}\nfun mk(x) { var p = P(); p.x = x; p.y = x * 2; return p; }\n"
+                         "var s = 0; for (var i = 0; i < 100; i = i + 1) s = s + mk(i).y - mk(i).x; s");
+    assert(r.result == INTERPRET_OK && 4950 == AS_NUMBER(r.value));
+    assert(vm->field_misses - misses == 4 && vm->field_hits - hits == 600 - 4); // 4 sites, 600 accesses
+    misses = vm->field_misses;
+    r = vm_interpret(vm, "class A {} class B {} fun v(o) { return o.v; }\n"
+                         "var a = A(); a.v = 1; var b = B(); b.w = 0; b.v = 2;\n"
+                         "var t = 0; for (var i = 0; i < 10; i = i + 1) t = t + v(a) + v(b); t");
+    // Once for each store, and o.v once for each class
+    assert(r.result == INTERPRET_OK && 30 == AS_NUMBER(r.value) && vm->field_misses - misses == 5);
+    // Sites don't share caches, however many there are
+    char many[2048];
+    int len = snprintf(many, sizeof(many), "class M {} var m = M(); m.f = 1;\n"
+                                           "var n = 0; for (var i = 0; i < 3; i = i + 1) { n = n");
+    for (int i = 0; i < 200; ++i) {
+        len += snprintf(many + len, sizeof(many) - len, " + m.f");
+    }
+    snprintf(many + len, sizeof(many) - len, "; } n");
+    hits = vm->field_hits, misses = vm->field_misses;
+    r = vm_interpret(vm, many);
+    assert(r.result == INTERPRET_OK && 600 == AS_NUMBER(r.value));
+    assert(vm->field_misses - misses == 201 && vm->field_hits - hits == 400);
+    errors = vm->errors;
+    vm->errors = fopen("/dev/null", "w");
+    static const char *field_errors[] = { "a.z", "nil.x", "1 .x = 2", "P(1)" };
+    for (int i = 0; i < (int)countof(field_errors); ++i) {
+        r = vm_interpret(vm, field_errors[i]);
+        assert(r.result == INTERPRET_RUNTIME_ERROR);
+    }
+    r = vm_interpret(vm, "class Q { fun m() {} }");
+    assert(r.result == INTERPRET_COMPILE_ERROR);
+    fclose(vm->errors);
+    vm->errors = errors;
+
+    // Small, interned and rope strings
+    assert(AS_BOOL(vm_interpret(vm, "\"ab\" + \"cd\" == \"abcd\"").value));
+    assert(AS_BOOL(vm_interpret(vm, "\"0123456789\" + \"x\" == \"0123456789x\"").value));
+    const char *ten = "\"0123456789\"";
+    snprintf(source, sizeof(source), "%s + %s + %s + %s", ten, ten, ten, ten);
+    Value rope = vm_interpret(vm, source).value;
+    assert(IS_ROPE(rope) && string_length(rope) == 40);
+    snprintf(source, sizeof(source), "(%s + %s) + (%s + %s) == %s + (%s + (%s + %s))",
+        ten, ten, ten, ten, ten, ten, ten, ten);
+    assert(AS_BOOL(vm_interpret(vm, source).value));
+    Value flat = string_flatten(&vm->heap, rope);
+    snprintf(source, sizeof(source), "\"%s\"", "0123456789012345678901234567890123456789");
+    assert(AS_OBJ(flat) == AS_OBJ(vm_interpret(vm, source).value));
+
+    // Concatenation fails once the heap keeps more than its limit after a
+    // collection. A 10 MB rope only takes as much when it is flattened.
+    VM limited = { 0 };
+    vm_init(&limited);
+    limited.heap.limit = 4 << 20;
+    limited.errors = fopen("/dev/null", "w");
+    int n = snprintf(source, sizeof(source), "var s = %s;", ten);
+    for (int i = 0; i < 20; ++i) {
+        n += snprintf(source + n, sizeof(source) - n, " s = s + s;");
+    }
+    snprintf(source + n, sizeof(source) - n, " s == \"\"");
+    assert(vm_interpret(&limited, source).result == INTERPRET_OK);
+    assert(vm_interpret(&limited, "s + \"x\"").result == INTERPRET_RUNTIME_ERROR);
+    fclose(limited.errors);
+    vm_free(&limited);
+
+    vm_free(vm);
+
+    // Least recently used chunks are evicted first
+    *vm = (VM){ 0 };
+    vm_init(vm);
+    vm->cache.capacity = 2;
+    const char *sources[] = { "1", "2", "1", "3", "2", "3" };
+    for (int i = 0; i < (int)countof(sources); ++i) {
+        assert(atoi(sources[i]) == AS_NUMBER(vm_interpret(vm, sources[i]).value));
+    }
+    CacheStats *cs = &vm->cache.stats;
+    assert(cs->hits == 2 && cs->misses == 4 && cs->evictions == 2 && cs->bytes > 0);
+
+    // A yielded VM keeps running its image after the cache dropped it
+    vm->budget = 1;
+    assert(vm_interpret(vm, "4 + 5").result == INTERPRET_YIELD);
+    vm->budget = 0;
+    cache_free(&vm->cache);
+    assert(9 == AS_NUMBER(vm_resume(vm).value));
+    vm_free(vm);
+    free(vm);
+
+    vm_profile_test();
+    vm_image_test();
 }
+#endif